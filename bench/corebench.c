@@ -0,0 +1,610 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2014 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Benchmark suite for the core kernels: hashing, bloom filters, file list
+// (de)serialization and searching, protocol parsing and the bandwidth
+// scheduler. Inputs are generated from a fixed seed, so results can be
+// compared across commits. Protocol traffic can also be read from captured
+// streams: the raw data as received from an ADC ('\n'-separated) or NMDC
+// ('|'-separated) hub.
+//
+// Output is one tab-separated line per benchmark: name, number of
+// operations, ns per operation and MiB/s (or `-' if not applicable). Lines
+// starting with '#' are comments.
+//
+// Usage: corebench [-n files] [-t transfers] [-r rounds] [-a adc-stream]
+//                  [-m nmdc-stream] [name-prefix..]
+
+#include "../src/ncdc.h"
+#include "corebench.h"
+
+
+// Not linked with main.c, so provide the few symbols that other files use.
+void ncdc_quit() { exit(0); }
+char *ncdc_version() { return "corebench"; }
+
+
+static int opt_files = 100000;
+static int opt_transfers = 5000;
+static int opt_rounds = 3;
+static char *opt_adc = NULL;
+static char *opt_nmdc = NULL;
+static char **opt_only = NULL;
+
+static GTimer *timer;
+static volatile int sink; // keeps the compiler from optimizing work away
+
+
+static gboolean want(const char *name) {
+  char **o = opt_only;
+  if(!o || !*o)
+    return TRUE;
+  for(; *o; o++)
+    if(strncmp(name, *o, strlen(*o)) == 0)
+      return TRUE;
+  return FALSE;
+}
+
+
+// Whether any of the benchmarks starting with prefix may be selected, i.e.
+// whether the prefix and one of the arguments is a prefix of the other.
+static gboolean want_group(const char *prefix) {
+  char **o = opt_only;
+  if(!o || !*o)
+    return TRUE;
+  for(; *o; o++)
+    if(strncmp(prefix, *o, MIN(strlen(prefix), strlen(*o))) == 0)
+      return TRUE;
+  return FALSE;
+}
+
+
+// Reports a benchmark that performed ops operations over bytes bytes of data
+// (0 if not applicable) since the last g_timer_start(timer).
+static void report(const char *name, double ops, double bytes) {
+  double s = g_timer_elapsed(timer, NULL);
+  if(bytes > 0)
+    printf("%s\t%.0f\t%.1f\t%.1f\n", name, ops, s*1e9/ops, bytes/(1024*1024)/s);
+  else
+    printf("%s\t%.0f\t%.1f\t-\n", name, ops, s*1e9/ops);
+  fflush(stdout);
+}
+
+
+static guint32 rnd = 1;
+
+static guint32 rand32() {
+  rnd = rnd*1103515245 + 12345;
+  return rnd >> 8;
+}
+
+static void randbuf(char *buf, int len) {
+  int i;
+  for(i=0; i<len; i++)
+    buf[i] = rand32();
+}
+
+
+
+
+// Hashing
+
+static void bench_hash() {
+  int len = 16*1024*1024;
+  int leaves = len/1024;
+  char *buf = g_malloc(len);
+  char *blocks = g_malloc(leaves*24);
+  char res[24];
+  randbuf(buf, len);
+  int r;
+
+  if(want("tiger_update")) {
+    g_timer_start(timer);
+    for(r=0; r<opt_rounds; r++) {
+      tiger_ctx_t t;
+      tiger_init(&t);
+      tiger_update(&t, buf, len);
+      tiger_final(&t, res);
+      sink += res[0];
+    }
+    report("tiger_update", opt_rounds, (double)len*opt_rounds);
+  }
+
+  if(want("tth_update")) {
+    g_timer_start(timer);
+    for(r=0; r<opt_rounds; r++) {
+      tth_ctx_t t;
+      tth_init(&t);
+      tth_update(&t, buf, len);
+      tth_final(&t, res);
+      sink += res[0];
+    }
+    report("tth_update", opt_rounds, (double)len*opt_rounds);
+  }
+
+  // Measured per leaf, the tree on top of the leaves is all that's left.
+  if(want("tth_root")) {
+    tth_leaves(buf, leaves, blocks, 1);
+    g_timer_start(timer);
+    for(r=0; r<opt_rounds*16; r++) {
+      tth_root(blocks, leaves, res);
+      sink += res[0];
+    }
+    report("tth_root", (double)leaves*opt_rounds*16, 0);
+  }
+
+  g_free(buf);
+  g_free(blocks);
+}
+
+
+
+
+// Bloom filter, with the parameters ncdc uses for a typical share.
+
+static void bench_bloom() {
+  if(!want("bloom_add"))
+    return;
+  int num = opt_files;
+  char *hashes = g_malloc(num*24);
+  randbuf(hashes, num*24);
+
+  bloom_t b;
+  if(bloom_init(&b, 1024*1024, 8, 24) < 0) {
+    fprintf(stderr, "Invalid bloom filter parameters.\n");
+    exit(1);
+  }
+  int r, i;
+  g_timer_start(timer);
+  for(r=0; r<opt_rounds; r++)
+    for(i=0; i<num; i++)
+      bloom_add(&b, hashes+i*24);
+  report("bloom_add", (double)num*opt_rounds, 0);
+
+  sink += b.d[0];
+  bloom_free(&b);
+  g_free(hashes);
+}
+
+
+
+
+// File lists
+
+static const char *words[] = {
+  "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+  "india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa",
+  "quebec", "romeo", "sierra", "tango", "uniform", "victor", "whiskey",
+  "xray", "yankee", "zulu", "album", "live", "remix", "season", "episode",
+  "disc", "part", "final", "best", "of", "the", "collection", "edition"
+};
+#define WORDS (sizeof(words)/sizeof(*words))
+
+static const char *exts[] = { "mp3", "flac", "avi", "mkv", "jpg", "txt", "iso", "nfo" };
+#define EXTS (sizeof(exts)/sizeof(*exts))
+
+
+static fl_list_t *gen_dir(fl_list_t *parent, const char *name) {
+  fl_list_t *d = fl_list_create(name, FALSE);
+  d->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  if(parent)
+    fl_list_add(parent, d, -1);
+  return d;
+}
+
+
+// Generates a list with dirs of 50 files each, grouped in dirs of 20 dirs.
+// File names consist of a few words from the list above, so that keyword
+// searches have something to match on.
+static fl_list_t *gen_list(int files, fl_list_t ***all) {
+  fl_list_t *root = gen_dir(NULL, "");
+  fl_list_t *top = NULL, *sub = NULL;
+  *all = g_new(fl_list_t *, files);
+  int i;
+  for(i=0; i<files; i++) {
+    char name[128];
+    if(i % 1000 == 0) {
+      g_snprintf(name, sizeof(name), "%s %s %d", words[rand32() % WORDS], words[rand32() % WORDS], i/1000);
+      top = gen_dir(root, name);
+    }
+    if(i % 50 == 0) {
+      g_snprintf(name, sizeof(name), "%s %d", words[rand32() % WORDS], i/50);
+      sub = gen_dir(top, name);
+    }
+    g_snprintf(name, sizeof(name), "%s %s %s %d.%s", words[rand32() % WORDS], words[rand32() % WORDS],
+      words[rand32() % WORDS], i, exts[rand32() % EXTS]);
+    fl_list_t *f = fl_list_create(name, FALSE);
+    f->isfile = TRUE;
+    f->hastth = TRUE;
+    f->size = rand32() % (64*1024*1024);
+    randbuf(f->tth, 24);
+    fl_list_add(sub, f, -1);
+    (*all)[i] = f;
+  }
+  return root;
+}
+
+
+typedef struct query_t {
+  const char *name;
+  const char *and[4];
+  const char *ext[3];
+  signed char sizem;
+  guint64 size;
+} query_t;
+
+static const query_t queries[] = {
+  { "fl_search_rec_common", { "alpha" },               {},             -2, 0 },
+  { "fl_search_rec_two",    { "bravo", "remix" },      {},             -2, 0 },
+  { "fl_search_rec_three",  { "live", "disc", "zulu" }, {},            -2, 0 },
+  { "fl_search_rec_rare",   { "nonexistent" },         {},             -2, 0 },
+  { "fl_search_rec_ext",    { "season" },              { "mkv", "avi" }, -2, 0 },
+  { "fl_search_rec_size",   { "echo" },                {},              1, 60*1024*1024 },
+};
+#define QUERIES (sizeof(queries)/sizeof(*queries))
+
+
+static void query_init(const query_t *q, fl_search_t *s) {
+  memset(s, 0, sizeof(fl_search_t));
+  s->sizem = q->sizem;
+  s->size = q->size;
+  s->filedir = 3;
+  s->and = fl_search_create_and((char **)q->and);
+  s->ext = q->ext[0] ? (char **)q->ext : NULL;
+}
+
+
+static void bench_fl() {
+  if(!want_group("fl_"))
+    return;
+  fl_list_t **all;
+  fl_list_t *root = gen_list(opt_files, &all);
+  int items = opt_files + opt_files/50 + (opt_files+999)/1000;
+  GError *err = NULL;
+  int r, i;
+
+  if(want("fl_save")) {
+    GString *buf = g_string_sized_new(64*opt_files);
+    gsize len = 0;
+    g_timer_start(timer);
+    for(r=0; r<opt_rounds; r++) {
+      g_string_truncate(buf, 0);
+      fl_save(root, "CIDCIDCIDCIDCIDCIDCIDCIDCIDCIDCIDCIDCIDC", 0, FALSE, buf, NULL, &err);
+      len = buf->len;
+    }
+    report("fl_save", (double)items*opt_rounds, (double)len*opt_rounds);
+    g_string_free(buf, TRUE);
+  }
+
+  if(want("fl_load")) {
+    char *fn = g_build_filename(g_get_tmp_dir(), "corebench.xml", NULL);
+    if(!fl_save(root, "CIDCIDCIDCIDCIDCIDCIDCIDCIDCIDCIDCIDCIDC", 0, FALSE, NULL, fn, &err)) {
+      fprintf(stderr, "Error saving %s: %s\n", fn, err->message);
+      exit(1);
+    }
+    struct stat st;
+    stat(fn, &st);
+    g_timer_start(timer);
+    for(r=0; r<opt_rounds; r++) {
+      fl_list_t *fl = fl_load(fn, &err, FALSE);
+      if(!fl) {
+        fprintf(stderr, "Error loading %s: %s\n", fn, err->message);
+        exit(1);
+      }
+      fl_list_free(fl);
+    }
+    report("fl_load", (double)items*opt_rounds, (double)st.st_size*opt_rounds);
+    unlink(fn);
+    g_free(fn);
+  }
+
+  // Search queries are limited to the usual 10 results of an incoming search
+  // request, so the frequent keywords measure an early exit and the rare
+  // ones measure a full walk through the list.
+  fl_list_t *res[10];
+  int q;
+  for(q=0; q<QUERIES; q++) {
+    if(!want(queries[q].name))
+      continue;
+    fl_search_t s;
+    query_init(queries+q, &s);
+    int rounds = opt_rounds*10;
+    g_timer_start(timer);
+    for(r=0; r<rounds; r++)
+      sink += fl_search_rec(root, &s, res, 10);
+    report(queries[q].name, rounds, 0);
+    fl_search_free_and(s.and);
+  }
+
+  // Matching each file individually, as is done for the candidates from the
+  // name index.
+  if(want("fl_search_match_full")) {
+    fl_search_t s;
+    query_init(queries+1, &s);
+    g_timer_start(timer);
+    for(r=0; r<opt_rounds; r++)
+      for(i=0; i<opt_files; i++)
+        sink += fl_search_match_full(all[i], &s);
+    report("fl_search_match_full", (double)opt_files*opt_rounds, 0);
+    fl_search_free_and(s.and);
+  }
+
+  fl_list_free(root);
+  g_free(all);
+}
+
+
+
+
+// Protocol parsing
+
+static char *gen_nick(int i) {
+  static char nick[32];
+  g_snprintf(nick, sizeof(nick), "%s_%d", words[i % WORDS], i);
+  return nick;
+}
+
+
+// A hub join followed by searches and chat, roughly in the proportions seen
+// on a public hub.
+static char *gen_sid(int i) {
+  static char sid[5];
+  int j;
+  for(j=0; j<4; j++, i>>=5)
+    sid[j] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"[i & 31];
+  sid[4] = 0;
+  return sid;
+}
+
+
+static GPtrArray *gen_adc(int users) {
+  GPtrArray *a = g_ptr_array_new_with_free_func(g_free);
+  char id[40];
+  int i, j;
+  for(i=0; i<users; i++) {
+    char *sid = gen_sid(i+1);
+    for(j=0; j<39; j++)
+      id[j] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"[rand32() % 32];
+    id[39] = 0;
+    g_ptr_array_add(a, g_strdup_printf("BINF %s ID%s NI%s SS%u SF%u VEncdc\\s1.19 "
+      "US%u SL%u HN%u HR0 HO%u I4192.168.%u.%u U4%u SUTCP4,UDP4,ADC0 DEsome\\sdescription\\s%d",
+      sid, id, gen_nick(i), rand32(), rand32() % 100000, rand32() % 10000000, rand32() % 10,
+      rand32() % 10, rand32() % 3, rand32() % 256, rand32() % 256, rand32() % 65536, i));
+  }
+  for(i=0; i<users; i++) {
+    char *sid = gen_sid((rand32() % users)+1);
+    if(i % 4 == 3)
+      g_ptr_array_add(a, g_strdup_printf("BMSG %s Hello\\severyone,\\sthis\\sis\\smessage\\s%d", sid, i));
+    else
+      g_ptr_array_add(a, g_strdup_printf("BSCH %s AN%s AN%s TO%u", sid,
+        words[rand32() % WORDS], words[rand32() % WORDS], rand32()));
+  }
+  return a;
+}
+
+
+static GPtrArray *gen_nmdc(int users) {
+  GPtrArray *a = g_ptr_array_new_with_free_func(g_free);
+  int i;
+  for(i=0; i<users; i++)
+    g_ptr_array_add(a, g_strdup_printf("$MyINFO $ALL %s some description %d<ncdc V:1.19,M:A,H:%u/0/0,S:%u>$ $100\x01$$%u$",
+      gen_nick(i), i, rand32() % 10, rand32() % 10, rand32()));
+  for(i=0; i<users; i++) {
+    char *nick = gen_nick(rand32() % users);
+    if(i % 4 == 3)
+      g_ptr_array_add(a, g_strdup_printf("<%s> Hello everyone, this is message %d", nick, i));
+    else if(i % 4 == 2)
+      g_ptr_array_add(a, g_strdup_printf("$ConnectToMe me 192.168.%u.%u:%u", rand32() % 256, rand32() % 256, rand32() % 65536));
+    else
+      g_ptr_array_add(a, g_strdup_printf("$Search Hub:%s F?T?0?1?%s$%s", nick, words[rand32() % WORDS], words[rand32() % WORDS]));
+  }
+  return a;
+}
+
+
+static GPtrArray *load_stream(const char *fn, char sep) {
+  char *buf;
+  gsize len;
+  GError *err = NULL;
+  if(!g_file_get_contents(fn, &buf, &len, &err)) {
+    fprintf(stderr, "Error reading %s: %s\n", fn, err->message);
+    exit(1);
+  }
+  GPtrArray *a = g_ptr_array_new_with_free_func(g_free);
+  char *cur = buf, *end = buf+len;
+  while(cur < end) {
+    char *e = memchr(cur, sep, end-cur);
+    if(!e)
+      e = end;
+    if(e > cur)
+      g_ptr_array_add(a, g_strndup(cur, e-cur));
+    cur = e+1;
+  }
+  g_free(buf);
+  return a;
+}
+
+
+static gsize stream_bytes(GPtrArray *a) {
+  gsize n = 0;
+  int i;
+  for(i=0; i<a->len; i++)
+    n += strlen(g_ptr_array_index(a, i)) + 1;
+  return n;
+}
+
+
+static void bench_adc() {
+  if(!want_group("adc_"))
+    return;
+  GPtrArray *msgs = opt_adc ? load_stream(opt_adc, '\n') : gen_adc(opt_files/10);
+  double bytes = (double)stream_bytes(msgs)*opt_rounds;
+  double num = (double)msgs->len*opt_rounds;
+  adc_cmd_t c;
+  int r, i;
+
+  if(want("adc_parse")) {
+    g_timer_start(timer);
+    for(r=0; r<opt_rounds; r++)
+      for(i=0; i<msgs->len; i++)
+        if(adc_parse(g_ptr_array_index(msgs, i), &c, NULL, NULL)) {
+          sink += c.argc;
+          g_strfreev(c.argv);
+        }
+    report("adc_parse", num, bytes);
+  }
+
+  if(want("adc_parse_arena")) {
+    adc_arena_t arena = {};
+    g_timer_start(timer);
+    for(r=0; r<opt_rounds; r++)
+      for(i=0; i<msgs->len; i++)
+        if(adc_parse_arena(g_ptr_array_index(msgs, i), &c, NULL, &arena, NULL))
+          sink += c.argc;
+    report("adc_parse_arena", num, bytes);
+    adc_arena_free(&arena);
+  }
+
+  g_ptr_array_unref(msgs);
+}
+
+
+static void bench_nmdc() {
+  if(!want("nmdc_parse"))
+    return;
+  GPtrArray *msgs = opt_nmdc ? load_stream(opt_nmdc, '|') : gen_nmdc(opt_files/10);
+  gsize maxlen = 0;
+  int r, i;
+  for(i=0; i<msgs->len; i++)
+    maxlen = MAX(maxlen, strlen(g_ptr_array_index(msgs, i)));
+  char *buf = g_malloc(maxlen+1);
+
+  // Includes a copy of the message, since nmdc_parse() modifies it in-place.
+  nmdc_cmd_t c;
+  g_timer_start(timer);
+  for(r=0; r<opt_rounds; r++)
+    for(i=0; i<msgs->len; i++) {
+      strcpy(buf, g_ptr_array_index(msgs, i));
+      if(nmdc_parse(buf, &c))
+        sink += c.cmd;
+    }
+  report("nmdc_parse", (double)msgs->len*opt_rounds, (double)stream_bytes(msgs)*opt_rounds);
+
+  g_free(buf);
+  g_ptr_array_unref(msgs);
+}
+
+
+
+
+// Bandwidth scheduler, with the transfers spread over limited per-hub groups.
+
+static void bench_ratecalc() {
+  if(!want("ratecalc_tick"))
+    return;
+  int num = opt_transfers;
+  int ngroups = MAX(1, num/100);
+  ratecalc_t *groups = g_new(ratecalc_t, ngroups);
+  ratecalc_t *rcs = g_new(ratecalc_t, num);
+  int i, r;
+  for(i=0; i<ngroups; i++) {
+    ratecalc_init(groups+i);
+    ratecalc_setlimit(groups+i, 1024*1024);
+    ratecalc_register_group(groups+i, RCC_UP);
+  }
+  for(i=0; i<num; i++) {
+    ratecalc_init(rcs+i);
+    ratecalc_register(rcs+i, RCC_UP);
+    ratecalc_setparent(rcs+i, groups + i % ngroups);
+  }
+
+  // One simulated second worth of ticks per round, with every transfer using
+  // part of its allowance in between.
+  int ticks = opt_rounds * (1000/RATECALC_TICK);
+  g_timer_start(timer);
+  for(r=0; r<ticks; r++) {
+    for(i=0; i<num; i++) {
+      int b = ratecalc_burst(rcs+i);
+      if(b > 0)
+        ratecalc_add(rcs+i, MIN(b, 4096));
+    }
+    ratecalc_tick(RATECALC_TICK*1000);
+  }
+  report("ratecalc_tick", ticks, 0);
+
+  for(i=0; i<num; i++)
+    ratecalc_unregister(rcs+i);
+  for(i=0; i<ngroups; i++)
+    ratecalc_unregister(groups+i);
+  g_free(rcs);
+  g_free(groups);
+}
+
+
+
+
+static GOptionEntry cli_options[] = {
+  { "files", 'n', 0, G_OPTION_ARG_INT, &opt_files,
+      "Number of files in the generated file list and bloom filter. Default: 100000.", "<num>" },
+  { "transfers", 't', 0, G_OPTION_ARG_INT, &opt_transfers,
+      "Number of transfers registered with the bandwidth scheduler. Default: 5000.", "<num>" },
+  { "rounds", 'r', 0, G_OPTION_ARG_INT, &opt_rounds,
+      "Number of rounds per benchmark. Default: 3.", "<num>" },
+  { "adc", 'a', 0, G_OPTION_ARG_FILENAME, &opt_adc,
+      "Captured ADC hub stream to parse, instead of generated traffic.", "<file>" },
+  { "nmdc", 'm', 0, G_OPTION_ARG_FILENAME, &opt_nmdc,
+      "Captured NMDC hub stream to parse, instead of generated traffic.", "<file>" },
+  { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_only, NULL, NULL },
+  { NULL }
+};
+
+
+int main(int argc, char **argv) {
+  g_thread_init(NULL);
+
+  GOptionContext *optx = g_option_context_new("[name-prefix..] - ncdc core benchmarks");
+  g_option_context_add_main_entries(optx, cli_options, NULL);
+  GError *err = NULL;
+  if(!g_option_context_parse(optx, &argc, &argv, &err)) {
+    fprintf(stderr, "%s\n", err->message);
+    return 1;
+  }
+  g_option_context_free(optx);
+  opt_files = MAX(opt_files, 100);
+  opt_transfers = MAX(opt_transfers, 1);
+  opt_rounds = MAX(opt_rounds, 1);
+
+  printf("# files=%d transfers=%d rounds=%d\n", opt_files, opt_transfers, opt_rounds);
+  printf("# name\tops\tns/op\tMiB/s\n");
+  timer = g_timer_new();
+  bench_hash();
+  bench_bloom();
+  bench_fl();
+  bench_adc();
+  bench_nmdc();
+  bench_ratecalc();
+  g_timer_destroy(timer);
+  return 0;
+}
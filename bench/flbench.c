@@ -0,0 +1,142 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2014 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Benchmark for the file list parser. Loads a file list with each of the
+// parser and decompression strategies and reports the number of entries per
+// second. If no file is given, a synthetic list is generated.
+// Usage: flbench [file.xml.bz2 | -n number-of-files] [rounds]
+
+#include "../src/ncdc.h"
+#include "fl_load.h"
+
+
+// Not linked with main.c, so provide the few symbols that other files use.
+void ncdc_quit() { exit(0); }
+char *ncdc_version() { return "flbench"; }
+
+
+static void gen_write(BZFILE *bz, GString *s) {
+  int bzerr;
+  BZ2_bzWrite(&bzerr, bz, s->str, s->len);
+  g_string_truncate(s, 0);
+}
+
+
+// Generates a list with dirs of 50 files each, grouped in dirs of 20 dirs.
+static char *gen(int files) {
+  char *fn = g_build_filename(g_get_tmp_dir(), "flbench.xml.bz2", NULL);
+  FILE *f = fopen(fn, "w");
+  int bzerr;
+  BZFILE *bz = BZ2_bzWriteOpen(&bzerr, f, 9, 0, 0);
+  GString *s = g_string_new("<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\n"
+    "<FileListing Version=\"1\" Base=\"/\" Generator=\"flbench\">\n");
+
+  guint32 r = 1;
+  int i, j;
+  for(i=0; i<files; i++) {
+    if(i % 1000 == 0)
+      g_string_append_printf(s, "%s<Directory Name=\"Directory &amp; %d\">\n", i ? "</Directory>\n</Directory>\n" : "", i/1000);
+    if(i % 50 == 0)
+      g_string_append_printf(s, "%s<Directory Name=\"Sub %d\">\n", i % 1000 ? "</Directory>\n" : "", i/50);
+    char tth[40];
+    for(j=0; j<39; j++) {
+      r = r*1103515245 + 12345;
+      tth[j] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"[(r>>16) % 32];
+    }
+    tth[39] = 0;
+    g_string_append_printf(s, "<File Name=\"Some file name number %d.ext\" Size=\"%u\" TTH=\"%s\"/>\n", i, r, tth);
+    if(s->len > 64*1024)
+      gen_write(bz, s);
+  }
+  g_string_append(s, files ? "</Directory>\n</Directory>\n</FileListing>\n" : "</FileListing>\n");
+  gen_write(bz, s);
+
+  BZ2_bzWriteClose(&bzerr, bz, 0, NULL, NULL);
+  fclose(f);
+  g_string_free(s, TRUE);
+  return fn;
+}
+
+
+static int count(fl_list_t *fl) {
+  int i, n = 1;
+  for(i=0; fl->sub && i<fl->sub->len; i++)
+    n += count(g_ptr_array_index(fl->sub, i));
+  return n;
+}
+
+
+static void bench(const char *name, const char *file, int flags, int rounds) {
+  fl_load_debug = flags;
+  GTimer *t = g_timer_new();
+  int i, n = 0;
+  for(i=0; i<rounds; i++) {
+    GError *err = NULL;
+    fl_list_t *fl = fl_load(file, &err, FALSE);
+    if(!fl) {
+      fprintf(stderr, "Error loading %s: %s\n", file, err->message);
+      exit(1);
+    }
+    n = count(fl);
+    fl_list_free(fl);
+  }
+  double s = g_timer_elapsed(t, NULL);
+  g_timer_destroy(t);
+  printf("%-16s %10d entries %12.0f entries/s\n", name, n, ((double)n*rounds)/s);
+}
+
+
+int main(int argc, char **argv) {
+  g_thread_init(NULL);
+
+  char *file = NULL;
+  int rounds = 3;
+  gboolean del = FALSE;
+  if(argc > 2 && strcmp(argv[1], "-n") == 0) {
+    file = gen(atoi(argv[2]));
+    del = TRUE;
+    if(argc > 3)
+      rounds = atoi(argv[3]);
+  } else if(argc > 1) {
+    file = g_strdup(argv[1]);
+    if(argc > 2)
+      rounds = atoi(argv[2]);
+  } else {
+    file = gen(500000);
+    del = TRUE;
+  }
+  if(rounds < 1)
+    rounds = 1;
+
+  bench("fast+thread", file, 0, rounds);
+  bench("fast", file, FL_LOAD_NOTHREAD, rounds);
+  bench("yxml+thread", file, FL_LOAD_NOFAST, rounds);
+  bench("yxml", file, FL_LOAD_NOFAST|FL_LOAD_NOTHREAD, rounds);
+
+  if(del)
+    unlink(file);
+  g_free(file);
+  return 0;
+}
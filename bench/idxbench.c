@@ -0,0 +1,191 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2014 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Benchmark for the TTH index. Compares tthidx_t against the GHashTable +
+// GSList index that was previously used for the local share, reporting the
+// memory used per file and the lookup time for hits and misses. One in
+// twenty files is a duplicate of another one.
+// Usage: idxbench [number-of-files]
+
+#include "../src/ncdc.h"
+#include "tthidx.h"
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+
+typedef struct {
+  char tth[24];
+} item_t;
+
+
+static gsize heapsize() {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+  return mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+  return (unsigned)mallinfo().uordblks;
+#else
+  return 0;
+#endif
+}
+
+
+static guint32 rnd = 1;
+
+static void gen(char *tth) {
+  int i;
+  for(i=0; i<24; i++) {
+    rnd = rnd*1103515245 + 12345;
+    tth[i] = rnd >> 16;
+  }
+}
+
+
+static gboolean old_equal(gconstpointer a, gconstpointer b) {
+  return memcmp(a, b, 24) == 0;
+}
+
+
+static void old_add(GHashTable *h, item_t *it) {
+  GSList *cur = g_hash_table_lookup(h, it->tth);
+  if(cur)
+    g_slist_insert(cur, it, 1);
+  else
+    g_hash_table_insert(h, it->tth, g_slist_prepend(NULL, it));
+}
+
+
+static void report(const char *name, gsize mem, int files, double hit, double miss, int lookups) {
+  printf("%-10s %6.1f bytes/file %8.1f ns/hit %8.1f ns/miss\n", name,
+    (double)mem/files, hit*1e9/lookups, miss*1e9/lookups);
+}
+
+
+int main(int argc, char **argv) {
+  // Make GSlice allocations visible to mallinfo()
+  g_setenv("G_SLICE", "always-malloc", TRUE);
+
+  int files = argc > 1 ? atoi(argv[1]) : 1000000;
+  if(files < 20)
+    files = 1000000;
+  int lookups = files;
+  int i, n;
+
+  item_t *items = g_new(item_t, files);
+  for(i=0; i<files; i++) {
+    if(i % 20 == 19)
+      memcpy(items[i].tth, items[i-1].tth, 24);
+    else
+      gen(items[i].tth);
+  }
+  char *misses = g_malloc(lookups*24);
+  for(i=0; i<lookups; i++)
+    gen(misses+i*24);
+  guint32 *order = g_new(guint32, lookups);
+  for(i=0; i<lookups; i++) {
+    rnd = rnd*1103515245 + 12345;
+    order[i] = ((guint64)rnd * files) >> 32;
+  }
+
+  GTimer *t = g_timer_new();
+  volatile gsize sink = 0;
+
+  // Old implementation
+  gsize mem = heapsize();
+  GHashTable *h = g_hash_table_new(g_int_hash, old_equal);
+  for(i=0; i<files; i++)
+    old_add(h, items+i);
+  mem = heapsize() - mem;
+
+  g_timer_start(t);
+  for(i=0; i<lookups; i++) {
+    GSList *l = g_hash_table_lookup(h, items[order[i]].tth);
+    sink += GPOINTER_TO_SIZE(l->data);
+  }
+  double hit = g_timer_elapsed(t, NULL);
+  g_timer_start(t);
+  for(i=0; i<lookups; i++)
+    sink += GPOINTER_TO_SIZE(g_hash_table_lookup(h, misses+i*24));
+  double miss = g_timer_elapsed(t, NULL);
+  report("ghashtable", mem, files, hit, miss, lookups);
+
+  GHashTableIter iter;
+  GSList *l;
+  g_hash_table_iter_init(&iter, h);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&l))
+    g_slist_free(l);
+  g_hash_table_unref(h);
+
+  // tthidx
+  tthidx_t idx;
+  mem = heapsize();
+  tthidx_init(&idx, G_STRUCT_OFFSET(item_t, tth));
+  for(i=0; i<files; i++)
+    tthidx_add(&idx, items+i);
+  mem = heapsize() - mem;
+  if(!mem)
+    mem = tthidx_memsize(&idx);
+
+  g_timer_start(t);
+  for(i=0; i<lookups; i++) {
+    gpointer *r = tthidx_get(&idx, items[order[i]].tth, &n);
+    sink += GPOINTER_TO_SIZE(r[0]);
+  }
+  hit = g_timer_elapsed(t, NULL);
+  g_timer_start(t);
+  for(i=0; i<lookups; i++)
+    sink += GPOINTER_TO_SIZE(tthidx_get(&idx, misses+i*24, &n));
+  miss = g_timer_elapsed(t, NULL);
+  report("tthidx", mem, files, hit, miss, lookups);
+
+  // Verify the results and the removal code while we're at it
+  for(i=0; i<files; i++) {
+    gpointer *r = tthidx_get(&idx, items[i].tth, &n);
+    if(!n || r[0] != items + (i % 20 == 19 ? i-1 : i)) {
+      fprintf(stderr, "Invalid lookup result for file %d!\n", i);
+      return 1;
+    }
+  }
+  for(i=0; i<files; i+=2)
+    tthidx_del(&idx, items+i);
+  for(i=0; i<files; i++) {
+    gpointer *r = tthidx_get(&idx, items[i].tth, &n);
+    int j, found = 0;
+    for(j=0; j<n; j++)
+      if(r[j] == items+i)
+        found++;
+    if(found != (i & 1)) {
+      fprintf(stderr, "Invalid lookup result for file %d after removal!\n", i);
+      return 1;
+    }
+  }
+  tthidx_free(&idx);
+
+  g_timer_destroy(t);
+  g_free(items);
+  g_free(misses);
+  g_free(order);
+  return 0;
+}
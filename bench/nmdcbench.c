@@ -0,0 +1,262 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2014 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Benchmark for the NMDC hub message parser. Replays a captured hub stream
+// (the raw '|'-separated data as received from the hub) through nmdc_parse()
+// and through the GRegex chain that nmdc_handle() used before, making sure
+// both agree on the result and reporting the number of messages per second.
+// If no file is given, a join flood followed by search traffic is generated.
+// Usage: nmdcbench [hub-stream | -n number-of-users] [rounds]
+
+#include "../src/ncdc.h"
+#include "proto.h"
+
+
+// Not linked with main.c, so provide the few symbols that other files use.
+void ncdc_quit() { exit(0); }
+char *ncdc_version() { return "nmdcbench"; }
+
+
+static const struct {
+  nmdc_cmd_type cmd;
+  const char *regex;
+} old_cmds[] = {
+  { NMDCC_LOCK,           "Lock ([^ $]+) Pk=[^ $]+" },
+  { NMDCC_SUPPORTS,       "Supports (.+)" },
+  { NMDCC_HELLO,          "Hello ([^ $]+)" },
+  { NMDCC_QUIT,           "Quit ([^ $]+)" },
+  { NMDCC_NICKLIST,       "NickList (.+)" },
+  { NMDCC_OPLIST,         "OpList (.+)" },
+  { NMDCC_USERIP,         "UserIP (.+)" },
+  { NMDCC_MYINFO,         "MyINFO \\$ALL ([^ $]+) (.+)" },
+  { NMDCC_HUBNAME,        "HubName (.+)" },
+  { NMDCC_TO,             "To: ([^ $]+) From: ([^ $]+) \\$(.+)" },
+  { NMDCC_FORCEMOVE,      "ForceMove (.+)" },
+  { NMDCC_CONNECTTOME,    "ConnectToMe ([^ $]+) ([a-fA-F0-9:\\[\\]\\.]+)(S|)" },
+  { NMDCC_REVCONNECTTOME, "RevConnectToMe ([^ $]+) ([^ $]+)" },
+  { NMDCC_SEARCH,         "Search (Hub:(?:[^ $]+)|(?:[a-fA-F0-9:\\[\\]\\.]+)) ([TF])\\?([TF])\\?([0-9]+)\\?([1-9])\\?(.+)" }
+};
+
+#define OLD_NUM (sizeof(old_cmds)/sizeof(*old_cmds))
+
+static GRegex *old_regex[OLD_NUM];
+
+
+// Same matching as the old nmdc_handle(): every regex is tried and the groups
+// are fetched into newly allocated strings. Returns the command or -1, argv
+// must be freed with g_strfreev() by the caller.
+static int old_parse(const char *cmd, char ***argv) {
+  GMatchInfo *nfo;
+  int i, r = -1;
+  *argv = NULL;
+  for(i=0; i<OLD_NUM; i++) {
+    if(g_regex_match(old_regex[i], cmd, 0, &nfo)) {
+      r = old_cmds[i].cmd;
+      *argv = g_match_info_fetch_all(nfo);
+    }
+    g_match_info_free(nfo);
+  }
+  if(strncmp(cmd, "$GetPass", 8) == 0)
+    r = NMDCC_GETPASS;
+  if(strncmp(cmd, "$BadPass", 8) == 0)
+    r = NMDCC_BADPASS;
+  if(strncmp(cmd, "$ValidateDenide", 15) == 0)
+    r = NMDCC_VALIDATEDENIDE;
+  if(strncmp(cmd, "$HubIsFull", 10) == 0)
+    r = NMDCC_HUBISFULL;
+  if(strncmp(cmd, "$SR", 3) == 0)
+    r = NMDCC_SR;
+  if(cmd[0] != '$')
+    r = NMDCC_CHAT;
+  return r;
+}
+
+
+// Compares the results of both parsers for a single message.
+static gboolean verify(const char *msg, char *buf) {
+  char **argv;
+  nmdc_cmd_t c;
+  int i, r = old_parse(msg, &argv);
+  strcpy(buf, msg);
+  gboolean ok = nmdc_parse(buf, &c) ? r == c.cmd : r == -1;
+  if(ok && r >= 0) {
+    if(r == NMDCC_SR || r == NMDCC_CHAT)
+      ok = strcmp(c.argv[0], msg) == 0;
+    for(i=1; ok && argv && argv[i]; i++)
+      ok = strcmp(argv[i], c.argv[i-1]) == 0;
+  }
+  if(!ok)
+    fprintf(stderr, "Parsers disagree on: %s\n", msg);
+  g_strfreev(argv);
+  return ok;
+}
+
+
+static void gen_user(GPtrArray *msgs, int i) {
+  g_ptr_array_add(msgs, g_strdup_printf("$Hello user%d", i));
+  g_ptr_array_add(msgs, g_strdup_printf("$MyINFO $ALL user%d Some description %d<++ V:0.868,M:%c,H:%d/0/%d,S:%d>$ $%s%c$user%d@example.com$%"G_GUINT64_FORMAT"$",
+    i, i, i & 1 ? 'A' : 'P', 1+i%5, i%3, 1+i%10, i % 3 ? "100" : "0.01", 1, i, (guint64)i*1073741824));
+}
+
+
+// Generates a join flood of the given number of users, followed by search
+// traffic with some chat, private messages, connection requests and quits.
+static GPtrArray *gen(int users) {
+  GPtrArray *msgs = g_ptr_array_new();
+  g_ptr_array_add(msgs, g_strdup("$Lock EXTENDEDPROTOCOL_verlihub Pk=version0.9.8e-r2"));
+  g_ptr_array_add(msgs, g_strdup("$Supports OpPlus NoGetINFO NoHello UserIP2 HubINFO"));
+  g_ptr_array_add(msgs, g_strdup("$HubName Benchmark hub"));
+  g_ptr_array_add(msgs, g_strdup("$Hello me"));
+  int i;
+  for(i=0; i<users; i++)
+    gen_user(msgs, i);
+  g_ptr_array_add(msgs, g_strdup("$OpList user0$$user1$$"));
+
+  guint32 r = 1;
+  for(i=0; i<users*4; i++) {
+    r = r*1103515245 + 12345;
+    int u = (r>>8) % users;
+    switch((r>>24) % 16) {
+    case 0:
+      g_ptr_array_add(msgs, g_strdup_printf("<user%d> Chat message number %d", u, i));
+      break;
+    case 1:
+      g_ptr_array_add(msgs, g_strdup_printf("$To: me From: user%d $<user%d> Private message %d", u, u, i));
+      break;
+    case 2:
+      g_ptr_array_add(msgs, g_strdup_printf("$ConnectToMe me 10.%d.%d.%d:%d%s", u>>16, (u>>8)&255, u&255, 1024+u%60000, u&1 ? "S" : ""));
+      break;
+    case 3:
+      g_ptr_array_add(msgs, g_strdup_printf("$Quit user%d", u));
+      gen_user(msgs, u);
+      break;
+    case 4:
+    case 5:
+    case 6:
+      g_ptr_array_add(msgs, g_strdup_printf("$Search Hub:user%d F?T?0?9?TTH:%039d", u, i));
+      break;
+    case 7:
+    case 8:
+    case 9:
+      g_ptr_array_add(msgs, g_strdup_printf("$Search 10.%d.%d.%d:%d F?T?0?9?TTH:%039d", u>>16, (u>>8)&255, u&255, 1024+u%60000, i));
+      break;
+    case 10:
+    case 11:
+      g_ptr_array_add(msgs, g_strdup_printf("$Search Hub:user%d T?F?%d?1?some$search$query%d", u, i*1000, i));
+      break;
+    default:
+      g_ptr_array_add(msgs, g_strdup_printf("$Search 10.%d.%d.%d:%d T?T?%d?7?directory$name", u>>16, (u>>8)&255, u&255, 1024+u%60000, i*100));
+    }
+  }
+  return msgs;
+}
+
+
+static GPtrArray *load(const char *fn) {
+  char *dat;
+  gsize len;
+  GError *err = NULL;
+  if(!g_file_get_contents(fn, &dat, &len, &err)) {
+    fprintf(stderr, "%s: %s\n", fn, err->message);
+    exit(1);
+  }
+  GPtrArray *msgs = g_ptr_array_new();
+  char *cur = dat, *end;
+  while((end = memchr(cur, '|', len-(cur-dat)))) {
+    *end = 0;
+    if(*cur)
+      g_ptr_array_add(msgs, g_strdup(cur));
+    cur = end+1;
+  }
+  g_free(dat);
+  return msgs;
+}
+
+
+int main(int argc, char **argv) {
+  GPtrArray *msgs;
+  int rounds = 10;
+  if(argc > 2 && strcmp(argv[1], "-n") == 0) {
+    msgs = gen(atoi(argv[2]));
+    if(argc > 3)
+      rounds = atoi(argv[3]);
+  } else if(argc > 1) {
+    msgs = load(argv[1]);
+    if(argc > 2)
+      rounds = atoi(argv[2]);
+  } else
+    msgs = gen(10000);
+  if(rounds < 1)
+    rounds = 1;
+
+  int i, r;
+  gsize maxlen = 0;
+  for(i=0; i<OLD_NUM; i++) {
+    char *re = g_strconcat("\\$", old_cmds[i].regex, NULL);
+    old_regex[i] = g_regex_new(re, G_REGEX_OPTIMIZE|G_REGEX_ANCHORED|G_REGEX_DOTALL|G_REGEX_RAW, 0, NULL);
+    g_free(re);
+  }
+  for(i=0; i<msgs->len; i++)
+    maxlen = MAX(maxlen, strlen(g_ptr_array_index(msgs, i)));
+  char *buf = g_malloc(maxlen+1);
+
+  int bad = 0;
+  for(i=0; i<msgs->len; i++)
+    if(!verify(g_ptr_array_index(msgs, i), buf))
+      bad++;
+  printf("%d messages, %d mismatches\n", msgs->len, bad);
+
+  GTimer *t = g_timer_new();
+  volatile int sink = 0;
+  char **res;
+
+  g_timer_start(t);
+  for(r=0; r<rounds; r++)
+    for(i=0; i<msgs->len; i++) {
+      sink += old_parse(g_ptr_array_index(msgs, i), &res);
+      g_strfreev(res);
+    }
+  double old = g_timer_elapsed(t, NULL);
+
+  // Includes a copy of the message, since nmdc_parse() modifies it in-place.
+  nmdc_cmd_t c;
+  g_timer_start(t);
+  for(r=0; r<rounds; r++)
+    for(i=0; i<msgs->len; i++) {
+      const char *msg = g_ptr_array_index(msgs, i);
+      strcpy(buf, msg);
+      if(nmdc_parse(buf, &c))
+        sink += c.cmd;
+    }
+  double new = g_timer_elapsed(t, NULL);
+
+  double num = (double)msgs->len*rounds;
+  printf("%-10s %10.0f msg/s %8.1f ns/msg\n", "regex", num/old, old*1e9/num);
+  printf("%-10s %10.0f msg/s %8.1f ns/msg\n", "nmdc_parse", num/new, new*1e9/num);
+
+  g_timer_destroy(t);
+  g_free(buf);
+  return bad ? 1 : 0;
+}
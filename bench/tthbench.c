@@ -0,0 +1,92 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2014 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Benchmark for the TTH leaf hashing code. Hashes a buffer of pseudo-random
+// data with each of the available lane counts and reports the throughput.
+// Usage: tthbench [MiB]
+
+#include "../src/ncdc.h"
+#include "tth.h"
+
+
+static void bench(const char *name, const char *buf, int leaves, char *res, int lanes, int rounds) {
+  GTimer *t = g_timer_new();
+  int i;
+  for(i=0; i<rounds; i++)
+    tth_leaves(buf, leaves, res, lanes);
+  double s = g_timer_elapsed(t, NULL);
+  g_timer_destroy(t);
+  printf("%-12s %8.1f MB/s\n", name, ((double)leaves*1024*rounds)/(1024*1024)/s);
+}
+
+
+int main(int argc, char **argv) {
+  int mib = argc > 1 ? atoi(argv[1]) : 64;
+  if(mib < 1)
+    mib = 64;
+  int leaves = mib*1024;
+  char *buf = g_malloc(leaves*1024);
+  char *ref = g_malloc(leaves*24);
+  char *res = g_malloc(leaves*24);
+
+  guint32 r = 1;
+  int i;
+  for(i=0; i<leaves*1024; i++) {
+    r = r*1103515245 + 12345;
+    buf[i] = r >> 16;
+  }
+
+  // Verify the multi-buffer variants against the scalar code
+  tth_leaves(buf, leaves, ref, 1);
+  int lanes;
+  for(lanes=2; lanes<=4; lanes*=2) {
+    tth_leaves(buf, leaves, res, lanes);
+    if(memcmp(ref, res, leaves*24) != 0) {
+      fprintf(stderr, "%d-lane result differs from scalar code!\n", lanes);
+      return 1;
+    }
+  }
+
+  // And the full tree API against the leaf hashes
+  char root1[24], root2[24];
+  tth_ctx_t ctx;
+  tth_init(&ctx);
+  tth_update(&ctx, buf, leaves*1024);
+  tth_final(&ctx, root1);
+  tth_root(ref, leaves, root2);
+  if(memcmp(root1, root2, 24) != 0) {
+    fprintf(stderr, "tth_update() result differs from tth_root()!\n");
+    return 1;
+  }
+
+  bench("scalar", buf, leaves, res, 1, 3);
+  bench("2-lane", buf, leaves, res, 2, 3);
+  bench("4-lane", buf, leaves, res, 4, 3);
+
+  g_free(buf);
+  g_free(ref);
+  g_free(res);
+  return 0;
+}
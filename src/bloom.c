@@ -36,6 +36,7 @@ typedef struct {
   int k; /* Number of sub-hashes */
   int h; /* Number of bits for each sub-hash */
   unsigned char *d;
+  unsigned char *c; /* Counter for each bit (m*8 bytes), NULL if this is not a counting filter */
 } bloom_t;
 
 #endif
@@ -50,25 +51,74 @@ int bloom_init(bloom_t *b, int m, int k, int h) {
   b->k = k;
   b->h = h;
   b->d = g_malloc0(m);
+  b->c = NULL;
   return 0;
 }
 
 
+/* Same as bloom_init(), but creates a counting bloom filter to which
+ * bloom_del() can be applied. The counters saturate at 255, a bit that has
+ * reached that count will never be cleared again. */
+int bloom_init_counting(bloom_t *b, int m, int k, int h) {
+  if(bloom_init(b, m, k, h) < 0)
+    return -1;
+  b->c = g_malloc0((gsize)m*8);
+  return 0;
+}
+
+
+/* Get bit position of the i'th sub-hash. The hash is read as a 192-bit little
+ * endian number, from which the sub-hashes are taken as consecutive h-bit
+ * words. */
+static guint32 bloom_pos(const bloom_t *b, const guint64 *w, int i) {
+  int pos = i*b->h;
+  int off = pos & 63;
+  guint64 tmp = w[pos>>6] >> off;
+  if(off + b->h > 64)
+    tmp |= w[(pos>>6)+1] << (64-off);
+  if(b->h < 64)
+    tmp &= (((guint64)1)<<b->h)-1;
+  return tmp % (((guint64)b->m)<<3);
+}
+
+
+static void bloom_words(const char *hash, guint64 *w) {
+  memcpy(w, hash, 24);
+  w[0] = GUINT64_FROM_LE(w[0]);
+  w[1] = GUINT64_FROM_LE(w[1]);
+  w[2] = GUINT64_FROM_LE(w[2]);
+}
+
+
 void bloom_add(bloom_t *b, const char *hash) {
-  int i, j, pos = 0;
-  guint64 tmp;
+  guint64 w[3];
+  int i;
+  bloom_words(hash, w);
   for(i=0; i<b->k; i++) {
-    tmp = 0;
-    for(j=0; j<b->h; j++) {
-      tmp |= ((guint64)((((const unsigned char *)hash)[pos>>3] >> (pos&7)) & 1)) << j;
-      pos++;
-    }
-    j = tmp % (b->m<<3);
+    guint32 j = bloom_pos(b, w, i);
     b->d[j>>3] |= 1<<(j&7);
+    if(b->c && b->c[j] < 255)
+      b->c[j]++;
+  }
+}
+
+
+/* Removes a hash from a counting bloom filter. The hash must have been added
+ * before. */
+void bloom_del(bloom_t *b, const char *hash) {
+  g_return_if_fail(b->c);
+  guint64 w[3];
+  int i;
+  bloom_words(hash, w);
+  for(i=0; i<b->k; i++) {
+    guint32 j = bloom_pos(b, w, i);
+    if(b->c[j] > 0 && b->c[j] < 255 && !--b->c[j])
+      b->d[j>>3] &= ~(1<<(j&7));
   }
 }
 
 
 void bloom_free(bloom_t *b) {
   g_free(b->d);
+  g_free(b->c);
 }
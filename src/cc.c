@@ -259,11 +259,13 @@ struct cc_t {
   guint64 last_length;
   gboolean last_tthl;
   time_t last_start;
+  guint64 dl_speed; // Average throughput of the previous segments downloaded from this user
   char last_hash[24];
   char *kp_real;  // (ADC) slice-alloc'ed with 32 bytes. This is the actually calculated keyprint.
   char *kp_user;  // (ADC) This is the keyprint from the users' INF
   GError *err;
   GSequenceIter *iter;
+  adc_arena_t adc_arena; // (ADC) buffers for adc_parse_arena()
 };
 
 #endif
@@ -390,6 +392,8 @@ void cc_remove_hub(hub_t *hub) {
     if(c->hub == hub) {
       c->hub_name = g_strdup(hub->tab->name);
       c->hub = NULL;
+      ratecalc_setparent(net_rate_in(c->net), NULL);
+      ratecalc_setparent(net_rate_out(c->net), NULL);
     }
   }
 
@@ -493,11 +497,11 @@ static gboolean request_slot(cc_t *cc, gboolean need_full) {
     return TRUE;
 
   // if we have a free slot, use that
-  if(slots < var_get_int(0, VAR_slots))
+  if(slots < var_snap(0)->slots)
     return TRUE;
 
   // if we can use a minislot, do so
-  if(!need_full && minislots < var_get_int(0, VAR_minislots)) {
+  if(!need_full && minislots < var_snap(0)->minislots) {
     cc->slot_mini = TRUE;
     return TRUE;
   }
@@ -517,6 +521,23 @@ void cc_download(cc_t *cc, dl_t *dl) {
 
   memcpy(cc->last_hash, dl->hash, 24);
 
+  // partial file list
+  if(dl->flpath) {
+    char *path = adc_escape(dl->flpath, !cc->adc);
+    if(cc->adc)
+      net_writef(cc->net, "CGET list %s 0 -1\n", path);
+    else
+      net_writef(cc->net, "$ADCGET list %s 0 -1|", path);
+    g_free(path);
+    cc->last_offset = 0;
+    g_free(cc->last_file);
+    cc->last_file = g_strdup(dl->flpath);
+    cc->last_size = 0;
+    cc->last_length = 0;
+    cc->state = CCS_TRANSFER;
+    return;
+  }
+
   // get virtual path
   char fn[45] = {};
   if(dl->islist)
@@ -536,8 +557,7 @@ void cc_download(cc_t *cc, dl_t *dl) {
 
   // otherwise, send GET request
   } else {
-    /* TODO: A more long-term rate calculation algorithm might be more suitable here */
-    cc->dlthread = dlfile_getchunk(dl, cc->uid, ratecalc_rate(net_rate_in(cc->net)));
+    cc->dlthread = dlfile_getchunk(dl, cc->uid, cc->dl_speed ? cc->dl_speed : ratecalc_rate(net_rate_in(cc->net)));
     if(!cc->dlthread) {
       g_set_error_literal(&cc->err, 1, 0, "Download interrupted.");
       cc_disconnect(cc, FALSE);
@@ -566,6 +586,11 @@ static void handle_recvdone(net_t *n, void *dat) {
   // stuff to download
   if(n && net_is_connected(n)) {
     cc_t *cc = net_handle(n);
+    // Update the throughput estimate used for sizing the next segment. Recent
+    // segments weigh more, so that the segment size follows the speed of the
+    // peer.
+    guint64 speed = cc->last_length / MAX(1, time(NULL)-cc->last_start);
+    cc->dl_speed = cc->dl_speed ? (cc->dl_speed + 2*speed) / 3 : speed;
     net_readmsg(cc->net, cc->adc ? '\n' : '|', cc->adc ? adc_handle : nmdc_handle);
     xfer_log_add(cc);
     cc->state = CCS_IDLE;
@@ -590,9 +615,36 @@ static void handle_recvtth(net_t *n, char *buf, int read) {
 }
 
 
+// Maximum size of a partial file list we are willing to receive. The list is
+// read into the receive buffer of the connection, so this must be smaller than
+// NET_MAX_RBUF.
+#define CC_PARTIAL_MAXSIZE (512*1024)
+
+static void handle_recvlist(net_t *n, char *buf, int read) {
+  cc_t *cc = net_handle(n);
+  g_return_if_fail(read == cc->last_length);
+
+  dl_setpartial(cc->uid, cc->last_hash, buf, read);
+  if(net_is_connected(n)) {
+    cc->state = CCS_IDLE;
+    dl_user_cc(cc->uid, cc);
+    net_readmsg(cc->net, cc->adc ? '\n' : '|', cc->adc ? adc_handle : nmdc_handle);
+  }
+}
+
+
+// Whether we are requesting a partial file list. Errors on those usually mean
+// that the peer does not support them, dl.c handles that by falling back to
+// the full list.
+static gboolean cc_partial(cc_t *cc) {
+  dl_t *dl = g_hash_table_lookup(dl_queue, cc->last_hash);
+  return dl && dl->flpath;
+}
+
+
 static void handle_adcsnd(cc_t *cc, gboolean tthl, guint64 start, gint64 bytes) {
   dl_t *dl = g_hash_table_lookup(dl_queue, cc->last_hash);
-  if(!dl || (!tthl && !cc->dlthread)) {
+  if(!dl || (!tthl && !dl->flpath && !cc->dlthread)) {
     g_set_error_literal(&cc->err, 1, 0, "Download interrupted.");
     cc_disconnect(cc, FALSE);
     return;
@@ -600,11 +652,21 @@ static void handle_adcsnd(cc_t *cc, gboolean tthl, guint64 start, gint64 bytes)
 
   cc->last_length = bytes;
   cc->last_tthl = tthl;
-  if(!tthl) {
+  if(dl->flpath) {
+    // Has to fit in the receive buffer of the connection
+    if(tthl || start != 0 || bytes <= 0 || bytes > CC_PARTIAL_MAXSIZE) {
+      dl_queue_setuerr(cc->uid, cc->last_hash, DLE_NOFILE, "Invalid partial file list");
+      g_set_error_literal(&cc->err, 1, 0, "Invalid partial file list.");
+      cc_disconnect(cc, TRUE);
+      return;
+    }
+    net_readbytes(cc->net, bytes, handle_recvlist);
+  } else if(!tthl) {
     if(dl->islist) {
       cc->last_size = dl->size = bytes;
       dl->hassize = TRUE;
     }
+    ratecalc_setparent(net_rate_in(cc->net), cc->hub ? &cc->hub->rate_in : NULL);
     net_recvfile(cc->net, bytes, dlfile_recv, handle_recvdone, cc->dlthread);
     cc->dlthread = NULL;
   } else {
@@ -622,7 +684,7 @@ static void handle_sendcomplete(net_t *net) {
 }
 
 
-static void send_file(cc_t *cc, const char *path, guint64 start, guint64 len, gboolean flush, GError **err) {
+static void send_file(cc_t *cc, const char *path, guint64 start, guint64 len, gboolean flush, const char *tth, GError **err) {
   int fd = 0;
   if((fd = open(path, O_RDONLY)) < 0 || lseek(fd, start, SEEK_SET) == (off_t)-1) {
     // Don't give a detailed error message, the remote shouldn't know too much about us.
@@ -630,7 +692,53 @@ static void send_file(cc_t *cc, const char *path, guint64 start, guint64 len, gb
     g_message("Error opening/seeking '%s' for sending: %s", path, g_strerror(errno));
     return;
   }
-  net_sendfile(cc->net, fd, len, flush, handle_sendcomplete);
+  ratecalc_setparent(net_rate_out(cc->net), cc->hub ? &cc->hub->rate_out : NULL);
+  net_sendfile(cc->net, fd, len, flush, tth, handle_sendcomplete);
+}
+
+
+// Sends the error of a failed GET or $ADCGET to the other client. Ownership of
+// err is passed to cc->err.
+static void handle_adcget_error(cc_t *cc, GError *err) {
+  if(cc->adc) {
+    GString *r = adc_generate('C', ADCC_STA, 0, 0);
+    g_string_append_printf(r, " 1%02d", err->code);
+    adc_append(r, NULL, err->message);
+    g_string_append_c(r, '\n');
+    net_writestr(cc->net, r->str);
+    g_string_free(r, TRUE);
+  } else if(err->code != 53)
+    net_writef(cc->net, "$Error %s|", err->message);
+  else
+    net_writestr(cc->net, "$MaxedOut|");
+  g_propagate_error(&cc->err, err);
+}
+
+
+// TTHL data is fetched from the database asynchronously, see
+// db_fl_gettthl_async(). The cc may be gone by the time it arrives.
+typedef struct cc_tthl_t {
+  net_t *net;
+  char id[44]; // TTH/<base32>
+} cc_tthl_t;
+
+
+static void handle_tthl(const char *dat, int len, void *arg) {
+  cc_tthl_t *t = arg;
+  if(net_is_connected(t->net)) {
+    cc_t *cc = net_handle(t->net);
+    if(!dat) {
+      GError *err = NULL;
+      g_set_error_literal(&err, 1, 51, "File Not Available");
+      handle_adcget_error(cc, err);
+    } else {
+      // no need to adc_escape(id) here, since it cannot contain any special characters
+      net_writef(cc->net, cc->adc ? "CSND tthl %s 0 %d\n" : "$ADCSND tthl %s 0 %d|", t->id, len);
+      net_write(cc->net, dat, len);
+    }
+  }
+  net_unref(t->net);
+  g_slice_free(cc_tthl_t, t);
 }
 
 
@@ -649,18 +757,19 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
     }
     char root[24];
     base32_decode(id+4, root);
-    int len = 0;
-    char *dat = db_fl_gettthl(root, &len);
-    if(!dat)
+    int n = 0;
+    fl_local_from_tth(root, &n);
+    if(!n)
       g_set_error_literal(err, 1, 51, "File Not Available");
     else if(!cc->slot_granted && throttle_check(cc, root, G_MAXUINT64)) {
       g_message("CC:%s: TTHL request throttled: %s", net_remoteaddr(cc->net), id);
       g_set_error_literal(err, 1, 50, "Action throttled");
     } else {
-      // no need to adc_escape(id) here, since it cannot contain any special characters
-      net_writef(cc->net, cc->adc ? "CSND tthl %s 0 %d\n" : "$ADCSND tthl %s 0 %d|", id, len);
-      net_write(cc->net, dat, len);
-      g_free(dat);
+      cc_tthl_t *t = g_slice_new(cc_tthl_t);
+      t->net = cc->net;
+      net_ref(t->net);
+      g_strlcpy(t->id, id, sizeof(t->id));
+      db_fl_gettthl_async(root, handle_tthl, t);
     }
     return;
   }
@@ -676,24 +785,18 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
       g_set_error_literal(err, 1, 51, "File Not Available");
       return;
     }
-    // Use a targetsize of 16k for non-recursive lists and 256k for recursive
-    // ones. This should give useful results in most cases. The only exception
-    // here is Jucy, which does not handle "Incomplete" entries in a recursive
-    // list, but... yeah, that's Jucy's problem. :-)
-    GString *buf = g_string_new("");
     GError *e = NULL;
-    int len = fl_save(f, var_get(0, VAR_cid), re1 ? 256*1024 : 16*1024, zlib, buf, NULL, &e);
-    if(!len) {
+    int len = 0;
+    GString *buf = fl_local_partial(f, re1, zlib, &len, &e);
+    if(!buf) {
       g_set_error(err, 1, 50, "Creating partial XML list: %s", e->message);
       g_error_free(e);
-      g_string_free(buf, TRUE);
       return;
     }
     char *eid = adc_escape(id, !cc->adc);
     net_writef(cc->net, cc->adc ? "CSND list %s 0 %d%s\n" : "$ADCSND list %s 0 %d%s|", eid, len, zlib ? " ZL1" : "");
     net_write(cc->net, buf->str, buf->len);
     g_free(eid);
-    g_string_free(buf, TRUE);
     return;
   }
 
@@ -722,8 +825,9 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
   } else if(strncmp(id, "TTH/", 4) == 0 && istth(id+4)) {
     char root[24];
     base32_decode(id+4, root);
-    GSList *l = fl_local_from_tth(root);
-    f = l ? l->data : NULL;
+    int n;
+    fl_list_t **l = fl_local_from_tth(root, &n);
+    f = n ? l[0] : NULL;
   }
 
   if(f) {
@@ -746,7 +850,7 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
   }
   if(bytes < 0 || bytes > st.st_size-start)
     bytes = st.st_size-start;
-  if(needslot && st.st_size < var_get_int(0, VAR_minislot_size))
+  if(needslot && st.st_size < var_snap(0)->minislot_size)
     needslot = FALSE;
 
   if(f && !cc->slot_granted && throttle_check(cc, f->tth, start)) {
@@ -776,7 +880,7 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
       tmp, start, bytes);
     cc->state = CCS_TRANSFER;
     time(&cc->last_start);
-    send_file(cc, path, start, cc->last_length, strcmp(vpath, "files.xml.bz2") == 0 ? FALSE : TRUE, err);
+    send_file(cc, path, start, cc->last_length, strcmp(vpath, "files.xml.bz2") == 0 ? FALSE : TRUE, f && f->hastth ? f->tth : NULL, err);
     g_free(tmp);
   } else {
     g_set_error_literal(err, 1, 53, "No Slots Available");
@@ -808,6 +912,7 @@ static void handle_id(cc_t *cc, hub_user_t *u) {
         u->ip4 = ip4_pack(uri.host);
       else
         u->ip6 = ip6_pack(uri.host);
+      u->country_gen = 0;
       free(uri.buf);
     }
   }
@@ -839,7 +944,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
   adc_cmd_t cmd;
   GError *err = NULL;
 
-  adc_parse(msg, &cmd, NULL, &err);
+  adc_parse_arena(msg, &cmd, NULL, &cc->adc_arena, &err);
   if(err) {
     g_message("CC:%s: ADC parse error: %s. --> %s", net_remoteaddr(cc->net), err->message, msg);
     g_error_free(err);
@@ -848,7 +953,6 @@ static void adc_handle(net_t *net, char *msg, int _len) {
 
   if(cmd.type != 'C') {
     g_message("CC:%s: Not a client command: %s", net_remoteaddr(cc->net), msg);
-    g_strfreev(cmd.argv);
     return;
   }
 
@@ -885,8 +989,8 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       cc_disconnect(cc, TRUE);
     } else {
       cc->state = CCS_IDLE;;
-      char *id = adc_getparam(cmd.argv, "ID", NULL);
-      char *token = adc_getparam(cmd.argv, "TO", NULL);
+      char *id = adc_cmd_param(&cmd, 0, "ID");
+      char *token = adc_cmd_param(&cmd, 0, "TO");
       if(!id || (cc->active && !token)) {
         g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
         g_message("CC:%s: No token or CID present: %s", net_remoteaddr(cc->net), msg);
@@ -939,16 +1043,9 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       gint64 len = g_ascii_strtoll(cmd.argv[3], NULL, 0);
       GError *err = NULL;
       handle_adcget(cc, cmd.argv[0], cmd.argv[1], start, len,
-        cc->zlig&&adc_getparam(cmd.argv, "ZL", NULL)?TRUE:FALSE, adc_getparam(cmd.argv, "RE", NULL)?TRUE:FALSE, &err);
-      if(err) {
-        GString *r = adc_generate('C', ADCC_STA, 0, 0);
-        g_string_append_printf(r, " 1%02d", err->code);
-        adc_append(r, NULL, err->message);
-        g_string_append_c(r, '\n');
-        net_writestr(cc->net, r->str);
-        g_string_free(r, TRUE);
-        g_propagate_error(&cc->err, err);
-      }
+        cc->zlig&&adc_cmd_param(&cmd, 0, "ZL")?TRUE:FALSE, adc_cmd_param(&cmd, 0, "RE")?TRUE:FALSE, &err);
+      if(err)
+        handle_adcget_error(cc, err);
     }
     break;
 
@@ -959,7 +1056,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
       g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), msg);
       cc_disconnect(cc, TRUE);
-    } else if(adc_getparam(cmd.argv, "ZL", NULL)) {
+    } else if(adc_cmd_param(&cmd, 0, "ZL")) {
       // Even though we indicate support for ZLIG, we don't actually support
       // *receiving* zlib compressed transfers. So this is an error.
       // TODO: This is in violation with the ADC spec, to probably want to fix
@@ -986,8 +1083,9 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       } else if(strncmp(cmd.argv[1], "TTH/", 4) == 0 && istth(cmd.argv[1]+4)) {
         char root[24];
         base32_decode(cmd.argv[1]+4, root);
-        GSList *l = fl_local_from_tth(root);
-        f = l ? l->data : NULL;
+        int n;
+        fl_list_t **l = fl_local_from_tth(root, &n);
+        f = n ? l[0] : NULL;
       }
       // Generate response
       GString *r;
@@ -996,7 +1094,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
         g_string_append_printf(r, " 151 File Not Available");
       } else {
         r = adc_generate('C', ADCC_RES, 0, 0);
-        g_string_append_printf(r, " SL%d SI%"G_GUINT64_FORMAT, var_get_int(0, VAR_slots) - cc_slots_in_use(NULL), f->size);
+        g_string_append_printf(r, " SL%d SI%"G_GUINT64_FORMAT, var_snap(0)->slots - cc_slots_in_use(NULL), f->size);
         char *path = fl_list_path(f);
         adc_append(r, "FN", path);
         g_free(path);
@@ -1047,20 +1145,26 @@ static void adc_handle(net_t *net, char *msg, int _len) {
         }
       }
 
+    // Other error in reply to a partial file list request: notify dl.c
+    } else if((cmd.argv[0][0] == '1' || cmd.argv[0][0] == '2') && cc->dl && cc->state == CCS_TRANSFER && cc_partial(cc)) {
+      dl_queue_setuerr(cc->uid, cc->last_hash, DLE_NOFILE, cmd.argv[1]);
+      cc->state = CCS_IDLE;
+      dl_user_cc(cc->uid, cc);
+      if(cmd.argv[0][0] == '2')
+        cc_disconnect(cc, FALSE);
+
     // Other message
     } else if(cmd.argv[0][0] == '1' || cmd.argv[0][0] == '2') {
       g_set_error(&cc->err, 1, 0, "(%s) %s", cmd.argv[0], cmd.argv[1]);
       if(cmd.argv[0][0] == '2')
         cc_disconnect(cc, FALSE);
-    } else if(!adc_getparam(cmd.argv, "RF", NULL))
+    } else if(!adc_cmd_param(&cmd, 0, "RF"))
       g_message("CC:%s: Status: (%s) %s", net_remoteaddr(cc->net), cmd.argv[0], cmd.argv[1]);
     break;
 
   default:
     g_message("CC:%s: Unknown command: %s", net_remoteaddr(cc->net), msg);
   }
-
-  g_strfreev(cmd.argv);
 }
 
 
@@ -1161,7 +1265,7 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
   CMDREGEX(supports, "Supports (.+)");
   CMDREGEX(direction, "Direction (Download|Upload) ([0-9]+)");
   CMDREGEX(adcget, "ADCGET ([^ ]+) (.+) ([0-9]+) (-?[0-9]+)");
-  CMDREGEX(adcsnd, "ADCSND (file|tthl) .+ ([0-9]+) (-?[0-9]+)");
+  CMDREGEX(adcsnd, "ADCSND (file|tthl|list) .+ ([0-9]+) (-?[0-9]+)");
   CMDREGEX(error, "Error (.+)");
   CMDREGEX(maxedout, "MaxedOut");
 
@@ -1252,13 +1356,8 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
     } else if(un_id && g_utf8_validate(un_id, -1, NULL)) {
       GError *err = NULL;
       handle_adcget(cc, type, un_id, st, by, FALSE, FALSE, &err);
-      if(err) {
-        if(err->code != 53)
-          net_writef(cc->net, "$Error %s|", err->message);
-        else
-          net_writestr(cc->net, "$MaxedOut|");
-        g_propagate_error(&cc->err, err);
-      }
+      if(err)
+        handle_adcget_error(cc, err);
     }
     g_free(un_id);
     g_free(type);
@@ -1269,7 +1368,7 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
   g_match_info_free(nfo);
 
   // $ADCSND
-  if(g_regex_match(adcsnd, cmd, 0, &nfo)) { // 1 = file/tthl, 2 = start_pos, 3 = bytes
+  if(g_regex_match(adcsnd, cmd, 0, &nfo)) { // 1 = file/tthl/list, 2 = start_pos, 3 = bytes
     if(!cc->dl || cc->state != CCS_TRANSFER) {
       g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
       g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
@@ -1295,8 +1394,9 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
     } else {
       char *msg = g_match_info_fetch(nfo, 1);
       g_set_error_literal(&cc->err, 1, 0, msg);
-      // Handle "File Not Available" and ".. no more exists"
-      if(str_casestr(msg, "file not available") || str_casestr(msg, "no more exists"))
+      // Handle "File Not Available", ".. no more exists" and whatever reason
+      // a peer may have for refusing a partial file list.
+      if(str_casestr(msg, "file not available") || str_casestr(msg, "no more exists") || cc_partial(cc))
         dl_queue_setuerr(cc->uid, cc->last_hash, DLE_NOFILE, NULL);
       g_free(msg);
       cc->state = CCS_IDLE;
@@ -1516,5 +1616,6 @@ void cc_free(cc_t *cc) {
   g_free(cc->hub_name);
   g_free(cc->last_file);
   g_free(cc->cid);
+  adc_arena_free(&cc->adc_arena);
   g_free(cc);
 }
@@ -509,6 +509,8 @@ static void listshares() {
       fl_list_t *fl = fl_local_list ? fl_list_file(fl_local_list, l->name) : NULL;
       ui_mf(NULL, 0, " /%s -> %s (%s)", l->name, l->path, fl ? str_formatsize(fl->size) : "-");
     }
+    ui_mf(NULL, 0, "\nPartial file list cache: %"G_GUINT64_FORMAT" hits, %"G_GUINT64_FORMAT" misses.",
+      fl_partial_hits, fl_partial_misses);
     ui_m(NULL, 0, "");
   }
 }
@@ -714,6 +716,18 @@ static void c_gc(char *args) {
 }
 
 
+static void c_perf(char *args) {
+  if(args[0])
+    ui_m(NULL, 0, "This command does not accept any arguments.");
+  else {
+    GString *s = g_string_new("\n");
+    perf_stats(s);
+    ui_m(NULL, 0, s->str);
+    g_string_free(s, TRUE);
+  }
+}
+
+
 static void c_whois(char *args) {
   ui_tab_t *tab = ui_tab_cur->data;
   char *u = NULL;
@@ -1272,6 +1286,7 @@ static cmd_t cmds[] = {
   { "nick",        c_nick,        NULL             },
   { "open",        c_open,        c_open_sug       },
   { "password",    c_password,    NULL             },
+  { "perf",        c_perf,        NULL             },
   { "pm",          c_msg,         c_msg_sug        },
   { "queue",       c_queue,       NULL             },
   { "quit",        c_quit,        NULL             },
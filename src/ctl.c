@@ -0,0 +1,263 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2014 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+#include "ncdc.h"
+#include "ctl.h"
+
+
+// Control socket, used in headless mode to accept the same commands as the
+// main input line. The protocol is line-based: Each line received from a
+// client is passed to cmd_handle(), and any messages generated while running
+// the command are written back to that client. Messages logged to the main
+// tab at other times are written to all connected clients. A line of the form
+// "@<tab> <command>" runs the command as if <tab> was selected, e.g.
+// "@#hub /nick foo".
+
+// Max. length of an incoming line and max. amount of pending output for a
+// client. Clients exceeding the line limit are disconnected, output beyond
+// the buffer limit is dropped.
+#define CTL_MAXLINE (64*1024)
+#define CTL_MAXOUT  (1024*1024)
+
+
+typedef struct ctl_client_t {
+  int fd;
+  guint in_watch;
+  guint out_watch;
+  GString *in;
+  GString *out;
+} ctl_client_t;
+
+
+static int ctl_fd = -1;
+static guint ctl_io = 0;
+static char *ctl_path = NULL;
+static GSList *ctl_clients = NULL;
+static ctl_client_t *ctl_cur = NULL; // client whose command is being run
+
+
+static void ctl_client_free(ctl_client_t *cl) {
+  if(cl->in_watch)
+    g_source_remove(cl->in_watch);
+  if(cl->out_watch)
+    g_source_remove(cl->out_watch);
+  close(cl->fd);
+  g_string_free(cl->in, TRUE);
+  g_string_free(cl->out, TRUE);
+  ctl_clients = g_slist_remove(ctl_clients, cl);
+  g_free(cl);
+}
+
+
+static gboolean ctl_client_flush(GIOChannel *src, GIOCondition cond, gpointer dat) {
+  ctl_client_t *cl = dat;
+  while(cl->out->len > 0) {
+    int r = write(cl->fd, cl->out->str, cl->out->len);
+    if(r < 0 && errno == EAGAIN)
+      return TRUE;
+    if(r < 0) {
+      g_debug("ctl:%d: Write error: %s", cl->fd, g_strerror(errno));
+      cl->out_watch = 0;
+      ctl_client_free(cl);
+      return FALSE;
+    }
+    g_string_erase(cl->out, 0, r);
+  }
+  cl->out_watch = 0;
+  return FALSE;
+}
+
+
+static void ctl_client_write(ctl_client_t *cl, const char *msg) {
+  if(cl->out->len > CTL_MAXOUT)
+    return;
+  g_string_append(cl->out, msg);
+  g_string_append_c(cl->out, '\n');
+  if(!cl->out_watch) {
+    GIOChannel *c = g_io_channel_unix_new(cl->fd);
+    cl->out_watch = g_io_add_watch(c, G_IO_OUT, ctl_client_flush, cl);
+    g_io_channel_unref(c);
+  }
+}
+
+
+static void ctl_client_exec(ctl_client_t *cl, char *line) {
+  GList *tab = ui_tabs;
+  if(*line == '@') {
+    char *sep = strchr(line, ' ');
+    if(sep)
+      *(sep++) = 0;
+    for(; tab; tab=tab->next)
+      if(strcmp(((ui_tab_t *)tab->data)->name, line+1) == 0)
+        break;
+    if(!tab) {
+      char *msg = g_strdup_printf("No tab named `%s'.", line+1);
+      ctl_client_write(cl, msg);
+      g_free(msg);
+      return;
+    }
+    line = sep ? sep : "";
+  }
+
+  ui_tab_cur = tab;
+  ctl_cur = cl;
+  cmd_handle(line);
+  ctl_cur = NULL;
+  // Nobody looks at the tab selection in headless mode, messages without an
+  // explicit tab should end up in the main tab by default.
+  ui_tab_cur = ui_tabs;
+}
+
+
+static gboolean ctl_client_read(GIOChannel *src, GIOCondition cond, gpointer dat) {
+  ctl_client_t *cl = dat;
+  char buf[4096];
+  int r = read(cl->fd, buf, sizeof(buf));
+  if(r < 0 && errno == EAGAIN)
+    return TRUE;
+  if(r <= 0) {
+    if(r < 0)
+      g_debug("ctl:%d: Read error: %s", cl->fd, g_strerror(errno));
+    cl->in_watch = 0;
+    ctl_client_free(cl);
+    return FALSE;
+  }
+  g_string_append_len(cl->in, buf, r);
+
+  char *sep;
+  while((sep = memchr(cl->in->str, '\n', cl->in->len))) {
+    *sep = 0;
+    if(sep > cl->in->str && sep[-1] == '\r')
+      sep[-1] = 0;
+    char *line = g_strdup(cl->in->str);
+    g_string_erase(cl->in, 0, sep - cl->in->str + 1);
+    ctl_client_exec(cl, line);
+    g_free(line);
+  }
+
+  if(cl->in->len > CTL_MAXLINE) {
+    g_debug("ctl:%d: Line too long, disconnecting.", cl->fd);
+    cl->in_watch = 0;
+    ctl_client_free(cl);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+static gboolean ctl_accept(GIOChannel *src, GIOCondition cond, gpointer dat) {
+  int fd = accept(ctl_fd, NULL, NULL);
+  if(fd < 0) {
+    if(errno != EAGAIN && errno != EINTR)
+      g_warning("Error accepting control socket connection: %s", g_strerror(errno));
+    return TRUE;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+
+  ctl_client_t *cl = g_new0(ctl_client_t, 1);
+  cl->fd = fd;
+  cl->in = g_string_new("");
+  cl->out = g_string_new("");
+  GIOChannel *c = g_io_channel_unix_new(fd);
+  cl->in_watch = g_io_add_watch(c, G_IO_IN|G_IO_HUP|G_IO_ERR, ctl_client_read, cl);
+  g_io_channel_unref(c);
+  ctl_clients = g_slist_prepend(ctl_clients, cl);
+  g_debug("ctl:%d: New control connection.", fd);
+  return TRUE;
+}
+
+
+// Called from ui_m_mainthread() for every message, after the tab has been
+// resolved.
+void ctl_message(ui_tab_t *tab, const char *msg) {
+  if(ctl_cur)
+    ctl_client_write(ctl_cur, msg);
+  else if(tab == uit_main_tab) {
+    GSList *n = ctl_clients;
+    for(; n; n=n->next)
+      ctl_client_write(n->data, msg);
+  }
+}
+
+
+// Opens the control socket at $NCDC_DIR/ncdc.sock. Failure is not fatal, ncdc
+// will just keep running without it.
+void ctl_init() {
+  ctl_path = g_build_filename(db_dir, "ncdc.sock", NULL);
+
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if(strlen(ctl_path) >= sizeof(addr.sun_path)) {
+    g_warning("Path to control socket is too long: %s", ctl_path);
+    goto err;
+  }
+  strcpy(addr.sun_path, ctl_path);
+
+  ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(ctl_fd < 0) {
+    g_warning("Unable to create control socket: %s", g_strerror(errno));
+    goto err;
+  }
+
+  // Anything at this path is a leftover from an unclean shutdown, db_init()
+  // already makes sure no other instance uses this session directory.
+  unlink(ctl_path);
+  mode_t old = umask(0077);
+  int r = bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old);
+  if(r < 0 || listen(ctl_fd, 5) < 0 || fcntl(ctl_fd, F_SETFL, O_NONBLOCK) < 0) {
+    g_warning("Unable to listen on control socket %s: %s", ctl_path, g_strerror(errno));
+    close(ctl_fd);
+    ctl_fd = -1;
+    goto err;
+  }
+
+  GIOChannel *c = g_io_channel_unix_new(ctl_fd);
+  ctl_io = g_io_add_watch(c, G_IO_IN, ctl_accept, NULL);
+  g_io_channel_unref(c);
+  g_debug("Listening for commands on %s.", ctl_path);
+  return;
+
+err:
+  g_free(ctl_path);
+  ctl_path = NULL;
+}
+
+
+void ctl_close() {
+  while(ctl_clients)
+    ctl_client_free(ctl_clients->data);
+  if(ctl_fd >= 0) {
+    g_source_remove(ctl_io);
+    close(ctl_fd);
+    ctl_fd = -1;
+  }
+  if(ctl_path) {
+    unlink(ctl_path);
+    g_free(ctl_path);
+    ctl_path = NULL;
+  }
+}
@@ -35,6 +35,13 @@
 // - Multiple UPDATE/DELETE/INSERT statements in a short interval are grouped
 //   together in a single transaction.
 // - All queries are executed in the same order as they are queued.
+// - A thread can group many write queries into a single queue item with
+//   db_batch_begin() and db_batch_end(), to cut down on the per-query message
+//   passing and locking overhead.
+// - When the db_readers setting is non-zero, the database is used in WAL mode
+//   and a few read-only connections, each in their own thread, are opened to
+//   handle lookups that would otherwise have to wait for the database thread.
+//   See db_queue_read().
 
 
 // TODO: Improve error handling. In the current implementation, if an error
@@ -46,7 +53,21 @@
 
 static GAsyncQueue *db_queue = NULL;
 static GThread *db_thread = NULL;
-static GHashTable *db_stmt_cache = NULL;
+
+// Queue and threads of the read connections, NULL if there are none.
+static GAsyncQueue *db_read_queue = NULL;
+static GPtrArray *db_read_threads = NULL;
+
+// Each thread that has a database connection has its own prepared statement
+// cache.
+static GStaticPrivate db_stmt_cache = G_STATIC_PRIVATE_INIT;
+
+// Statistics, updated by the database thread and protected by db_stats_lock.
+static GStaticMutex db_stats_lock = G_STATIC_MUTEX_INIT;
+static hist_t db_stats_depth;  // Length of the queue at each fetched item
+static hist_t db_stats_batch;  // Number of queries in each batch item
+static hist_t db_stats_trans;  // Number of queries in each transaction
+static hist_t db_stats_commit; // Time taken by each COMMIT, in microseconds
 
 
 // A "queue item" is a darray (see util.c) to represent a queued SQL query,
@@ -66,6 +87,13 @@ static GHashTable *db_stmt_cache = NULL;
 //   if(type != END)
 //     goto arguments
 
+// A "batch item" is a queue item with the DBF_BATCH flag set, which holds any
+// number of queries to be executed in the same transaction:
+//   int32 = flags
+// repeat:
+//   int32 = 1 if a query follows, 0 if this is the end of the batch
+//   the same ptr-to-query and argument list as above
+
 // A "result item" is a darray to represent a result row, with the following
 // structure:
 //   int32 = result code (SQLITE_ROW, SQLITE_DONE or anything else for error)
@@ -80,6 +108,7 @@ static GHashTable *db_stmt_cache = NULL;
 #define DBF_LAST    2 // Current query must be the last in a transaction (forces a flush)
 #define DBF_SINGLE  4 // Query must not be executed in a transaction (e.g. VACUUM)
 #define DBF_NOCACHE 8 // Don't cache this query in the prepared statement cache
+#define DBF_BATCH  16 // This is a batch item
 #define DBF_END   128 // Signal the database thread to close
 
 // Column types
@@ -96,6 +125,21 @@ static GHashTable *db_stmt_cache = NULL;
 // How long to keep a transaction active before flushing. In microseconds.
 #define DB_FLUSH_TIMEOUT (5000000)
 
+// Tuning for every connection. The hashdata table can get rather large with
+// big shares, and a larger page cache and memory-mapped I/O avoid a lot of
+// read() calls on lookups. The cache size is in KiB, per connection.
+#define DB_CACHE_SIZE 16384
+#define DB_MMAP_SIZE (256*1024*1024)
+
+#if INTERFACE
+// Maximum value of the db_readers setting.
+#define DB_READERS_MAX 8
+#endif
+
+// Maximum number of queries in a single batch item. Larger batches are split
+// into multiple items, to keep the memory usage somewhat bounded.
+#define DB_BATCH_MAX 1000
+
 
 // Give back a final response and unref the queue.
 static void db_queue_item_final(GAsyncQueue *res, int code, gint64 lastid) {
@@ -111,16 +155,36 @@ static void db_queue_item_final(GAsyncQueue *res, int code, gint64 lastid) {
 }
 
 
-// Give back an error result and decrement the reference counter of the
-// response queue. Assumes the `flags' has already been read.
-static void db_queue_item_error(char *q) {
+// Give back an error result for a single query and decrement the reference
+// counter of the response queue.
+static void db_queue_query_error(char *q) {
   char *b = darray_get_ptr(q); // query
   b++; // otherwise gcc will complain
-  int t;
-  while((t = darray_get_int32(q)) != DBQ_END && t != DBQ_RES)
-    ;
-  if(t == DBQ_RES)
+  int t, n;
+  while((t = darray_get_int32(q)) != DBQ_END && t != DBQ_RES) {
+    switch(t) {
+    case DBQ_INT:   (void)darray_get_int32(q); break;
+    case DBQ_INT64: (void)darray_get_int64(q); break;
+    case DBQ_TEXT:  (void)darray_get_string(q); break;
+    case DBQ_BLOB:  (void)darray_get_dat(q, &n); break;
+    }
+  }
+  if(t == DBQ_RES) {
     db_queue_item_final(darray_get_ptr(q), SQLITE_ERROR, 0);
+    while(darray_get_int32(q) != DBQ_END)
+      ;
+  }
+}
+
+
+// Give back an error result for all queries in a queue item. Assumes the
+// `flags' has already been read.
+static void db_queue_item_error(char *q, int flags) {
+  if(!(flags & DBF_BATCH))
+    db_queue_query_error(q);
+  else
+    while(darray_get_int32(q))
+      db_queue_query_error(q);
 }
 
 
@@ -129,16 +193,18 @@ static void db_queue_item_error(char *q) {
 // in the db_stmt_cache is *NOT* done by the actual query string, but by its
 // pointer value. This is a lot more efficient, but assumes that SQL statements
 // are never dynamically generated: they must be somewhere in static memory.
-// Note: db_stmt_cache is assumed to be used only for the given *db pointer.
+// Note: The cache of the current thread is assumed to be used only for the
+// given *db pointer.
 // Important: DON'T run sqlite3_finalize() on queries returned by this
 // function! Use sqlite3_reset() instead.
 static int db_queue_process_prepare(sqlite3 *db, const char *query, sqlite3_stmt **s) {
-  *s = g_hash_table_lookup(db_stmt_cache, query);
+  GHashTable *cache = g_static_private_get(&db_stmt_cache);
+  *s = g_hash_table_lookup(cache, query);
   if(*s)
     return SQLITE_OK;
   int r = sqlite3_prepare_v2(db, query, -1, s, NULL);
   if(r == SQLITE_OK)
-    g_hash_table_insert(db_stmt_cache, (gpointer)query, *s);
+    g_hash_table_insert(cache, (gpointer)query, *s);
   return r;
 }
 
@@ -170,27 +236,32 @@ static int db_queue_process_one(sqlite3 *db, char *q, gboolean nocache, gboolean
 
   // Bind parameters
   int t, n;
+  gint64 l;
   int i = 1;
   char *a;
+  // The arguments are still read when the query could not be prepared, to get
+  // to the next query in a batch item.
+  gboolean bind = r != SQLITE_ERROR;
   while((t = darray_get_int32(q)) != DBQ_END && t != DBQ_RES) {
-    if(r == SQLITE_ERROR)
-      continue;
     switch(t) {
     case DBQ_NULL:
-      sqlite3_bind_null(s, i);
+      if(bind) sqlite3_bind_null(s, i);
       break;
     case DBQ_INT:
-      sqlite3_bind_int(s, i, darray_get_int32(q));
+      n = darray_get_int32(q);
+      if(bind) sqlite3_bind_int(s, i, n);
       break;
     case DBQ_INT64:
-      sqlite3_bind_int64(s, i, darray_get_int64(q));
+      l = darray_get_int64(q);
+      if(bind) sqlite3_bind_int64(s, i, l);
       break;
     case DBQ_TEXT:
-      sqlite3_bind_text(s, i, darray_get_string(q), -1, SQLITE_STATIC);
+      a = darray_get_string(q);
+      if(bind) sqlite3_bind_text(s, i, a, -1, SQLITE_STATIC);
       break;
     case DBQ_BLOB:
       a = darray_get_dat(q, &n);
-      sqlite3_bind_blob(s, i, a, n, SQLITE_STATIC);
+      if(bind) sqlite3_bind_blob(s, i, a, n, SQLITE_STATIC);
       break;
     }
     i++;
@@ -250,8 +321,32 @@ static int db_queue_process_one(sqlite3 *db, char *q, gboolean nocache, gboolean
 }
 
 
-static int db_queue_process_commit(sqlite3 *db) {
+// Executes the queries of a batch item in the current transaction. If a query
+// fails, the remaining queries in the batch are not executed and get an error
+// response instead. The number of queries in the batch is added to *num.
+static int db_queue_process_batch(sqlite3 *db, char *q, int *num) {
+  GAsyncQueue *res;
+  gint64 lastid;
+  int r = SQLITE_DONE;
+  while(darray_get_int32(q)) {
+    if(r != SQLITE_DONE)
+      db_queue_query_error(q);
+    else {
+      r = db_queue_process_one(db, q, FALSE, TRUE, &res, &lastid);
+      db_queue_item_final(res, r, lastid);
+    }
+    (*num)++;
+  }
+  return r;
+}
+
+
+// `queries' is the number of queries executed in the transaction, for the
+// statistics.
+static int db_queue_process_commit(sqlite3 *db, int queries) {
   g_debug("db: COMMIT");
+  GTimeVal start, end;
+  g_get_current_time(&start);
   int r;
   sqlite3_stmt *s;
   if(db_queue_process_prepare(db, "COMMIT", &s))
@@ -262,6 +357,13 @@ static int db_queue_process_commit(sqlite3 *db) {
   if(r != SQLITE_DONE)
     g_critical("SQLite3 error committing transaction: %s", sqlite3_errmsg(db));
   sqlite3_reset(s);
+
+  g_get_current_time(&end);
+  gint64 t = (gint64)(end.tv_sec - start.tv_sec)*G_USEC_PER_SEC + (end.tv_usec - start.tv_usec);
+  g_static_mutex_lock(&db_stats_lock);
+  hist_add(&db_stats_commit, MAX(t, 0));
+  hist_add(&db_stats_trans, queries);
+  g_static_mutex_unlock(&db_stats_lock);
   return r;
 }
 
@@ -295,10 +397,11 @@ static void db_queue_process(sqlite3 *db) {
   GTimeVal trans_end = {}; // tv_sec = 0 if no transaction is active
   gboolean donext = FALSE;
   gboolean errtrans = FALSE;
+  int queries = 0; // number of queries executed in the current transaction
 
   GAsyncQueue *res;
   gint64 lastid;
-  int r;
+  int r, n;
 
   while(1) {
     char *q =   donext ? g_async_queue_try_pop(db_queue) :
@@ -308,11 +411,18 @@ static void db_queue_process(sqlite3 *db) {
     int flags = q ? darray_get_int32(q) : 0;
     gboolean nocache = flags & DBF_NOCACHE ? TRUE : FALSE;
 
+    if(q) {
+      n = g_async_queue_length(db_queue);
+      g_static_mutex_lock(&db_stats_lock);
+      hist_add(&db_stats_depth, MAX(n, 0));
+      g_static_mutex_unlock(&db_stats_lock);
+    }
+
     // Commit state if we need to
     if(!q || flags & DBF_SINGLE || flags & DBF_END) {
       g_warn_if_fail(!donext);
       if(trans_end.tv_sec)
-        db_queue_process_commit(db);
+        db_queue_process_commit(db, queries);
       trans_end.tv_sec = 0;
       donext = errtrans = FALSE;
     }
@@ -339,7 +449,7 @@ static void db_queue_process(sqlite3 *db) {
     // report error to NEXT-chained queries if the transaction has been aborted.
     if(errtrans) {
       g_warn_if_fail(donext);
-      db_queue_item_error(q);
+      db_queue_item_error(q, flags);
       donext = flags & DBF_NEXT ? TRUE : FALSE;
       if(!donext) {
         errtrans = FALSE;
@@ -355,7 +465,7 @@ static void db_queue_process(sqlite3 *db) {
       // Commit first, then send back the final result
       if(trans_end.tv_sec) {
         if(r == SQLITE_DONE)
-          r = db_queue_process_commit(db);
+          r = db_queue_process_commit(db, queries+1);
         if(r != SQLITE_DONE)
           db_queue_process_rollback(db);
       }
@@ -370,21 +480,34 @@ static void db_queue_process(sqlite3 *db) {
     if(!trans_end.tv_sec) {
       g_get_current_time(&trans_end);
       g_time_val_add(&trans_end, DB_FLUSH_TIMEOUT);
+      queries = 0;
       r = db_queue_process_begin(db);
       if(r != SQLITE_DONE) {
         if(flags & DBF_NEXT)
           donext = errtrans = TRUE;
         else
           trans_end.tv_sec = 0;
-        db_queue_item_error(q);
+        db_queue_item_error(q, flags);
         g_free(q);
         continue;
       }
     }
 
+    // handle batches
+    if(flags & DBF_BATCH) {
+      n = 0;
+      r = db_queue_process_batch(db, q, &n);
+      queries += n;
+      g_static_mutex_lock(&db_stats_lock);
+      hist_add(&db_stats_batch, n);
+      g_static_mutex_unlock(&db_stats_lock);
+
     // handle normal/NEXT queries
-    r = db_queue_process_one(db, q, nocache, TRUE, &res, &lastid);
-    db_queue_item_final(res, r, lastid);
+    } else {
+      r = db_queue_process_one(db, q, nocache, TRUE, &res, &lastid);
+      db_queue_item_final(res, r, lastid);
+      queries++;
+    }
     g_free(q);
 
     // Rollback and update state on error
@@ -401,6 +524,30 @@ static void db_queue_process(sqlite3 *db) {
 
 static void db_stmt_free(gpointer dat) { sqlite3_finalize(dat); }
 
+
+// Sets the connection options and creates the prepared statement cache for the
+// current thread.
+static void db_conn_init(sqlite3 *db) {
+  sqlite3_busy_timeout(db, 10);
+  sqlite3_exec(db, "PRAGMA foreign_keys = FALSE", NULL, NULL, NULL);
+  // Unknown PRAGMAs are silently ignored, so this is safe with older SQLite
+  // versions that don't support mmap_size.
+  char *tune = g_strdup_printf("PRAGMA cache_size = -%d; PRAGMA mmap_size = %d", DB_CACHE_SIZE, DB_MMAP_SIZE);
+  sqlite3_exec(db, tune, NULL, NULL, NULL);
+  g_free(tune);
+  g_static_private_set(&db_stmt_cache, g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, db_stmt_free), NULL);
+}
+
+
+// Finalizes the cached statements of the current thread and closes the
+// connection.
+static void db_conn_close(sqlite3 *db) {
+  g_hash_table_unref(g_static_private_get(&db_stmt_cache));
+  g_static_private_set(&db_stmt_cache, NULL, NULL);
+  sqlite3_close(db);
+}
+
+
 static gpointer db_thread_func(gpointer dat) {
   // Open database
   char *dbfn = dat;
@@ -409,16 +556,33 @@ static gpointer db_thread_func(gpointer dat) {
     g_error("Couldn't open `%s': %s", dbfn, sqlite3_errmsg(db));
   g_free(dbfn);
 
-  sqlite3_busy_timeout(db, 10);
-  sqlite3_exec(db, "PRAGMA foreign_keys = FALSE", NULL, NULL, NULL);
-
-  // Create prepared statement cache and start handling queries
-  db_stmt_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, db_stmt_free);
+  db_conn_init(db);
   db_queue_process(db);
-  g_hash_table_unref(db_stmt_cache);
+  db_conn_close(db);
+  return NULL;
+}
 
-  // Close
-  sqlite3_close(db);
+
+// Thread of a read connection. These only handle plain queue items (no
+// batches or flags) and never start a transaction.
+static gpointer db_read_thread_func(gpointer dat) {
+  sqlite3 *db = dat;
+  db_conn_init(db);
+
+  GAsyncQueue *res;
+  gint64 lastid;
+  while(1) {
+    char *q = g_async_queue_pop(db_read_queue);
+    if(darray_get_int32(q) & DBF_END) {
+      g_free(q);
+      break;
+    }
+    int r = db_queue_process_one(db, q, FALSE, FALSE, &res, &lastid);
+    db_queue_item_final(res, r, lastid);
+    g_free(q);
+  }
+
+  db_conn_close(db);
   return NULL;
 }
 
@@ -426,6 +590,24 @@ static gpointer db_thread_func(gpointer dat) {
 // Flushes the queue, blocks until all queries are processed and then performs
 // a little cleanup.
 void db_close() {
+  // The read connections are closed first, so that the database thread holds
+  // the last connection and can checkpoint the WAL.
+  if(db_read_queue) {
+    guint i;
+    for(i=0; i<db_read_threads->len; i++) {
+      GByteArray *a = g_byte_array_new();
+      darray_init(a);
+      darray_add_int32(a, DBF_END);
+      g_async_queue_push(db_read_queue, g_byte_array_free(a, FALSE));
+    }
+    for(i=0; i<db_read_threads->len; i++)
+      g_thread_join(g_ptr_array_index(db_read_threads, i));
+    g_ptr_array_unref(db_read_threads);
+    g_async_queue_unref(db_read_queue);
+    db_read_threads = NULL;
+    db_read_queue = NULL;
+  }
+
   // Send a END message to the database thread
   GByteArray *a = g_byte_array_new();
   darray_init(a);
@@ -438,17 +620,13 @@ void db_close() {
 }
 
 
-// The query is assumed to be a static string that is not freed or modified.
-static void *db_queue_item_create(int flags, const char *q, ...) {
-  GByteArray *a = g_byte_array_new();
-  darray_init(a);
-  darray_add_int32(a, flags);
+// Appends a query and its arguments to a queue item. The query is assumed to
+// be a static string that is not freed or modified.
+static void db_queue_item_add(GByteArray *a, const char *q, va_list va) {
   darray_add_ptr(a, q);
 
   int t;
   char *p;
-  va_list va;
-  va_start(va, q);
   while((t = va_arg(va, int)) != DBQ_END && t != DBQ_RES) {
     switch(t) {
     case DBQ_NULL:
@@ -480,7 +658,7 @@ static void *db_queue_item_create(int flags, const char *q, ...) {
         darray_add_int32(a, DBQ_NULL);
       break;
     default:
-      g_return_val_if_reached(NULL);
+      g_return_if_reached();
     }
   }
 
@@ -493,19 +671,184 @@ static void *db_queue_item_create(int flags, const char *q, ...) {
       darray_add_int32(a, t);
   }
 
-  va_end(va);
   darray_add_int32(a, DBQ_END);
+}
+
+
+static void *db_queue_item_create(int flags, const char *q, ...) {
+  GByteArray *a = g_byte_array_new();
+  darray_init(a);
+  darray_add_int32(a, flags);
+
+  va_list va;
+  va_start(va, q);
+  db_queue_item_add(a, q, va);
+  va_end(va);
 
   return g_byte_array_free(a, FALSE);
 }
 
 
-#define db_queue_lock() g_async_queue_lock(db_queue)
+// Batches. Each thread has its own batch, which is started with
+// db_batch_begin() and pushed to the database thread when the outermost
+// db_batch_end() is called. Only queries that are added with
+// db_queue_push_batch() end up in the batch; any other query will first flush
+// the current batch to make sure that the order of execution is preserved.
+// This means that functions that wait for a result can still be used within a
+// db_batch_begin()/db_batch_end() block.
+
+typedef struct db_batch_t {
+  int depth;
+  int num;
+  GByteArray *a;
+} db_batch_t;
+
+static GStaticPrivate db_batch_key = G_STATIC_PRIVATE_INIT;
+
+
+static void db_batch_free(gpointer dat) {
+  db_batch_t *b = dat;
+  g_return_if_fail(!b->a);
+  g_slice_free(db_batch_t, b);
+}
+
+
+static db_batch_t *db_batch_get() {
+  db_batch_t *b = g_static_private_get(&db_batch_key);
+  if(!b) {
+    b = g_slice_new0(db_batch_t);
+    g_static_private_set(&db_batch_key, b, db_batch_free);
+  }
+  return b;
+}
+
+
+// Pushes the batch of the current thread to the database thread, if there is
+// anything in it.
+static void db_batch_flush() {
+  db_batch_t *b = g_static_private_get(&db_batch_key);
+  if(!b || !b->a)
+    return;
+  darray_add_int32(b->a, 0);
+  g_async_queue_push(db_queue, g_byte_array_free(b->a, FALSE));
+  b->a = NULL;
+  b->num = 0;
+}
+
+
+// Starts or continues a batch in the current thread. Batches may be nested.
+void db_batch_begin() {
+  db_batch_get()->depth++;
+}
+
+
+void db_batch_end() {
+  db_batch_t *b = db_batch_get();
+  g_return_if_fail(b->depth > 0);
+  if(!--b->depth)
+    db_batch_flush();
+}
+
+
+// Adds a query to the batch of the current thread, or pushes it as a regular
+// query if no batch has been started. Queries that return results may be
+// added, but the results will only become available after the batch has been
+// flushed.
+static void db_queue_push_batch(const char *q, ...) {
+  va_list va;
+  va_start(va, q);
+  db_batch_t *b = g_static_private_get(&db_batch_key);
+
+  if(!b || !b->depth) {
+    GByteArray *a = g_byte_array_new();
+    darray_init(a);
+    darray_add_int32(a, 0);
+    db_queue_item_add(a, q, va);
+    g_async_queue_push(db_queue, g_byte_array_free(a, FALSE));
+  } else {
+    if(!b->a) {
+      b->a = g_byte_array_new();
+      darray_init(b->a);
+      darray_add_int32(b->a, DBF_BATCH);
+    }
+    darray_add_int32(b->a, 1);
+    db_queue_item_add(b->a, q, va);
+    if(++b->num >= DB_BATCH_MAX)
+      db_batch_flush();
+  }
+  va_end(va);
+}
+
+
+#define db_queue_lock() do { db_batch_flush(); g_async_queue_lock(db_queue); } while(0)
 #define db_queue_unlock() g_async_queue_unlock(db_queue)
-#define db_queue_push(...) g_async_queue_push(db_queue, db_queue_item_create(__VA_ARGS__))
+#define db_queue_push(...) do { db_batch_flush(); g_async_queue_push(db_queue, db_queue_item_create(__VA_ARGS__)); } while(0)
 #define db_queue_push_unlocked(...) g_async_queue_push_unlocked(db_queue, db_queue_item_create(__VA_ARGS__))
 
 
+// Executes a read-only query on a read connection, if there are any, and
+// returns its first row. `res' must be the same queue as given with DBQ_RES.
+// Returns NULL on error or if the query didn't return a row, otherwise the
+// returned result item (with the result code already read) must be g_free()'d.
+// Read connections only see committed data, while the database thread may keep
+// a transaction open for up to DB_FLUSH_TIMEOUT. A query that doesn't return
+// a row is therefore retried on the database thread, so a row that has just
+// been inserted is never missed. Rows that have been modified in the current
+// transaction may still be returned in their old state, so this should only be
+// used for data that is rarely modified after being inserted.
+static char *db_queue_read(GAsyncQueue *res, const char *q, ...) {
+  GByteArray *a = g_byte_array_new();
+  darray_init(a);
+  darray_add_int32(a, 0);
+  va_list va;
+  va_start(va, q);
+  db_queue_item_add(a, q, va);
+  va_end(va);
+
+  char *r = NULL;
+  if(db_read_queue) {
+    // The copy needs its own reference to the result queue
+    char *retry = g_memdup(a->data, a->len);
+    g_async_queue_ref(res);
+    g_async_queue_push(db_read_queue, g_byte_array_free(a, FALSE));
+    r = g_async_queue_pop(res);
+    if(darray_get_int32(r) == SQLITE_ROW) {
+      g_async_queue_unref(res);
+      g_free(retry);
+      return r;
+    }
+    g_free(r);
+    r = retry;
+  } else
+    r = (char *)g_byte_array_free(a, FALSE);
+
+  db_batch_flush();
+  g_async_queue_push(db_queue, r);
+  r = g_async_queue_pop(res);
+  if(darray_get_int32(r) == SQLITE_ROW)
+    return r;
+  g_free(r);
+  return NULL;
+}
+
+
+// Writes the database thread statistics to *out, for display to the user.
+void db_stats(GString *out) {
+  hist_t depth, batch, trans, commit;
+  g_static_mutex_lock(&db_stats_lock);
+  depth = db_stats_depth;
+  batch = db_stats_batch;
+  trans = db_stats_trans;
+  commit = db_stats_commit;
+  g_static_mutex_unlock(&db_stats_lock);
+
+  hist_format(&depth, out, "Queue depth", "");
+  hist_format(&batch, out, "Batch size", "");
+  hist_format(&trans, out, "Transaction size", "");
+  hist_format(&commit, out, "Commit latency", "us");
+}
+
+
 
 
 
@@ -517,8 +860,11 @@ gint64 db_fl_addhash(const char *path, guint64 size, time_t lastmod, const char
   char hash[40] = {};
   base32_encode(root, hash);
 
-  db_queue_lock();
-  db_queue_push_unlocked(DBF_NEXT,
+  // Both queries are sent in a single batch item. The batch is flushed
+  // explicitly because we wait for the result, even if the caller has a
+  // batch of its own open.
+  db_batch_begin();
+  db_queue_push_batch(
     "INSERT OR IGNORE INTO hashdata (root, size, tthl) VALUES(?, ?, ?)",
     DBQ_TEXT, hash,
     DBQ_INT64, (gint64)size,
@@ -532,7 +878,7 @@ gint64 db_fl_addhash(const char *path, guint64 size, time_t lastmod, const char
   // the same realpath() (e.g. one is a symlink). In such a case it is safe to
   // just do a REPLACE.
   GAsyncQueue *a = g_async_queue_new_full(g_free);
-  db_queue_push_unlocked(0,
+  db_queue_push_batch(
     "INSERT OR REPLACE INTO hashfiles (tth, lastmod, filename) VALUES(?, ?, ?)",
     DBQ_TEXT, hash,
     DBQ_INT64, (gint64)lastmod,
@@ -540,7 +886,8 @@ gint64 db_fl_addhash(const char *path, guint64 size, time_t lastmod, const char
     DBQ_RES, a, DBQ_LASTID,
     DBQ_END
   );
-  db_queue_unlock();
+  db_batch_flush();
+  db_batch_end();
 
   char *r = g_async_queue_pop(a);
   guint64 id = darray_get_int32(r) == SQLITE_DONE ? darray_get_int64(r) : 0;
@@ -550,45 +897,140 @@ gint64 db_fl_addhash(const char *path, guint64 size, time_t lastmod, const char
 }
 
 
-// Fetch the tthl data associated with a TTH root. Return value must be
-// g_free()'d. Returns NULL on error or when it's not in the DB.
-char *db_fl_gettthl(const char *root, int *len) {
-  char hash[40] = {};
-  base32_encode(root, hash);
+// Fetch the tthl data associated with a TTH root, without blocking the main
+// thread on the database. The callback is called from the main loop with
+// dat=NULL on error or when it's not in the DB. The data is owned by the cache
+// and must not be modified or freed, nor used after the callback returns.
+// Recently requested TTHL data is kept in a small LRU cache, as popular files
+// are likely to have their TTHL requested by each new downloader.
+
+#define DB_TTHL_CACHE (4*1024*1024)
+
+typedef struct db_tthl_t {
+  char root[24];
+  int len;
+  char *dat;
+  GList *lru;
+} db_tthl_t;
+
+typedef struct db_tthl_req_t {
+  char root[24];
+  gboolean dl; // Fetch from the dl table rather than hashdata, bypasses the cache
+  char *r;
+  void (*cb)(const char *, int, void *);
+  void *dat;
+} db_tthl_req_t;
 
+static GThreadPool *db_tthl_pool = NULL;
+static GHashTable *db_tthl_cache = NULL; // root -> db_tthl_t
+static GQueue db_tthl_lru = G_QUEUE_INIT;// most recently used first
+static int db_tthl_bytes = 0;
+
+
+static void db_tthl_add(const char *root, char *dat, int len) {
+  if(g_hash_table_lookup(db_tthl_cache, root)) {
+    g_free(dat);
+    return;
+  }
+  while(db_tthl_bytes + len > DB_TTHL_CACHE) {
+    db_tthl_t *t = g_queue_pop_tail(&db_tthl_lru);
+    g_hash_table_remove(db_tthl_cache, t->root);
+    db_tthl_bytes -= t->len;
+    g_free(t->dat);
+    g_slice_free(db_tthl_t, t);
+  }
+  db_tthl_t *t = g_slice_new(db_tthl_t);
+  memcpy(t->root, root, 24);
+  t->dat = dat;
+  t->len = len;
+  g_queue_push_head(&db_tthl_lru, t);
+  t->lru = db_tthl_lru.head;
+  g_hash_table_insert(db_tthl_cache, t->root, t);
+  db_tthl_bytes += len;
+}
+
+
+static gboolean db_tthl_done(gpointer dat) {
+  db_tthl_req_t *q = dat;
+  int n = 0;
+  char *res = q->r ? darray_get_dat(q->r, &n) : NULL;
+  if(q->dl || n > DB_TTHL_CACHE/16)
+    q->cb(n ? res : NULL, n, q->dat);
+  else if(n) {
+    db_tthl_add(q->root, g_memdup(res, n), n);
+    db_tthl_t *t = g_hash_table_lookup(db_tthl_cache, q->root);
+    q->cb(t->dat, t->len, q->dat);
+  } else
+    q->cb(NULL, 0, q->dat);
+
+  g_free(q->r);
+  g_slice_free(db_tthl_req_t, q);
+  return FALSE;
+}
+
+
+static void db_tthl_fetch(gpointer dat, gpointer udat) {
+  db_tthl_req_t *q = dat;
+  char hash[40] = {};
+  base32_encode(q->root, hash);
   GAsyncQueue *a = g_async_queue_new_full(g_free);
-  db_queue_push(0, "SELECT COALESCE(tthl, '') FROM hashdata WHERE root = ?",
+  q->r = db_queue_read(a, q->dl
+      ? "SELECT COALESCE(tthl, '') FROM dl WHERE tth = ?"
+      : "SELECT COALESCE(tthl, '') FROM hashdata WHERE root = ?",
     DBQ_TEXT, hash,
     DBQ_RES, a, DBQ_BLOB,
     DBQ_END
   );
+  g_async_queue_unref(a);
+  g_idle_add(db_tthl_done, q);
+}
 
-  char *r = g_async_queue_pop(a);
-  int n = 0;
-  char *res = darray_get_int32(r) == SQLITE_ROW ? darray_get_dat(r, &n) : NULL;
-  res = n ? g_memdup(res, n) : NULL;
-  if(len)
-    *len = n;
 
-  g_free(r);
-  g_async_queue_unref(a);
-  return res;
+static void db_tthl_push(const char *root, gboolean dl, void (*cb)(const char *, int, void *), void *dat) {
+  db_tthl_req_t *q = g_slice_new0(db_tthl_req_t);
+  memcpy(q->root, root, 24);
+  q->dl = dl;
+  q->cb = cb;
+  q->dat = dat;
+  g_thread_pool_push(db_tthl_pool, q, NULL);
+}
+
+
+static void db_tthl_init() {
+  if(!db_tthl_pool) {
+    // Each thread waits for one query at a time, this allows for a few
+    // lookups to run concurrently on the read connections.
+    db_tthl_pool = g_thread_pool_new(db_tthl_fetch, NULL, 4, FALSE, NULL);
+    db_tthl_cache = g_hash_table_new(g_int_hash, tiger_hash_equal);
+  }
+}
+
+
+void db_fl_gettthl_async(const char *root, void (*cb)(const char *, int, void *), void *dat) {
+  db_tthl_init();
+  db_tthl_t *t = g_hash_table_lookup(db_tthl_cache, root);
+  if(t) {
+    g_queue_unlink(&db_tthl_lru, t->lru);
+    g_queue_push_head_link(&db_tthl_lru, t->lru);
+    cb(t->dat, t->len, dat);
+    return;
+  }
+  db_tthl_push(root, FALSE, cb, dat);
 }
 
 
 // Get information for a file. Returns 0 if not found or error.
 gint64 db_fl_getfile(const char *path, time_t *lastmod, guint64 *size, char *tth) {
   GAsyncQueue *a = g_async_queue_new_full(g_free);
-  db_queue_push(0,
+  char *r = db_queue_read(a,
     "SELECT f.id, f.lastmod, f.tth, d.size FROM hashfiles f JOIN hashdata d ON d.root = f.tth WHERE f.filename = ?",
     DBQ_TEXT, path,
     DBQ_RES, a, DBQ_INT64, DBQ_INT64, DBQ_TEXT, DBQ_INT64,
     DBQ_END
   );
 
-  char *r = g_async_queue_pop(a);
   gint64 id = 0;
-  if(darray_get_int32(r) == SQLITE_ROW) {
+  if(r) {
     id = darray_get_int64(r);
     *lastmod = darray_get_int64(r);
     base32_decode(darray_get_string(r), tth);
@@ -607,8 +1049,10 @@ gint64 db_fl_getfile(const char *path, time_t *lastmod, guint64 *size, char *tth
 // would be done as soon as the hashdata row has become obsolete.
 void db_fl_rmfiles(gint64 *ids, int num) {
   int i;
+  db_batch_begin();
   for(i=0; i<num; i++)
-    db_queue_push(0, "DELETE FROM hashfiles WHERE id = ?", DBQ_INT64, ids[i], DBQ_END);
+    db_queue_push_batch("DELETE FROM hashfiles WHERE id = ?", DBQ_INT64, ids[i], DBQ_END);
+  db_batch_end();
 }
 
 
@@ -714,10 +1158,10 @@ void db_dl_rm(const char *tth) {
   char hash[40] = {};
   base32_encode(tth, hash);
 
-  db_queue_lock();
-  db_queue_push_unlocked(DBF_NEXT, "DELETE FROM dl_users WHERE tth = ?", DBQ_TEXT, hash, DBQ_END);
-  db_queue_push_unlocked(0, "DELETE FROM dl WHERE tth = ?", DBQ_TEXT, hash, DBQ_END);
-  db_queue_unlock();
+  db_batch_begin();
+  db_queue_push_batch("DELETE FROM dl_users WHERE tth = ?", DBQ_TEXT, hash, DBQ_END);
+  db_queue_push_batch("DELETE FROM dl WHERE tth = ?", DBQ_TEXT, hash, DBQ_END);
+  db_batch_end();
 }
 
 
@@ -725,7 +1169,7 @@ void db_dl_rm(const char *tth) {
 void db_dl_setstatus(const char *tth, signed char priority, char error, const char *error_msg) {
   char hash[40] = {};
   base32_encode(tth, hash);
-  db_queue_push(0, "UPDATE dl SET priority = ?, error = ?, error_msg = ? WHERE tth = ?",
+  db_queue_push_batch("UPDATE dl SET priority = ?, error = ?, error_msg = ? WHERE tth = ?",
     DBQ_INT, (int)priority, DBQ_INT, (int)error,
     DBQ_TEXT, error_msg,
     DBQ_TEXT, hash,
@@ -742,7 +1186,7 @@ void db_dl_setuerr(guint64 uid, const char *tth, char error, const char *error_m
   if(tth) {
     char hash[40] = {};
     base32_encode(tth, hash);
-    db_queue_push(0, "UPDATE dl_users SET error = ?, error_msg = ? WHERE uid = ? AND tth = ?",
+    db_queue_push_batch("UPDATE dl_users SET error = ?, error_msg = ? WHERE uid = ? AND tth = ?",
       DBQ_INT, (int)error,
       DBQ_TEXT, error_msg,
       DBQ_INT64, (gint64)uid,
@@ -751,7 +1195,7 @@ void db_dl_setuerr(guint64 uid, const char *tth, char error, const char *error_m
     );
   // for all dl items
   } else {
-    db_queue_push(0, "UPDATE dl_users SET error = ?, error_msg = ? WHERE uid = ?",
+    db_queue_push_batch("UPDATE dl_users SET error = ?, error_msg = ? WHERE uid = ?",
       DBQ_INT, (int)error,
       DBQ_TEXT, error_msg,
       DBQ_INT64, (gint64)uid,
@@ -769,14 +1213,14 @@ void db_dl_rmuser(guint64 uid, const char *tth) {
   if(tth) {
     char hash[40] = {};
     base32_encode(tth, hash);
-    db_queue_push(0, "DELETE FROM dl_users WHERE uid = ? AND tth = ?",
+    db_queue_push_batch("DELETE FROM dl_users WHERE uid = ? AND tth = ?",
       DBQ_INT64, (gint64)uid,
       DBQ_TEXT, hash,
       DBQ_END
     );
   // for all dl items
   } else {
-    db_queue_push(0, "DELETE FROM dl_users WHERE uid = ?",
+    db_queue_push_batch("DELETE FROM dl_users WHERE uid = ?",
       DBQ_INT64, (gint64)uid,
       DBQ_END
     );
@@ -788,7 +1232,7 @@ void db_dl_rmuser(guint64 uid, const char *tth) {
 void db_dl_settthl(const char *tth, const char *tthl, int len) {
   char hash[40] = {};
   base32_encode(tth, hash);
-  db_queue_push(0, "UPDATE dl SET tthl = ? WHERE tth = ?",
+  db_queue_push_batch("UPDATE dl SET tthl = ? WHERE tth = ?",
     DBQ_BLOB, len, tthl,
     DBQ_TEXT, hash,
     DBQ_END
@@ -800,7 +1244,7 @@ void db_dl_settthl(const char *tth, const char *tthl, int len) {
 void db_dl_insert(const char *tth, guint64 size, const char *dest, signed char priority, char error, const char *error_msg) {
   char hash[40] = {};
   base32_encode(tth, hash);
-  db_queue_push(0, "INSERT OR REPLACE INTO dl (tth, size, dest, priority, error, error_msg) VALUES (?, ?, ?, ?, ?, ?)",
+  db_queue_push_batch("INSERT OR REPLACE INTO dl (tth, size, dest, priority, error, error_msg) VALUES (?, ?, ?, ?, ?, ?)",
     DBQ_TEXT, hash,
     DBQ_INT64, (gint64)size,
     DBQ_TEXT, dest,
@@ -816,7 +1260,7 @@ void db_dl_insert(const char *tth, guint64 size, const char *dest, signed char p
 void db_dl_adduser(const char *tth, guint64 uid, char error, const char *error_msg) {
   char hash[40] = {};
   base32_encode(tth, hash);
-  db_queue_push(0, "INSERT OR REPLACE INTO dl_users (tth, uid, error, error_msg) VALUES (?, ?, ?, ?)",
+  db_queue_push_batch("INSERT OR REPLACE INTO dl_users (tth, uid, error, error_msg) VALUES (?, ?, ?, ?)",
     DBQ_TEXT, hash,
     DBQ_INT64, (gint64)uid,
     DBQ_INT, (int)error,
@@ -826,11 +1270,20 @@ void db_dl_adduser(const char *tth, guint64 uid, char error, const char *error_m
 }
 
 
+// Fetch the (possibly shrunk) tthl data of a dl row, in the same way as
+// db_fl_gettthl_async(). The data isn't cached, and is only valid for the
+// duration of the callback.
+void db_dl_gettthl_async(const char *tth, void (*cb)(const char *, int, void *), void *dat) {
+  db_tthl_init();
+  db_tthl_push(tth, TRUE, cb, dat);
+}
+
+
 gboolean db_dl_checkhash(const char *root, int num, const char *hash) {
   char rhash[40] = {};
   base32_encode(root, rhash);
   GAsyncQueue *a = g_async_queue_new_full(g_free);
-  db_queue_push(0, "SELECT 1 FROM dl WHERE tth = ? AND substr(tthl, 1+(24*?), 24) = ?",
+  char *r = db_queue_read(a, "SELECT 1 FROM dl WHERE tth = ? AND substr(tthl, 1+(24*?), 24) = ?",
     DBQ_TEXT, rhash,
     DBQ_INT, num,
     DBQ_BLOB, 24, hash,
@@ -838,8 +1291,7 @@ gboolean db_dl_checkhash(const char *root, int num, const char *hash) {
     DBQ_END
   );
 
-  char *r = g_async_queue_pop(a);
-  gboolean res = darray_get_int32(r) == SQLITE_ROW ? TRUE : FALSE;
+  gboolean res = r ? TRUE : FALSE;
   g_free(r);
   g_async_queue_unref(a);
   return res;
@@ -1044,6 +1496,7 @@ void db_vars_rm(guint64 hub, const char *name) {
   i.name = (char *)name;
   i.hub = hub;
   g_hash_table_remove(db_vars_cache, &i);
+  var_snap_invalidate(hub, FALSE);
 
   // Update database
   db_queue_push(0, "DELETE FROM vars WHERE name = ? AND hub = ?",
@@ -1063,6 +1516,7 @@ void db_vars_rmhub(guint64 hub) {
   while(g_hash_table_iter_next(&i, NULL, (gpointer *)&n))
     if(n->hub == hub)
       g_hash_table_iter_remove(&i);
+  var_snap_invalidate(hub, TRUE);
 
   // Update database
   db_queue_push(0, "DELETE FROM vars WHERE hub = ?", DBQ_INT64, hub, DBQ_END);
@@ -1086,6 +1540,7 @@ void db_vars_set(guint64 hub, const char *name, const char *val) {
   i->name = g_strdup(name);
   i->val = g_strdup(val);
   g_hash_table_replace(db_vars_cache, i, i);
+  var_snap_invalidate(hub, FALSE);
 
   // Update database
   db_queue_push(0, "INSERT OR REPLACE INTO vars (name, hub, value) VALUES (?, ?, ?)",
@@ -1619,6 +2074,56 @@ void db_init() {
 
 
 
+// Switches the database to WAL mode and opens the read connections, or
+// switches back to the default rollback journal, depending on the db_readers
+// setting. Must be called after vars_init() and before any other thread uses
+// the database.
+void db_init_readers() {
+  int num = var_get_int(0, VAR_db_readers);
+
+  GAsyncQueue *a = g_async_queue_new_full(g_free);
+  db_queue_push(DBF_SINGLE|DBF_NOCACHE, num ? "PRAGMA journal_mode = WAL" : "PRAGMA journal_mode = DELETE",
+    DBQ_RES, a, DBQ_TEXT, DBQ_END);
+  char *r = g_async_queue_pop(a);
+  gboolean wal = darray_get_int32(r) == SQLITE_ROW && strcmp(darray_get_string(r), "wal") == 0;
+  g_free(r);
+  g_async_queue_unref(a);
+
+  if(!num)
+    return;
+  if(!wal) {
+    g_warning("Unable to enable WAL mode, not using any read connections.");
+    return;
+  }
+
+  // It is safe to relax this in WAL mode: the database can't get corrupted,
+  // at most the last few transactions are lost on power failure.
+  db_queue_push(DBF_SINGLE|DBF_NOCACHE, "PRAGMA synchronous = NORMAL", DBQ_END);
+
+  char *fn = g_build_filename(db_dir, "db.sqlite3", NULL);
+  db_read_queue = g_async_queue_new();
+  db_read_threads = g_ptr_array_new();
+  int i;
+  for(i=0; i<num; i++) {
+    sqlite3 *db;
+    if(sqlite3_open_v2(fn, &db, SQLITE_OPEN_READONLY, NULL)) {
+      g_warning("Couldn't open read connection to `%s': %s", fn, sqlite3_errmsg(db));
+      sqlite3_close(db);
+      break;
+    }
+    g_ptr_array_add(db_read_threads, g_thread_create(db_read_thread_func, db, TRUE, NULL));
+  }
+  g_free(fn);
+
+  if(!db_read_threads->len) {
+    g_ptr_array_unref(db_read_threads);
+    g_async_queue_unref(db_read_queue);
+    db_read_threads = NULL;
+    db_read_queue = NULL;
+  }
+}
+
+
 // Executes a VACUUM
 void db_vacuum() {
   db_queue_push(DBF_SINGLE|DBF_NOCACHE, "VACUUM", DBQ_END);
@@ -51,6 +51,8 @@ struct dl_user_t {
   cc_t *cc;             // Always when state = IDL or ACT, may be set or NULL in EXP
   GSequence *queue;     // list of dl_user_dl_t, ordered by dl_user_dl_sort()
   dl_user_dl_t *active; // when state = DLU_ACT, the dud that is being downloaded (NULL if it had been removed from the queue while downloading)
+  dl_user_dl_t *next;   // cached dl_user_getdl(), valid when sched != NULL
+  GSequenceIter *sched; // position in dl_sched, or NULL if not a possible target
 };
 
 /* State machine for dl_user.state:
@@ -104,23 +106,28 @@ struct dl_t {
   gboolean flmatch : 1;  // For lists: Whether to match queue after completed download
   gboolean hassize : 1;  // For lists: Whether the size of the file list is known and validated
   gboolean allbusy : 1;  // When no more unallocated blocks are available (maintained by dlfile.c)
+  gboolean moving : 1;   // When the completed file is being moved to its destination (maintained by dlfile.c)
+  gboolean tthl_load : 1;// When dl.tthl has been requested from the database, set even if that failed (maintained by dlfile.c)
   signed char prio;      // DLP_*
   char error;            // DLE_*
   unsigned char active_threads; // number of active downloading threads (maintained by dlfile.c)
   int incfd;             // file descriptor for this file in <incoming_dir> (maintained by dlfile.c)
   char *error_msg;       // if error != DLE_NONE
   char *flsel;           // path to file/dir to select for filelists
+  char *flpath;          // For partial lists: path of the requested directory, NULL for the full list
   ui_tab_t *flpar;       // parent of the file list browser tab for filelists (might be a dangling pointer!)
-  char hash[24];         // TTH for files, tiger(uid) for filelists
+  char hash[24];         // TTH for files, tiger(uid) for filelists, tiger(uid+flpath) for partial lists
   GPtrArray *u;          // list of users who have this file (GSequenceIter pointers into dl_user.queue)
   guint64 size;          // total size of the file
   guint64 have;          // what we have so far
   guint64 hash_block;    // number of bytes that each block represents
+  int moved;             // MiB copied so far while moving, (atomically) written by the mover thread (maintained by dlfile.c)
   char *inc;             // path to the incomplete file (<incoming_dir>/<base32-hash>)
   char *dest;            // destination path
   GSequenceIter *iter;   // used by ui_dl
   GSList *threads;       // maintained by dlfile.c
   guint8 *bitmap;        // Only used if hastthl, maintained by dlfile.c
+  char *tthl;            // In-memory copy of the TTHL data, maintained by dlfile.c (may be NULL even if hastthl)
   guint bitmap_src;      // timeout source for flushing the bitmap, maintained by dlfile.c
   /* Maintained by dlfile.c, protects dl_t.{have,bitmap,bitmap_src} and
    * dlfile_thread_t.{allocated,avail,chunk}.
@@ -140,6 +147,9 @@ struct dl_t {
 // Minimum TTHL block size we're interested in. If we get better granularity
 // than this, blocks will be combined to reduce the TTHL data.
 #define DL_MINBLOCKSIZE (1024*1024)
+// Interval, in seconds, at which the users of items that are fully allocated
+// are re-checked for endgame mode.
+#define DL_ENDGAME_RECHECK 10
 
 // Download queue.
 // Key = dl->hash, Value = dl_t
@@ -149,6 +159,17 @@ GHashTable *dl_queue = NULL;
 // uid -> dl_user lookup table.
 static GHashTable *queue_users = NULL;
 
+// Scheduler index: the users that are possible targets for
+// dl_queue_start_do(), ordered by dl_sched_cmp(). A user is in this list when
+// it is in the NCO or IDL state and has something to download from it, see
+// dl_sched_update(). Whether an NCO user is online is only checked when it is
+// about to be connected to; offline users are dropped from the index at that
+// point and re-added by dl_user_join().
+static GSequence *dl_sched = NULL;
+
+// Number of users in the DLU_ACT state
+static int dl_sched_active = 0;
+
 
 
 // Utility function that returns an error string for DLE_* errors.
@@ -179,7 +200,7 @@ static gboolean dl_user_waitdone(gpointer dat);
 
 // Determine whether a dl_user_dl struct can be considered as "enabled".
 #define dl_user_dl_enabled(dud) (\
-    !dud->error && dud->dl->prio > DLP_OFF\
+    !dud->error && dud->dl->prio > DLP_OFF && !dud->dl->moving\
     && ((!dud->dl->size && dud->dl->islist) || dud->dl->size != dud->dl->have)\
   )
 
@@ -224,13 +245,64 @@ static dl_user_dl_t *dl_user_getdl(const dl_user_t *du) {
   GSequenceIter *i = g_sequence_get_begin_iter(du->queue);
   for(; !g_sequence_iter_is_end(i); i=g_sequence_iter_next(i)) {
     dl_user_dl_t *dud = g_sequence_get(i);
-    if(dl_user_dl_enabled(dud) && !dud->dl->allbusy)
+    if(dl_user_dl_enabled(dud) && (!dud->dl->allbusy || dlfile_endgame(dud->dl, du->uid)))
       return dud;
   }
   return NULL;
 }
 
 
+// Compares two users in the scheduler index. Users in the IDL state always
+// get priority over users in the NCO state, in order to prevent the situation
+// that the lower-priority user in the IDL state is connected to anyway in a
+// next iteration. Otherwise the users are ordered on the file that would be
+// downloaded from them. Returns -1 if a has a higher priority than b.
+static gint dl_sched_cmp(gconstpointer a, gconstpointer b, gpointer dat) {
+  const dl_user_t *ua = a;
+  const dl_user_t *ub = b;
+  return
+      ua->state == DLU_IDL && ub->state != DLU_IDL ? -1
+    : ua->state != DLU_IDL && ub->state == DLU_IDL ?  1
+    : dl_user_dl_sort(ua->next, ub->next, NULL);
+}
+
+
+static void dl_sched_rm(dl_user_t *du) {
+  if(du->sched) {
+    g_sequence_remove(du->sched);
+    du->sched = NULL;
+  }
+}
+
+
+static void dl_sched_add(dl_user_t *du) {
+  du->next = du->state == DLU_NCO || du->state == DLU_IDL ? dl_user_getdl(du) : NULL;
+  if(du->next)
+    du->sched = g_sequence_insert_sorted(dl_sched, du, dl_sched_cmp, NULL);
+}
+
+
+// Updates the position of a user in the scheduler index. Must be called after
+// anything has changed that may affect the result of dl_user_getdl() or
+// dl_sched_cmp() for this user.
+static void dl_sched_update(dl_user_t *du) {
+  dl_sched_rm(du);
+  dl_sched_add(du);
+}
+
+
+// Same as above, for all users of a dl item. The users are all removed before
+// being added again; users that are ordered on this item may be at the wrong
+// position in the index, which would confuse g_sequence_insert_sorted().
+static void dl_sched_update_dl(dl_t *dl) {
+  int i;
+  for(i=0; i<dl->u->len; i++)
+    dl_sched_rm(((dl_user_dl_t *)g_sequence_get(g_ptr_array_index(dl->u, i)))->u);
+  for(i=0; i<dl->u->len; i++)
+    dl_sched_add(((dl_user_dl_t *)g_sequence_get(g_ptr_array_index(dl->u, i)))->u);
+}
+
+
 // Change the state of a user, use state=-1 when something is removed from
 // du->queue.
 static void dl_user_setstate(dl_user_t *du, int state) {
@@ -248,19 +320,22 @@ static void dl_user_setstate(dl_user_t *du, int state) {
 
   // Set state
   //g_debug("dlu:%"G_GINT64_MODIFIER"x: %d -> %d (active = %s)", du->uid, du->state, state, du->active ? "true":"false");
+  if(state >= 0 && state != du->state)
+    dl_sched_active += (state == DLU_ACT ? 1 : 0) - (du->state == DLU_ACT ? 1 : 0);
   if(state >= 0)
     du->state = state;
 
   // Check whether there is any value in keeping this dl_user struct in memory
   if(du->state == DLU_NCO && !g_sequence_get_length(du->queue)) {
+    dl_sched_rm(du);
     g_hash_table_remove(queue_users, &du->uid);
     g_sequence_free(du->queue);
     g_slice_free(dl_user_t, du);
     return;
   }
 
-  // Check whether we can initiate a download again. (We could be more
-  // selective here to possibly decrease CPU usage, but oh well.)
+  // Check whether we can initiate a download again.
+  dl_sched_update(du);
   dl_queue_start();
 }
 
@@ -292,8 +367,22 @@ void dl_user_cc(guint64 uid, cc_t *cc) {
 // get from that user. May be called with uid=0 after joining a hub, in which
 // case all users in the queue will be checked.
 void dl_user_join(guint64 uid) {
-  if(!uid || g_hash_table_lookup(queue_users, &uid))
-    dl_queue_start();
+  dl_user_t *du = NULL;
+  if(uid) {
+    du = g_hash_table_lookup(queue_users, &uid);
+    if(!du)
+      return;
+    dl_sched_update(du);
+  } else {
+    // Users that went offline have been dropped from the index by
+    // dl_queue_start_do(), add them again.
+    GHashTableIter iter;
+    g_hash_table_iter_init(&iter, queue_users);
+    while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&du))
+      if(!du->sched)
+        dl_sched_add(du);
+  }
+  dl_queue_start();
 }
 
 
@@ -323,6 +412,7 @@ static void dl_user_add(dl_t *dl, guint64 uid, char error, const char *error_msg
   // Add to du->queue and dl->u
   g_ptr_array_add(dl->u, g_sequence_insert_sorted(du->queue, dud, dl_user_dl_sort, NULL));
   uit_dl_dud_listchange(dud, UITDL_ADD);
+  dl_sched_update(du);
 }
 
 
@@ -341,6 +431,9 @@ static void dl_user_rm(dl_t *dl, int i) {
     du->active = NULL;
   }
 
+  // du->next may point to dud, so take the user out of the scheduler index
+  // before dud is freed. dl_user_setstate() will add it again.
+  dl_sched_rm(du);
   uit_dl_dud_listchange(dud, UITDL_DEL);
   g_sequence_remove(dudi); // dl_user_dl_free() will be called implicitly
   g_ptr_array_remove_index_fast(dl->u, i);
@@ -404,77 +497,36 @@ static gboolean dl_queue_start_user(dl_user_t *du) {
 }
 
 
-// Compares two dl_user structs by a "priority" to determine from whom to
-// download first. Note that users in the IDL state always get priority over
-// users in the NCO state, in order to prevent the situation that the
-// lower-priority user in the IDL state is connected to anyway in a next
-// iteration. Returns -1 if a has a higher priority than b.
-// This function assumes dl_queue_start_istarget() for both arguments.
-static gint dl_queue_start_cmp(gconstpointer a, gconstpointer b) {
-  const dl_user_t *ua = a;
-  const dl_user_t *ub = b;
-  return -1*(
-    ua->state == DLU_IDL && ub->state != DLU_IDL ?  1 :
-    ua->state != DLU_IDL && ub->state == DLU_IDL ? -1 :
-    dl_user_dl_sort(dl_user_getdl(ub), dl_user_getdl(ua), NULL)
-  );
-}
-
-
 // Initiates a new connection to a user or requests a file from an already
-// connected user, based on the current state of dl_user and dl structs.  This
-// function is relatively slow, so is executed from a timeout to bulk-check
-// everything after some state variables have changed. Should not be called
-// directly, use dl_queue_start() instead.
+// connected user, based on the current state of dl_user and dl structs. The
+// targets are taken from the head of the scheduler index, so the cost of this
+// function depends on the number of free slots rather than on the size of the
+// queue. Should not be called directly, use dl_queue_start() instead.
 static gboolean dl_queue_start_do(gpointer dat) {
-  int freeslots = var_get_int(0, VAR_download_slots);
-
-  // Walk through all users in the queue and:
-  // - determine possible targets to connect to or to start a transfer from
-  // - determine the highest-priority target
-  // - calculate freeslots
-  GPtrArray *targets = g_ptr_array_new();
-  dl_user_t *du, *target = NULL;
-  int target_i = 0;
-  GHashTableIter iter;
-  g_hash_table_iter_init(&iter, queue_users);
-  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&du)) {
-    if(du->state == DLU_ACT)
-      freeslots--;
-    if(dl_queue_start_istarget(du)) {
-      if(!target || dl_queue_start_cmp(target, du) > 0) {
-        target_i = targets->len;
-        target = du;
-      }
-      g_ptr_array_add(targets, du);
+  int freeslots = var_get_int(0, VAR_download_slots) - dl_sched_active;
+
+  while(freeslots > 0 && g_sequence_get_length(dl_sched) > 0) {
+    dl_user_t *du = g_sequence_get(g_sequence_get_begin_iter(dl_sched));
+
+    // The result of dl_user_getdl() may have changed without us being
+    // notified, e.g. when dl->allbusy is set or when the endgame conditions
+    // have changed. Fix the position of the user and try again.
+    if(dl_user_getdl(du) != du->next) {
+      dl_sched_update(du);
+      continue;
     }
-  }
 
-  // Try to connect to the previously found highest-priority target, then go
-  // through the list again to eliminate any users that may not be a target
-  // anymore and to fetch a new highest-priority target.
-  while(freeslots > 0 && target) {
-    if(dl_queue_start_user(target) && !--freeslots)
-      break;
-    g_ptr_array_remove_index_fast(targets, target_i);
-
-    int i = 0;
-    target = NULL;
-    while(i < targets->len) {
-      du = g_ptr_array_index(targets, i);
-      if(!dl_queue_start_istarget(du))
-        g_ptr_array_remove_index_fast(targets, i);
-      else {
-        if(!target || dl_queue_start_cmp(target, du) > 0) {
-          target_i = i;
-          target = du;
-        }
-        i++;
-      }
+    // Not a target (most likely offline), drop it from the index.
+    if(!dl_queue_start_istarget(du)) {
+      dl_sched_rm(du);
+      continue;
     }
-  }
 
-  g_ptr_array_unref(targets);
+    // dl_queue_start_user() changes the state of the user, which removes it
+    // from the index.
+    if(dl_queue_start_user(du))
+      freeslots--;
+  }
 
   // Reset this value *after* performing all the checks and starts, to ignore
   // any dl_queue_start() calls while this function was working - this function
@@ -485,9 +537,9 @@ static gboolean dl_queue_start_do(gpointer dat) {
 
 
 // Make sure dl_queue_start() can be called at any time that something changed
-// that might allow us to initiate a download again. Since this is a relatively
-// expensive operation, dl_queue_start() simply queues a dl_queue_start_do()
-// from a timer.
+// that might allow us to initiate a download again. dl_queue_start() simply
+// queues a dl_queue_start_do() from a timer, in order to handle many changes
+// in a single run.
 // TODO: Make the timeout configurable? It's a tradeoff between download
 // management responsiveness and CPU usage.
 void dl_queue_start() {
@@ -498,6 +550,49 @@ void dl_queue_start() {
 }
 
 
+// Items for which dl->allbusy is set and that may be eligible for endgame
+// mode at a later point. Whether a user can join in endgame mode depends on
+// time and on the progress of the other downloaders, so the users of these
+// items are re-checked periodically. List of (hash) g_memdup()'ed TTHs.
+static GSList *dl_endgame_list = NULL;
+
+static gboolean dl_endgame_recheck(gpointer dat) {
+  GSList *l = dl_endgame_list;
+  dl_endgame_list = NULL;
+  gboolean change = FALSE;
+  for(; l; l=g_slist_delete_link(l, l)) {
+    dl_t *dl = g_hash_table_lookup(dl_queue, l->data);
+    if(dl && dl->allbusy) {
+      dl_sched_update_dl(dl);
+      dl_endgame_list = g_slist_prepend(dl_endgame_list, l->data);
+      change = TRUE;
+    } else
+      g_free(l->data);
+  }
+  if(change)
+    dl_queue_start();
+  return dl_endgame_list ? TRUE : FALSE;
+}
+
+
+// To be called by dlfile.c in the main thread when dl->allbusy has changed.
+void dl_queue_sched(dl_t *dl) {
+  dl_sched_update_dl(dl);
+  if(dl->allbusy && !dl->islist) {
+    GSList *l = dl_endgame_list;
+    for(; l; l=l->next)
+      if(memcmp(l->data, dl->hash, 24) == 0)
+        break;
+    if(!l) {
+      if(!dl_endgame_list)
+        g_timeout_add_seconds(DL_ENDGAME_RECHECK, dl_endgame_recheck, NULL);
+      dl_endgame_list = g_slist_prepend(dl_endgame_list, g_memdup(dl->hash, 24));
+    }
+  }
+  dl_queue_start();
+}
+
+
 
 
 
@@ -569,6 +664,43 @@ void dl_queue_addlist(hub_user_t *u, const char *sel, ui_tab_t *parent, gboolean
 }
 
 
+// Add a partial file list of some user to the queue. The list is not written
+// to disk, once received it is passed to uit_fl_partial().
+void dl_queue_addpartial(hub_user_t *u, const char *path) {
+  g_return_if_fail(u && u->hasinfo);
+  dl_t *dl = g_slice_new0(dl_t);
+  dl->islist = TRUE;
+  g_static_mutex_init(&dl->lock);
+  tiger_ctx_t tg;
+  tiger_init(&tg);
+  tiger_update(&tg, (char *)&u->uid, 8);
+  tiger_update(&tg, path, strlen(path));
+  tiger_final(&tg, dl->hash);
+  if(g_hash_table_lookup(dl_queue, dl->hash)) {
+    g_slice_free(dl_t, dl);
+    return;
+  }
+  dl->flpath = g_strdup(path);
+  dl->dest = g_strdup_printf("%016"G_GINT64_MODIFIER"x:%s", u->uid, path);
+  g_debug("dl:%016"G_GINT64_MODIFIER"x: queueing partial list of %s", u->uid, path);
+  dl_queue_insert(dl, FALSE);
+  dl_user_add(dl, u->uid, 0, NULL);
+}
+
+
+// Removes a partial list without disconnecting the user it was being
+// downloaded from, the caller is responsible for putting the connection back
+// into the idle state.
+static void dl_queue_rmpartial(dl_t *dl) {
+  if(dl->u->len) {
+    dl_user_dl_t *dud = g_sequence_get(g_ptr_array_index(dl->u, 0));
+    if(dud->u->active == dud)
+      dud->u->active = NULL;
+  }
+  dl_queue_rm(dl);
+}
+
+
 // Add a regular file to the queue. If there is another file in the queue with
 // the same filename, something else will be chosen instead.
 // Returns true if it was added, false if it was already in the queue.
@@ -608,9 +740,12 @@ void dl_queue_add_fl(guint64 uid, fl_list_t *fl, char *base, GRegex *excl) {
     if(!dl_queue_addfile(uid, fl->tth, fl->size, name))
       ui_mf(NULL, 0, "Ignoring `%s': already queued.", name);
   } else {
+    // Send the database updates for all files in a single batch
     int i;
+    db_batch_begin();
     for(i=0; i<fl->sub->len; i++)
       dl_queue_add_fl(uid, g_ptr_array_index(fl->sub, i), name, excl);
+    db_batch_end();
   }
   if(!base)
     ui_mf(NULL, 0, "%s added to queue.", name);
@@ -665,8 +800,10 @@ int dl_queue_match_fl(guint64 uid, fl_list_t *fl, int *added) {
   } else {
     int n = 0;
     int i;
+    db_batch_begin();
     for(i=0; i<fl->sub->len; i++)
       n += dl_queue_match_fl(uid, g_ptr_array_index(fl->sub, i), added);
+    db_batch_end();
     return n;
   }
 }
@@ -689,10 +826,10 @@ void dl_queue_rm(dl_t *dl) {
     g_hash_table_remove(dl_queue, dl->hash);
   }
 
-  // Don't do anything else if there is still an active downloading thread.
-  // Wait until all threads stop this function is called again to actually free
-  // and remove the stuff.
-  if(dl->active_threads)
+  // Don't do anything else if there is still an active downloading thread or
+  // if the file is being moved. Wait until all threads stop this function is
+  // called again to actually free and remove the stuff.
+  if(dl->active_threads || dl->moving)
     return;
 
   // remove from the database
@@ -704,6 +841,7 @@ void dl_queue_rm(dl_t *dl) {
   g_ptr_array_unref(dl->u);
   g_free(dl->inc);
   g_free(dl->flsel);
+  g_free(dl->flpath);
   g_free(dl->dest);
   g_free(dl->error_msg);
   g_slice_free(dl_t, dl);
@@ -718,6 +856,7 @@ void dl_queue_setprio(dl_t *dl, signed char prio) {
   int i;
   for(i=0; i<dl->u->len; i++)
     g_sequence_sort_changed(g_ptr_array_index(dl->u, i), dl_user_dl_sort, NULL);
+  dl_sched_update_dl(dl);
   // Start downloading or re-attempt finalization if it is enabled
   if(enabled) {
     if(!dl->active_threads && (dl->hassize || !dl->islist) && dl->have == dl->size)
@@ -749,6 +888,14 @@ void dl_queue_setuerr(guint64 uid, char *tth, char e, const char *emsg) {
 
   g_debug("%016"G_GINT64_MODIFIER"x: Setting download error for `%s' to: %s", uid, dl?dl->dest:"all", dl_strerror(e, emsg));
 
+  // Partial lists are not retried, the browser falls back to the full list
+  // instead.
+  if(dl && dl->flpath) {
+    uit_fl_partial(uid, dl->flpath, NULL, 0);
+    dl_queue_rmpartial(dl);
+    return;
+  }
+
   // from a single dl item
   if(dl) {
     int i;
@@ -781,6 +928,7 @@ void dl_queue_setuerr(guint64 uid, char *tth, char e, const char *emsg) {
   // update DB
   db_dl_setuerr(uid, tth, e, emsg);
 
+  dl_sched_update(du);
   dl_queue_start();
 }
 
@@ -900,6 +1048,19 @@ void dl_settthl(guint64 uid, char *tth, char *tthl, int len) {
   db_dl_settthl(tth, tthl, newlen);
   dl->hastthl = TRUE;
   dl->hash_block = bs;
+  dlfile_settthl(dl, tthl, newlen);
+}
+
+
+// Called when a partial file list has been received. buf has the uncompressed
+// XML data.
+void dl_setpartial(guint64 uid, char *hash, const char *buf, int len) {
+  dl_t *dl = g_hash_table_lookup(dl_queue, hash);
+  if(!dl || !dl->flpath)
+    return;
+  g_debug("dl:%016"G_GINT64_MODIFIER"x: Received partial list of %s (len = %d)", uid, dl->flpath, len);
+  uit_fl_partial(uid, dl->flpath, buf, len);
+  dl_queue_rmpartial(dl);
 }
 
 
@@ -944,6 +1105,7 @@ void dl_load_dlu(const char *tth, guint64 uid, char error, const char *error_msg
 
 void dl_init_global() {
   queue_users = g_hash_table_new(g_int64_hash, g_int64_equal);
+  dl_sched = g_sequence_new(NULL);
   dl_queue = g_hash_table_new(g_int_hash, tiger_hash_equal);
   // load stuff from the database
   db_dl_getdls(dl_load_dl);
@@ -960,6 +1122,7 @@ void dl_init_global() {
 
 
 void dl_close_global() {
+  dlfile_close_global();
   // Delete incomplete file lists. They won't be completed anyway.
   GHashTableIter iter;
   dl_t *dl;
@@ -38,6 +38,8 @@
  * segment: A range of chunks that is requested for downloading in a single
  *          CGET/$ADCGET. Not necessarily aligned to or a multiple of the block
  *          size. Segments are allocated at the start of a thread.
+ *    twin: A thread created in endgame mode, downloading the same segment as
+ *          a slow busy thread. See dlfile_endgame_new().
  */
 
 
@@ -60,6 +62,17 @@ struct dlfile_thread_t {
   guint32 chunk;     /* Current chunk number */
   guint32 len;       /* Number of bytes downloaded into this chunk */
   gboolean busy;     /* Whether this thread is being used */
+  struct dlfile_pipe_t *pipe; /* Write-behind pipeline while receiving data, see dlfile_recv() */
+  GStaticMutex wlock; /* Held while writing to the incoming file through the pipeline */
+  time_t started;    /* When the current segment was allocated */
+  guint32 startchunk;/* First chunk of the current segment */
+  /* Endgame mode, see dlfile_endgame_new(). Protected by dl->lock. */
+  struct dlfile_thread_t *twin; /* The other thread downloading the same segment */
+  gboolean endgame;  /* Data is buffered and written per block (egbuf/eglen) */
+  gboolean dupdone;  /* The current segment has already been raced and won */
+  int lost;          /* (atomic) Range taken over by the twin, thread is not in dl->threads */
+  char *egbuf;
+  guint32 eglen;
   /* Fields for deferred error reporting */
   guint64 uid;
   char *err_msg, *uerr_msg;
@@ -69,11 +82,49 @@ struct dlfile_thread_t {
 #endif
 
 
+/* Maximum size of the in-memory copy of the TTHL data of a single file. With
+ * the minimum block size of 1 MiB, this covers files of up to 42 GiB. Block
+ * verification for larger files falls back to querying the database. */
+#define DLFILE_TTHL_MAXLEN (1024*1024)
+
+
+/* Endgame mode is only used when the block size is at most this large, as
+ * twin threads buffer a full block in memory. */
+#define DLFILE_ENDGAME_MAXBLOCK (16*1024*1024)
+
+/* A busy thread is only raced by a twin when its segment has been running for
+ * at least DLFILE_ENDGAME_MINTIME seconds and is expected to take at least
+ * DLFILE_ENDGAME_MINETA more seconds to complete. */
+#define DLFILE_ENDGAME_MINTIME 10
+#define DLFILE_ENDGAME_MINETA  30
+
+/* Segments are sized to approximate this download time, in seconds. */
+#define DLFILE_SEGMENT_TIME 300
+
+
 static guint32 dlfile_chunks(guint64 size) {
   return (size+DLFILE_CHUNKSIZE-1)/DLFILE_CHUNKSIZE;
 }
 
 
+static dlfile_thread_t *dlfile_thread_new(dl_t *dl, guint32 chunk, guint32 avail) {
+  dlfile_thread_t *t = g_slice_new0(dlfile_thread_t);
+  t->dl = dl;
+  t->chunk = chunk;
+  t->avail = avail;
+  g_static_mutex_init(&t->wlock);
+  tth_init(&t->hash_tth);
+  return t;
+}
+
+
+static void dlfile_thread_free(dlfile_thread_t *t) {
+  g_static_mutex_free(&t->wlock);
+  g_free(t->egbuf);
+  g_slice_free(dlfile_thread_t, t);
+}
+
+
 static gboolean dlfile_hasfreeblock(dlfile_thread_t *t) {
   guint32 chunksinblock = t->dl->hash_block / DLFILE_CHUNKSIZE;
   return t->avail - t->allocated > chunksinblock
@@ -216,11 +267,7 @@ static gboolean dlfile_load_bitmap(dl_t *dl, int fd) {
 
 
 static dlfile_thread_t *dlfile_load_block(dl_t *dl, int fd, guint32 chunk, guint32 chunksinblock, guint32 *reset) {
-  dlfile_thread_t *t = g_slice_new0(dlfile_thread_t);
-  t->dl = dl;
-  t->chunk = chunk;
-  t->avail = chunksinblock;
-  tth_init(&t->hash_tth);
+  dlfile_thread_t *t = dlfile_thread_new(dl, chunk, chunksinblock);
 
   char *bufp = malloc(DLFILE_CHUNKSIZE);
 
@@ -347,9 +394,42 @@ void dlfile_rm(dl_t *dl) {
 
   GSList *l;
   for(l=dl->threads; l; l=l->next)
-    g_slice_free(dlfile_thread_t, l->data);
+    dlfile_thread_free(l->data);
   g_slist_free(dl->threads);
   g_free(dl->bitmap);
+  g_free(dl->tthl);
+  dl->tthl = NULL;
+}
+
+
+/* Called from dl.c when the TTHL data has been received. Keeps a copy of the
+ * data in memory, so that we don't have to ask the database thread when
+ * verifying a block. */
+void dlfile_settthl(dl_t *dl, const char *tthl, int len) {
+  if(dl->tthl || len != tth_num_blocks(dl->size, dl->hash_block)*24 || len > DLFILE_TTHL_MAXLEN)
+    return;
+  dl->tthl = g_memdup(tthl, len);
+}
+
+
+static void dlfile_load_tthl_cb(const char *tthl, int len, void *dat) {
+  dl_t *dl = g_hash_table_lookup(dl_queue, dat);
+  g_free(dat);
+  if(dl && dl->incfd > 0 && !dl->tthl && tthl && len == tth_num_blocks(dl->size, dl->hash_block)*24)
+    dl->tthl = g_memdup(tthl, len);
+}
+
+
+/* Loads the TTHL data from the database in the background if we don't have it
+ * yet, see dlfile_settthl(). This is only attempted once for each dl item,
+ * until then (or if it fails) blocks are verified with db_dl_checkhash(). */
+static void dlfile_load_tthl(dl_t *dl) {
+  if(dl->islist || !dl->hastthl || dl->tthl || dl->tthl_load || dl->size < dl->hash_block)
+    return;
+  if(tth_num_blocks(dl->size, dl->hash_block)*24 > DLFILE_TTHL_MAXLEN)
+    return;
+  dl->tthl_load = TRUE;
+  db_dl_gettthl_async(dl->hash, dlfile_load_tthl_cb, g_memdup(dl->hash, 24));
 }
 
 
@@ -364,6 +444,8 @@ static gboolean dlfile_open(dl_t *dl) {
     return FALSE;
   }
 
+  dlfile_load_tthl(dl);
+
   /* Everything else has already been initialized if we have a thread or bitmap */
   if(dl->threads || dl->bitmap)
     return TRUE;
@@ -379,20 +461,86 @@ static gboolean dlfile_open(dl_t *dl) {
     }
   }
 
-  dlfile_thread_t *t = g_slice_new0(dlfile_thread_t);
-  t->dl = dl;
-  t->chunk = 0;
-  t->allocated = 0;
-  if(!dl->islist)
-    t->avail = dlfile_chunks(dl->size);
-  tth_init(&t->hash_tth);
+  dlfile_thread_t *t = dlfile_thread_new(dl, 0, dl->islist ? 0 : dlfile_chunks(dl->size));
   dl->threads = g_slist_prepend(dl->threads, t);
   return TRUE;
 }
 
 
-/* XXX: This function may block in the main thread for a while. Perhaps do it in a threadpool? */
+/* Moving the completed file to its destination may involve copying it to
+ * another filesystem, which can take minutes for large files. This is done in
+ * a separate thread, the dl item is only removed from the queue after that.
+ * Moves that are still in progress at shutdown are cancelled by
+ * dlfile_close_global(). */
+typedef struct dlfile_move_t {
+  dl_t *dl;
+  char *dest;
+  GError *err;
+  int finished; /* (atomic) Set by the mover thread after file_move() */
+} dlfile_move_t;
+
+static GThreadPool *dlfile_move_pool = NULL;
+static GSList *dlfile_moves = NULL; /* Moves without a dlfile_move_done() yet */
+static int dlfile_move_cancel = 0;  /* (atomic) */
+
+
+static gboolean dlfile_move_done(gpointer dat) {
+  dlfile_move_t *m = dat;
+  dl_t *dl = m->dl;
+  dl->moving = FALSE;
+  dlfile_moves = g_slist_remove(dlfile_moves, m);
+
+  /* The item has been removed from the queue while it was being moved, so
+   * dl_queue_rm() has been deferred. */
+  if(g_hash_table_lookup(dl_queue, dl->hash) != dl)
+    dl_queue_rm(dl);
+  else if(m->err) {
+    g_warning("Error moving file to destination `%s': %s.", dl->dest, m->err->message);
+    dl_queue_seterr(dl, DLE_IO_DEST, m->err->message);
+  } else
+    dl_finished(dl);
+
+  if(m->err)
+    g_error_free(m->err);
+  g_free(m->dest);
+  g_slice_free(dlfile_move_t, m);
+  return FALSE;
+}
+
+
+static void dlfile_move_thread(gpointer dat, gpointer udat) {
+  dlfile_move_t *m = dat;
+  file_move(m->dl->inc, m->dest, m->dl->islist, &m->dl->moved, &dlfile_move_cancel, &m->err);
+  g_atomic_int_set(&m->finished, 1);
+  g_idle_add(dlfile_move_done, m);
+}
+
+
+/* Called at shutdown. Cancels any copies in progress and waits for them to
+ * stop. Moves that didn't finish leave the download in the DLE_IO_DEST error
+ * state, which dlfile_load() recognizes on the next start; the incoming file
+ * is still complete at that point. */
+void dlfile_close_global() {
+  if(!dlfile_move_pool)
+    return;
+  g_atomic_int_set(&dlfile_move_cancel, 1);
+  g_thread_pool_free(dlfile_move_pool, TRUE, TRUE);
+  dlfile_move_pool = NULL;
+
+  while(dlfile_moves) {
+    dlfile_move_t *m = dlfile_moves->data;
+    if(g_atomic_int_get(&m->finished))
+      g_idle_remove_by_data(m);
+    else
+      g_set_error_literal(&m->err, 1, g_file_error_from_errno(EINTR), "Interrupted by shutdown");
+    dlfile_move_done(m);
+  }
+}
+
+
 void dlfile_finished(dl_t *dl) {
+  if(dl->moving)
+    return;
   if(dl->incfd <= 0 && !dlfile_open(dl))
     return;
 
@@ -406,6 +554,8 @@ void dlfile_finished(dl_t *dl) {
   }
   int r = close(dl->incfd);
   dl->incfd = 0;
+  g_free(dl->tthl);
+  dl->tthl = NULL;
   if(r < 0) {
     g_warning("Error closing the incoming file for `%s': %s.", dl->dest, g_strerror(errno));
     dl_queue_seterr(dl, DLE_IO_INC, g_strerror(errno));
@@ -439,23 +589,146 @@ void dlfile_finished(dl_t *dl) {
   }
   g_free(fdest);
 
-  GError *err = NULL;
-  file_move(dl->inc, dest, dl->islist, &err);
-  g_free(dest);
-  if(err) {
-    g_warning("Error moving file to destination `%s': %s.", dl->dest, err->message);
-    dl_queue_seterr(dl, DLE_IO_DEST, err->message);
-    g_error_free(err);
-    return;
+  if(!dlfile_move_pool)
+    dlfile_move_pool = g_thread_pool_new(dlfile_move_thread, NULL, 2, FALSE, NULL);
+  dlfile_move_t *m = g_slice_new0(dlfile_move_t);
+  m->dl = dl;
+  m->dest = dest;
+  dl->moving = TRUE;
+  g_atomic_int_set(&dl->moved, 0);
+  dlfile_moves = g_slist_prepend(dlfile_moves, m);
+  g_thread_pool_push(dlfile_move_pool, m, NULL);
+}
+
+
+/* Endgame mode: When all blocks have been allocated (dl->allbusy), an idle
+ * source may race the segment of a slow busy thread. The new thread (the
+ * twin) starts at the beginning of the block that the busy thread is
+ * currently downloading, and requests the remainder of its segment, rounded up
+ * to whole blocks.
+ *
+ * Twin threads don't use the pipeline; each block is buffered in memory and
+ * only written to the file after its hash has been verified. Whoever
+ * completes a block first wins:
+ * - If the busy thread has already passed the block, the twin has lost and
+ *   its transfer is cancelled. The busy thread is not raced again for the
+ *   same segment.
+ * - Otherwise the busy thread is cancelled and the twin takes its place in
+ *   dl->threads, see dlfile_endgame_takeover().
+ * The busy thread is only raced when it is somewhat into its current block,
+ * so that the hash check of its previous block can't still be running. */
+
+/* Looks for the busy thread that is expected to take the longest to complete
+ * its segment. Must be called with dl->lock held. */
+static dlfile_thread_t *dlfile_endgame_victim(dl_t *dl, guint64 uid) {
+  if(dl->islist || dl->hash_block > DLFILE_ENDGAME_MAXBLOCK)
+    return NULL;
+
+  guint32 chunksinblock = dl->hash_block/DLFILE_CHUNKSIZE;
+  time_t now = time(NULL);
+  dlfile_thread_t *v = NULL;
+  guint64 veta = 0;
+  GSList *l;
+  for(l=dl->threads; l; l=l->next) {
+    dlfile_thread_t *ti = l->data;
+    if(!ti->busy || !ti->allocated || ti->twin || ti->endgame || ti->dupdone || ti->uid == uid
+        || (ti->chunk % chunksinblock == 0 && !ti->len) || now - ti->started < DLFILE_ENDGAME_MINTIME)
+      continue;
+    guint64 done = ti->chunk < ti->startchunk ? 0 : (guint64)(ti->chunk - ti->startchunk)*DLFILE_CHUNKSIZE + ti->len;
+    guint64 left = (guint64)ti->allocated*DLFILE_CHUNKSIZE - ti->len;
+    guint64 eta = done ? left * (now - ti->started) / done : G_MAXUINT64;
+    if(eta >= DLFILE_ENDGAME_MINETA && eta > veta) {
+      v = ti;
+      veta = eta;
+    }
   }
+  return v;
+}
+
+
+/* Whether dlfile_getchunk() can give this user something to download, even
+ * though dl->allbusy is set. */
+gboolean dlfile_endgame(dl_t *dl, guint64 uid) {
+  if(!dl->allbusy)
+    return FALSE;
+  g_static_mutex_lock(&dl->lock);
+  gboolean r = dlfile_endgame_victim(dl, uid) != NULL;
+  g_static_mutex_unlock(&dl->lock);
+  return r;
+}
+
 
-  dl_finished(dl);
+/* Must be called with dl->lock held. */
+static dlfile_thread_t *dlfile_endgame_new(dl_t *dl, dlfile_thread_t *v) {
+  guint32 chunksinblock = dl->hash_block/DLFILE_CHUNKSIZE;
+  guint32 start = (v->chunk / chunksinblock) * chunksinblock;
+  guint32 end = v->chunk + v->avail;
+  guint32 segend = MIN(end, ((v->chunk + v->allocated + chunksinblock - 1) / chunksinblock) * chunksinblock);
+
+  dlfile_thread_t *t = dlfile_thread_new(dl, start, end - start);
+  t->allocated = segend - start;
+  t->endgame = TRUE;
+  t->egbuf = g_malloc(MIN(dl->hash_block, dl->size));
+  t->twin = v;
+  v->twin = t;
+  g_debug("Endgame: racing thread at chunk %u (allocated = %u) from chunk %u to %u", v->chunk, v->allocated, start, segend);
+  return t;
+}
+
+
+/* Number of chunks in the block starting at the given chunk. */
+static guint32 dlfile_endgame_blockchunks(dl_t *dl, guint32 chunk) {
+  return MIN(dl->hash_block/DLFILE_CHUNKSIZE, dlfile_chunks(dl->size) - chunk);
+}
+
+
+/* Ends the race of the twin t, which has lost or failed. Must be called with
+ * dl->lock held. */
+static void dlfile_endgame_lose(dlfile_thread_t *t, gboolean raced) {
+  t->twin->twin = NULL;
+  if(raced)
+    t->twin->dupdone = TRUE;
+  t->twin = NULL;
+  g_atomic_int_set(&t->lost, 1);
+}
+
+
+/* Called when the twin t wins from v: v is cancelled and t takes over its
+ * range. Must be called with dl->lock held. */
+static void dlfile_endgame_takeover(dlfile_thread_t *t, dlfile_thread_t *v) {
+  dl_t *dl = t->dl;
+
+  /* v may still be writing through its pipeline; make sure that it has
+   * stopped before t writes the block. */
+  g_static_mutex_lock(&v->wlock);
+  g_atomic_int_set(&v->lost, 1);
+  g_static_mutex_unlock(&v->wlock);
+
+  /* Whatever v has downloaded of the current block is redone by t */
+  dl->have -= (guint64)(v->chunk - t->chunk)*DLFILE_CHUNKSIZE + v->len;
+  t->avail = v->chunk + v->avail - t->chunk;
+  t->allocated = MIN(t->allocated, t->avail);
+  g_slist_find(dl->threads, v)->data = t;
+  v->twin = t->twin = NULL;
+  g_debug("Endgame: twin at chunk %u has taken over, avail = %u", t->chunk, t->avail);
+}
+
+
+/* Called after t has completed a block. If its twin is still working on that
+ * block, the twin has lost. */
+static void dlfile_endgame_passed(dlfile_thread_t *t) {
+  g_static_mutex_lock(&t->dl->lock);
+  dlfile_thread_t *d = t->twin;
+  if(d && t->chunk >= d->chunk + dlfile_endgame_blockchunks(t->dl, d->chunk))
+    dlfile_endgame_lose(d, TRUE);
+  g_static_mutex_unlock(&t->dl->lock);
 }
 
 
 /* The 'speed' argument should be a pessimistic estimate of the peers' speed,
- * in bytes/s. I think this is best obtained from a 30 second average.
- * Returns the thread pointer. */
+ * in bytes/s, and is used to size the segment. I think this is best obtained
+ * from the throughput of the previous segments received from the peer.
+ * Returns the thread pointer, or NULL if there is nothing to download. */
 dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
   dlfile_thread_t *t = NULL;
   if(!dlfile_open(dl))
@@ -493,33 +766,41 @@ dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
       t = ti;
   }
 
-  if(!t) {
+  if(!t && !tsec) {
+    dlfile_thread_t *v = dlfile_endgame_victim(dl, uid);
+    if(!v) {
+      g_static_mutex_unlock(&dl->lock);
+      return NULL;
+    }
+    t = dlfile_endgame_new(dl, v);
+  } else if(!t) {
     guint32 chunksinblock = dl->hash_block/DLFILE_CHUNKSIZE;
     guint32 chunk = ((tsec->chunk + tsec->allocated + (tsec->avail - tsec->allocated)/2) / chunksinblock) * chunksinblock;
     if(chunk < tsec->chunk + tsec->allocated) /* Only possible for the last block in the file */
       chunk += chunksinblock;
-    t = g_slice_new0(dlfile_thread_t);
-    t->dl = dl;
-    t->chunk = chunk;
-    t->avail = tsec->avail - (chunk - tsec->chunk);
+    t = dlfile_thread_new(dl, chunk, tsec->avail - (chunk - tsec->chunk));
     g_return_val_if_fail(t->avail > 0, NULL);
-    tth_init(&t->hash_tth);
 
     tsec->avail -= t->avail;
     dl->threads = g_slist_prepend(dl->threads, t);
   }
 
   /* Number of chunks to request as one segment. The size of a segment is
-   * chosen to approximate a download time of ~5 min. */
-  guint32 minsegment = var_get_int64(0, VAR_download_segment);
-  if(minsegment) {
-    guint32 chunks = MIN(G_MAXUINT32, 1 + ((speed * 300) / DLFILE_CHUNKSIZE));
+   * chosen to approximate a download time of DLFILE_SEGMENT_TIME, so fast
+   * peers get large segments and slow peers small ones. The segment of a
+   * twin thread has already been determined. */
+  guint32 minsegment = var_snap(0)->download_segment;
+  if(!t->endgame && minsegment) {
+    guint32 chunks = MIN(G_MAXUINT32, 1 + ((speed * DLFILE_SEGMENT_TIME) / DLFILE_CHUNKSIZE));
     chunks = MAX(chunks, (minsegment+DLFILE_CHUNKSIZE-1) / DLFILE_CHUNKSIZE);
     t->allocated = MIN(t->avail, chunks);
-  } else
+  } else if(!t->endgame)
     t->allocated = t->avail;
   t->busy = TRUE;
   t->uid = uid;
+  t->dupdone = FALSE;
+  t->started = time(NULL);
+  t->startchunk = t->chunk;
   dl->active_threads++;
 
   /* Go through the list again to update dl->allbusy */
@@ -528,23 +809,42 @@ dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
     if(ti->avail && (!ti->busy || dlfile_hasfreeblock(ti)))
       break;
   }
+  gboolean busychange = dl->allbusy != !l;
   dl->allbusy = !l;
 
   dlfile_threaddump(dl, 2);
   g_static_mutex_unlock(&dl->lock);
   g_debug("Allocating: allbusy = %d, chunk = %u, allocated = %u, avail = %u, chunksinblock = %u, chunksinfile = %u",
       dl->allbusy, t->chunk, t->allocated, t->avail, (guint32)dl->hash_block/DLFILE_CHUNKSIZE, dlfile_chunks(dl->size));
+  /* The other users of this file may have lost (or gained) their position in
+   * the download scheduler. */
+  if(busychange)
+    dl_queue_sched(dl);
   return t;
 }
 
 
+static gboolean dlfile_checkleaf(dl_t *dl, guint32 num, const char *leaf) {
+  return dl->size < dl->hash_block ? memcmp(leaf, dl->hash, 24) == 0
+    : dl->tthl ? memcmp(leaf, dl->tthl+(num*24), 24) == 0
+    : db_dl_checkhash(dl->hash, num, leaf);
+}
+
+
 static gboolean dlfile_recv_check(dlfile_thread_t *t, char *leaf) {
   guint32 num = (t->chunk-1)/(t->dl->hash_block / DLFILE_CHUNKSIZE);
-  if(t->dl->size < t->dl->hash_block ? memcmp(leaf, t->dl->hash, 24) == 0 : db_dl_checkhash(t->dl->hash, num, leaf))
+  if(dlfile_checkleaf(t->dl, num, leaf))
     return TRUE;
 
   g_static_mutex_lock(&t->dl->lock);
 
+  /* The block has been taken over by the twin, which has verified its own
+   * copy. Nothing to reset. */
+  if(g_atomic_int_get(&t->lost)) {
+    g_static_mutex_unlock(&t->dl->lock);
+    return FALSE;
+  }
+
   /* Hash failure, remove the failed block from the bitmap and dl->have, and
    * reset this thread so that the block can be re-downloaded. */
   guint32 startchunk = num * (t->dl->hash_block / DLFILE_CHUNKSIZE);
@@ -568,14 +868,21 @@ static gboolean dlfile_recv_check(dlfile_thread_t *t, char *leaf) {
 }
 
 
-static gboolean dlfile_recv_write(dlfile_thread_t *t, const char *buf, int len) {
-  off_t off = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len;
+/* t->wlock is held while writing, so that dlfile_endgame_takeover() can
+ * wait for an in-progress write to finish. */
+static gboolean dlfile_recv_write(dlfile_thread_t *t, guint64 off, const char *buf, int len) {
   off_t offi = off;
   size_t rem = len;
   const char *bufi = buf;
+  g_static_mutex_lock(&t->wlock);
+  if(g_atomic_int_get(&t->lost)) {
+    g_static_mutex_unlock(&t->wlock);
+    return FALSE;
+  }
   while(rem > 0) {
     ssize_t r = pwrite(t->dl->incfd, bufi, rem, offi);
     if(r <= 0) {
+      g_static_mutex_unlock(&t->wlock);
       t->err = DLE_IO_INC;
       t->err_msg = g_strdup(g_strerror(errno));
       return FALSE;
@@ -585,31 +892,32 @@ static gboolean dlfile_recv_write(dlfile_thread_t *t, const char *buf, int len)
     bufi += r;
   }
   fadv_oneshot(t->dl->incfd, off, len, VAR_FFC_DOWNLOAD);
+  g_static_mutex_unlock(&t->wlock);
   return TRUE;
 }
 
 
-/* Called when new data has been received from a downloading thread.  The data
- * is written to the file, the TTH calculation is updated and checked with the
- * DB, and the bitmap is updated.
- * This function may be called from another OS thread.
+/* Called when data has been written to the file. The TTH calculation is
+ * updated and checked with the TTHL data, and the bitmap is updated.
  * Returns TRUE to indicate success, FALSE on failure. */
-gboolean dlfile_recv(void *vt, const char *buf, int len) {
-  dlfile_thread_t *t = vt;
-  if(!dlfile_recv_write(t, buf, len))
-    return FALSE;
-
+static gboolean dlfile_recv_update(dlfile_thread_t *t, const char *buf, int len) {
   while(len > 0) {
     guint32 inchunk = MIN((guint32)len, DLFILE_CHUNKSIZE - t->len);
-    t->len += inchunk;
-    gboolean islast = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len == t->dl->size;
+    gboolean islast = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len + inchunk == t->dl->size;
 
     if(!t->dl->islist)
       tth_update(&t->hash_tth, buf, inchunk);
     buf += inchunk;
     len -= inchunk;
 
+    /* t->len is updated while the lock is held, so that it is consistent with
+     * dl->have in dlfile_endgame_takeover(). */
     g_static_mutex_lock(&t->dl->lock);
+    if(g_atomic_int_get(&t->lost)) {
+      g_static_mutex_unlock(&t->dl->lock);
+      return FALSE;
+    }
+    t->len += inchunk;
     t->dl->have += inchunk;
 
     if(!islast && t->len < DLFILE_CHUNKSIZE) {
@@ -633,25 +941,309 @@ gboolean dlfile_recv(void *vt, const char *buf, int len) {
       tth_init(&t->hash_tth);
       if(!dlfile_recv_check(t, leaf))
         return FALSE;
+      if(t->twin)
+        dlfile_endgame_passed(t);
+    }
+  }
+  return TRUE;
+}
+
+
+/* Called from twin threads when a full block has been received in t->egbuf. */
+static gboolean dlfile_endgame_commit(dlfile_thread_t *t, const char *leaf) {
+  dl_t *dl = t->dl;
+  guint32 chunksinblock = dl->hash_block / DLFILE_CHUNKSIZE;
+  guint32 chunks = dlfile_endgame_blockchunks(dl, t->chunk);
+
+  g_static_mutex_lock(&dl->lock);
+  if(g_atomic_int_get(&t->lost)) {
+    g_static_mutex_unlock(&dl->lock);
+    return FALSE;
+  }
+  if(!dlfile_checkleaf(dl, t->chunk / chunksinblock, leaf)) {
+    if(t->twin)
+      dlfile_endgame_lose(t, FALSE);
+    g_static_mutex_unlock(&dl->lock);
+    t->uerr = DLE_HASH;
+    t->uerr_msg = g_strdup_printf("Hash for block %u (chunk %u-%u) does not match.", t->chunk / chunksinblock, t->chunk, t->chunk+chunks);
+    return FALSE;
+  }
+  if(t->twin && t->twin->chunk >= t->chunk + chunks) {
+    dlfile_endgame_lose(t, TRUE);
+    g_static_mutex_unlock(&dl->lock);
+    return FALSE;
+  }
+  if(t->twin)
+    dlfile_endgame_takeover(t, t->twin);
+  g_static_mutex_unlock(&dl->lock);
+
+  /* Nobody else is writing to this block anymore, so the lock isn't needed
+   * while writing. */
+  if(!dlfile_recv_write(t, (guint64)t->chunk * DLFILE_CHUNKSIZE, t->egbuf, t->eglen))
+    return FALSE;
+
+  g_static_mutex_lock(&dl->lock);
+  guint32 i;
+  for(i=t->chunk; i<t->chunk+chunks; i++)
+    bita_set(dl->bitmap, i);
+  dlfile_save_bitmap_defer(dl);
+  dl->have += t->eglen;
+  t->chunk += chunks;
+  t->avail -= chunks;
+  t->allocated -= MIN(t->allocated, chunks);
+  g_static_mutex_unlock(&dl->lock);
+  return TRUE;
+}
+
+
+static gboolean dlfile_recv_endgame(dlfile_thread_t *t, const char *buf, int len) {
+  dl_t *dl = t->dl;
+  while(len > 0) {
+    if(g_atomic_int_get(&t->lost))
+      return FALSE;
+    guint32 blocklen = MIN(dl->hash_block, dl->size - (guint64)t->chunk * DLFILE_CHUNKSIZE);
+    guint32 n = MIN((guint32)len, blocklen - t->eglen);
+    memcpy(t->egbuf + t->eglen, buf, n);
+    tth_update(&t->hash_tth, buf, n);
+    t->eglen += n;
+    buf += n;
+    len -= n;
+
+    if(t->eglen == blocklen) {
+      char leaf[24];
+      tth_final(&t->hash_tth, leaf);
+      tth_init(&t->hash_tth);
+      if(!dlfile_endgame_commit(t, leaf))
+        return FALSE;
+      t->eglen = 0;
     }
   }
   return TRUE;
 }
 
 
+/* Received data passes through a pipeline of three threads, so that the
+ * network thread does not have to wait on the disk or on the TTH calculation:
+ *
+ *   receiver: dlfile_recv(), called from the network thread. Copies the data
+ *             into buffers.
+ *     writer: dlfile_pipe_writer(), writes the buffers to the incoming file.
+ *     hasher: dlfile_pipe_hasher(), calls dlfile_recv_update() on the written
+ *             data and passes the buffers back to the receiver.
+ *
+ * A buffer is handed to the writer when it is full, or earlier when the
+ * writer is idle. When the disk can't keep up, the data is thus written in
+ * large chunk-aligned blocks. Since the bitmap and dl->have are still only
+ * updated by dlfile_recv_update() after the data has been written, the
+ * bitmap never claims data that isn't in the file.
+ *
+ * After a stage has failed, the remaining data is discarded and dlfile_recv()
+ * returns FALSE. The error is stored in the dlfile_thread_t as usual.
+ * The pipeline is closed either when dlfile_recv() is called with buf = NULL
+ * from the network thread, or otherwise by dlfile_recv_done().
+ *
+ * Transfers handled by a shared transfer worker (see net_syn_worker()) don't
+ * use the pipeline: A full pipeline would block all other transfers on the
+ * same worker until the disk has caught up, and closing it has to wait for
+ * the writer and hasher. The data is written and hashed directly instead,
+ * like any other network I/O done by the worker. */
+
+#define DLFILE_PIPE_BUFSIZE (8*DLFILE_CHUNKSIZE)
+#define DLFILE_PIPE_BUFNUM  8
+
+typedef struct dlfile_buf_t {
+  guint64 off; /* File offset of dat[0] */
+  int len;     /* Length of the data, -1 to signal the end of the pipeline */
+  int size;    /* Number of bytes that may be stored in dat */
+  char dat[DLFILE_PIPE_BUFSIZE];
+} dlfile_buf_t;
+
+typedef struct dlfile_pipe_t {
+  dlfile_thread_t *t;
+  GAsyncQueue *free;  /* Unused buffers, for the receiver */
+  GAsyncQueue *write; /* Filled buffers, for the writer */
+  GAsyncQueue *hash;  /* Written buffers, for the hasher */
+  GThread *writer;
+  GThread *hasher;
+  dlfile_buf_t *cur;  /* Buffer currently being filled by the receiver */
+  int bufnum;         /* Number of allocated buffers */
+  guint64 off;        /* File offset of the next byte received */
+  int failed;         /* Set (atomically) when a stage has failed */
+} dlfile_pipe_t;
+
+
+static gpointer dlfile_pipe_writer(gpointer dat) {
+  dlfile_pipe_t *p = dat;
+  dlfile_buf_t *b;
+  while((b = g_async_queue_pop(p->write))->len >= 0) {
+    if(g_atomic_int_get(&p->failed) || !dlfile_recv_write(p->t, b->off, b->dat, b->len)) {
+      g_atomic_int_set(&p->failed, 1);
+      g_async_queue_push(p->free, b);
+    } else
+      g_async_queue_push(p->hash, b);
+  }
+  g_async_queue_push(p->hash, b);
+  return NULL;
+}
+
+
+static gpointer dlfile_pipe_hasher(gpointer dat) {
+  dlfile_pipe_t *p = dat;
+  dlfile_buf_t *b;
+  while((b = g_async_queue_pop(p->hash))->len >= 0) {
+    if(!g_atomic_int_get(&p->failed) && !dlfile_recv_update(p->t, b->dat, b->len))
+      g_atomic_int_set(&p->failed, 1);
+    g_async_queue_push(p->free, b);
+  }
+  g_free(b);
+  return NULL;
+}
+
+
+static dlfile_pipe_t *dlfile_pipe_new(dlfile_thread_t *t) {
+  dlfile_pipe_t *p = g_slice_new0(dlfile_pipe_t);
+  p->t = t;
+  p->free = g_async_queue_new();
+  p->write = g_async_queue_new();
+  p->hash = g_async_queue_new();
+  p->off = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len;
+  p->writer = g_thread_create(dlfile_pipe_writer, p, TRUE, NULL);
+  p->hasher = g_thread_create(dlfile_pipe_hasher, p, TRUE, NULL);
+  return p;
+}
+
+
+/* Flushes any remaining data to the writer and waits for the pipeline to
+ * finish. */
+static void dlfile_pipe_close(dlfile_thread_t *t) {
+  dlfile_pipe_t *p = t->pipe;
+  if(!p)
+    return;
+
+  if(p->cur && p->cur->len > 0)
+    g_async_queue_push(p->write, p->cur);
+  else if(p->cur)
+    g_free(p->cur);
+  dlfile_buf_t *b = g_malloc(G_STRUCT_OFFSET(dlfile_buf_t, dat));
+  b->len = -1;
+  g_async_queue_push(p->write, b);
+  g_thread_join(p->writer);
+  g_thread_join(p->hasher);
+
+  while((b = g_async_queue_try_pop(p->free)))
+    g_free(b);
+  g_async_queue_unref(p->free);
+  g_async_queue_unref(p->write);
+  g_async_queue_unref(p->hash);
+  g_slice_free(dlfile_pipe_t, p);
+  t->pipe = NULL;
+}
+
+
+/* Called when new data has been received from a downloading thread, or with
+ * buf = NULL when the transfer has ended.
+ * This function may be called from another OS thread.
+ * Returns TRUE to indicate success, FALSE on failure. */
+gboolean dlfile_recv(void *vt, const char *buf, int len) {
+  dlfile_thread_t *t = vt;
+  if(!buf) {
+    gboolean failed = t->pipe && g_atomic_int_get(&t->pipe->failed);
+    dlfile_pipe_close(t);
+    return !failed && !t->err && !t->uerr && !g_atomic_int_get(&t->lost);
+  }
+
+  if(t->endgame)
+    return dlfile_recv_endgame(t, buf, len);
+
+  if(!t->pipe && net_syn_worker()) {
+    guint64 off = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len;
+    return dlfile_recv_write(t, off, buf, len) && dlfile_recv_update(t, buf, len);
+  }
+
+  if(!t->pipe)
+    t->pipe = dlfile_pipe_new(t);
+  dlfile_pipe_t *p = t->pipe;
+  if(g_atomic_int_get(&p->failed))
+    return FALSE;
+
+  while(len > 0) {
+    if(!p->cur) {
+      p->cur = g_async_queue_try_pop(p->free);
+      if(!p->cur && p->bufnum < DLFILE_PIPE_BUFNUM) {
+        p->cur = g_new(dlfile_buf_t, 1);
+        p->bufnum++;
+      } else if(!p->cur)
+        p->cur = g_async_queue_pop(p->free);
+      p->cur->off = p->off;
+      p->cur->len = 0;
+      p->cur->size = DLFILE_PIPE_BUFSIZE - (p->off % DLFILE_CHUNKSIZE);
+    }
+
+    int n = MIN(len, p->cur->size - p->cur->len);
+    memcpy(p->cur->dat + p->cur->len, buf, n);
+    p->cur->len += n;
+    p->off += n;
+    buf += n;
+    len -= n;
+
+    if(p->cur->len == p->cur->size) {
+      g_async_queue_push(p->write, p->cur);
+      p->cur = NULL;
+    }
+  }
+
+  /* Don't hold on to the data if the writer has nothing else to do */
+  if(p->cur && g_async_queue_length(p->write) <= 0) {
+    g_async_queue_push(p->write, p->cur);
+    p->cur = NULL;
+  }
+  return !g_atomic_int_get(&p->failed);
+}
+
+
 void dlfile_recv_done(dlfile_thread_t *t) {
+  dlfile_pipe_close(t);
   dl_t *dl = t->dl;
   dl->active_threads--;
   t->busy = FALSE;
 
+  /* Settle any endgame race that this thread is part of. A twin that hasn't
+   * committed a block yet simply drops out, the busy thread either hands its
+   * range to the twin or makes it lose, as if the twin had completed the
+   * block now. */
+  g_static_mutex_lock(&dl->lock);
+  if(t->twin && t->endgame)
+    dlfile_endgame_lose(t, FALSE);
+  else if(t->twin) {
+    if(t->chunk < t->twin->chunk + dlfile_endgame_blockchunks(dl, t->twin->chunk))
+      dlfile_endgame_takeover(t->twin, t);
+    else
+      dlfile_endgame_lose(t->twin, TRUE);
+  }
+  g_static_mutex_unlock(&dl->lock);
+  if(t->endgame) {
+    t->endgame = FALSE;
+    g_free(t->egbuf);
+    t->egbuf = NULL;
+    t->eglen = 0;
+    tth_init(&t->hash_tth);
+  }
+
+  /* Threads that have lost a race are not in dl->threads anymore. */
+  gboolean lost = g_atomic_int_get(&t->lost);
   gboolean freet = FALSE;
-  if(dl->islist ? dl->hassize && dl->have == dl->size : !t->avail) {
+  if(lost)
+    freet = TRUE;
+  else if(dl->islist ? dl->hassize && dl->have == dl->size : !t->avail) {
     g_return_if_fail(!(t->err || t->uerr)); /* A failed thread can't be complete */
     dl->threads = g_slist_remove(dl->threads, t);
     freet = TRUE;
   } else {
     t->allocated = 0;
-    dl->allbusy = FALSE;
+    if(dl->allbusy) {
+      dl->allbusy = FALSE;
+      dl_queue_sched(dl);
+    }
   }
   dlfile_threaddump(dl, 3);
 
@@ -668,7 +1260,7 @@ void dlfile_recv_done(dlfile_thread_t *t) {
     dl_queue_seterr(t->dl, t->err, t->err_msg);
   else if(t->uerr)
     dl_queue_setuerr(t->uid, t->dl->hash, t->uerr, t->uerr_msg);
-  else if(!dl->threads) {
+  else if(!dl->threads && !lost) {
     dlfile_finished(dl);
     doclose = FALSE;
   }
@@ -683,7 +1275,7 @@ void dlfile_recv_done(dlfile_thread_t *t) {
   t->err = t->uerr = 0;
   t->err_msg = t->uerr_msg = NULL;
   if(freet)
-    g_slice_free(dlfile_thread_t, t);
+    dlfile_thread_free(t);
 
   if(dorm)
     dl_queue_rm(dl);
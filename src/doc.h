@@ -150,6 +150,31 @@ static const doc_cmd_t doc_cmds[] = {
   " /password every time, use '/hset password <password>'. Be warned, however,"
   " that your password will be saved unencrypted in that case."
 },
+{ "perf", NULL, "Display performance statistics.",
+  "Displays statistics that may be useful to diagnose performance problems:\n"
+  "  Iterations        Number of main loop iterations, and how many of those took\n"
+  "                    long enough to make the interface unresponsive.\n"
+  "  Time per iteration Time spent handling events in each main loop iteration.\n"
+  "  ADC/NMDC <cmd>    Time taken to handle each received protocol message.\n"
+  "  Queue depth       Number of queries waiting for the database thread.\n"
+  "  Batch size        Number of queries grouped in a single batch.\n"
+  "  Transaction size  Number of queries executed in a single transaction.\n"
+  "  Commit latency    Time taken to commit a transaction to disk.\n"
+  "  Search time       Time taken to search the local share.\n"
+  "  Search results    Number of results for each search of the local share.\n"
+  "  Hash speed per file Hashing throughput, measured for each hashed file.\n"
+  "  Transfer threads  Threads used for uploads and downloads.\n"
+  "  Tick jitter       Deviation of the bandwidth scheduler from its interval.\n"
+  "  Tick duration     Time taken by each run of the bandwidth scheduler.\n"
+  "  Received per call Number of UDP datagrams read with a single system call.\n"
+  "  Sent per call     Number of UDP datagrams sent with a single system call.\n"
+  "  Dropped           UDP datagrams dropped by the kernel before being read,\n"
+  "                    and replies that could not be queued or sent.\n"
+  "  Cached            Blocks and bytes in the upload cache, see `upload_cache'.\n"
+  "  Lookups           Upload cache hits and misses.\n\n"
+  "The statistics are collected since ncdc has been started. Set `perf_log' to"
+  " also write them to perf.log at a regular interval."
+},
 { "pm", "<user> [<message>]", "Alias for /msg",
   NULL
 },
@@ -212,7 +237,8 @@ static const doc_cmd_t doc_cmds[] = {
   "To get information on a particular setting, use `/help set <key>'."
 },
 { "share", "[<name> <path>]", "Add a directory to your share.",
-  "Use /share without arguments to get a list of shared directories.\n"
+  "Use /share without arguments to get a list of shared directories and the"
+  " hit statistics of the partial file list cache.\n"
   "When called with a name and a path, the path will be added to your share."
   " Note that shell escaping may be used in the name. For example, to add a"
   " directory with the name `Fun Stuff', you could do the following:\n\n"
@@ -370,6 +396,15 @@ static const doc_set_t doc_sets[] = {
   "This setting is ignored if `upload_rate' has been set. If it is, that value"
   " is broadcasted instead."
 },
+{ "db_readers", 0, "<integer>",
+  "Number of additional read-only database connections. When set to a non-zero"
+  " value, the database is switched to write-ahead logging (WAL) mode and file"
+  " list refreshes, TTHL lookups and downloaded data verification can read from"
+  " the database while the database thread is busy writing. This needs a file"
+  " system that supports shared memory mappings, so don't enable this if the"
+  " ncdc directory is on a network file system. Takes effect after restarting"
+  " ncdc."
+},
 { "description", 1, "<string>",
   "A short public description that will be displayed in the user list of a hub."
 },
@@ -398,7 +433,9 @@ static const doc_set_t doc_sets[] = {
   " will be limited to this value. The suffixes `G', 'M', and 'K' can be used"
   " for GiB/s, MiB/s and KiB/s, respectively. Note that, similar to upload_rate,"
   " TCP overhead are not counted towards this limit, so the actual bandwidth"
-  " usage might be a little higher."
+  " usage might be a little higher.\n\n"
+  "When set on a hub, the limit applies to the combined downloads from users"
+  " on that hub. The global limit still applies to all downloads together."
 },
 { "download_segment", 0, "<size>",
   "Minimum segment size to use when requesting file data from another user."
@@ -429,6 +466,15 @@ static const doc_set_t doc_sets[] = {
   " suffices are 's' for seconds, 'm' for minutes, 'h' for hours and 'd' for"
   " days. Set to 0 to disable the cache altogether."
 },
+{ "filelist_partial", 0, "<boolean>",
+  "When browsing the file list of a user of whom no recent list is cached,"
+  " only fetch the contents of the directories that are opened in the browser,"
+  " rather than downloading the complete list first. Fetched directories are"
+  " kept for as long as the browse tab is open. Matching the list against the"
+  " download queue, selecting a file from the search results and `/browse -f'"
+  " still use the full list. If the other client does not support partial"
+  " file lists, the full list is downloaded instead."
+},
 { "flush_file_cache", 0, "<none|upload|download|hash>[,...]",
   "Tell the OS to flush the file (disk) cache for file contents read while"
   " hashing and/or uploading or written to while downloading. On one hand, this"
@@ -447,10 +493,22 @@ static const doc_set_t doc_sets[] = {
   "Path to the GeoIP Country database file for IPv6, or 'disabled' to disable"
   " GeoIP lookup for IPv6 addresses."
 },
+{ "hash_mmap", 0, "<boolean>",
+  "Use mmap() instead of read() to read files while hashing. This avoids"
+  " copying the file contents and may reduce CPU usage when hashing large"
+  " files. The `flush_file_cache' setting is honoured either way."
+},
 { "hash_rate", 0, "<speed>",
   "Maximum file hashing speed. See the `download_rate' setting for allowed"
   " formats for this setting."
 },
+{ "hash_threads", 0, "<integer>",
+  "Maximum number of files to hash simultaneously. Files on the same device"
+  " (as determined by the shared directory they are in) are never hashed in"
+  " parallel, so increasing this number only helps if your share is spread"
+  " over multiple disks. The `hash_rate' limit applies to all hash threads"
+  " combined."
+},
 { "hubname", 1, "<string>",
   "The name of the currently opened hub tab. This is a user-assigned name, and"
   " is only used within ncdc itself. This is the same name as given to the"
@@ -528,6 +586,10 @@ static const doc_set_t doc_sets[] = {
   " `/password' command instead. Passwords are saved unencrypted in the config"
   " file."
 },
+{ "perf_log", 0, "<interval>",
+  "Interval at which the statistics displayed by /perf are written to"
+  " perf.log. Set to 0 to disable."
+},
 { "reconnect_timeout", 1, "<interval>",
   "The time to wait before automatically reconnecting to a hub. Set to 0 to"
   " disable automatic reconnect."
@@ -559,6 +621,16 @@ static const doc_set_t doc_sets[] = {
   " enabled, any symlinks in your shared directories will be followed, even"
   " when they point to a directory outside your share."
 },
+{ "share_watch", 0, "<boolean>",
+  "Watch the shared directories for changes, and refresh only the directories"
+  " in which something has changed. Changes are collected for a few seconds"
+  " before refreshing, so that copying a large number of files into your share"
+  " results in a single refresh. This uses inotify, which limits the number of"
+  " directories that can be watched, see /proc/sys/fs/inotify/max_user_watches."
+  " This setting does not replace `autorefresh', which can still be used to"
+  " periodically refresh the entire share, and which is also needed to notice"
+  " changes that were made while ncdc was not running."
+},
 { "show_joinquit", 1, "<boolean>",
   "Whether to display join/quit messages in the hub chat."
 },
@@ -592,6 +664,13 @@ static const doc_set_t doc_sets[] = {
   " that, even if you set this to `prefer', TLS will only be used if the"
   " connecting party also supports it."
 },
+{ "tls_offload", 0, "<boolean>",
+  "Let the kernel encrypt uploads over TLS (Linux kTLS), which allows"
+  " sendfile() to be used for TLS-encrypted connections as well. This only"
+  " works with the AES-GCM ciphers and if the `tls' kernel module is"
+  " available, ncdc silently falls back to GnuTLS otherwise. Has no effect if"
+  " `sendfile' is disabled."
+},
 { "tls_priority", 0, "<string>",
   "Set the GnuTLS priority string used for all TLS-enabled connections. See the"
   " \"Priority strings\" section in the GnuTLS manual for details on what this"
@@ -599,6 +678,13 @@ static const doc_set_t doc_sets[] = {
   " priority string for different types of connections (e.g. hub or"
   " incoming/outgoing client connections)."
 },
+{ "transfer_threads", 0, "<integer>",
+  "Number of threads used for uploading and downloading files. When set to 0"
+  " (the default), every transfer gets its own thread. Otherwise, all"
+  " transfers are divided over at most this many threads, which uses less"
+  " resources when you have many upload slots. Only affects transfers that"
+  " are started after changing this setting."
+},
 { "ui_time_format", 0, "<string>",
   "The format of the time displayed in the lower-left of the screen. Set `-' to"
   " not display a time at all. The string is passed to the Glib"
@@ -608,10 +694,18 @@ static const doc_set_t doc_sets[] = {
   " date/time format used in other places, such as the chat window or log"
   " files."
 },
+{ "upload_cache", 0, "<size>",
+  "Size of a memory cache for file data that is shared between uploads. When"
+  " several users download the same file at the same time, this avoids reading"
+  " the same data from disk for each of them. The cache is only used for"
+  " uploads that can't use sendfile(), such as TLS connections without kernel"
+  " TLS. Set to 0 (the default) to disable. See `/perf' for the hit rate."
+},
 { "upload_rate", 0, "<speed>",
   "Maximum combined transfer rate of all uploads. See the `download_rate'"
-  " setting for more information on rate limiting. Note that this setting also"
-  " overrides any `connection' setting."
+  " setting for more information on rate limiting, and on how hub and global"
+  " limits are combined. Note that this setting also overrides any"
+  " `connection' setting."
 },
 
 { NULL }
@@ -23,14 +23,23 @@
 
 */
 
-
 #include "ncdc.h"
 #include "fl_load.h"
 #include <yxml.h>
 
 
 #define STACKSIZE (8*1024)
-#define READBUFSIZE (32*1024)
+#define READBUFSIZE (64*1024)
+
+// Number of buffers passed between the decompression thread and the parser.
+#define READBUFNUM 4
+
+// Size of the window used by the fast parser. A single XML element must fit
+// in here, otherwise we fall back to the generic parser.
+#define FASTWINSIZE (4*READBUFSIZE)
+
+// Maximum number of attributes in a single element for the fast parser.
+#define FASTMAXATTR 16
 
 // Only used for attributes that we care about, and those tend to be short,
 // file names being the longest possible values. I am unaware of a filesystem
@@ -38,6 +47,18 @@
 #define MAXATTRVAL 1024
 
 
+#if INTERFACE
+
+// Flags for fl_load_debug, used by the benchmark to compare the different
+// code paths.
+#define FL_LOAD_NOFAST   1 // Always use the generic yxml-based parser
+#define FL_LOAD_NOTHREAD 2 // Decompress in the same thread as the parser
+
+#endif
+
+int fl_load_debug = 0;
+
+
 #define S_START    0 // waiting for <FileListing>
 #define S_FLOPEN   1 // In a <FileListing ..>
 #define S_DIROPEN  2 // In a <Directory ..>
@@ -46,12 +67,190 @@
 #define S_INFILE   5 // In a <File>..</File>
 
 
+
+
+// Input stream. Decompression of bzip2 files is done in a separate thread,
+// which passes filled buffers to the parser through the 'full' queue and gets
+// them back through the 'empty' queue. This way decompression and parsing
+// each get their own core.
+
+typedef struct buf_t {
+  int len;
+  int bzerr;
+  int errnum;
+  char data[READBUFSIZE];
+} buf_t;
+
+
+typedef struct in_t {
+  FILE *fh;
+  BZFILE *bzfh;
+  gboolean eof;
+  // Only used if the input is an in-memory buffer
+  const char *mem;
+  int memlen;
+  // Only used if thread != NULL
+  GThread *thread;
+  GAsyncQueue *full;
+  GAsyncQueue *empty;
+  int stop;
+  buf_t *cur;
+  // Only used if thread == NULL
+  char buf[READBUFSIZE];
+} in_t;
+
+
+static gpointer in_thread(gpointer dat) {
+  in_t *in = dat;
+  while(1) {
+    buf_t *b = g_async_queue_pop(in->empty);
+    if(g_atomic_int_get(&in->stop)) {
+      g_async_queue_push(in->empty, b);
+      break;
+    }
+    b->len = BZ2_bzRead(&b->bzerr, in->bzfh, b->data, READBUFSIZE);
+    b->errnum = errno;
+    int bzerr = b->bzerr;
+    g_async_queue_push(in->full, b);
+    if(bzerr != BZ_OK)
+      break;
+  }
+  return NULL;
+}
+
+
+static void in_close(in_t *in) {
+  if(in->thread) {
+    buf_t *b;
+    g_atomic_int_set(&in->stop, 1);
+    // Make sure the thread has a buffer to wake up on
+    if(in->cur)
+      g_async_queue_push(in->empty, in->cur);
+    while((b = g_async_queue_try_pop(in->full)))
+      g_async_queue_push(in->empty, b);
+    g_thread_join(in->thread);
+    while((b = g_async_queue_try_pop(in->full)))
+      g_free(b);
+    while((b = g_async_queue_try_pop(in->empty)))
+      g_free(b);
+    g_async_queue_unref(in->full);
+    g_async_queue_unref(in->empty);
+  }
+  if(in->bzfh) {
+    int bzerr;
+    BZ2_bzReadClose(&bzerr, in->bzfh);
+  }
+  if(in->fh)
+    fclose(in->fh);
+  g_free(in);
+}
+
+
+static in_t *in_open(const char *file, GError **err) {
+  in_t *in = g_new0(in_t, 1);
+
+  // open file
+  in->fh = fopen(file, "r");
+  if(!in->fh) {
+    g_set_error_literal(err, 1, 0, g_strerror(errno));
+    in_close(in);
+    return NULL;
+  }
+
+  // open BZ2 decompression
+  if(strlen(file) > 4 && strcmp(file+(strlen(file)-4), ".bz2") == 0) {
+    int bzerr;
+    in->bzfh = BZ2_bzReadOpen(&bzerr, in->fh, 0, 0, NULL, 0);
+    if(bzerr != BZ_OK) {
+      g_set_error(err, 1, 0, "Unable to open bzip2 file (%d): %s", bzerr, g_strerror(errno));
+      in_close(in);
+      return NULL;
+    }
+  }
+
+  if(in->bzfh && !(fl_load_debug & FL_LOAD_NOTHREAD)) {
+    in->full = g_async_queue_new();
+    in->empty = g_async_queue_new();
+    int i;
+    for(i=0; i<READBUFNUM; i++)
+      g_async_queue_push(in->empty, g_new(buf_t, 1));
+    in->thread = g_thread_create(in_thread, in, TRUE, NULL);
+  }
+  return in;
+}
+
+
+// Reads from an uncompressed in-memory buffer. The buffer must remain valid
+// until in_close().
+static in_t *in_open_buf(const char *buf, int len) {
+  in_t *in = g_new0(in_t, 1);
+  in->mem = buf;
+  in->memlen = len;
+  return in;
+}
+
+
+// Returns the length of the next block of data, 0 on EOF and -1 on error.
+static int in_read(in_t *in, char **data, GError **err) {
+  int len = 0;
+  if(in->eof)
+    return 0;
+
+  if(in->mem) {
+    in->eof = TRUE;
+    *data = (char *)in->mem;
+    return in->memlen;
+  }
+
+  if(in->thread) {
+    if(in->cur)
+      g_async_queue_push(in->empty, in->cur);
+    buf_t *b = in->cur = g_async_queue_pop(in->full);
+    if(b->bzerr == BZ_STREAM_END)
+      in->eof = TRUE;
+    else if(b->bzerr != BZ_OK) {
+      g_set_error(err, 1, 0, "bzip2 decompression error (%d): %s", b->bzerr, g_strerror(b->errnum));
+      return -1;
+    }
+    *data = b->data;
+    return b->len;
+  }
+
+  if(in->bzfh) {
+    int bzerr;
+    len = BZ2_bzRead(&bzerr, in->bzfh, in->buf, READBUFSIZE);
+    if(bzerr == BZ_STREAM_END)
+      in->eof = TRUE;
+    else if(bzerr != BZ_OK) {
+      g_set_error(err, 1, 0, "bzip2 decompression error (%d): %s", bzerr, g_strerror(errno));
+      return -1;
+    }
+  } else {
+    len = fread(in->buf, 1, READBUFSIZE, in->fh);
+    if(len < READBUFSIZE && ferror(in->fh)) {
+      g_set_error(err, 1, 0, "Read error: %s", g_strerror(errno));
+      return -1;
+    }
+    if(len < READBUFSIZE)
+      in->eof = TRUE;
+  }
+  *data = in->buf;
+  return len;
+}
+
+
+
+
+// Construction of the file list, shared by both parsers.
+
 typedef struct ctx_t {
   gboolean local;
+  gboolean arena;
   int state;
   char filetth[24];
   gboolean filehastth;
   guint64 filesize;
+  gboolean incomplete;
   char *name;
   fl_list_t *root;
   fl_list_t *cur;
@@ -63,7 +262,6 @@ typedef struct ctx_t {
 
   yxml_t x;
   char stack[STACKSIZE];
-  char buf[READBUFSIZE];
 } ctx_t;
 
 
@@ -72,46 +270,124 @@ typedef struct ctx_t {
     !(((x)[0] == '.' && (!(x)[1] || ((x)[1] == '.' && !(x)[2])))) && !strchr((x), '/'))
 
 
-static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
-  // Detect the end of the attributes for an open XML element.
-  if(r != YXML_ATTRSTART && r != YXML_ATTRVAL && r != YXML_ATTREND) {
-    if(x->state == S_DIROPEN) {
-      if(!x->name) {
-        g_set_error_literal(err, 1, 0, "Missing Name attribute in Directory element");
-        return;
-      }
-      fl_list_t *new = fl_list_create(x->name, FALSE);
-      new->isfile = FALSE;
-      new->sub = g_ptr_array_new_with_free_func(fl_list_free);
-      fl_list_add(x->cur, new, -1);
-      x->cur = new;
+// Local and partial lists are modified later on, so can't use an arena for
+// those.
+static ctx_t *ctx_new(gboolean local, gboolean arena) {
+  ctx_t *x = g_new(ctx_t, 1);
+  x->state = S_START;
+  x->root = arena ? fl_list_create_arena_root() : fl_list_create("", FALSE);
+  x->root->sub = arena ? g_ptr_array_new() : g_ptr_array_new_with_free_func(fl_list_free);
+  x->cur = x->root;
+  x->filesize = G_MAXUINT64;
+  x->incomplete = FALSE;
+  x->local = local;
+  x->arena = arena;
+  x->unknown_level = 0;
+  x->filehastth = FALSE;
+  x->name = NULL;
+  return x;
+}
 
-      g_free(x->name);
-      x->name = NULL;
-      x->state = S_INDIR;
 
-    } else if(x->state == S_FILEOPEN) {
-      if(!x->name || !x->filehastth || x->filesize == G_MAXUINT64) {
-        g_set_error(err, 1, 0, "Missing %s attribute in File element",
-          !x->name ? "Name" : !x->filehastth ? "TTH" : "Size");
-        return;
-      }
-      // Create the file entry
-      fl_list_t *new = fl_list_create(x->name, x->local);
-      new->isfile = TRUE;
-      new->size = x->filesize;
-      new->hastth = TRUE;
-      memcpy(new->tth, x->filetth, 24);
-      fl_list_add(x->cur, new, -1);
-
-      x->filehastth = FALSE;
-      x->filesize = G_MAXUINT64;
-      g_free(x->name);
-      x->name = NULL;
-      x->state = S_INFILE;
+// Called after all attributes of a <Directory> have been read.
+static void ctx_opendir(ctx_t *x, GError **err) {
+  if(!x->name) {
+    g_set_error_literal(err, 1, 0, "Missing Name attribute in Directory element");
+    return;
+  }
+  fl_list_t *new = x->arena ? fl_list_create_arena(x->root, x->name, FALSE) : fl_list_create(x->name, FALSE);
+  new->isfile = FALSE;
+  new->incomplete = x->incomplete;
+  new->sub = x->arena ? g_ptr_array_new() : g_ptr_array_new_with_free_func(fl_list_free);
+  fl_list_add(x->cur, new, -1);
+  x->cur = new;
+  x->incomplete = FALSE;
+
+  g_free(x->name);
+  x->name = NULL;
+  x->state = S_INDIR;
+}
+
+
+// Called after all attributes of a <File> have been read.
+static void ctx_openfile(ctx_t *x, GError **err) {
+  if(!x->name || !x->filehastth || x->filesize == G_MAXUINT64) {
+    g_set_error(err, 1, 0, "Missing %s attribute in File element",
+      !x->name ? "Name" : !x->filehastth ? "TTH" : "Size");
+    return;
+  }
+  // Create the file entry
+  fl_list_t *new = x->arena ? fl_list_create_arena(x->root, x->name, FALSE) : fl_list_create(x->name, x->local);
+  new->isfile = TRUE;
+  new->size = x->filesize;
+  new->hastth = TRUE;
+  memcpy(new->tth, x->filetth, 24);
+  fl_list_add(x->cur, new, -1);
+
+  x->filehastth = FALSE;
+  x->filesize = G_MAXUINT64;
+  g_free(x->name);
+  x->name = NULL;
+  x->state = S_INFILE;
+}
+
+
+// Called on </Directory> and </FileListing>
+static void ctx_closedir(ctx_t *x) {
+  if(x->arena)
+    fl_list_arena_trim(x->root, x->cur);
+  fl_list_sort(x->cur);
+  x->cur = x->cur->parent;
+}
 
-    } else if(x->state == S_FLOPEN)
+
+// Called with the (decoded and nil-terminated) value of an attribute in
+// x->attr. The attribute is identified by its first character.
+static void ctx_attr(ctx_t *x, char attr, GError **err) {
+  // Name, for either file or directory
+  if((attr|32) == 'n' && !x->name) {
+    x->name = g_utf8_validate(x->attr, -1, NULL) ? g_strdup(x->attr) : str_convert("UTF-8", "UTF-8", x->attr);
+    if(!isvalidfilename(x->name))
+      g_set_error_literal(err, 1, 0, "Invalid file name");
+  }
+  // TTH, for files
+  if((attr|32) == 't' && !x->filehastth) {
+    if(!istth(x->attr))
+      g_set_error_literal(err, 1, 0, "Invalid TTH");
+    else {
+      base32_decode(x->attr, x->filetth);
+      x->filehastth = TRUE;
+    }
+  }
+  // Size, for files
+  if((attr|32) == 's' && x->filesize == G_MAXUINT64) {
+    char *end = NULL;
+    x->filesize = g_ascii_strtoull(x->attr, &end, 10);
+    if(!end || *end)
+      g_set_error_literal(err, 1, 0, "Invalid file size");
+  }
+  // Incomplete, for directories in partial lists
+  if((attr|32) == 'i')
+    x->incomplete = strcmp(x->attr, "1") == 0;
+}
+
+
+
+
+// Generic parser, byte-by-byte through yxml. Handles any well-formed XML
+// document and provides accurate error reporting.
+
+static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
+  // Detect the end of the attributes for an open XML element.
+  if(r != YXML_ATTRSTART && r != YXML_ATTRVAL && r != YXML_ATTREND) {
+    if(x->state == S_DIROPEN)
+      ctx_opendir(x, err);
+    else if(x->state == S_FILEOPEN)
+      ctx_openfile(x, err);
+    else if(x->state == S_FLOPEN)
       x->state = S_INDIR;
+    if(*err)
+      return;
   }
 
   switch(r) {
@@ -141,15 +417,16 @@ static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
       x->unknown_level--;
     else if(x->state == S_INFILE)
       x->state = S_INDIR;
-    else {
-      fl_list_sort(x->cur);
-      x->cur = x->cur->parent;
-    }
+    else
+      ctx_closedir(x);
     break;
 
   case YXML_ATTRSTART:
     x->consume = !x->unknown_level && (
-      (x->state == S_DIROPEN && g_ascii_strcasecmp(x->x.attr, "Name") == 0) ||
+      (x->state == S_DIROPEN && (
+        g_ascii_strcasecmp(x->x.attr, "Name") == 0 ||
+        g_ascii_strcasecmp(x->x.attr, "Incomplete") == 0
+      )) ||
       (x->state == S_FILEOPEN && (
         g_ascii_strcasecmp(x->x.attr, "Name") == 0 ||
         g_ascii_strcasecmp(x->x.attr, "Size") == 0 ||
@@ -175,28 +452,7 @@ static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
     if(!x->consume)
       break;
     *x->attrp = 0;
-    // Name, for either file or directory
-    if((*x->x.attr|32) == 'n' && !x->name) {
-      x->name = g_utf8_validate(x->attr, -1, NULL) ? g_strdup(x->attr) : str_convert("UTF-8", "UTF-8", x->attr);
-      if(!isvalidfilename(x->name))
-        g_set_error_literal(err, 1, 0, "Invalid file name");
-    }
-    // TTH, for files
-    if((*x->x.attr|32) == 't' && !x->filehastth) {
-      if(!istth(x->attr))
-        g_set_error_literal(err, 1, 0, "Invalid TTH");
-      else {
-        base32_decode(x->attr, x->filetth);
-        x->filehastth = TRUE;
-      }
-    }
-    // Size, for files
-    if((*x->x.attr|32) == 's' && x->filesize == G_MAXUINT64) {
-      char *end = NULL;
-      x->filesize = g_ascii_strtoull(x->attr, &end, 10);
-      if(!end || *end)
-        g_set_error_literal(err, 1, 0, "Invalid file size");
-    }
+    ctx_attr(x, *x->x.attr, err);
     break;
 
   default:
@@ -205,58 +461,30 @@ static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
 }
 
 
-static fl_list_t *fl_load_parse(FILE *fh, BZFILE *bzfh, gboolean local, GError **err) {
-  ctx_t *x = g_new(ctx_t, 1);
-  x->state = S_START;
-  x->root = fl_list_create("", FALSE);
-  x->root->sub = g_ptr_array_new_with_free_func(fl_list_free);
-  x->cur = x->root;
-  x->filesize = G_MAXUINT64;
-  x->local = local;
-  x->unknown_level = 0;
-  x->filehastth = FALSE;
-  x->name = NULL;
-
+static void fl_load_parse(ctx_t *x, in_t *in, GError **err) {
   yxml_init(&x->x, x->stack, STACKSIZE);
-  int buflen = 0;
-  int bzeof = 0;
 
   while(1) {
-    // Fill buffer
-    if(bzfh) {
-      if(bzeof)
-        break;
-      int bzerr;
-      buflen = BZ2_bzRead(&bzerr, bzfh, x->buf, READBUFSIZE);
-      if(bzerr == BZ_STREAM_END)
-        bzeof = 1;
-      else if(bzerr != BZ_OK) {
-        g_set_error(err, 1, 0, "bzip2 decompression error (%d): %s", bzerr, g_strerror(errno));
-        break;
-      }
-    } else {
-      buflen = fread(x->buf, 1, READBUFSIZE, fh);
-      if(buflen < 0 && feof(fh))
-        break;
-      if(buflen < 0) {
-        g_set_error(err, 1, 0, "Read error: %s", g_strerror(errno));
-        break;
-      }
-    }
+    char *pbuf;
+    int buflen = in_read(in, &pbuf, err);
+    if(buflen <= 0)
+      break;
 
-    // And parse
-    char *pbuf = x->buf;
-    while(!*err && buflen > 0) {
+    while(buflen > 0) {
       yxml_ret_t r = yxml_parse(&x->x, *pbuf);
       pbuf++;
       buflen--;
-      if(r == YXML_OK)
+      // Most calls return one of these, don't bother calling fl_load_token()
+      // for them.
+      if(r == YXML_OK || r == YXML_CONTENT || (r == YXML_ATTRVAL && !x->consume))
         continue;
       if(r < 0) {
         g_set_error_literal(err, 1, 0, "XML parsing error");
         break;
       }
       fl_load_token(x, r, err);
+      if(*err)
+        break;
     }
     if(*err) {
       g_prefix_error(err, "Line %"G_GUINT32_FORMAT":%"G_GUINT64_FORMAT": ", x->x.line, x->x.byte);
@@ -266,48 +494,365 @@ static fl_list_t *fl_load_parse(FILE *fh, BZFILE *bzfh, gboolean local, GError *
 
   if(!*err && yxml_eof(&x->x) < 0)
     g_set_error_literal(err, 1, 0, "XML document did not end correctly");
+}
 
-  fl_list_t *root = x->root;
-  g_free(x->name);
-  g_free(x);
-  return root;
+
+
+
+// Fast parser. Only understands the subset of XML that is actually used in
+// file lists: an optional XML declaration, followed by <FileListing>,
+// <Directory> and <File> elements with only whitespace in between. Attribute
+// values are located with memchr() rather than being fed through a state
+// machine one byte at a time. Returns FALSE as soon as it encounters anything
+// it does not understand or any error, in which case the caller should discard
+// the result and re-parse the file with fl_load_parse(). That way the fast
+// parser never has to bother with proper error reporting.
+
+typedef struct fast_t {
+  in_t *in;
+  char *data;  // Data received from in_read() but not yet copied to win
+  int datalen;
+  gboolean eof;
+  char *p, *e; // Unparsed data in win
+  gboolean err;
+  // State
+  gboolean done;
+  gboolean infile;
+  // Attributes of the current element
+  int attrnum;
+  struct { char *name, *val; int namelen, vallen; } attr[FASTMAXATTR];
+  char win[FASTWINSIZE];
+} fast_t;
+
+
+#define fast_isspace(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+#define fast_isname(c)  ((unsigned)(((c)|32)-'a') < 26 || (unsigned)((c)-'0') < 10 || (c) == ':' || (c) == '_' || (c) == '-' || (c) == '.' || (c) >= 128)
+
+
+// Moves the unparsed data to the start of the window and appends more data
+// from the input. Returns FALSE if no data could be added.
+static gboolean fast_fill(fast_t *f) {
+  int left = f->e - f->p;
+  if(f->p != f->win)
+    memmove(f->win, f->p, left);
+  f->p = f->win;
+  f->e = f->win + left;
+
+  gboolean added = FALSE;
+  while(f->e < f->win+FASTWINSIZE) {
+    if(!f->datalen) {
+      if(f->eof)
+        break;
+      f->datalen = in_read(f->in, &f->data, NULL);
+      if(f->datalen <= 0) {
+        // Read errors are reported by fl_load_parse()
+        f->err = f->datalen < 0;
+        f->datalen = 0;
+        f->eof = TRUE;
+        break;
+      }
+    }
+    int len = MIN(f->datalen, f->win+FASTWINSIZE-f->e);
+    memcpy(f->e, f->data, len);
+    f->e += len;
+    f->data += len;
+    f->datalen -= len;
+    added = TRUE;
+  }
+  return added;
 }
 
 
-fl_list_t *fl_load(const char *file, GError **err, gboolean local) {
+// Decodes an attribute value into x->attr. Only the predefined entities and
+// character references are recognized. Returns FALSE if the value can't be
+// handled by the fast parser.
+static gboolean fast_attrval(ctx_t *x, const unsigned char *v, int len) {
+  const unsigned char *e = v+len;
+  char *d = x->attr;
+  while(v < e) {
+    if(d-x->attr > sizeof(x->attr)-5)
+      return FALSE;
+    // These are either invalid or need normalization, let yxml handle them.
+    if(!*v || *v == '\t' || *v == '\n' || *v == '\r')
+      return FALSE;
+    if(*v != '&') {
+      *(d++) = *(v++);
+      continue;
+    }
+
+    const unsigned char *r = ++v;
+    while(v < e && *v != ';')
+      v++;
+    if(v == e || v-r > 7)
+      return FALSE;
+    int rlen = v-r;
+    const unsigned char *n = r+1;
+    gunichar ch = 0;
+    if(rlen > 1 && *r == '#' && *n == 'x') {
+      for(n++; n < v && g_ascii_isxdigit(*n); n++)
+        ch = (ch<<4) + g_ascii_xdigit_value(*n);
+      if(n != v || rlen < 3)
+        ch = 0;
+    } else if(rlen > 1 && *r == '#') {
+      for(; n < v && g_ascii_isdigit(*n); n++)
+        ch = (ch*10) + (*n-'0');
+      if(n != v)
+        ch = 0;
+    } else
+      ch =
+        rlen == 2 && strncmp((char *)r, "lt", 2) == 0 ? '<' :
+        rlen == 2 && strncmp((char *)r, "gt", 2) == 0 ? '>' :
+        rlen == 3 && strncmp((char *)r, "amp", 3) == 0 ? '&' :
+        rlen == 4 && strncmp((char *)r, "apos", 4) == 0 ? '\'' :
+        rlen == 4 && strncmp((char *)r, "quot", 4) == 0 ? '"' : 0;
+    v++;
+    // Same restrictions as yxml
+    if(!ch || ch > 0x10FFFF || ch == 0xFFFE || ch == 0xFFFF || (ch-0xDFFF) < 0x7FF)
+      return FALSE;
+    d += g_unichar_to_utf8(ch, d);
+  }
+  *d = 0;
+  return TRUE;
+}
+
+
+// Tokenizes the attributes of an element, starting at q. Returns 1 when the
+// element is complete, 0 when more data is needed and -1 if the fast parser
+// should give up. On success, *end points to the byte after the element and
+// *empty is set for self-closing elements.
+static int fast_attrs(fast_t *f, char *q, char **end, gboolean *empty) {
+  char *e = f->e;
+  f->attrnum = 0;
+  while(1) {
+    char *s = q;
+    while(q < e && fast_isspace(*q))
+      q++;
+    if(q == e)
+      return 0;
+    if(*q == '/') {
+      if(q+1 == e)
+        return 0;
+      if(q[1] != '>')
+        return -1;
+      *end = q+2;
+      *empty = TRUE;
+      return 1;
+    }
+    if(*q == '>') {
+      *end = q+1;
+      *empty = FALSE;
+      return 1;
+    }
+    if(q == s || f->attrnum >= FASTMAXATTR || !fast_isname((unsigned char)*q) || (*q >= '0' && *q <= '9') || *q == '-' || *q == '.')
+      return -1;
+
+    char *name = q;
+    while(q < e && fast_isname((unsigned char)*q))
+      q++;
+    int namelen = q-name;
+    while(q < e && fast_isspace(*q))
+      q++;
+    if(q == e)
+      return 0;
+    if(*q != '=')
+      return -1;
+    q++;
+    while(q < e && fast_isspace(*q))
+      q++;
+    if(q == e)
+      return 0;
+    if(*q != '"' && *q != '\'')
+      return -1;
+    char *val = q+1;
+    q = memchr(val, *q, e-val);
+    if(!q)
+      return 0;
+    if(memchr(val, '<', q-val))
+      return -1;
+    f->attr[f->attrnum].name = name;
+    f->attr[f->attrnum].namelen = namelen;
+    f->attr[f->attrnum].val = val;
+    f->attr[f->attrnum].vallen = q-val;
+    f->attrnum++;
+    q++;
+  }
+}
+
+
+#define fast_isattr(f, i, n) ((f)->attr[i].namelen == strlen(n) && g_ascii_strncasecmp((f)->attr[i].name, n, strlen(n)) == 0)
+
+
+// Parses the next element, returns 1 on success, 0 if more data is needed and
+// -1 if the fast parser should give up.
+static int fast_step(ctx_t *x, fast_t *f) {
+  char *p = f->p, *e = f->e;
+  while(p < e && fast_isspace(*p))
+    p++;
+  f->p = p;
+  if(p == e)
+    return 0;
+  if(*p != '<' || f->done)
+    return -1;
+  if(p+1 == e)
+    return 0;
+
+  // Closing tag
+  if(p[1] == '/') {
+    const char *name = f->infile ? "File" : x->cur == x->root ? "FileListing" : "Directory";
+    int len = strlen(name);
+    if(e-p < len+3)
+      return 0;
+    if(strncmp(p+2, name, len) != 0)
+      return -1;
+    char *q = p+2+len;
+    if(*q != '>')
+      return -1;
+    if(f->infile)
+      f->infile = FALSE;
+    else if(x->cur == x->root) {
+      ctx_closedir(x);
+      f->done = TRUE;
+    } else
+      ctx_closedir(x);
+    f->p = q+1;
+    return 1;
+  }
+
+  // Opening tag
+  char *q = p+1;
+  while(q < e && fast_isname((unsigned char)*q))
+    q++;
+  if(q == e)
+    return 0;
+  int len = q-p-1;
+  int type =
+    len == 4  && strncmp(p+1, "File", 4) == 0 ? S_FILEOPEN :
+    len == 9  && strncmp(p+1, "Directory", 9) == 0 ? S_DIROPEN :
+    len == 11 && strncmp(p+1, "FileListing", 11) == 0 ? S_FLOPEN : -1;
+  if(type < 0 || f->infile || (type == S_FLOPEN) != (x->state == S_START))
+    return -1;
+
+  char *end;
+  gboolean empty;
+  int r = fast_attrs(f, q, &end, &empty);
+  if(r <= 0)
+    return r;
+
+  // Process the attributes
+  int i;
+  GError *err = NULL;
+  for(i=0; !err && i<f->attrnum; i++) {
+    char attr = 0;
+    if(fast_isattr(f, i, "Name"))
+      attr = 'n';
+    else if(type == S_FILEOPEN && fast_isattr(f, i, "Size"))
+      attr = 's';
+    else if(type == S_FILEOPEN && fast_isattr(f, i, "TTH"))
+      attr = 't';
+    else if(type == S_DIROPEN && fast_isattr(f, i, "Incomplete"))
+      attr = 'i';
+    if(type == S_FLOPEN || !attr) {
+      if(memchr(f->attr[i].val, '&', f->attr[i].vallen))
+        return -1;
+      continue;
+    }
+    if(!fast_attrval(x, (unsigned char *)f->attr[i].val, f->attr[i].vallen))
+      return -1;
+    ctx_attr(x, attr, &err);
+  }
+
+  if(!err && type == S_DIROPEN) {
+    ctx_opendir(x, &err);
+    if(!err && empty)
+      ctx_closedir(x);
+  } else if(!err && type == S_FILEOPEN) {
+    ctx_openfile(x, &err);
+    f->infile = !empty;
+    x->state = S_INDIR;
+  } else if(!err) {
+    x->state = S_INDIR;
+    if(empty) {
+      ctx_closedir(x);
+      f->done = TRUE;
+    }
+  }
+  if(err) {
+    g_error_free(err);
+    return -1;
+  }
+  f->p = end;
+  return 1;
+}
+
+
+static gboolean fl_load_fast(ctx_t *x, in_t *in) {
+  fast_t *f = g_new(fast_t, 1);
+  f->in = in;
+  f->datalen = 0;
+  f->eof = f->err = FALSE;
+  f->p = f->e = f->win;
+  f->done = f->infile = FALSE;
+  fast_fill(f);
+
+  // Skip the UTF-8 BOM and XML declaration, the latter is only allowed at the
+  // very start of the document.
+  if(f->e-f->p >= 3 && memcmp(f->p, "\xef\xbb\xbf", 3) == 0)
+    f->p += 3;
+  if(f->e-f->p >= 6 && strncmp(f->p, "<?xml", 5) == 0 && fast_isspace(f->p[5])) {
+    char *q = f->p;
+    while((q = memchr(q+1, '?', f->e-q-1)) && q+1 < f->e && q[1] != '>')
+      ;
+    f->p = q && q+1 < f->e ? q+2 : NULL;
+  }
+
+  int r = -1;
+  while(f->p && (r = fast_step(x, f)) >= 0)
+    if(r == 0 && !fast_fill(f))
+      break;
+
+  gboolean ok = r == 0 && f->done && f->p == f->e && f->eof && !f->err;
+  g_free(f);
+  return ok;
+}
+
+
+
+
+// Parses either the file or, if file is NULL, the uncompressed XML in buf.
+static fl_list_t *load(const char *file, const char *buf, int len, GError **err, gboolean local, gboolean arena) {
   g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
-  fl_list_t *root = NULL;
-  FILE *fh;
-  BZFILE *bzfh = NULL;
   GError *ierr = NULL;
+  ctx_t *x = NULL;
+  in_t *in = file ? in_open(file, &ierr) : in_open_buf(buf, len);
 
-  // open file
-  fh = fopen(file, "r");
-  if(!fh) {
-    g_set_error_literal(&ierr, 1, 0, g_strerror(errno));
-    goto end;
+  if(in && !(fl_load_debug & FL_LOAD_NOFAST)) {
+    x = ctx_new(local, arena);
+    if(!fl_load_fast(x, in)) {
+      // Start over with the generic parser.
+      fl_list_free(x->root);
+      g_free(x->name);
+      g_free(x);
+      x = NULL;
+      in_close(in);
+      in = file ? in_open(file, &ierr) : in_open_buf(buf, len);
+    }
   }
 
-  // open BZ2 decompression
-  if(strlen(file) > 4 && strcmp(file+(strlen(file)-4), ".bz2") == 0) {
-    int bzerr;
-    bzfh = BZ2_bzReadOpen(&bzerr, fh, 0, 0, NULL, 0);
-    if(bzerr != BZ_OK) {
-      g_set_error(&ierr, 1, 0, "Unable to open bzip2 file (%d): %s", bzerr, g_strerror(errno));
-      goto end;
-    }
+  if(in && !x) {
+    x = ctx_new(local, arena);
+    fl_load_parse(x, in, &ierr);
   }
 
-  root = fl_load_parse(fh, bzfh, local, &ierr);
+  if(in)
+    in_close(in);
 
-end:
-  if(bzfh) {
-    int bzerr;
-    BZ2_bzReadClose(&bzerr, bzfh);
+  fl_list_t *root = NULL;
+  if(x) {
+    root = x->root;
+    g_free(x->name);
+    g_free(x);
   }
-  if(fh)
-    fclose(fh);
   if(ierr) {
     g_propagate_error(err, ierr);
     if(root)
@@ -318,11 +863,196 @@ end:
 }
 
 
+fl_list_t *fl_load(const char *file, GError **err, gboolean local) {
+  return load(file, NULL, 0, err, local, !local);
+}
+
+
+// Loads a partial file list, as received from an ADCGET "list" request.
+// Directories that have not been included are marked as incomplete. The
+// returned list does not use an arena, so that the contents of other partial
+// lists can be merged into it.
+fl_list_t *fl_load_partial(const char *buf, int len, GError **err) {
+  return load(NULL, buf, len, err, FALSE, FALSE);
+}
+
+
+
+
+
+// Loading of the binary snapshot written by fl_save_snapshot(). The file is
+// mapped into memory and read in a single pass. Everything is validated, a
+// broken snapshot simply results in an error and the caller falls back to
+// fl_load().
+
+typedef struct snap_t {
+  const char *buf;
+  guint64 len, off, items;
+} snap_t;
+
+
+static gboolean snap_read(snap_t *x, fl_list_t *dir, guint32 sub) {
+  guint32 i;
+  for(i=0; i<sub; i++) {
+    if(x->off + sizeof(fl_snap_item_t) > x->len)
+      return FALSE;
+    fl_snap_item_t it;
+    memcpy(&it, x->buf+x->off, sizeof(it));
+    x->off += sizeof(it);
+
+    fl_snap_file_t fi;
+    if(it.isfile) {
+      if(x->off + sizeof(fl_snap_file_t) > x->len)
+        return FALSE;
+      memcpy(&fi, x->buf+x->off, sizeof(fi));
+      x->off += sizeof(fi);
+    }
+
+    const char *name = x->buf+x->off;
+    x->off += (it.namelen+1+7) & ~7;
+    if(x->off > x->len || name[it.namelen] || strlen(name) != it.namelen || !isvalidfilename(name))
+      return FALSE;
+
+    fl_list_t *cur = fl_list_create(name, it.isfile ? TRUE : FALSE);
+    cur->parent = dir;
+    g_ptr_array_add(dir->sub, cur);
+    x->items++;
+    if(it.isfile) {
+      cur->isfile = cur->hastth = TRUE;
+      cur->size = fi.size;
+      memcpy(cur->tth, fi.tth, 24);
+      fl_list_getlocal(cur).lastmod = fi.lastmod;
+      fl_list_getlocal(cur).id = fi.id;
+    } else {
+      cur->sub = g_ptr_array_sized_new(MIN(it.sub, 1024));
+      g_ptr_array_set_free_func(cur->sub, fl_list_free);
+      if(!snap_read(x, cur, it.sub))
+        return FALSE;
+    }
+    dir->size += cur->size;
+  }
+  return TRUE;
+}
+
+
+// Loads a snapshot of the local file list. *xml is the stat() result of the
+// current files.xml.bz2, the snapshot is considered stale if it had been
+// written for a different file.
+fl_list_t *fl_load_snapshot(const char *file, const struct stat *xml, GError **err) {
+  int fd = open(file, O_RDONLY);
+  if(fd < 0) {
+    g_set_error_literal(err, 1, 0, g_strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size < sizeof(fl_snap_head_t)) {
+    g_set_error_literal(err, 1, 0, "Invalid snapshot");
+    close(fd);
+    return NULL;
+  }
+  void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(buf == MAP_FAILED) {
+    g_set_error_literal(err, 1, 0, g_strerror(errno));
+    return NULL;
+  }
+#ifdef POSIX_MADV_SEQUENTIAL
+  posix_madvise(buf, st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+
+  fl_snap_head_t h;
+  memcpy(&h, buf, sizeof(h));
+  fl_list_t *root = NULL;
+  if(memcmp(h.magic, FL_SNAP_MAGIC, 8) != 0 || h.version != FL_SNAP_VERSION || h.itemsize != sizeof(fl_snap_item_t) + sizeof(fl_snap_file_t))
+    g_set_error_literal(err, 1, 0, "Invalid snapshot");
+  else if(h.xmlsize != xml->st_size || h.xmlmtime != xml->st_mtime)
+    g_set_error_literal(err, 1, 0, "Snapshot is out of date");
+  else {
+    snap_t x = { buf, st.st_size, sizeof(h), 0 };
+    root = fl_list_create("", FALSE);
+    root->sub = g_ptr_array_new_with_free_func(fl_list_free);
+    if(!snap_read(&x, root, h.sub) || x.off != x.len || x.items != h.items) {
+      g_set_error_literal(err, 1, 0, "Invalid snapshot");
+      fl_list_free(root);
+      root = NULL;
+    }
+  }
+
+  munmap(buf, st.st_size);
+  return root;
+}
+
+
 
 
 
 // Async version of fl_load(). Performs the load in a background thread. Only
 // used for non-local filelists.
+// The same lists tend to be opened and matched against the queue over and
+// over again, so recently loaded lists are kept in memory and shared with the
+// callers. A cached list is used as long as the file has not changed. Only
+// accessed from the main thread.
+
+#define FL_CACHE_BYTES (64*1024*1024)
+
+typedef struct cache_t {
+  char *file;
+  time_t mtime;
+  off_t size;
+  fl_list_t *fl;
+} cache_t;
+
+static GQueue fl_cache = G_QUEUE_INIT; // most recently used first
+static size_t fl_cache_bytes = 0;
+
+
+static void cache_free(GList *n) {
+  cache_t *c = n->data;
+  fl_cache_bytes -= fl_list_getarena(c->fl)->bytes;
+  fl_list_free(c->fl);
+  g_free(c->file);
+  g_slice_free(cache_t, c);
+  g_queue_delete_link(&fl_cache, n);
+}
+
+
+// Returns a new reference to the cached list, or NULL if there is none. Stale
+// entries for the same file are removed.
+static fl_list_t *cache_get(const char *file, const struct stat *st) {
+  GList *n;
+  for(n=fl_cache.head; n; n=n->next) {
+    cache_t *c = n->data;
+    if(strcmp(c->file, file) != 0)
+      continue;
+    if(!st || c->mtime != st->st_mtime || c->size != st->st_size) {
+      cache_free(n);
+      return NULL;
+    }
+    g_queue_unlink(&fl_cache, n);
+    g_queue_push_head_link(&fl_cache, n);
+    return fl_list_ref(c->fl);
+  }
+  return NULL;
+}
+
+
+static void cache_add(const char *file, const struct stat *st, fl_list_t *fl) {
+  cache_get(file, NULL);
+  size_t bytes = fl_list_getarena(fl)->bytes;
+  if(bytes > FL_CACHE_BYTES/2)
+    return;
+  while(fl_cache_bytes + bytes > FL_CACHE_BYTES)
+    cache_free(fl_cache.tail);
+
+  cache_t *c = g_slice_new(cache_t);
+  c->file = g_strdup(file);
+  c->mtime = st->st_mtime;
+  c->size = st->st_size;
+  c->fl = fl_list_ref(fl);
+  fl_cache_bytes += bytes;
+  g_queue_push_head(&fl_cache, c);
+}
+
 
 typedef struct async_t {
   char *file;
@@ -330,11 +1060,15 @@ typedef struct async_t {
   void *dat;
   GError *err;
   fl_list_t *fl;
+  struct stat st;
+  gboolean hasst;
 } async_t;
 
 
 static gboolean async_d(gpointer dat) {
   async_t *arg = dat;
+  if(arg->hasst && arg->fl && arg->fl->isarena)
+    cache_add(arg->file, &arg->st, arg->fl);
   arg->cb(arg->fl, arg->err, arg->dat);
   g_free(arg->file);
   g_slice_free(async_t, arg);
@@ -359,6 +1093,14 @@ void fl_load_async(const char *file, void (*cb)(fl_list_t *, GError *, void *),
   arg->file = g_strdup(file);
   arg->dat = dat;
   arg->cb = cb;
-  g_thread_pool_push(pool, arg, NULL);
+  arg->hasst = stat(file, &arg->st) == 0;
+
+  // Cached list, still call the callback from the main loop as the callers
+  // expect.
+  if((arg->fl = cache_get(file, arg->hasst ? &arg->st : NULL)) != NULL) {
+    arg->hasst = FALSE;
+    g_idle_add(async_d, arg);
+  } else
+    g_thread_pool_push(pool, arg, NULL);
 }
 
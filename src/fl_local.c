@@ -26,30 +26,47 @@
 
 #include "ncdc.h"
 #include "fl_local.h"
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 
 char           *fl_local_list_file;
+static char    *fl_local_snap_file; // binary snapshot of fl_local_list, see fl_save_snapshot()
 fl_list_t      *fl_local_list  = NULL;
 GQueue         *fl_refresh_queue = NULL;
 time_t          fl_refresh_last = 0; // time when the last full file list refresh has been queued
 static gboolean fl_needflush = FALSE;
-// Index of the files in fl_local_list. Key = TTH root, value = GSList of files.
-static GHashTable *fl_hash_index;
+static gboolean fl_needsnap = FALSE; // the snapshot is missing or out of date
+// Index of the files in fl_local_list, on TTH root.
+static tthidx_t fl_hash_index;
 guint64         fl_local_list_size;   // total share size, minus duplicate files
 int             fl_local_list_length; // total number of unique files in the share
+// Held for writing by the main thread when modifying fl_local_list, and for
+// reading by fl_search_pool.
+static GStaticRWLock fl_local_lock = G_STATIC_RW_LOCK_INIT;
+#define fl_local_wrlock()   g_static_rw_lock_writer_lock(&fl_local_lock)
+#define fl_local_wrunlock() g_static_rw_lock_writer_unlock(&fl_local_lock)
 
 static GThreadPool *fl_scan_pool;
 static GThreadPool *fl_hash_pool;
 
-GHashTable       *fl_hash_queue = NULL; // set of files-to-hash
+GHashTable       *fl_hash_queue = NULL; // files-to-hash, value = fl_hash_dev_t the file resides on
 guint64           fl_hash_queue_size = 0;
-static fl_list_t *fl_hash_cur = NULL;   // most recent file initiated for hashing
 ratecalc_t        fl_hash_rate;
-static guint64    fl_hash_reset = 0; // increased when fl_hash_cur is removed from the queue (to stop current hash operation)
-static GMutex    *fl_hash_resetlock;
+static int        fl_hash_active = 0; // number of files currently being hashed
+static GSList    *fl_hash_devs = NULL; // list of fl_hash_dev_t
+static GHashTable *fl_hash_devcache = NULL; // share path -> fl_hash_dev_t
+static GMutex    *fl_hash_resetlock; // protects fl_hash_t.cancel
 static GCond     *fl_hash_resetcond;
 
+// Statistics, displayed with /perf. Only updated from the main thread.
+static hist_t fl_stats_search;  // Time taken by each local search, in microseconds
+static hist_t fl_stats_results; // Number of results of each local search
+static hist_t fl_stats_hash;    // Hash speed of each file, in KiB/s
+
 #define TTH_BUFSIZE (512*1024)
+#define TTH_MMAPSIZE (8*1024*1024) // Must be a multiple of the page size
 
 
 // Utility functions
@@ -103,34 +120,79 @@ void fl_local_suggest(char *path, char **sug) {
 }
 
 
-// get files with the (raw) TTH. Result does not have to be freed.
-GSList *fl_local_from_tth(const char *root) {
-  return g_hash_table_lookup(fl_hash_index, root);
+// get files with the (raw) TTH, the number of files is stored in *n. Result
+// does not have to be freed, but is only valid until the next change to the
+// share.
+fl_list_t **fl_local_from_tth(const char *root, int *n) {
+  return (fl_list_t **)tthidx_get(&fl_hash_index, root, n);
 }
 
 
-// Fill a bloom filter with all local hashes
+// Bloom filters of the local hashes, kept up-to-date by the hash index
+// functions below. A filter is created on the first request for a certain set
+// of parameters, after which further requests only need to copy it. The
+// number of filters is limited, since a change in the size of our share
+// causes hubs to request filters with different parameters. Most recently
+// used filter first.
+#define FL_BLOOM_MAX 4
+static GSList *fl_bloom_list = NULL;
+
+static void fl_local_bloom_add(const char *tth, gpointer fl, gpointer b) {
+  bloom_add(b, tth);
+}
+
+// Fill a bloom filter (created with bloom_init()) with all local hashes
 void fl_local_bloom(bloom_t *b) {
-  GHashTableIter iter;
-  const char *tth;
-  g_hash_table_iter_init(&iter, fl_hash_index);
-  while(g_hash_table_iter_next(&iter, (gpointer *)&tth, NULL))
-    bloom_add(b, tth);
+  GSList *l;
+  bloom_t *lb = NULL;
+  for(l=fl_bloom_list; l; l=l->next) {
+    lb = l->data;
+    if(lb->m == b->m && lb->k == b->k && lb->h == b->h)
+      break;
+  }
+
+  if(l)
+    fl_bloom_list = g_slist_delete_link(fl_bloom_list, l);
+  else {
+    lb = g_slice_new(bloom_t);
+    bloom_init_counting(lb, b->m, b->k, b->h);
+    tthidx_foreach_key(&fl_hash_index, fl_local_bloom_add, lb);
+    if(g_slist_length(fl_bloom_list) >= FL_BLOOM_MAX) {
+      l = g_slist_last(fl_bloom_list);
+      bloom_free(l->data);
+      g_slice_free(bloom_t, l->data);
+      fl_bloom_list = g_slist_delete_link(fl_bloom_list, l);
+    }
+  }
+  fl_bloom_list = g_slist_prepend(fl_bloom_list, lb);
+  memcpy(b->d, lb->d, b->m);
 }
 
 
 // should be run from a timer. periodically flushes all unsaved data to disk.
 gboolean fl_flush(gpointer dat) {
+  GError *err = NULL;
   if(fl_needflush) {
     // save our file list
-    GError *err = NULL;
     if(!fl_save(fl_local_list, var_get(0, VAR_cid), 0, FALSE, NULL, fl_local_list_file, &err)) {
       // this is a pretty fatal error... oh well, better luck next time
       ui_mf(uit_main_tab, UIP_MED, "Error saving file list: %s", err->message);
       g_error_free(err);
-    }
+      err = NULL;
+    } else
+      fl_needsnap = TRUE;
   }
   fl_needflush = FALSE;
+
+  // and the snapshot that goes with it
+  struct stat st;
+  if(fl_needsnap && stat(fl_local_list_file, &st) == 0) {
+    if(!fl_save_snapshot(fl_local_list, &st, fl_local_snap_file, &err)) {
+      ui_mf(uit_main_tab, UIP_MED, "Error saving file list snapshot: %s", err->message);
+      g_error_free(err);
+    }
+    fl_needsnap = FALSE;
+  }
   return TRUE;
 }
 
@@ -143,15 +205,13 @@ gboolean fl_flush(gpointer dat) {
 
 // Add to the hash index
 static void fl_hashindex_insert(fl_list_t *fl) {
-  GSList *cur = g_hash_table_lookup(fl_hash_index, fl->tth);
-  if(cur) {
-    g_return_if_fail(cur == g_slist_insert(cur, fl, 1)); // insert item without modifying the pointer
-  } else {
-    cur = g_slist_prepend(cur, fl);
-    g_hash_table_insert(fl_hash_index, fl->tth, cur);
+  if(tthidx_add(&fl_hash_index, fl)) {
     fl_local_list_size += fl->size;
+    GSList *l;
+    for(l=fl_bloom_list; l; l=l->next)
+      bloom_add(l->data, fl->tth);
   }
-  fl_local_list_length = g_hash_table_size(fl_hash_index);
+  fl_local_list_length = tthidx_size(&fl_hash_index);
 }
 
 
@@ -160,29 +220,791 @@ static void fl_hashindex_insert(fl_list_t *fl) {
 static void fl_hashindex_del(fl_list_t *fl) {
   if(!fl->hastth)
     return;
-  GSList *cur = g_hash_table_lookup(fl_hash_index, fl->tth);
   fl->hastth = FALSE;
-
-  cur = g_slist_remove(cur, fl);
-  if(!cur) {
-    g_hash_table_remove(fl_hash_index, fl->tth);
+  if(tthidx_del(&fl_hash_index, fl)) {
     fl_local_list_size -= fl->size;
-  // there's another file with the same TTH.
-  } else
-    g_hash_table_replace(fl_hash_index, ((fl_list_t *)cur->data)->tth, cur);
-  fl_local_list_length = g_hash_table_size(fl_hash_index);
+    GSList *l;
+    for(l=fl_bloom_list; l; l=l->next)
+      bloom_del(l->data, fl->tth);
+  }
+  fl_local_list_length = tthidx_size(&fl_hash_index);
+}
+
+
+
+
+// Partial file list cache. Serializing (and compressing) a directory for an
+// ADCGET "list" request is relatively expensive, and peers browsing our share
+// will often request the same directories over and over again. The cache is
+// keyed by virtual path and the recursive/zlib flags, and entries are removed
+// whenever something in the directory (or below it, for recursive lists)
+// changes.
+
+#define FL_PARTIAL_MAXSIZE (4*1024*1024) // Total size of the cached lists
+
+typedef struct fl_partial_t {
+  char *key;    // "[r-][z-]/path"
+  GString *buf; // Result of fl_save()
+  int len;      // Uncompressed size, as returned by fl_save()
+  GList *lru;   // Link in fl_partial_lru
+} fl_partial_t;
+
+static GHashTable *fl_partial_cache = NULL; // key -> fl_partial_t
+static GQueue     *fl_partial_lru = NULL;   // fl_partial_t, most recently used first
+static gsize       fl_partial_size = 0;
+guint64            fl_partial_hits = 0;
+guint64            fl_partial_misses = 0;
+
+
+static void fl_partial_free(gpointer dat) {
+  fl_partial_t *c = dat;
+  fl_partial_size -= c->buf->len;
+  g_queue_delete_link(fl_partial_lru, c->lru);
+  g_string_free(c->buf, TRUE);
+  g_free(c->key);
+  g_slice_free(fl_partial_t, c);
+}
+
+
+// Should be called after anything in dir has changed. If subtree is TRUE, any
+// cached lists of subdirectories of dir are removed as well. Lists of the
+// parent directories are always removed, since these include the size of dir.
+static void fl_partial_invalidate(fl_list_t *dir, gboolean subtree) {
+  if(!fl_partial_cache || !g_hash_table_size(fl_partial_cache))
+    return;
+  if(!dir->parent && subtree) {
+    g_hash_table_remove_all(fl_partial_cache);
+    return;
+  }
+
+  char *path = fl_list_path(dir);
+  int plen = strlen(path);
+  GHashTableIter iter;
+  fl_partial_t *c;
+  g_hash_table_iter_init(&iter, fl_partial_cache);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&c)) {
+    const char *k = c->key+2;
+    int klen = strlen(k);
+    // k is either a parent of path or path itself
+    gboolean parent = klen == 1 || (klen <= plen && strncmp(k, path, klen) == 0 && (!path[klen] || path[klen] == '/'));
+    // k is inside path
+    gboolean child = subtree && klen > plen && strncmp(k, path, plen) == 0 && k[plen] == '/';
+    if(parent || child)
+      g_hash_table_iter_remove(&iter);
+  }
+  g_free(path);
 }
 
 
+// Returns the serialized partial file list of a directory, as used for ADCGET
+// "list" requests. *len is set to the uncompressed size of the list. The
+// returned string is owned by the cache and should not be modified; it
+// remains valid until the next modification of the file list.
+GString *fl_local_partial(fl_list_t *dir, gboolean recursive, gboolean zlib, int *len, GError **err) {
+  g_return_val_if_fail(!dir->isfile, NULL);
+  if(!fl_partial_cache) {
+    fl_partial_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, fl_partial_free);
+    fl_partial_lru = g_queue_new();
+  }
+
+  char *path = fl_list_path(dir);
+  char *key = g_strdup_printf("%c%c%s", recursive ? 'r' : '-', zlib ? 'z' : '-', path);
+  g_free(path);
+
+  fl_partial_t *c = g_hash_table_lookup(fl_partial_cache, key);
+  if(c) {
+    fl_partial_hits++;
+    g_queue_unlink(fl_partial_lru, c->lru);
+    g_queue_push_head_link(fl_partial_lru, c->lru);
+    g_free(key);
+    *len = c->len;
+    return c->buf;
+  }
+  fl_partial_misses++;
+
+  // Use a targetsize of 16k for non-recursive lists and 256k for recursive
+  // ones. This should give useful results in most cases. The only exception
+  // here is Jucy, which does not handle "Incomplete" entries in a recursive
+  // list, but... yeah, that's Jucy's problem. :-)
+  GString *buf = g_string_new("");
+  int l = fl_save(dir, var_get(0, VAR_cid), recursive ? 256*1024 : 16*1024, zlib, buf, NULL, err);
+  if(!l) {
+    g_string_free(buf, TRUE);
+    g_free(key);
+    return NULL;
+  }
+
+  c = g_slice_new(fl_partial_t);
+  c->key = key;
+  c->buf = buf;
+  c->len = l;
+  g_queue_push_head(fl_partial_lru, c);
+  c->lru = fl_partial_lru->head;
+  fl_partial_size += buf->len;
+  g_hash_table_insert(fl_partial_cache, key, c);
+
+  // Evict the least recently used lists, but always keep the new one
+  while(fl_partial_size > FL_PARTIAL_MAXSIZE && fl_partial_lru->tail != c->lru)
+    g_hash_table_remove(fl_partial_cache, ((fl_partial_t *)fl_partial_lru->tail->data)->key);
+
+  *len = l;
+  return buf;
+}
+
+
+
+
+// Name index. Used to quickly find the candidate matches for a keyword
+// search, rather than running all the regexes against every single item in
+// the share.
+//
+// Each name in fl_local_list (files and directories alike) is case-folded and
+// split into tokens at every ASCII character that is not alphanumeric. Every
+// distinct token has a list of the items that it occurs in. Since a search
+// keyword may match in the middle of a token, finding the tokens that contain
+// a keyword is done with a trigram index over the (much smaller) set of
+// distinct tokens.
+//
+// Items are added to and removed from the index as fl_local_list changes.
+// Removing is done in a single pass over the item lists of the affected
+// tokens. Tokens that end up without items are kept, the set of distinct
+// tokens is small compared to the number of items, and it would otherwise
+// require renumbering the trigram lists.
+
+typedef struct fl_nameindex_tok_t {
+  GPtrArray *items; // list of fl_list_t
+  char name[1];
+} fl_nameindex_tok_t;
+
+static gboolean    fl_nameindex_valid = FALSE;
+static GPtrArray  *fl_nameindex_toks;  // id -> fl_nameindex_tok_t
+static GHashTable *fl_nameindex_names; // name -> fl_nameindex_tok_t
+static GHashTable *fl_nameindex_grams; // trigram -> GArray of token ids
+
+#define fl_nameindex_gram(s) GUINT_TO_POINTER(((guint8)(s)[0]<<16) + ((guint8)(s)[1]<<8) + (guint8)(s)[2])
+#define fl_nameindex_issep(c) (!((c) & 0x80) && !g_ascii_isalnum(c))
+
+
+static void fl_nameindex_tok_free(gpointer dat) {
+  fl_nameindex_tok_t *t = dat;
+  g_ptr_array_unref(t->items);
+  g_free(t);
+}
+
+
+static void fl_nameindex_gram_free(gpointer dat) {
+  g_array_unref(dat);
+}
+
+
+// Case-fold a name or keyword in the same way. Result should be free'd.
+static char *fl_nameindex_fold(const char *str) {
+  const char *s = str;
+  while(*s && !(*s & 0x80))
+    s++;
+  return *s && g_utf8_validate(str, -1, NULL) ? g_utf8_casefold(str, -1) : g_ascii_strdown(str, -1);
+}
+
+
+static void fl_nameindex_addtok(fl_list_t *fl, const char *str, int len) {
+  char name[len+1];
+  memcpy(name, str, len);
+  name[len] = 0;
+
+  fl_nameindex_tok_t *t = g_hash_table_lookup(fl_nameindex_names, name);
+  if(!t) {
+    t = g_malloc(offsetof(fl_nameindex_tok_t, name) + len + 1);
+    memcpy(t->name, name, len+1);
+    t->items = g_ptr_array_new();
+    guint32 id = fl_nameindex_toks->len;
+    g_ptr_array_add(fl_nameindex_toks, t);
+    g_hash_table_insert(fl_nameindex_names, t->name, t);
+    int i;
+    for(i=0; i+3<=len; i++) {
+      GArray *a = g_hash_table_lookup(fl_nameindex_grams, fl_nameindex_gram(name+i));
+      if(!a) {
+        a = g_array_new(FALSE, FALSE, sizeof(guint32));
+        g_hash_table_insert(fl_nameindex_grams, fl_nameindex_gram(name+i), a);
+      }
+      if(!a->len || g_array_index(a, guint32, a->len-1) != id)
+        g_array_append_val(a, id);
+    }
+  }
+  // Tokens of a single item are added consecutively, so this is enough to
+  // avoid duplicates.
+  if(!t->items->len || g_ptr_array_index(t->items, t->items->len-1) != fl)
+    g_ptr_array_add(t->items, fl);
+}
+
+
+// Split the name of an item into tokens, and add the item to each token. If
+// del is given, the existing tokens are added to that set instead.
+static void fl_nameindex_tokenize(fl_list_t *fl, GHashTable *del) {
+  char *name = fl_nameindex_fold(fl->name);
+  char *s = name, *e;
+  while(*s) {
+    while(*s && fl_nameindex_issep(*s))
+      s++;
+    for(e=s; *e && !fl_nameindex_issep(*e); e++)
+      ;
+    if(e > s && !del)
+      fl_nameindex_addtok(fl, s, e-s);
+    else if(e > s) {
+      char c = *e;
+      *e = 0;
+      fl_nameindex_tok_t *t = g_hash_table_lookup(fl_nameindex_names, s);
+      if(t)
+        g_hash_table_insert(del, t, t);
+      *e = c;
+    }
+    s = e;
+  }
+  g_free(name);
+}
+
+
+// Recursively add an item and its children to the index.
+static void fl_nameindex_insert(fl_list_t *fl) {
+  if(!fl_nameindex_valid)
+    return;
+  if(fl->parent)
+    fl_nameindex_tokenize(fl, NULL);
+  int i;
+  for(i=0; !fl->isfile && fl->sub && i<fl->sub->len; i++)
+    fl_nameindex_insert(g_ptr_array_index(fl->sub, i));
+}
+
+
+static void fl_nameindex_collect(fl_list_t *fl, GHashTable *items, GHashTable *toks) {
+  if(fl->parent) {
+    g_hash_table_insert(items, fl, fl);
+    fl_nameindex_tokenize(fl, toks);
+  }
+  int i;
+  for(i=0; !fl->isfile && fl->sub && i<fl->sub->len; i++)
+    fl_nameindex_collect(g_ptr_array_index(fl->sub, i), items, toks);
+}
+
+
+// Remove an item and its children from the index. Must be called before the
+// item is removed from fl_local_list, with fl_local_lock held.
+static void fl_nameindex_remove(fl_list_t *fl) {
+  if(!fl_nameindex_valid)
+    return;
+  GHashTable *items = g_hash_table_new(g_direct_hash, g_direct_equal);
+  GHashTable *toks = g_hash_table_new(g_direct_hash, g_direct_equal);
+  fl_nameindex_collect(fl, items, toks);
+
+  GHashTableIter iter;
+  fl_nameindex_tok_t *t;
+  g_hash_table_iter_init(&iter, toks);
+  while(g_hash_table_iter_next(&iter, (gpointer *)&t, NULL)) {
+    int i, n = 0;
+    for(i=0; i<t->items->len; i++)
+      if(!g_hash_table_lookup(items, g_ptr_array_index(t->items, i)))
+        t->items->pdata[n++] = t->items->pdata[i];
+    g_ptr_array_set_size(t->items, n);
+  }
+  g_hash_table_unref(toks);
+  g_hash_table_unref(items);
+}
+
+
+// (Re)creates an empty index. Must be called with fl_local_lock held.
+static void fl_nameindex_clear() {
+  if(fl_nameindex_valid) {
+    g_hash_table_unref(fl_nameindex_grams);
+    g_hash_table_unref(fl_nameindex_names);
+    g_ptr_array_unref(fl_nameindex_toks);
+  }
+  fl_nameindex_toks = g_ptr_array_new_with_free_func(fl_nameindex_tok_free);
+  fl_nameindex_names = g_hash_table_new(g_str_hash, g_str_equal);
+  fl_nameindex_grams = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, fl_nameindex_gram_free);
+  fl_nameindex_valid = TRUE;
+}
+
+
+// Find the tokens that contain the longest token of the given keyword. Returns
+// NULL if the keyword doesn't have any tokens, otherwise an array of
+// fl_nameindex_tok_t pointers (possibly empty), and the total number of items
+// in *cost.
+static GPtrArray *fl_nameindex_lookup(const char *keyword, int *cost) {
+  char *kw = fl_nameindex_fold(keyword);
+  char *s = kw, *e, *tok = NULL;
+  int len = 0;
+  while(*s) {
+    while(*s && fl_nameindex_issep(*s))
+      s++;
+    for(e=s; *e && !fl_nameindex_issep(*e); e++)
+      ;
+    if(e-s > len) {
+      tok = s;
+      len = e-s;
+    }
+    s = e;
+  }
+  if(!tok) {
+    g_free(kw);
+    return NULL;
+  }
+  tok[len] = 0;
+
+  GPtrArray *r = g_ptr_array_new();
+  *cost = 0;
+  int i;
+  // Short tokens don't have any trigrams, fall back to going through all tokens.
+  if(len < 3) {
+    for(i=0; i<fl_nameindex_toks->len; i++) {
+      fl_nameindex_tok_t *t = g_ptr_array_index(fl_nameindex_toks, i);
+      if(strstr(t->name, tok)) {
+        g_ptr_array_add(r, t);
+        *cost += t->items->len;
+      }
+    }
+  // Otherwise, check the tokens having the least common trigram of the keyword.
+  } else {
+    GArray *min = NULL;
+    for(i=0; i+3<=len; i++) {
+      GArray *a = g_hash_table_lookup(fl_nameindex_grams, fl_nameindex_gram(tok+i));
+      if(!a || !min || a->len < min->len)
+        min = a;
+      if(!min)
+        break;
+    }
+    for(i=0; min && i<min->len; i++) {
+      fl_nameindex_tok_t *t = g_ptr_array_index(fl_nameindex_toks, g_array_index(min, guint32, i));
+      if(strstr(t->name, tok)) {
+        g_ptr_array_add(r, t);
+        *cost += t->items->len;
+      }
+    }
+  }
+  g_free(kw);
+  return r;
+}
+
+
+// Search through fl_local_list and return at most max results. keywords are
+// the (unescaped) strings from which s->and was created. Uses the name index
+// to narrow down the list of items to check, if possible.
+int fl_local_search(fl_search_t *s, char **keywords, fl_list_t **res, int max) {
+  if(!fl_nameindex_valid || !keywords || !*keywords)
+    return fl_search_rec(fl_local_list, s, res, max);
+
+  // Find the keyword with the least amount of candidate items.
+  GPtrArray *toks = NULL;
+  int mincost = 0;
+  for(; *keywords; keywords++) {
+    int cost;
+    GPtrArray *t = fl_nameindex_lookup(*keywords, &cost);
+    if(t && (!toks || cost < mincost)) {
+      if(toks)
+        g_ptr_array_unref(toks);
+      toks = t;
+      mincost = cost;
+    } else if(t)
+      g_ptr_array_unref(t);
+  }
+  // None of the keywords have anything we can index on, or it matches so many
+  // items that walking through the entire list is cheaper.
+  if(!toks || mincost > fl_local_list_length/2) {
+    if(toks)
+      g_ptr_array_unref(toks);
+    return fl_search_rec(fl_local_list, s, res, max);
+  }
+
+  // The keyword matches either in the name of a result or in the name of one
+  // of its parents. So all results can be found by checking the candidates
+  // and the contents of the candidate directories.
+  GHashTable *cand = g_hash_table_new(g_direct_hash, g_direct_equal);
+  int i, j;
+  for(i=0; i<toks->len; i++) {
+    fl_nameindex_tok_t *t = g_ptr_array_index(toks, i);
+    for(j=0; j<t->items->len; j++)
+      g_hash_table_insert(cand, g_ptr_array_index(t->items, j), (void *)1);
+  }
+  g_ptr_array_unref(toks);
+
+  int n = 0;
+  GHashTableIter iter;
+  fl_list_t *fl, *p;
+  g_hash_table_iter_init(&iter, cand);
+  while(n < max && g_hash_table_iter_next(&iter, (gpointer *)&fl, NULL)) {
+    // Skip items that are already covered by a parent candidate directory.
+    for(p=fl->parent; p; p=p->parent)
+      if(g_hash_table_lookup(cand, p))
+        break;
+    if(p)
+      continue;
+    if(fl_search_match_full(fl, s))
+      res[n++] = fl;
+    if(!fl->isfile && n < max)
+      n += fl_search_rec_full(fl, s, res+n, max-n);
+  }
+  g_hash_table_unref(cand);
+  return n;
+}
+
+
+
+
+
+// Answering searches in a background thread.
+//
+// Keyword searches on a large share can take a while, so these are handled
+// by fl_search_pool. The search thread only reads from fl_local_list (and the
+// name index) while holding a reader lock on fl_local_lock, and the main
+// thread holds the writer lock whenever it modifies those. The main thread
+// does not need to lock for reading, as it is the only writer.
+//
+// The number of searches waiting for the thread is limited, new searches are
+// simply dropped when the queue is full.
+
+#if INTERFACE
+
+// Copy of a search result, since the fl_list_t items may be gone by the time
+// the result is received in the main thread.
+struct fl_search_res_t {
+  char *path;     // as returned by fl_list_path()
+  guint64 size;
+  gboolean isfile;
+  char tth[24];   // only if isfile
+};
+
+#endif
+
+#define FL_SEARCH_QUEUE 50
+
+typedef struct fl_search_job_t {
+  fl_search_t s;      // own copy
+  char **keywords;
+  int max, num;
+  guint64 time;       // time taken by fl_local_search(), in microseconds
+  fl_search_res_t *res;
+  void (*cb)(fl_search_res_t *, int, gpointer);
+  gpointer dat;
+} fl_search_job_t;
+
+static GThreadPool *fl_search_pool;
+static int          fl_search_pending = 0;
+static int          fl_search_dropped = 0; // since the last report
+static time_t       fl_search_lastdrop = 0;
+
+void fl_search_res_set(fl_search_res_t *r, fl_list_t *fl) {
+  r->path = fl_list_path(fl);
+  r->size = fl->size;
+  r->isfile = fl->isfile ? TRUE : FALSE;
+  if(fl->isfile)
+    memcpy(r->tth, fl->tth, 24);
+}
+
+
+void fl_search_res_free(fl_search_res_t *r, int num) {
+  int i;
+  for(i=0; i<num; i++)
+    g_free(r[i].path);
+  g_free(r);
+}
+
+
+static gboolean fl_search_done(gpointer dat);
+
+static void fl_search_thread(gpointer data, gpointer udata) {
+  fl_search_job_t *j = data;
+  fl_list_t *res[j->max];
+  int i;
+
+  g_static_rw_lock_reader_lock(&fl_local_lock);
+  guint64 start = perf_time();
+  j->num = fl_local_search(&j->s, j->keywords, res, j->max);
+  j->time = perf_elapsed(start);
+  j->res = g_new0(fl_search_res_t, j->num);
+  for(i=0; i<j->num; i++)
+    fl_search_res_set(j->res+i, res[i]);
+  g_static_rw_lock_reader_unlock(&fl_local_lock);
+
+  g_idle_add_full(G_PRIORITY_HIGH_IDLE, fl_search_done, j, NULL);
+}
+
+
+static gboolean fl_search_done(gpointer dat) {
+  fl_search_job_t *j = dat;
+  fl_search_pending--;
+  hist_add(&fl_stats_search, j->time);
+  hist_add(&fl_stats_results, j->num);
+  j->cb(j->res, j->num, j->dat);
+
+  fl_search_res_free(j->res, j->num);
+  fl_search_free_and(j->s.and);
+  if(j->s.not)
+    g_regex_unref(j->s.not);
+  g_strfreev(j->s.ext);
+  g_strfreev(j->keywords);
+  g_slice_free(fl_search_job_t, j);
+  return FALSE;
+}
+
+
+// Queue a keyword search on the local file list. The search struct and
+// keywords (see fl_local_search()) are copied, so the caller remains
+// responsible for freeing those. Once the search has finished, cb() is called
+// from the main thread with the results, unless the search was dropped, in
+// which case FALSE is returned and the callback is never called. The results
+// are freed after the callback returns.
+gboolean fl_local_search_async(fl_search_t *s, char **keywords, int max, void (*cb)(fl_search_res_t *, int, gpointer), gpointer dat) {
+  if(fl_search_pending >= FL_SEARCH_QUEUE) {
+    fl_search_dropped++;
+    time_t t = time(NULL);
+    if(fl_search_lastdrop+60 < t) {
+      g_message("Search queue full, dropped %d incoming search request(s).", fl_search_dropped);
+      fl_search_dropped = 0;
+      fl_search_lastdrop = t;
+    }
+    return FALSE;
+  }
+
+  fl_search_job_t *j = g_slice_new0(fl_search_job_t);
+  j->s = *s;
+  j->s.ext = g_strdupv(s->ext);
+  j->s.not = s->not ? g_regex_ref(s->not) : NULL;
+  int i, len = 0;
+  for(; s->and && s->and[len]; len++)
+    ;
+  j->s.and = len ? g_new(GRegex *, len+1) : NULL;
+  for(i=0; i<len; i++)
+    j->s.and[i] = g_regex_ref(s->and[i]);
+  if(len)
+    j->s.and[i] = NULL;
+  j->keywords = g_strdupv(keywords);
+  j->max = max;
+  j->cb = cb;
+  j->dat = dat;
+
+  fl_search_pending++;
+  g_thread_pool_push(fl_search_pool, j, NULL);
+  return TRUE;
+}
+
+
+
+
+
+
+// Watching the share for changes (share_watch)
+//
+// Each directory that is read by the scanner is added to an inotify instance.
+// Directories in which something changes are collected in fl_watch_dirty and
+// refreshed after there haven't been any events for FL_WATCH_DELAY seconds,
+// or at most FL_WATCH_MAXDELAY seconds after the first event. Subdirectories
+// of other dirty directories are dropped at that point, so copying a large
+// directory tree into the share results in a single refresh.
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define FL_WATCH_DELAY 10
+#define FL_WATCH_MAXDELAY 120
+
+static int fl_watch_fd = -1;
+// wd -> path (in filename encoding). Written by the scan threads, protected
+// by fl_watch_lock.
+static GHashTable *fl_watch_wds = NULL;
+static GStaticMutex fl_watch_lock = G_STATIC_MUTEX_INIT;
+static gboolean fl_watch_limit = FALSE; // whether the watch limit has been reached
+static guint fl_watch_io = 0;
+
+static GHashTable *fl_watch_dirty = NULL; // set of paths, in filename encoding
+static gboolean fl_watch_all = FALSE;     // refresh everything
+static time_t fl_watch_first, fl_watch_last;
+
+
+// Called from the scan threads for each directory.
+static void fl_watch_add(const char *path) {
+  int fd = g_atomic_int_get(&fl_watch_fd);
+  if(fd < 0)
+    return;
+  int wd = inotify_add_watch(fd, path, IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_CLOSE_WRITE|IN_ONLYDIR);
+  g_static_mutex_lock(&fl_watch_lock);
+  if(wd >= 0)
+    g_hash_table_replace(fl_watch_wds, GINT_TO_POINTER(wd), g_strdup(path));
+  else if(errno == ENOSPC && !fl_watch_limit) {
+    fl_watch_limit = TRUE;
+    ui_m(uit_main_tab, UIP_MED, "Too many directories to watch for changes. Increase /proc/sys/fs/inotify/max_user_watches"
+      " to fix this, otherwise some changes will only be noticed on the next manual or automatic refresh.");
+  }
+  g_static_mutex_unlock(&fl_watch_lock);
+}
+
+
+static gboolean fl_watch_process(gpointer dat) {
+  time_t t = time(NULL);
+  if(fl_watch_last+FL_WATCH_DELAY > t && fl_watch_first+FL_WATCH_MAXDELAY > t)
+    return TRUE;
+
+  if(fl_watch_all) {
+    g_debug("fl: Changes detected, refreshing everything.");
+    fl_refresh(NULL);
+  } else {
+    // Sort the paths, so that subdirectories of a dirty directory come right
+    // after it.
+    GList *l, *paths = g_list_sort(g_hash_table_get_keys(fl_watch_dirty), (GCompareFunc)strcmp);
+    const char *last = NULL;
+    for(l=paths; l; l=l->next) {
+      const char *p = l->data;
+      int len = last ? strlen(last) : 0;
+      if(last && strncmp(p, last, len) == 0 && (p[len] == '/' || !last[1]))
+        continue;
+      last = p;
+
+      // A directory that we don't know yet is handled by refreshing the
+      // closest parent that we do know.
+      char *path = g_filename_to_utf8(p, -1, NULL, NULL, NULL);
+      fl_list_t *fl = NULL;
+      char *sep;
+      while(path && !(fl = fl_local_from_path(path)) && (sep = strrchr(path, '/')) && sep > path)
+        *sep = 0;
+      if(fl && fl->isfile)
+        fl = fl->parent;
+      if(fl) {
+        g_debug("fl: Changes detected in `%s', refreshing.", path);
+        fl_refresh(fl);
+      }
+      g_free(path);
+    }
+    g_list_free(paths);
+  }
+
+  g_hash_table_remove_all(fl_watch_dirty);
+  fl_watch_all = FALSE;
+  fl_watch_first = 0;
+  return FALSE;
+}
+
+
+// path = NULL to refresh everything.
+static void fl_watch_mark(const char *path) {
+  if(!fl_watch_first) {
+    fl_watch_first = time(NULL);
+    g_timeout_add_seconds_full(G_PRIORITY_LOW, FL_WATCH_DELAY, fl_watch_process, NULL, NULL);
+  }
+  fl_watch_last = time(NULL);
+  if(!path)
+    fl_watch_all = TRUE;
+  else if(!fl_watch_all && !g_hash_table_lookup(fl_watch_dirty, path))
+    g_hash_table_insert(fl_watch_dirty, g_strdup(path), (gpointer)1);
+}
+
+
+static gboolean fl_watch_read(GIOChannel *src, GIOCondition cond, gpointer dat) {
+  char buf[16*1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  gboolean hidden = var_get_bool(0, VAR_share_hidden);
+  int r;
+  while((r = read(fl_watch_fd, buf, sizeof(buf))) > 0) {
+    char *p = buf;
+    g_static_mutex_lock(&fl_watch_lock);
+    while(p < buf+r) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+      if(ev->mask & IN_Q_OVERFLOW) {
+        fl_watch_mark(NULL);
+        continue;
+      }
+      if(ev->mask & IN_IGNORED) {
+        g_hash_table_remove(fl_watch_wds, GINT_TO_POINTER(ev->wd));
+        continue;
+      }
+      const char *path = g_hash_table_lookup(fl_watch_wds, GINT_TO_POINTER(ev->wd));
+      if(path && !(ev->len && !hidden && ev->name[0] == '.'))
+        fl_watch_mark(path);
+    }
+    g_static_mutex_unlock(&fl_watch_lock);
+  }
+  return TRUE;
+}
+
+
+// Adds a directory in fl_local_list and its subdirectories to the watch list.
+// path is in the filename encoding.
+static void fl_watch_addrec(fl_list_t *dir, const char *path, gboolean utf8) {
+  fl_watch_add(path);
+  int i;
+  for(i=0; dir->sub && i<dir->sub->len; i++) {
+    fl_list_t *cur = g_ptr_array_index(dir->sub, i);
+    if(cur->isfile)
+      continue;
+    char *enc = utf8 ? g_strdup(cur->name) : g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
+    if(enc) {
+      char *sub = g_build_filename(path, enc, NULL);
+      fl_watch_addrec(cur, sub, utf8);
+      g_free(sub);
+    }
+    g_free(enc);
+  }
+}
+
+
+// (Re-)initializes or disables watching after a change to share_watch.
+void fl_watch_setup() {
+  gboolean on = var_get_bool(0, VAR_share_watch);
+  if(!fl_watch_dirty) {
+    fl_watch_dirty = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    fl_watch_wds = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  }
+
+  if(on && fl_watch_fd < 0) {
+    int fd = inotify_init();
+    if(fd < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+      ui_mf(uit_main_tab, UIP_MED, "Unable to watch the share for changes: %s", g_strerror(errno));
+      if(fd >= 0)
+        close(fd);
+      return;
+    }
+    GIOChannel *c = g_io_channel_unix_new(fd);
+    fl_watch_io = g_io_add_watch(c, G_IO_IN, fl_watch_read, NULL);
+    g_io_channel_unref(c);
+    fl_watch_limit = FALSE;
+    g_atomic_int_set(&fl_watch_fd, fd);
+    // Directories are normally added to the watch list while scanning. The
+    // directories that are already in the list are added directly instead of
+    // rescanning the entire share. Changes made while ncdc wasn't running are,
+    // as without share_watch, picked up by autorefresh.
+    const gchar *charset;
+    gboolean utf8 = g_get_filename_charsets(&charset);
+    int i;
+    for(i=0; fl_local_list && i<fl_local_list->sub->len; i++) {
+      fl_list_t *root = g_ptr_array_index(fl_local_list->sub, i);
+      char *path = g_filename_from_utf8(db_share_path(root->name), -1, NULL, NULL, NULL);
+      if(path)
+        fl_watch_addrec(root, path, utf8);
+      g_free(path);
+    }
+
+  } else if(!on && fl_watch_fd >= 0) {
+    g_source_remove(fl_watch_io);
+    close(fl_watch_fd);
+    g_atomic_int_set(&fl_watch_fd, -1);
+    g_static_mutex_lock(&fl_watch_lock);
+    g_hash_table_remove_all(fl_watch_wds);
+    g_static_mutex_unlock(&fl_watch_lock);
+  }
+}
+
+#else // HAVE_SYS_INOTIFY_H
+
+static void fl_watch_add(const char *path) {}
+void fl_watch_setup() {}
+
+#endif
+
+
 
 
 
 // Scanning directories
 
 // Note: The `file' structure points to a (sub-)item in fl_local_list, and will
-// be accessed from both the scan thread and the main thread. It is therefore
+// be accessed from both the scan threads and the main thread. It is therefore
 // important that no changes are made to the local file list while the scan
-// thread is active.
+// threads are active.
 typedef struct fl_scan_t {
   fl_list_t **file, **res;
   char **path;
@@ -191,11 +1013,42 @@ typedef struct fl_scan_t {
   gboolean inc_hidden;
   gboolean symlink;
   gboolean (*donefun)(gpointer);
+  // Used by fl_scan_thread() to wait for the directory jobs
+  int pending; // number of queued or active jobs, plus one for fl_scan_thread()
+  gboolean done;
+  GMutex *lock;
+  GCond *cond;
 } fl_scan_t;
 
 
+// A directory to be read by one of the threads in fl_scan_dirpool. Each job
+// only modifies its own directory, subdirectories are queued as new jobs.
+// Directory sizes are calculated by fl_scan_finish() after all jobs are done.
+typedef struct fl_scan_job_t {
+  fl_scan_t *opts;
+  fl_list_t *dir;  // directory in the new list, with dir->sub created
+  fl_list_t *old;  // the same directory in the old list, if any
+  char *path;      // filesystem path, in filename encoding
+  char *vpath;     // virtual path, in UTF-8
+} fl_scan_job_t;
+
+// Number of directories that are read in parallel. Reading directories is
+// mostly latency-bound, especially on network filesystems, so this can be
+// larger than the number of CPUs.
+#define FL_SCAN_THREADS 8
+
+static GThreadPool *fl_scan_dirpool;
+
+// Whether the filename encoding is UTF-8, in which case the conversions from
+// and to UTF-8 can be skipped for valid names.
+static gboolean fl_scan_utf8;
+
+static GStaticMutex fl_scan_invlock = G_STATIC_MUTEX_INIT;
+
+
 // Removes duplicate files (that is, files with the same name in a
-// case-insensitive context) from a dirtectory.
+// case-insensitive context) from a dirtectory. Doesn't update the size of the
+// parent directories.
 static void fl_scan_rmdupes(fl_list_t *fl, const char *vpath) {
   int i = 1;
   while(i<fl->sub->len) {
@@ -204,7 +1057,7 @@ static void fl_scan_rmdupes(fl_list_t *fl, const char *vpath) {
     if(fl_list_cmp_strict(a, b) == 0) {
       char *tmp = g_build_filename(vpath, b->name, NULL);
       ui_mf(uit_main_tab, UIP_MED, "Not sharing \"%s\": Other file with same name (but different case) already shared.", tmp);
-      fl_list_remove(b);
+      g_ptr_array_remove_index(fl->sub, i);
       g_free(tmp);
     } else
       i++;
@@ -219,6 +1072,7 @@ static void fl_scan_invalidate(gint64 id, gboolean force_flush) {
   static gint64 rmids[50];
   static int i = 0;
 
+  g_static_mutex_lock(&fl_scan_invlock);
   if(id)
     rmids[i++] = id;
 
@@ -226,12 +1080,16 @@ static void fl_scan_invalidate(gint64 id, gboolean force_flush) {
     db_fl_rmfiles(rmids, i);
     i = 0;
   }
+  g_static_mutex_unlock(&fl_scan_invlock);
 }
 
 
-// Fetches TTH information either from the database or from *oldpar, and
-// invalidates this data if the file has changed.
-static void fl_scan_check(fl_list_t *oldpar, fl_list_t *new, const char *real) {
+// Fetches TTH information either from *oldpar or from the database, and
+// invalidates this data if the file has changed. *path and *ename are the
+// filesystem path of the directory and file name of the file, these are only
+// used when the database needs to be consulted. Returns FALSE if the file
+// should not be shared.
+static gboolean fl_scan_check(fl_list_t *oldpar, fl_list_t *new, const char *path, const char *ename, const char *vcpath) {
   time_t oldlastmod;
   guint64 oldsize;
   char oldhash[24];
@@ -244,13 +1102,28 @@ static void fl_scan_check(fl_list_t *oldpar, fl_list_t *new, const char *real) {
     oldlastmod = fl_list_getlocal(old).lastmod;
     oldsize = old->size;
     memcpy(oldhash, old->tth, 24);
-  // Otherwise, do a database lookup on the file path
-  } else
+  // Otherwise, do a database lookup on the path_expand()'ed path
+  } else {
+    char *cpath = g_build_filename(path, ename, NULL);
+    char *tmp = path_expand(cpath);
+    g_free(cpath);
+    if(!tmp) {
+      ui_mf(uit_main_tab, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, g_strerror(errno));
+      return FALSE;
+    }
+    char *real = g_filename_to_utf8(tmp, -1, NULL, NULL, NULL);
+    g_free(tmp);
+    if(!real) {
+      ui_mf(uit_main_tab, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, "Encoding error.");
+      return FALSE;
+    }
     oldid = db_fl_getfile(real, &oldlastmod, &oldsize, oldhash);
+    g_free(real);
+  }
 
   // Check for file change
   if(oldid && (oldlastmod < fl_list_getlocal(new).lastmod || oldsize != new->size)) {
-    g_debug("fl: Dropping hash information for `%s': file has changed.", real);
+    g_debug("fl: Dropping hash information for `%s': file has changed.", vcpath);
     fl_scan_invalidate(oldid, FALSE);
   // Otherwise, update *new
   } else if(oldid) {
@@ -259,44 +1132,48 @@ static void fl_scan_check(fl_list_t *oldpar, fl_list_t *new, const char *real) {
     fl_list_getlocal(new).lastmod = oldlastmod;
     fl_list_getlocal(new).id = oldid;
   }
+  return TRUE;
 }
 
 
-// *name is in filesystem encoding. For *path and *vpath see fl_scan_dir().
-static fl_list_t *fl_scan_item(fl_list_t *old, const char *path, const char *vpath, const char *name, fl_scan_t *opts) {
+// *name is in filesystem encoding, fd is the opened directory. For *old see
+// fl_scan_job_t.
+static fl_list_t *fl_scan_item(fl_scan_job_t *j, int fd, const char *name) {
+  fl_scan_t *opts = j->opts;
   char *uname = NULL;  // name-to-UTF8
   char *vcpath = NULL; // vpath + uname
   char *ename = NULL;  // uname-to-filesystem
-  char *cpath = NULL;  // path + ename
-  char *real = NULL;   // path_expand(cpath)-to-UTF8
   fl_list_t *node = NULL;
 
   // Try to get a UTF-8 filename
-  uname = g_filename_to_utf8(name, -1, NULL, NULL, NULL);
-  if(!uname)
-    uname = g_filename_display_name(name);
+  if(fl_scan_utf8 && g_utf8_validate(name, -1, NULL))
+    uname = g_strdup(name);
+  else {
+    uname = g_filename_to_utf8(name, -1, NULL, NULL, NULL);
+    if(!uname)
+      uname = g_filename_display_name(name);
+  }
 
   // Check for share_exclude as soon as we have the confname
   if(opts->excl_regex && g_regex_match(opts->excl_regex, uname, 0, NULL))
     goto done;
 
   // Get the virtual path (for reporting purposes)
-  vcpath = g_build_filename(vpath, uname, NULL);
+  vcpath = g_build_filename(j->vpath, uname, NULL);
 
   // Check that the UTF-8 filename can be converted back to something we can
   // access on the filesystem. If it can't be converted back, we won't share
   // the file at all. Keeping track of a raw-to-UTF-8 filename lookup table
   // isn't worth the effort.
-  ename = g_filename_from_utf8(uname, -1, NULL, NULL, NULL);
+  ename = fl_scan_utf8 ? g_strdup(uname) : g_filename_from_utf8(uname, -1, NULL, NULL, NULL);
   if(!ename) {
     ui_mf(uit_main_tab, UIP_MED, "Error reading directory entry in \"%s\": Invalid encoding.", vcpath);
     goto done;
   }
 
-  // Get cpath and try to stat() the file
-  cpath = g_build_filename(path, ename, NULL);
+  // Try to stat() the file
   struct stat dat;
-  int r = opts->symlink ? stat(cpath, &dat) : lstat(cpath, &dat);
+  int r = fstatat(fd, ename, &dat, opts->symlink ? 0 : AT_SYMLINK_NOFOLLOW);
   if(r < 0 || S_ISLNK(dat.st_mode) || !(S_ISREG(dat.st_mode) || S_ISDIR(dat.st_mode))) {
     if(r < 0)
       ui_mf(uit_main_tab, UIP_MED, "Error stat'ing \"%s\": %s", vcpath, g_strerror(errno));
@@ -305,22 +1182,6 @@ static fl_list_t *fl_scan_item(fl_list_t *old, const char *path, const char *vpa
     goto done;
   }
 
-  // Get the path_expand() (for lookup in the database)
-  // TODO: this path is only used if fl_scan_check() can't find the item in the
-  // old fl_list structure. It may be more efficient to only try to execute
-  // this code when this is the case.
-  char *tmp = path_expand(cpath);
-  if(!tmp) {
-    ui_mf(uit_main_tab, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, g_strerror(errno));
-    goto done;
-  }
-  real = g_filename_to_utf8(tmp, -1, NULL, NULL, NULL);
-  g_free(tmp);
-  if(!real) {
-    ui_mf(uit_main_tab, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, "Encoding error.");
-    goto done;
-  }
-
   // create the node
   node = fl_list_create(uname, S_ISREG(dat.st_mode) ? TRUE : FALSE);
   if(S_ISREG(dat.st_mode)) {
@@ -330,86 +1191,151 @@ static fl_list_t *fl_scan_item(fl_list_t *old, const char *path, const char *vpa
   }
 
   // Fetch id, tth, and hashtth fields.
-  if(node->isfile)
-    fl_scan_check(old, node, real);
+  if(node->isfile && !fl_scan_check(j->old, node, j->path, ename, vcpath)) {
+    fl_list_free(node);
+    node = NULL;
+  }
 
 done:
   g_free(uname);
   g_free(vcpath);
-  g_free(cpath);
   g_free(ename);
-  g_free(real);
   return node;
 }
 
 
-// recursive
-// Doesn't handle paths longer than PATH_MAX, but I don't think it matters all that much.
-// *path is the filesystem path in filename encoding, vpath is the virtual path in UTF-8.
-static void fl_scan_dir(fl_list_t *parent, fl_list_t *old, const char *path, const char *vpath, fl_scan_t *opts) {
-  GError *err = NULL;
-  GDir *dir = g_dir_open(path, 0, &err);
+static void fl_scan_push(fl_scan_t *opts, fl_list_t *dir, fl_list_t *old, char *path, char *vpath) {
+  fl_scan_job_t *j = g_slice_new(fl_scan_job_t);
+  j->opts = opts;
+  j->dir = dir;
+  j->old = old;
+  j->path = path;
+  j->vpath = vpath;
+  dir->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  g_atomic_int_inc(&opts->pending);
+  g_thread_pool_push(fl_scan_dirpool, j, NULL);
+}
+
+
+static void fl_scan_jobdone(fl_scan_t *opts) {
+  if(g_atomic_int_dec_and_test(&opts->pending)) {
+    g_mutex_lock(opts->lock);
+    opts->done = TRUE;
+    g_cond_signal(opts->cond);
+    g_mutex_unlock(opts->lock);
+  }
+}
+
+
+// Reads a single directory, executed in one of the fl_scan_dirpool threads.
+// Doesn't handle paths longer than PATH_MAX, but I don't think it matters all
+// that much.
+static void fl_scan_dir(gpointer dat, gpointer udata) {
+  fl_scan_job_t *j = dat;
+  fl_scan_t *opts = j->opts;
+  fl_list_t *parent = j->dir;
+
+  int fd = open(j->path, O_RDONLY|O_DIRECTORY);
+  DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+  if(dir)
+    fl_watch_add(j->path);
   if(!dir) {
-    ui_mf(uit_main_tab, UIP_MED, "Error reading directory \"%s\": %s", vpath, g_strerror(errno));
-    g_error_free(err);
-    return;
+    ui_mf(uit_main_tab, UIP_MED, "Error reading directory \"%s\": %s", j->vpath, g_strerror(errno));
+    if(fd >= 0)
+      close(fd);
+    goto done;
   }
-  const char *name;
-  while((name = g_dir_read_name(dir))) {
+
+  struct dirent *ent;
+  while((ent = readdir(dir))) {
+    const char *name = ent->d_name;
     if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
       continue;
     if(!opts->inc_hidden && name[0] == '.')
       continue;
     // check with *excl, stat and create
-    fl_list_t *item = fl_scan_item(old, path, vpath, name, opts);
+    fl_list_t *item = fl_scan_item(j, fd, name);
     // and add it
-    if(item)
-      fl_list_add(parent, item, -1);
+    if(item) {
+      item->parent = parent;
+      g_ptr_array_add(parent->sub, item);
+    }
   }
-  g_dir_close(dir);
+  closedir(dir);
 
   // Sort
   fl_list_sort(parent);
-  fl_scan_rmdupes(parent, vpath);
+  fl_scan_rmdupes(parent, j->vpath);
 
-  // check for directories (outside of the above loop, to avoid having too many
-  // directories opened at the same time. Costs some extra CPU cycles, though...)
+  // Queue the subdirectories
   int i;
   for(i=0; i<parent->sub->len; i++) {
     fl_list_t *cur = g_ptr_array_index(parent->sub, i);
     if(!cur->isfile) {
-      char *enc = g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
-      char *cpath = g_build_filename(path, enc, NULL);
-      char *virtpath = g_build_filename(vpath, cur->name, NULL);
-      cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
-      fl_scan_dir(cur, old && old->sub ? fl_list_file_strict(old, cur) : NULL, cpath, virtpath, opts);
-      g_free(virtpath);
-      g_free(cpath);
+      char *enc = fl_scan_utf8 ? g_strdup(cur->name) : g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
+      fl_scan_push(opts, cur, j->old && j->old->sub ? fl_list_file_strict(j->old, cur) : NULL,
+        g_build_filename(j->path, enc, NULL), g_build_filename(j->vpath, cur->name, NULL));
       g_free(enc);
     }
-    // Removes this item if it is an empty directory and if !opts->emptydirs.
-    if(!opts->emptydirs && !cur->isfile && !cur->sub->len) {
-      fl_list_remove(cur);
-      i--; // Make sure that the index doesn't change with the next iteration
+  }
+
+done:
+  g_free(j->path);
+  g_free(j->vpath);
+  g_slice_free(fl_scan_job_t, j);
+  fl_scan_jobdone(opts);
+}
+
+
+// Calculates the directory sizes and removes empty directories if
+// !emptydirs, after all directories have been read.
+static void fl_scan_finish(fl_list_t *dir, gboolean emptydirs) {
+  int i = 0;
+  dir->size = 0;
+  while(i < dir->sub->len) {
+    fl_list_t *cur = g_ptr_array_index(dir->sub, i);
+    if(!cur->isfile) {
+      fl_scan_finish(cur, emptydirs);
+      if(!emptydirs && !cur->sub->len) {
+        g_ptr_array_remove_index(dir->sub, i);
+        continue;
+      }
     }
+    dir->size += cur->size;
+    i++;
   }
 }
 
 
-// Must be called in a separate thread.
+// Must be called in a separate thread. Queues the given directories to
+// fl_scan_dirpool and waits for the scan to finish.
 static void fl_scan_thread(gpointer data, gpointer udata) {
   fl_scan_t *args = data;
+  const gchar *charset;
+  fl_scan_utf8 = g_get_filename_charsets(&charset);
+
+  args->lock = g_mutex_new();
+  args->cond = g_cond_new();
+  args->pending = 1;
+  args->done = FALSE;
 
   int i, len = g_strv_length(args->path);
   for(i=0; i<len; i++) {
-    fl_list_t *cur = fl_list_create("", FALSE);
-    char *tmp = g_filename_from_utf8(args->path[i], -1, NULL, NULL, NULL);
-    cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
-    fl_scan_dir(cur, args->file[i], tmp, args->path[i], args);
-    g_free(tmp);
-    args->res[i] = cur;
+    args->res[i] = fl_list_create("", FALSE);
+    fl_scan_push(args, args->res[i], args->file[i], g_filename_from_utf8(args->path[i], -1, NULL, NULL, NULL), g_strdup(args->path[i]));
   }
 
+  fl_scan_jobdone(args);
+  g_mutex_lock(args->lock);
+  while(!args->done)
+    g_cond_wait(args->cond, args->lock);
+  g_mutex_unlock(args->lock);
+  g_mutex_free(args->lock);
+  g_cond_free(args->cond);
+
+  for(i=0; i<len; i++)
+    fl_scan_finish(args->res[i], args->emptydirs);
+
   fl_scan_invalidate(0, TRUE);
   g_idle_add_full(G_PRIORITY_HIGH_IDLE, args->donefun, args, NULL);
 }
@@ -422,17 +1348,33 @@ static void fl_scan_thread(gpointer data, gpointer udata) {
 // Hashing files
 
 
+// Files in the hash queue are grouped by the device they reside on, and only
+// one file per device is being hashed at any point in time. This allows
+// multiple disks to be hashed in parallel, while still making sure that a
+// single (spinning) disk mostly sees sequential reads. The device is
+// determined from the share root a file is in, other filesystems mounted
+// inside a shared directory are not detected.
+// These structs are only accessed from the main thread, and are never freed.
+typedef struct fl_hash_dev_t {
+  dev_t dev;
+  GHashTable *files;     // files in fl_hash_queue that reside on this device
+  struct fl_hash_t *cur; // file currently being hashed, NULL if idle
+} fl_hash_dev_t;
+
+
 // This struct is passed from the main thread to the hasher and back with modifications.
 typedef struct fl_hash_t {
   fl_list_t *file; // only accessed from main thread
+  fl_hash_dev_t *dev; // only accessed from main thread
   char *path;        // owned by main thread, read from hash thread
   guint64 filesize;  // set by main thread
+  gboolean usemmap;  // set by main thread
   char root[24];     // set by hash thread
   GError *err;       // set by hash thread
   time_t lastmod;    // set by hash thread
   gint64 id;         // set by hash thread
   gdouble time;      // set by hash thread
-  guint64 lastreset; // last value of fl_hash_reset when starting this thread
+  gboolean cancel;   // set by main thread when the file is removed from the queue, protected by fl_hash_resetlock
 } fl_hash_t;
 
 // Maximum number of levels, including root (level 0).  The ADC docs specify
@@ -457,27 +1399,63 @@ typedef struct fl_hash_t {
 
 
 
+// Get the device group for a file in the share.
+static fl_hash_dev_t *fl_hash_getdev(fl_list_t *fl) {
+  while(fl->parent && fl->parent->parent)
+    fl = fl->parent;
+  const char *path = db_share_path(fl->name);
+  if(!path)
+    path = "";
+
+  fl_hash_dev_t *dev = g_hash_table_lookup(fl_hash_devcache, path);
+  if(dev)
+    return dev;
+
+  // Files for which we can't determine the device are grouped as device 0.
+  struct stat st;
+  dev_t d = stat(path, &st) < 0 ? 0 : st.st_dev;
+  GSList *n;
+  for(n=fl_hash_devs; n; n=n->next)
+    if(((fl_hash_dev_t *)n->data)->dev == d)
+      break;
+  if(n)
+    dev = n->data;
+  else {
+    dev = g_new0(fl_hash_dev_t, 1);
+    dev->dev = d;
+    dev->files = g_hash_table_new(g_direct_hash, g_direct_equal);
+    fl_hash_devs = g_slist_append(fl_hash_devs, dev);
+  }
+  g_hash_table_insert(fl_hash_devcache, g_strdup(path), dev);
+  return dev;
+}
+
+
 // adding/removing items from the files-to-be-hashed queue
 // _append() assumes that fl->hastth is false.
 #define fl_hash_queue_append(fl) do {\
     g_warn_if_fail(!fl->hastth);\
-    gboolean start = !g_hash_table_size(fl_hash_queue);\
-    if(start || !g_hash_table_lookup(fl_hash_queue, fl))\
+    if(!g_hash_table_lookup(fl_hash_queue, fl)) {\
+      fl_hash_dev_t *dev = fl_hash_getdev(fl);\
       fl_hash_queue_size += fl->size;\
-    g_hash_table_insert(fl_hash_queue, fl, (void *)1);\
-    if(start)\
-      fl_hash_process();\
+      g_hash_table_insert(fl_hash_queue, fl, dev);\
+      g_hash_table_insert(dev->files, fl, fl);\
+      if(!dev->cur && fl_hash_active < var_get_int(0, VAR_hash_threads))\
+        fl_hash_process();\
+    }\
   } while(0)
 
 
 #define fl_hash_queue_del(fl) do {\
-    if((fl)->isfile && g_hash_table_lookup(fl_hash_queue, fl)) {\
+    fl_hash_dev_t *dev = (fl)->isfile ? g_hash_table_lookup(fl_hash_queue, fl) : NULL;\
+    if(dev) {\
       fl_hash_queue_size -= fl->size;\
       g_hash_table_remove(fl_hash_queue, fl);\
-      if((fl) == fl_hash_cur) {\
+      g_hash_table_remove(dev->files, fl);\
+      if(dev->cur && dev->cur->file == (fl)) {\
         g_mutex_lock(fl_hash_resetlock);\
-        fl_hash_reset++;\
-        g_cond_signal(fl_hash_resetcond);\
+        dev->cur->cancel = TRUE;\
+        g_cond_broadcast(fl_hash_resetcond);\
         g_mutex_unlock(fl_hash_resetlock);\
       }\
     }\
@@ -499,16 +1477,19 @@ static void fl_hash_queue_delrec(fl_list_t *f) {
 
 // Checks whether this hashing operation has been cancelled and waits until the
 // hash ratecalc object has enough burst to allow us to continue hashing again.
-// Returns the allowed burst, or 0 on cancellation.
-static int fl_hash_burst(guint64 lastreset) {
+// Returns the allowed burst, or 0 on cancellation. The burst is shared among
+// all hash threads, so the hash_rate limit applies to all of them combined.
+static int fl_hash_burst(fl_hash_t *args) {
   int b = 0;
   g_mutex_lock(fl_hash_resetlock);
-  while(fl_hash_reset == lastreset && (b = ratecalc_burst(&fl_hash_rate)) <= 0) {
+  while(!args->cancel && (b = ratecalc_burst(&fl_hash_rate)) <= 0) {
     GTimeVal end;
     g_get_current_time(&end);
-    g_time_val_add(&end, 100*1000); // Wake up every 100ms.
+    g_time_val_add(&end, RATECALC_TICK*1000); // Wake up on every allocation.
     g_cond_timed_wait(fl_hash_resetcond, fl_hash_resetlock, &end);
   }
+  if(args->cancel)
+    b = 0;
   g_mutex_unlock(fl_hash_resetlock);
   return b;
 }
@@ -516,12 +1497,89 @@ static int fl_hash_burst(guint64 lastreset) {
 
 static gboolean fl_hash_done(gpointer dat);
 
+
+// Current window of a file being read with mmap().
+typedef struct fl_hash_map_t {
+  char *base;
+  guint64 off;
+  size_t len;
+} fl_hash_map_t;
+
+
+// Alternative to read() for the hash thread. Files are mapped in windows of
+// TTH_MMAPSIZE bytes, which are unmapped (and dropped from the page cache, if
+// VAR_FFC_HASH is set) once they have been fully processed. Sets *buf to the
+// data at pos and returns the number of bytes available (at most max), 0 once
+// the end of the file has been reached or the file has been modified, or -1
+// on error.
+// A file that is truncated while one of its windows is mapped causes a
+// SIGBUS when the hasher touches the pages past the new end of the file, so
+// the mapped data is only accessed through fl_hash_mmap_update().
+static int fl_hash_mmap_read(int fd, fl_hash_map_t *m, fadv_t *adv, guint64 pos, guint64 filesize, int max, char **buf) {
+  if(m->base && pos >= m->off + m->len) {
+    munmap(m->base, m->len);
+    fadv_purge(adv, m->len);
+    m->base = NULL;
+  }
+  if(!m->base) {
+    struct stat st;
+    if(pos >= filesize)
+      return 0;
+    if(fstat(fd, &st) < 0)
+      return -1;
+    if((guint64)st.st_size != filesize)
+      return 0;
+    m->off = pos;
+    m->len = MIN(TTH_MMAPSIZE, filesize - pos);
+    m->base = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, m->off);
+    if(m->base == MAP_FAILED) {
+      m->base = NULL;
+      return -1;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(m->base, m->len, MADV_SEQUENTIAL);
+#endif
+  }
+  *buf = m->base + (pos - m->off);
+  return MIN((guint64)max, m->off + m->len - pos);
+}
+
+
+// Where the SIGBUS handler jumps to, if the current thread is hashing mapped
+// data.
+static __thread sigjmp_buf *fl_hash_sigbus_jmp = NULL;
+
+
+static void fl_hash_sigbus(int sig) {
+  if(fl_hash_sigbus_jmp)
+    siglongjmp(*fl_hash_sigbus_jmp, 1);
+  // Not caused by the hasher, let the faulting instruction raise it again
+  // with the default action.
+  signal(SIGBUS, SIG_DFL);
+}
+
+
+// tth_update() on mapped data. Returns FALSE if the data could not be read
+// because the file has been truncated.
+static gboolean fl_hash_mmap_update(tth_ctx_t *tth, const char *buf, int len) {
+  sigjmp_buf jmp;
+  if(sigsetjmp(jmp, 1)) {
+    fl_hash_sigbus_jmp = NULL;
+    return FALSE;
+  }
+  fl_hash_sigbus_jmp = &jmp;
+  tth_update(tth, buf, len);
+  fl_hash_sigbus_jmp = NULL;
+  return TRUE;
+}
+
+
 static void fl_hash_thread(gpointer data, gpointer udata) {
   fl_hash_t *args = data;
-  // static, since only one hash thread is allowed and this saves stack space
   tth_ctx_t tth;
-  char *buf = g_malloc(TTH_BUFSIZE);
+  char *buf = args->usemmap ? NULL : g_malloc(TTH_BUFSIZE);
   char *blocks = NULL;
+  fl_hash_map_t map = {};
   int f = -1;
   char *real = NULL;
 
@@ -557,12 +1615,16 @@ static void fl_hash_thread(gpointer data, gpointer udata) {
   guint64 rd = 0;
   int block_cur = 0;
   guint64 block_len = 0;
+  char *b;
 
-  if((nr = fl_hash_burst(args->lastreset)) <= 0)
+  if((nr = fl_hash_burst(args)) <= 0)
     goto finish;
-  while((r = read(f, buf, MIN(nr, TTH_BUFSIZE))) > 0) {
+  while((r = args->usemmap
+      ? fl_hash_mmap_read(f, &map, &adv, rd, args->filesize, nr, &b)
+      : read(f, (b = buf), MIN(nr, TTH_BUFSIZE))) > 0) {
     rd += r;
-    fadv_purge(&adv, r);
+    if(!args->usemmap)
+      fadv_purge(&adv, r);
     // file has been modified. time to back out
     if(rd > args->filesize) {
       g_set_error_literal(&args->err, 1, 0, "File has been modified.");
@@ -570,10 +1632,14 @@ static void fl_hash_thread(gpointer data, gpointer udata) {
     }
     ratecalc_add(&fl_hash_rate, r);
     // and hash
-    char *b = buf;
     while(r > 0) {
       int w = MIN(r, blocksize-block_len);
-      tth_update(&tth, b, w);
+      if(!args->usemmap)
+        tth_update(&tth, b, w);
+      else if(!fl_hash_mmap_update(&tth, b, w)) {
+        g_set_error_literal(&args->err, 1, 0, "File has been modified.");
+        goto finish;
+      }
       block_len += w;
       b += w;
       r -= w;
@@ -584,7 +1650,7 @@ static void fl_hash_thread(gpointer data, gpointer udata) {
         block_len = 0;
       }
     }
-    if((nr = fl_hash_burst(args->lastreset)) <= 0)
+    if((nr = fl_hash_burst(args)) <= 0)
       goto finish;
   }
   if(r < 0) {
@@ -610,6 +1676,10 @@ static void fl_hash_thread(gpointer data, gpointer udata) {
     g_set_error_literal(&args->err, 1, 0, "Error saving hash data to the database.");
 
 finish:
+  if(map.base) {
+    munmap(map.base, map.len);
+    fadv_purge(&adv, map.len);
+  }
   if(f > 0) {
     fadv_close(&adv);
     close(f);
@@ -623,6 +1693,8 @@ finish:
 }
 
 
+// Starts hashing files on any idle devices, as long as the number of active
+// hash threads is below the configured maximum.
 static void fl_hash_process() {
   if(!g_hash_table_size(fl_hash_queue)) {
     ratecalc_unregister(&fl_hash_rate);
@@ -630,26 +1702,47 @@ static void fl_hash_process() {
     var_set_bool(0, VAR_fl_done, TRUE);
     return;
   }
-  var_set_bool(0, VAR_fl_done, FALSE);
-  ratecalc_register(&fl_hash_rate, RCC_HASH);
 
-  // get one item from fl_hash_queue
-  GHashTableIter iter;
-  fl_list_t *file;
-  g_hash_table_iter_init(&iter, fl_hash_queue);
-  g_hash_table_iter_next(&iter, (gpointer *)&file, NULL);
-  fl_hash_cur = file;
-
-  // pass stuff to the hash thread
-  fl_hash_t *args = g_new0(fl_hash_t, 1);
-  args->file = file;
-  char *tmp = fl_local_path(file);
-  args->path = g_filename_from_utf8(tmp, -1, NULL, NULL, NULL);
-  g_free(tmp);
-  args->filesize = file->size;
-  args->lastreset = fl_hash_reset;
-  g_message("Start hashing %s", args->path);
-  g_thread_pool_push(fl_hash_pool, args, NULL);
+  int max = var_get_int(0, VAR_hash_threads);
+  GSList *n;
+  for(n=fl_hash_devs; n && fl_hash_active < max; n=n->next) {
+    fl_hash_dev_t *dev = n->data;
+    if(dev->cur || !g_hash_table_size(dev->files))
+      continue;
+
+    var_set_bool(0, VAR_fl_done, FALSE);
+    ratecalc_register(&fl_hash_rate, RCC_HASH);
+
+    // get one item from this device
+    GHashTableIter iter;
+    fl_list_t *file;
+    g_hash_table_iter_init(&iter, dev->files);
+    g_hash_table_iter_next(&iter, (gpointer *)&file, NULL);
+
+    // pass stuff to the hash thread
+    fl_hash_t *args = g_new0(fl_hash_t, 1);
+    args->file = file;
+    args->dev = dev;
+    char *tmp = fl_local_path(file);
+    args->path = g_filename_from_utf8(tmp, -1, NULL, NULL, NULL);
+    g_free(tmp);
+    args->filesize = file->size;
+    args->usemmap = var_get_bool(0, VAR_hash_mmap);
+    dev->cur = args;
+    fl_hash_active++;
+    g_message("Start hashing %s", args->path);
+    g_thread_pool_push(fl_hash_pool, args, NULL);
+  }
+}
+
+
+// Called when the hash_threads setting has been changed.
+void fl_hash_setthreads() {
+  if(!fl_hash_pool)
+    return;
+  g_thread_pool_set_max_threads(fl_hash_pool, var_get_int(0, VAR_hash_threads), NULL);
+  if(g_hash_table_size(fl_hash_queue))
+    fl_hash_process();
 }
 
 
@@ -657,11 +1750,17 @@ static gboolean fl_hash_done(gpointer dat) {
   fl_hash_t *args = dat;
   fl_list_t *fl = args->file;
 
-  // remove file from queue, ignore this hash if the file was already removed
-  // by some other process.
-  if(!g_hash_table_remove(fl_hash_queue, fl))
+  args->dev->cur = NULL;
+  fl_hash_active--;
+
+  // Ignore this hash if the file has been removed from the queue by some other
+  // process. (It may have been re-added in the mean time, in which case it
+  // will simply be hashed again)
+  if(args->cancel)
     goto fl_hash_done_f;
 
+  g_hash_table_remove(fl_hash_queue, fl);
+  g_hash_table_remove(args->dev->files, fl);
   fl_hash_queue_size -= fl->size;
 
   if(args->err) {
@@ -669,13 +1768,18 @@ static gboolean fl_hash_done(gpointer dat) {
     goto fl_hash_done_f;
   }
   g_message("Completed hashing %s in %.2fs", args->path, args->time);
+  if(args->time > 0)
+    hist_add(&fl_stats_hash, args->filesize / args->time / 1024);
 
   // update file and hash info
+  fl_local_wrlock();
   memcpy(fl->tth, args->root, 24);
   fl->hastth = 1;
   fl_list_getlocal(fl).lastmod = args->lastmod;
   fl_list_getlocal(fl).id = args->id;
   fl_hashindex_insert(fl);
+  fl_local_wrunlock();
+  fl_partial_invalidate(fl->parent, FALSE);
   fl_needflush = TRUE;
 
 fl_hash_done_f:
@@ -683,7 +1787,7 @@ fl_hash_done_f:
     g_error_free(args->err);
   g_free(args->path);
   g_free(args);
-  // Hash next file in the queue
+  // Hash next file(s) in the queue
   fl_hash_process();
   return FALSE;
 }
@@ -692,11 +1796,25 @@ fl_hash_done_f:
 
 
 
+// Writes the search and hashing statistics to *out, for display to the user.
+void fl_stats(GString *out) {
+  hist_format(&fl_stats_search, out, "Search time", "us");
+  hist_format(&fl_stats_results, out, "Search results", "");
+  hist_format(&fl_stats_hash, out, "Hash speed per file", " KiB/s");
+  g_string_append_printf(out, "Hashing: %d files active, %.2f MiB/s\n",
+    fl_hash_active, ((float)ratecalc_rate(&fl_hash_rate))/(1024.0f*1024.0f));
+}
+
+
+
+
+
 // Refresh filelist & (un)share directories
 
 
 // get or create a root directory
 static fl_list_t *fl_refresh_getroot(const char *name) {
+  fl_local_wrlock();
   // no root? create!
   if(!fl_local_list) {
     fl_local_list = fl_list_create("", FALSE);
@@ -709,7 +1827,10 @@ static fl_list_t *fl_refresh_getroot(const char *name) {
     cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
     fl_list_add(fl_local_list, cur, -1);
     fl_list_sort(fl_local_list);
+    fl_nameindex_insert(cur);
+    fl_partial_invalidate(fl_local_list, FALSE);
   }
+  fl_local_wrunlock();
   return cur;
 }
 
@@ -789,6 +1910,7 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
 
     // remove
     if(remove) {
+      fl_nameindex_remove(oldl);
       fl_refresh_delhash(oldl);
       fl_list_remove(oldl);
       // don't modify oldi, after deletion it will automatically point to the next item in the list
@@ -799,6 +1921,7 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
       fl_list_t *tmp = fl_list_copy(newl);
       fl_list_add(old, tmp, oldi);
       fl_refresh_addhash(tmp);
+      fl_nameindex_insert(tmp);
       oldi++; // after fl_list_add(), oldi points to the new item. But we don't have to check that one again, so increase.
       newi++;
     }
@@ -879,10 +2002,14 @@ static gboolean fl_refresh_scanned(gpointer dat) {
   fl_scan_t *args = dat;
 
   int i, len = g_strv_length(args->path);
+  fl_local_wrlock();
   for(i=0; i<len; i++) {
     fl_refresh_compare(args->file[i], args->res[i]);
-    fl_list_free(args->res[i]);
+    fl_partial_invalidate(args->file[i], TRUE);
   }
+  fl_local_wrunlock();
+  for(i=0; i<len; i++)
+    fl_list_free(args->res[i]);
 
   // If the hash queue is empty after calling fl_refresh_compare() then it
   // means the file list is completely hashed.
@@ -942,19 +2069,25 @@ void fl_share(const char *dir) {
 // when a currently-being-hashed file is removed due to the directory not being
 // present in the config file anymore).
 void fl_unshare(const char *dir) {
+  fl_list_t *fl = dir ? fl_list_file(fl_local_list, dir) : NULL;
+  g_return_if_fail(!dir || fl);
+  fl_local_wrlock();
   if(dir) {
-    fl_list_t *fl = fl_list_file(fl_local_list, dir);
-    g_return_if_fail(fl);
+    fl_nameindex_remove(fl);
     fl_hash_queue_delrec(fl);
     fl_refresh_delhash(fl);
     fl_list_remove(fl);
   } else if(fl_local_list) {
+    fl_nameindex_clear();
     fl_hash_queue_delrec(fl_local_list);
     fl_refresh_delhash(fl_local_list);
     fl_list_free(fl_local_list);
     fl_local_list = fl_list_create("", FALSE);
     fl_local_list->sub = g_ptr_array_new_with_free_func(fl_list_free);
   }
+  if(fl_local_list)
+    fl_partial_invalidate(fl_local_list, TRUE);
+  fl_local_wrunlock();
   // force a refresh, people may be in a hurry with removing stuff
   fl_needflush = TRUE;
   fl_flush(NULL);
@@ -997,15 +2130,25 @@ void fl_init() {
   // init stuff
   fl_local_list = NULL;
   fl_local_list_file = g_build_filename(db_dir, "files.xml.bz2", NULL);
+  fl_local_snap_file = g_build_filename(db_dir, "files.snap", NULL);
   fl_refresh_queue = g_queue_new();
   fl_scan_pool = g_thread_pool_new(fl_scan_thread, NULL, 1, FALSE, NULL);
-  fl_hash_pool = g_thread_pool_new(fl_hash_thread, NULL, 1, FALSE, NULL);
+  fl_scan_dirpool = g_thread_pool_new(fl_scan_dir, NULL, FL_SCAN_THREADS, FALSE, NULL);
+  fl_hash_pool = g_thread_pool_new(fl_hash_thread, NULL, var_get_int(0, VAR_hash_threads), FALSE, NULL);
+  fl_search_pool = g_thread_pool_new(fl_search_thread, NULL, 1, FALSE, NULL);
   fl_hash_resetlock = g_mutex_new();
   fl_hash_resetcond = g_cond_new();
+
+  // See fl_hash_mmap_update()
+  struct sigaction act;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = 0;
+  act.sa_handler = fl_hash_sigbus;
+  if(sigaction(SIGBUS, &act, NULL) < 0)
+    g_warning("Can't setup SIGBUS: %s", g_strerror(errno));
   fl_hash_queue = g_hash_table_new(g_direct_hash, g_direct_equal);
-  // Even though the keys are the tth roots, we can just use g_int_hash. The
-  // first four bytes provide enough unique data anyway.
-  fl_hash_index = g_hash_table_new(g_int_hash, tiger_hash_equal);
+  fl_hash_devcache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  tthidx_init(&fl_hash_index, G_STRUCT_OFFSET(fl_list_t, tth));
   ratecalc_init(&fl_hash_rate);
 
   // flush unsaved data to disk every 60 seconds
@@ -1024,8 +2167,18 @@ void fl_init() {
   // check whether something is shared
   gboolean sharing = db_share_list()->name ? TRUE : FALSE;
 
-  // load our files.xml.bz2
-  fl_local_list = sharing ? fl_load(fl_local_list_file, &err, TRUE) : NULL;
+  // load our files.xml.bz2, or preferably the snapshot of it
+  struct stat st;
+  if(sharing && stat(fl_local_list_file, &st) == 0) {
+    fl_local_list = fl_load_snapshot(fl_local_snap_file, &st, &err);
+    if(!fl_local_list) {
+      g_debug("fl: Not using file list snapshot: %s", err->message);
+      g_clear_error(&err);
+      fl_needsnap = TRUE;
+    }
+  }
+  if(sharing && !fl_local_list)
+    fl_local_list = fl_load(fl_local_list_file, &err, TRUE);
   if(sharing && !fl_local_list) {
     ui_mf(uit_main_tab, UIP_MED, "Error loading local filelist: %s. Re-building list.", err->message);
     g_error_free(err);
@@ -1052,6 +2205,11 @@ void fl_init() {
   // Initialize the fl_hash_index
   if(fl_local_list)
     fl_init_list(fl_local_list);
+  fl_local_wrlock();
+  fl_nameindex_clear();
+  if(fl_local_list)
+    fl_nameindex_insert(fl_local_list);
+  fl_local_wrunlock();
 
   // reset loading indicator
   if(!fl_local_list || !dorefresh)
@@ -1059,6 +2217,7 @@ void fl_init() {
 
   if(dorefresh || var_get_int(0, VAR_autorefresh))
     fl_refresh(NULL);
+  fl_watch_setup();
 }
 
 
@@ -1098,6 +2257,11 @@ static void fl_gc_id(gint64 id) {
 }
 
 
+static void fl_gc_addid(gpointer fl, gpointer dat) {
+  g_array_append_val(fl_gc_active, fl_list_getlocal((fl_list_t *)fl).id);
+}
+
+
 // Returns TRUE when it has done garbage collection, FALSE if it's not possible
 // to create a list of `active' ids because no full file refresh has been
 // performed yet.
@@ -1106,18 +2270,13 @@ gboolean fl_gc() {
     return FALSE;
 
   // Init data
-  fl_gc_active = g_array_sized_new(FALSE, FALSE, 8, g_hash_table_size(fl_hash_index));
+  fl_gc_active = g_array_sized_new(FALSE, FALSE, 8, fl_hash_index.items);
   fl_gc_remove = g_array_new(FALSE, FALSE, 8);
   fl_gc_last = 0;
 
   // Fill fl_active array.  It is possible that two identical ids are added to
   // the array, but this isn't a problem.
-  GSList *l;
-  GHashTableIter iter;
-  g_hash_table_iter_init(&iter, fl_hash_index);
-  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&l))
-    for(; l; l=l->next)
-      g_array_append_val(fl_gc_active, fl_list_getlocal((fl_list_t *)l->data).id);
+  tthidx_foreach(&fl_hash_index, fl_gc_addid, NULL);
   g_array_sort(fl_gc_active, fl_gc_idcmp);
 
   // walk through hashfiles table and fill fl_gc_remove
@@ -66,6 +66,30 @@
  */
 
 
+/* Incremental bzip2 output:
+ *
+ * Compressing a large file list with bzip2 takes several seconds, and the
+ * local list is saved every time something has changed. Usually only a small
+ * part of the list is different from the previous save, so the FO_FI output
+ * mode avoids compressing the same data over and over again.
+ *
+ * The XML output is cut into chunks at line boundaries. A chunk ends at a line
+ * whose hash matches FI_BOUNDARY once the chunk is at least FI_CHUNKMIN bytes,
+ * or before it would grow beyond FI_CHUNKMAX bytes. Since the cut points
+ * depend on the content rather than on the offset, a change somewhere in the
+ * list only affects the chunk(s) around it.
+ *
+ * Each chunk is small enough to always fit in a single bzip2 block. Chunks are
+ * compressed separately, after which the block is taken out of its stream and
+ * appended to the output file at the bit level. The stream CRC of the final
+ * file is calculated from the block CRCs. The result is a regular
+ * single-stream bzip2 file. For every chunk we remember the SHA-1 of its
+ * uncompressed contents and the position of its block in the output file, so
+ * that on the next save any unchanged chunk is simply copied from the old
+ * file.
+ */
+
+
 // This isn't a strict maximum, may be exceeded by a single <File> or <Directory> entry.
 #define BUFSIZE (64*1024 - 1024)
 // Minimum output buffer size to give to zlib's deflate() function.
@@ -81,6 +105,28 @@
 #define FO_FB 1 // Write to file (bzip2)
 #define FO_MU 2 // Write to memory (uncompressed)
 #define FO_MZ 3 // Write to memory (zlib)
+#define FO_FI 4 // Write to file (incremental bzip2)
+
+// Incremental bzip2 settings. The block size for level 7 is 699981 bytes after
+// the initial run-length encoding, which may expand the input by up to 25%.
+// FI_CHUNKMAX must stay below that.
+#define FI_LEVEL 7
+#define FI_CHUNKMIN (256*1024)
+#define FI_CHUNKMAX (512*1024)
+#define FI_BOUNDARY 1023
+
+
+typedef struct fi_chunk_t {
+  guint64 bitoff; // Offset of the block in the file
+  guint32 nbits;  // Length of the block
+  guint32 crc;    // Block CRC
+} fi_chunk_t;
+
+
+// The chunks of the last file written in FO_FI mode
+static char       *fi_file = NULL;
+static struct stat fi_st;
+static GHashTable *fi_chunks = NULL; // SHA-1 digest -> fi_chunk_t
 
 
 typedef struct ctx_t {
@@ -94,9 +140,205 @@ typedef struct ctx_t {
   const char *file; // F0_F* - Filename (ownership is of the caller)
   char *tmpfile;    // F0_F* - Temp filename (ownership is ours)
   GError *err;
+  // F0_FI
+  GString *chunk;   // Current chunk
+  GString *out;     // Output buffer
+  GHashTable *newchunks;
+  int oldfd;        // Previous file, -1 if its chunks can't be used
+  guint64 bitpos;   // Number of bits written
+  guint64 acc;      // Bits that have not been written to out yet
+  int nacc;
+  guint32 crc;      // Stream CRC
 } ctx_t;
 
 
+
+
+// Functions for the incremental bzip2 mode
+
+static guint fi_hash(gconstpointer a) {
+  guint h;
+  memcpy(&h, a, sizeof(guint));
+  return h;
+}
+
+
+static gboolean fi_equal(gconstpointer a, gconstpointer b) {
+  return memcmp(a, b, 20) == 0;
+}
+
+
+static void fi_chunk_free(gpointer dat) {
+  g_slice_free(fi_chunk_t, dat);
+}
+
+
+// Append n (<= 32) bits to the output
+static void fi_putbits(ctx_t *x, guint32 v, int n) {
+  x->acc = (x->acc << n) | (v & (guint32)((G_GUINT64_CONSTANT(1) << n) - 1));
+  x->nacc += n;
+  x->bitpos += n;
+  while(x->nacc >= 8) {
+    x->nacc -= 8;
+    g_string_append_c(x->out, (x->acc >> x->nacc) & 0xff);
+  }
+}
+
+
+// Returns n (<= 56) bits at bit offset b of buf
+static guint64 fi_getbits(const guchar *buf, guint64 b, int n) {
+  guint64 v = 0;
+  for(; n>0; n--, b++)
+    v = (v << 1) | ((buf[b>>3] >> (7-(b&7))) & 1);
+  return v;
+}
+
+
+// Append n bits from buf, starting at bit offset b (< 8)
+static void fi_copybits(ctx_t *x, const guchar *buf, int b, guint64 n) {
+  for(; n && b; n--, b = (b+1) & 7, buf += !b)
+    fi_putbits(x, (*buf >> (7-b)) & 1, 1);
+  for(; n >= 32; n -= 32, buf += 4)
+    fi_putbits(x, ((guint32)buf[0] << 24) | ((guint32)buf[1] << 16) | ((guint32)buf[2] << 8) | buf[3], 32);
+  for(; n >= 8; n -= 8, buf++)
+    fi_putbits(x, *buf, 8);
+  if(n)
+    fi_putbits(x, *buf >> (8-n), n);
+}
+
+
+static int fi_write(ctx_t *x) {
+  if(fwrite(x->out->str, 1, x->out->len, x->fh_f) != x->out->len) {
+    g_set_error(&x->err, 1, 0, "Write error: %s", g_strerror(errno));
+    return -1;
+  }
+  g_string_truncate(x->out, 0);
+  return 0;
+}
+
+
+// Copies the block of a chunk from the previous file. Returns FALSE if that
+// failed, in which case the chunk should be compressed again.
+static gboolean fi_reuse(ctx_t *x, fi_chunk_t *c) {
+  guint64 start = c->bitoff >> 3;
+  int len = ((c->bitoff + c->nbits + 7) >> 3) - start;
+  guchar *buf = g_malloc(len);
+  gboolean r = pread(x->oldfd, buf, len, start) == len;
+  if(r)
+    fi_copybits(x, buf, c->bitoff & 7, c->nbits);
+  g_free(buf);
+  return r;
+}
+
+
+// Compresses a chunk and appends its block to the output.
+static int fi_compress(ctx_t *x, fi_chunk_t *c) {
+  unsigned int len = x->chunk->len + x->chunk->len/100 + 601;
+  guchar *buf = g_malloc(len);
+  int r = BZ2_bzBuffToBuffCompress((char *)buf, &len, x->chunk->str, x->chunk->len, FI_LEVEL, 0, 0);
+  if(r != BZ_OK) {
+    g_set_error(&x->err, 1, 0, "bzip2 compression error (%d)", r);
+    g_free(buf);
+    return -1;
+  }
+
+  // The stream consists of a 4-byte header, a single block starting with a
+  // 48-bit magic and the 32-bit block CRC, and the 48-bit end-of-stream magic
+  // followed by the stream CRC and 0-7 bits of padding. With only one block,
+  // the stream CRC equals the block CRC.
+  guint64 end = 0;
+  if(len > 14 && memcmp(buf, "BZh", 3) == 0 && fi_getbits(buf, 32, 48) == G_GUINT64_CONSTANT(0x314159265359)) {
+    c->crc = fi_getbits(buf, 80, 32);
+    int pad;
+    for(pad=0; pad<8 && !end; pad++) {
+      guint64 pos = (guint64)len*8 - 80 - pad;
+      if(fi_getbits(buf, pos, 48) == G_GUINT64_CONSTANT(0x177245385090) && fi_getbits(buf, pos+48, 32) == c->crc)
+        end = pos;
+    }
+  }
+  if(!end) {
+    g_set_error_literal(&x->err, 1, 0, "Unexpected bzip2 output");
+    g_free(buf);
+    return -1;
+  }
+
+  c->nbits = end - 32;
+  fi_copybits(x, buf+4, 0, c->nbits);
+  g_free(buf);
+  return 0;
+}
+
+
+// Writes the current chunk to the output
+static int fi_chunk(ctx_t *x) {
+  if(!x->chunk->len)
+    return 0;
+
+  guint8 digest[20];
+  gsize digestlen = 20;
+  GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA1);
+  g_checksum_update(sum, (guchar *)x->chunk->str, x->chunk->len);
+  g_checksum_get_digest(sum, digest, &digestlen);
+  g_checksum_free(sum);
+
+  fi_chunk_t *old = x->oldfd >= 0 ? g_hash_table_lookup(fi_chunks, digest) : NULL;
+  fi_chunk_t *c = g_slice_new(fi_chunk_t);
+  c->bitoff = x->bitpos;
+  if(old && fi_reuse(x, old)) {
+    c->nbits = old->nbits;
+    c->crc = old->crc;
+  } else if(fi_compress(x, c)) {
+    g_slice_free(fi_chunk_t, c);
+    return -1;
+  }
+  g_hash_table_replace(x->newchunks, g_memdup(digest, 20), c);
+
+  x->crc = ((x->crc << 1) | (x->crc >> 31)) ^ c->crc;
+  g_string_truncate(x->chunk, 0);
+  return x->out->len >= BUFSIZE ? fi_write(x) : 0;
+}
+
+
+static guint32 fi_linehash(const char *s, int len) {
+  guint32 h = 2166136261U;
+  for(; len>0; len--, s++)
+    h = (h ^ (guchar)*s) * 16777619;
+  return h;
+}
+
+
+// Splits the buffer into chunks. Incomplete lines are kept in the buffer,
+// unless force is set.
+static int fi_flush(ctx_t *x, gboolean force) {
+  char *s = x->buf->str, *end = x->buf->str + x->buf->len;
+  while(s < end) {
+    char *nl = memchr(s, '\n', end-s);
+    if(!nl && !force)
+      break;
+    int len = nl ? nl-s+1 : end-s;
+    if(x->chunk->len + len > FI_CHUNKMAX && fi_chunk(x))
+      return -1;
+    g_string_append_len(x->chunk, s, len);
+    if(x->chunk->len >= FI_CHUNKMIN && !(fi_linehash(s, len) & FI_BOUNDARY) && fi_chunk(x))
+      return -1;
+    s += len;
+  }
+  g_string_erase(x->buf, 0, s - x->buf->str);
+
+  if(force) {
+    if(fi_chunk(x))
+      return -1;
+    fi_putbits(x, 0x177245, 24);
+    fi_putbits(x, 0x385090, 24);
+    fi_putbits(x, x->crc, 32);
+    if(x->nacc)
+      fi_putbits(x, 0, 8-x->nacc);
+    return fi_write(x);
+  }
+  return 0;
+}
+
+
 // Flushes the write buffer to the underlying bzip2/zlib/file object (if any).
 static int doflush(ctx_t *x, gboolean force) {
   switch(x->conf) {
@@ -146,6 +388,9 @@ static int doflush(ctx_t *x, gboolean force) {
   case FO_MU:
     // Nothing to do here, x->buf is already our destiniation.
     break;
+
+  case FO_FI:
+    return fi_flush(x, force);
   }
 
   return 0;
@@ -283,6 +528,7 @@ static int at(ctx_t *x, fl_list_t *fl, const char *cid, int targetsize) {
 
 static int ctx_open(ctx_t *x, int conf, const char *file, GString *buf) {
   memset(x, 0, sizeof(ctx_t));
+  x->oldfd = -1;
   x->file = file;
   x->conf = conf;
 
@@ -308,7 +554,7 @@ static int ctx_open(ctx_t *x, int conf, const char *file, GString *buf) {
   }
 
   // open file
-  if(x->conf == FO_FB || x->conf == FO_FU) {
+  if(x->conf == FO_FB || x->conf == FO_FU || x->conf == FO_FI) {
     x->tmpfile = g_strdup_printf("%s.tmp-%d", file, rand());
     x->fh_f = fopen(x->tmpfile, "w");
     if(!x->fh_f) {
@@ -327,6 +573,23 @@ static int ctx_open(ctx_t *x, int conf, const char *file, GString *buf) {
     }
   }
 
+  // incremental bzip2, see if the chunks of the previous file can be used
+  if(x->conf == FO_FI) {
+    x->chunk = g_string_sized_new(FI_CHUNKMAX);
+    x->out = g_string_sized_new(BUFSIZE+FI_CHUNKMAX);
+    x->newchunks = g_hash_table_new_full(fi_hash, fi_equal, g_free, fi_chunk_free);
+    x->oldfd = fi_file && strcmp(fi_file, file) == 0 ? open(file, O_RDONLY) : -1;
+    struct stat st;
+    if(x->oldfd >= 0 && (fstat(x->oldfd, &st) < 0 || st.st_ino != fi_st.st_ino || st.st_size != fi_st.st_size || st.st_mtime != fi_st.st_mtime)) {
+      close(x->oldfd);
+      x->oldfd = -1;
+    }
+    fi_putbits(x, 'B', 8);
+    fi_putbits(x, 'Z', 8);
+    fi_putbits(x, 'h', 8);
+    fi_putbits(x, '0'+FI_LEVEL, 8);
+  }
+
   return 0;
 }
 
@@ -352,7 +615,7 @@ static void ctx_close(ctx_t *x) {
       g_set_error(&x->err, 1, 0, "Error closing bzip2 stream (%d): %s", bzerr, g_strerror(errno));
   }
 
-  if(x->conf == FO_FB || x->conf == FO_FU) {
+  if(x->conf == FO_FB || x->conf == FO_FU || x->conf == FO_FI) {
     if(x->fh_f && fclose(x->fh_f) && !x->err)
       g_set_error(&x->err, 1, 0, "Error closing file: %s", g_strerror(errno));
 
@@ -363,12 +626,32 @@ static void ctx_close(ctx_t *x) {
       unlink(x->tmpfile);
     g_free(x->tmpfile);
   }
+
+  // Remember the chunks of the new file. On error the old file is still
+  // there, so its chunks remain valid.
+  if(x->conf == FO_FI) {
+    if(x->oldfd >= 0)
+      close(x->oldfd);
+    if(!x->err && x->newchunks && stat(x->file, &fi_st) == 0) {
+      if(fi_chunks)
+        g_hash_table_unref(fi_chunks);
+      fi_chunks = x->newchunks;
+      g_free(fi_file);
+      fi_file = g_strdup(x->file);
+    } else if(x->newchunks)
+      g_hash_table_unref(x->newchunks);
+    if(x->chunk)
+      g_string_free(x->chunk, TRUE);
+    if(x->out)
+      g_string_free(x->out, TRUE);
+  }
 }
 
 
 // Serialize a file list to a string. Config is chosen from the arguments:
 //   FU: buf == NULL, file doesn't end with .bz2
-//   FB: buf == NULL, file ends with .bz2
+//   FB: buf == NULL, file ends with .bz2, targetsize != 0
+//   FI: buf == NULL, file ends with .bz2, targetsize == 0
 //   MU: buf != NULL, !zlib
 //   MZ: buf == NULL, zlib
 // Returns the uncompressed size of the list or 0 on error.
@@ -377,7 +660,8 @@ int fl_save(fl_list_t *fl, const char *cid, int targetsize, gboolean zlib, GStri
 
   ctx_t x;
   int conf = buf && zlib ? FO_MZ : buf ? FO_MU :
-    strlen(file) > 4 && strcmp(file+(strlen(file)-4), ".bz2") == 0 ? FO_FB : FO_FU;
+    strlen(file) <= 4 || strcmp(file+(strlen(file)-4), ".bz2") != 0 ? FO_FU :
+    targetsize ? FO_FB : FO_FI;
   if(ctx_open(&x, conf, file, buf) == 0)
     at(&x, fl, cid, targetsize);
   ctx_close(&x);
@@ -387,3 +671,133 @@ int fl_save(fl_list_t *fl, const char *cid, int targetsize, gboolean zlib, GStri
   return x.err ? 0 : x.size;
 }
 
+
+
+
+
+// Binary snapshot of the local file list. This is written next to our
+// files.xml.bz2 and is a lot faster to load at startup, since it doesn't need
+// decompression or XML parsing. The format is architecture-dependent and only
+// meant as a local cache, the file list itself remains the authoritative copy.
+// The snapshot stores the same items as fl_save() does, in the same order,
+// plus the fl_list_local_t info of each file.
+//
+// Format: fl_snap_head_t followed by the items in the root directory in
+// pre-order. Each item starts with an fl_snap_item_t, files are followed by an
+// fl_snap_file_t, and then comes the zero-terminated name, padded to 8 bytes.
+
+#if INTERFACE
+
+#define FL_SNAP_MAGIC "ncdcsnap"
+#define FL_SNAP_VERSION 1
+
+typedef struct {
+  char magic[8];
+  guint32 version;
+  guint32 itemsize;  // sizeof(fl_snap_item_t) + sizeof(fl_snap_file_t), for sanity checking
+  guint64 items;     // total number of items
+  // size and mtime of the files.xml.bz2 this snapshot corresponds with
+  guint64 xmlsize;
+  gint64 xmlmtime;
+  guint32 sub;       // number of items in the root directory
+  guint32 pad;
+} fl_snap_head_t;
+
+typedef struct {
+  guint32 sub;     // number of items in this directory
+  guint16 namelen;
+  guint8 isfile;
+  guint8 pad;
+} fl_snap_item_t;
+
+typedef struct {
+  guint64 size;
+  char tth[24];
+  gint64 lastmod;
+  gint64 id;
+} fl_snap_file_t;
+
+#endif
+
+
+static void fl_snap_count(fl_list_t *fl, guint32 *n) {
+  int i;
+  *n = 0;
+  for(i=0; i<fl->sub->len; i++) {
+    fl_list_t *cur = g_ptr_array_index(fl->sub, i);
+    if(cur->isfile ? cur->hastth : !fl_list_isempty(cur))
+      (*n)++;
+  }
+}
+
+
+static gboolean fl_snap_write(FILE *f, fl_list_t *fl, guint64 *items) {
+  static const char pad[8] = {};
+  int i;
+  for(i=0; i<fl->sub->len; i++) {
+    fl_list_t *cur = g_ptr_array_index(fl->sub, i);
+    if(cur->isfile ? !cur->hastth : fl_list_isempty(cur))
+      continue;
+    fl_snap_item_t it = {};
+    it.namelen = strlen(cur->name);
+    it.isfile = cur->isfile;
+    if(!cur->isfile)
+      fl_snap_count(cur, &it.sub);
+    if(fwrite(&it, sizeof(it), 1, f) != 1)
+      return FALSE;
+    if(cur->isfile) {
+      fl_snap_file_t fi = {};
+      fi.size = cur->size;
+      memcpy(fi.tth, cur->tth, 24);
+      fi.lastmod = fl_list_getlocal(cur).lastmod;
+      fi.id = fl_list_getlocal(cur).id;
+      if(fwrite(&fi, sizeof(fi), 1, f) != 1)
+        return FALSE;
+    }
+    int len = it.namelen+1;
+    if(fwrite(cur->name, len, 1, f) != 1 || ((len & 7) && fwrite(pad, 8-(len & 7), 1, f) != 1))
+      return FALSE;
+    (*items)++;
+    if(!cur->isfile && !fl_snap_write(f, cur, items))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+
+// Writes a snapshot of the local file list. *xml is the stat() result of the
+// files.xml.bz2 that has been written from the same list.
+gboolean fl_save_snapshot(fl_list_t *root, const struct stat *xml, const char *file, GError **err) {
+  char *tmpfile = g_strdup_printf("%s.tmp-%d", file, rand());
+  FILE *f = fopen(tmpfile, "w");
+  if(!f) {
+    g_set_error_literal(err, 1, 0, g_strerror(errno));
+    g_free(tmpfile);
+    return FALSE;
+  }
+  setvbuf(f, NULL, _IOFBF, 1024*1024);
+
+  fl_snap_head_t h = {};
+  memcpy(h.magic, FL_SNAP_MAGIC, 8);
+  h.version = FL_SNAP_VERSION;
+  h.itemsize = sizeof(fl_snap_item_t) + sizeof(fl_snap_file_t);
+  h.xmlsize = xml->st_size;
+  h.xmlmtime = xml->st_mtime;
+  fl_snap_count(root, &h.sub);
+
+  // Write the header twice, the second time with the item count
+  gboolean ok = fwrite(&h, sizeof(h), 1, f) == 1
+    && fl_snap_write(f, root, &h.items)
+    && fseek(f, 0, SEEK_SET) == 0
+    && fwrite(&h, sizeof(h), 1, f) == 1;
+  if(fclose(f))
+    ok = FALSE;
+
+  if(!ok || rename(tmpfile, file) < 0) {
+    g_set_error_literal(err, 1, 0, g_strerror(errno));
+    unlink(tmpfile);
+    ok = FALSE;
+  }
+  g_free(tmpfile);
+  return ok;
+}
@@ -40,6 +40,8 @@ struct fl_list_t {
   gboolean isfile : 1;
   gboolean hastth : 1;  // only if isfile==TRUE
   gboolean islocal : 1; // only if isfile==TRUE
+  gboolean isarena : 1; // allocated from an fl_arena_t, see below
+  gboolean incomplete : 1; // only if isfile==FALSE, contents not known yet (partial lists)
   char name[1];
 };
 
@@ -80,14 +82,131 @@ struct fl_list_local_t {
 // Get the fl_list_local part of a fl_list struct.
 #define fl_list_getlocal(f) G_STRUCT_MEMBER(fl_list_local_t, f, fl_list_local_offset((f)->name))
 
+// Get the arena of the root of an arena-allocated list. Uses the same space as
+// the fl_list_local struct does for local files.
+#define fl_list_getarena(f) G_STRUCT_MEMBER(fl_arena_t *, f, fl_list_local_offset((f)->name))
+
+#endif
+
+
+
+
+// Arena allocation, used for file lists that are never modified and only
+// freed as a whole (i.e. the lists of other users). Items are allocated
+// back-to-back from large blocks, avoiding the per-allocation overhead, and
+// the sub arrays of directories are kept at their exact size. Such a list is
+// created with fl_list_create_arena_root(), and items with
+// fl_list_create_arena(). Calling fl_list_free() on the root frees the entire
+// list, calling it on any other item does nothing.
+// Since these lists are read-only, they can be shared: fl_list_ref() on the
+// root adds a reference, and the list is only freed when the last reference
+// is dropped with fl_list_free().
+
+#if INTERFACE
+
+struct fl_arena_t {
+  GSList *blocks;
+  char *ptr;
+  size_t left;
+  size_t bytes; // approximate memory use of the list
+  int ref;
+};
+
 #endif
 
+#define FL_ARENA_BLOCK (256*1024)
+
+
+static void *fl_arena_alloc(fl_arena_t *a, size_t size) {
+  size = (size + 7) & ~7;
+  if(size > a->left) {
+    a->left = MAX(FL_ARENA_BLOCK, size);
+    // g_malloc0() rather than g_malloc(), so that items don't have to be
+    // zero'd individually.
+    a->ptr = g_malloc0(a->left);
+    a->blocks = g_slist_prepend(a->blocks, a->ptr);
+    a->bytes += a->left;
+  }
+  void *r = a->ptr;
+  a->ptr += size;
+  a->left -= size;
+  return r;
+}
+
+
+fl_list_t *fl_list_create_arena_root() {
+  fl_arena_t *a = g_slice_new0(fl_arena_t);
+  a->ref = 1;
+  fl_list_t *fl = fl_arena_alloc(a, fl_list_local_offset("") + sizeof(fl_arena_t *));
+  fl->isarena = TRUE;
+  fl_list_getarena(fl) = a;
+  return fl;
+}
+
+
+fl_list_t *fl_list_create_arena(fl_list_t *root, const char *name, gboolean local) {
+  fl_list_t *fl = fl_arena_alloc(fl_list_getarena(root), fl_list_size(name, local));
+  strcpy(fl->name, name);
+  fl->islocal = local;
+  fl->isarena = TRUE;
+  return fl;
+}
+
+
+fl_list_t *fl_list_ref(fl_list_t *root) {
+  g_return_val_if_fail(root->isarena && !root->parent, root);
+  fl_list_getarena(root)->ref++;
+  return root;
+}
+
+
+// Replace the sub array of a directory with an exactly-sized copy. To be
+// called when all items have been added.
+void fl_list_arena_trim(fl_list_t *root, fl_list_t *fl) {
+  fl_list_getarena(root)->bytes += sizeof(GPtrArray) + fl->sub->len*sizeof(gpointer);
+  GPtrArray *n = g_ptr_array_sized_new(fl->sub->len);
+  g_ptr_array_set_size(n, fl->sub->len);
+  memcpy(n->pdata, fl->sub->pdata, fl->sub->len*sizeof(gpointer));
+  g_ptr_array_unref(fl->sub);
+  fl->sub = n;
+}
+
+
+static void fl_arena_free_subs(fl_list_t *fl) {
+  int i;
+  for(i=0; i<fl->sub->len; i++) {
+    fl_list_t *c = g_ptr_array_index(fl->sub, i);
+    if(c->sub)
+      fl_arena_free_subs(c);
+  }
+  g_ptr_array_unref(fl->sub);
+}
+
+
+static void fl_arena_free(fl_list_t *root) {
+  fl_arena_t *a = fl_list_getarena(root);
+  if(root->sub)
+    fl_arena_free_subs(root);
+  GSList *n;
+  for(n=a->blocks; n; n=n->next)
+    g_free(n->data);
+  g_slist_free(a->blocks);
+  g_slice_free(fl_arena_t, a);
+}
+
+
+
 
 // only frees the given item and its childs. leaves the parent(s) untouched
 void fl_list_free(gpointer dat) {
   fl_list_t *fl = dat;
   if(!fl)
     return;
+  if(fl->isarena) {
+    if(!fl->parent && !--fl_list_getarena(fl)->ref)
+      fl_arena_free(fl);
+    return;
+  }
   if(fl->sub)
     g_ptr_array_unref(fl->sub);
   g_slice_free1(fl_list_size(fl->name, fl->islocal), fl);
@@ -180,6 +299,7 @@ fl_list_t *fl_list_copy(const fl_list_t *fl) {
   fl_list_t *cur = g_slice_alloc(size);
   memcpy(cur, fl, size);
   cur->parent = NULL;
+  cur->isarena = FALSE;
   if(fl->sub) {
     cur->sub = g_ptr_array_sized_new(fl->sub->len);
     g_ptr_array_set_free_func(cur->sub, fl_list_free);
@@ -445,6 +565,29 @@ int fl_search_rec(fl_list_t *parent, fl_search_t *s, fl_list_t **res, int max) {
 }
 
 
+// Similar to fl_search_rec(), but also takes the names of the parents of
+// 'parent' into account.
+int fl_search_rec_full(fl_list_t *parent, fl_search_t *s, fl_list_t **res, int max) {
+  GRegex **oand = s->and;
+  int len = fl_search_and_len(s->and);
+  GRegex *nand[len+1];
+  fl_list_t *p;
+  int i, j = 0;
+  for(i=0; i<len; i++) {
+    for(p=parent->parent; p && p->parent; p=p->parent)
+      if(G_UNLIKELY(g_regex_match(oand[i], p->name, 0, NULL)))
+        break;
+    if(!p || !p->parent)
+      nand[j++] = oand[i];
+  }
+  nand[j] = NULL;
+  s->and = nand;
+  int r = fl_search_rec(parent, s, res, max);
+  s->and = oand;
+  return r;
+}
+
+
 // Similar to fl_search_match(), but also matches the name of the parents.
 gboolean fl_search_match_full(fl_list_t *fl, fl_search_t *s) {
   // weed out stuff from 'and' if it's already matched in any of its parents.
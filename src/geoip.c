@@ -29,6 +29,10 @@
 
 gboolean geoip_available = FALSE;
 
+// Incremented whenever a GeoIP database is (re)opened, to invalidate country
+// codes that have been cached elsewhere.
+int geoip_generation = 1;
+
 #ifdef USE_GEOIP
 static GeoIP *geoip4;
 static GeoIP *geoip6;
@@ -67,6 +71,7 @@ void geoip_reinit(int v) {
   }
 
   geoip_available = geoip4 || geoip6;
+  geoip_generation++;
 #endif
 }
 
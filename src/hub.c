@@ -49,9 +49,12 @@ struct hub_user_t {
   int sid;        // for ADC
   struct in_addr ip4;
   struct in6_addr ip6;
+  int country_gen; // geoip_generation of *country, 0 if not looked up yet
+  const char *country;
   hub_t *hub;
   char *name;     // UTF-8
   char *name_hub; // hub-encoded (NMDC)
+  // desc, mail, client and the NMDC conn are shared strings from strpool_ref()
   char *desc;
   char *conn;     // NMDC: string pointer, ADC: GUINT_TO_POINTER() of the US param
   char *mail;
@@ -101,6 +104,9 @@ struct hub_t {
   char *gpa_salt;
   int gpa_salt_len;
 
+  // (ADC) buffers for adc_parse_arena()
+  adc_arena_t adc_arena;
+
   // TLS certificate verification
   char *kp;                // NULL if it matches config, 32 bytes slice-alloced otherwise
 
@@ -115,6 +121,10 @@ struct hub_t {
   gboolean received_first;  // true if one precondition for joincomplete is satisfied.
   gboolean joincomplete;    // if we have the userlist
   guint joincomplete_timer; // fallback timer which ensures joincomplete is set at some point
+
+  // ratecalc groups for the transfers with users on this hub
+  ratecalc_t rate_in;
+  ratecalc_t rate_out;
 };
 
 
@@ -211,11 +221,11 @@ static void user_free(gpointer dat) {
     g_slice_free1(32, u->kp);
   g_free(u->name_hub);
   g_free(u->name);
-  g_free(u->desc);
+  strpool_unref(u->desc);
   if(!u->hub->adc)
-    g_free(u->conn);
-  g_free(u->mail);
-  g_free(u->client);
+    strpool_unref(u->conn);
+  strpool_unref(u->mail);
+  strpool_unref(u->client);
   g_slice_free(hub_user_t, u);
 }
 
@@ -256,6 +266,22 @@ void hub_user_suggest(hub_t *hub, char *str, char **sug) {
 #endif
 
 
+// Returns the country code for the IP of the user, or NULL if unknown. The
+// lookup is cached until the IP or the GeoIP databases change; code that
+// modifies u->ip4 or u->ip6 should reset u->country_gen.
+const char *hub_user_country(hub_user_t *u) {
+  if(!geoip_available)
+    return NULL;
+  if(u->country_gen != geoip_generation) {
+    u->country =
+      !ip4_isany(u->ip4) ? geoip_country4(ip4_unpack(u->ip4)) :
+      !ip6_isany(u->ip6) ? geoip_country6(ip6_unpack(u->ip6)) : NULL;
+    u->country_gen = geoip_generation;
+  }
+  return u->country;
+}
+
+
 char *hub_user_tag(hub_user_t *u) {
   if(!u->client || !u->slots)
     return NULL;
@@ -360,15 +386,15 @@ static void user_nmdc_nfo(hub_t *hub, hub_user_t *u, char *str) {
   share = g_ascii_strtoull(str, NULL, 10);
 
   // If we still haven't 'return'ed yet, that means we have a correct $MyINFO. Now we can update the struct.
-  g_free(u->desc);
-  g_free(u->client);
-  g_free(u->conn);
-  g_free(u->mail);
+  strpool_unref(u->desc);
+  strpool_unref(u->client);
+  strpool_unref(u->conn);
+  strpool_unref(u->mail);
   u->sharesize = share;
-  u->desc = desc[0] ? nmdc_unescape_and_decode(hub, desc) : NULL;
-  u->client = client && client[0] ? g_strdup(client) : NULL;
-  u->conn = conn[0] ? nmdc_unescape_and_decode(hub, conn) : NULL;
-  u->mail = mail[0] ? nmdc_unescape_and_decode(hub, mail) : NULL;
+  u->desc = desc[0] ? strpool_take(nmdc_unescape_and_decode(hub, desc)) : NULL;
+  u->client = client && client[0] ? strpool_ref(client) : NULL;
+  u->conn = conn[0] ? strpool_take(nmdc_unescape_and_decode(hub, conn)) : NULL;
+  u->mail = mail[0] ? strpool_take(nmdc_unescape_and_decode(hub, mail)) : NULL;
   u->h_norm = h_norm;
   u->h_reg = h_reg;
   u->h_op = h_op;
@@ -407,17 +433,17 @@ static void user_adc_nfo(hub_t *hub, hub_user_t *u, adc_cmd_t *cmd) {
       g_hash_table_insert(hub->users, u->name, u);
       break;
     case P('D','E'): // description
-      g_free(u->desc);
-      u->desc = p[0] ? g_strdup(p) : NULL;
+      strpool_unref(u->desc);
+      u->desc = p[0] ? strpool_ref(p) : NULL;
       break;
     case P('V','E'): // client name (+ version)
-      g_free(u->client);
-      char *ap = adc_getparam(cmd->argv, "AP", NULL);
-      u->client = !p[0] ? NULL : !ap || strncmp(p, ap, strlen(ap)) == 0 ? g_strdup(p) : g_strdup_printf("%s %s", ap, p);
+      strpool_unref(u->client);
+      char *ap = adc_cmd_param(cmd, 0, "AP");
+      u->client = !p[0] ? NULL : !ap || strncmp(p, ap, strlen(ap)) == 0 ? strpool_ref(p) : strpool_take(g_strdup_printf("%s %s", ap, p));
       break;
     case P('E','M'): // mail
-      g_free(u->mail);
-      u->mail = p[0] ? g_strdup(p) : NULL;
+      strpool_unref(u->mail);
+      u->mail = p[0] ? strpool_ref(p) : NULL;
       break;
     case P('S','S'): // share size
       u->sharesize = g_ascii_strtoull(p, NULL, 10);
@@ -439,9 +465,11 @@ static void user_adc_nfo(hub_t *hub, hub_user_t *u, adc_cmd_t *cmd) {
       break;
     case P('I','4'): // IPv4 address
       u->ip4 = ip4_pack(p);
+      u->country_gen = 0;
       break;
     case P('I','6'): // IPv6 address
       u->ip6 = ip6_pack(p);
+      u->country_gen = 0;
       break;
     case P('U','4'): // UDP4 port
       u->udp4 = strtol(p, NULL, 10);
@@ -567,7 +595,7 @@ void hub_opencc(hub_t *hub, hub_user_t *u) {
     base32_encode_dat(nonce, token, 8);
   }
 
-  guint16 wanttls = var_get_int(hub->id, VAR_tls_policy) == VAR_TLSP_PREFER;
+  guint16 wanttls = var_snap(hub->id)->tls_policy == VAR_TLSP_PREFER;
   int port = listen_hub_tcp(hub->id);
   gboolean usetls = wanttls && u->hastls;
   char *adcproto = !usetls ? "ADC/1.0" : u->hasadc0 ? "ADCS/0.10" : "ADCS/1.0";
@@ -629,7 +657,7 @@ void hub_search(hub_t *hub, search_q_t *q) {
       for(; *s; s++)
         g_string_append_printf(cmd, " AN%s", *s);
     }
-    if(hub->tls && var_get_int(0, VAR_sudp_policy) == VAR_SUDPP_PREFER) {
+    if(hub->tls && var_snap(0)->sudp_policy == VAR_SUDPP_PREFER) {
       char key[27] = {};
       base32_encode_dat(q->key, key, 16);
       g_string_append_printf(cmd, " KY%s", key);
@@ -683,8 +711,8 @@ void hub_send_nfo(hub_t *hub) {
   mail = var_get(hub->id, VAR_email);
 
   char buf[50] = {};
-  if(var_get_int(0, VAR_upload_rate)) {
-    g_snprintf(buf, sizeof(buf), "%d KiB/s", var_get_int(0, VAR_upload_rate)/1024);
+  if(var_get_int(hub->id, VAR_upload_rate)) {
+    g_snprintf(buf, sizeof(buf), "%d KiB/s", var_get_int(hub->id, VAR_upload_rate)/1024);
     conn = buf;
   } else
     conn = var_get(hub->id, VAR_connection);
@@ -703,12 +731,12 @@ void hub_send_nfo(hub_t *hub) {
     else
       h_norm++;
   }
-  slots = var_get_int(0, VAR_slots);
+  slots = var_snap(0)->slots;
   ip = listen_hub_active(hub->id) ? hub_ip(hub) : NULL;
   udp_port = listen_hub_udp(hub->id);
   share = fl_local_list_size;
-  sup_tls = var_get_int(hub->id, VAR_tls_policy) > VAR_TLSP_DISABLE ? TRUE : FALSE;
-  sup_sudp = hub->tls && var_get_int(0, VAR_sudp_policy) != VAR_SUDPP_DISABLE ? TRUE : FALSE;
+  sup_tls = var_snap(hub->id)->tls_policy > VAR_TLSP_DISABLE ? TRUE : FALSE;
+  sup_sudp = hub->tls && var_snap(0)->sudp_policy != VAR_SUDPP_DISABLE ? TRUE : FALSE;
 
   // check whether we need to make any further effort
   if(hub->nick_valid && streq(desc) && streq(conn) && streq(mail) && eq(slots) && streq(ip)
@@ -872,7 +900,7 @@ static void adc_sch_reply_send(hub_t *hub, net_udp_t *udp, GString *r, const cha
   if(!udp) {
     net_writestr(hub->net, r->str);
     return;
-  } else if(!key || var_get_int(0, VAR_sudp_policy) == VAR_SUDPP_DISABLE) {
+  } else if(!key || var_snap(0)->sudp_policy == VAR_SUDPP_DISABLE) {
     net_udp_send(udp, r->str);
     return;
   }
@@ -897,15 +925,32 @@ static void adc_sch_reply_send(hub_t *hub, net_udp_t *udp, GString *r, const cha
 }
 
 
-static void adc_sch_reply(hub_t *hub, adc_cmd_t *cmd, hub_user_t *u, fl_list_t **res, int len) {
-  char *ky = adc_getparam(cmd->argv, "KY", NULL); // SUDP key
-  char *to = adc_getparam(cmd->argv, "TO", NULL); // token
+// State of a search that is being answered in the background, used for both
+// NMDC and ADC.
+typedef struct hub_search_t {
+  guint64 hubid;
+  int source;    // (ADC) SID of the searching user
+  guint64 uid;   // (ADC) to make sure the SID still refers to the same user
+  char *ky, *to; // (ADC) KY and TO parameters
+  char *from;    // (NMDC) nick or IP
+  unsigned short port; // (NMDC)
+} hub_search_t;
 
+
+static void hub_search_free(hub_search_t *hs) {
+  g_free(hs->ky);
+  g_free(hs->to);
+  g_free(hs->from);
+  g_slice_free(hub_search_t, hs);
+}
+
+
+static void adc_sch_reply(hub_t *hub, int source, const char *ky, const char *to, hub_user_t *u, fl_search_res_t *res, int len) {
   char sudpkey[16];
   if(ky && isbase32(ky) && strlen(ky) == 26)
     base32_decode(ky, sudpkey);
 
-  int slots = var_get_int(0, VAR_slots);
+  int slots = var_snap(0)->slots;
   int slots_free = slots - cc_slots_in_use(NULL);
   if(slots_free < 0)
     slots_free = 0;
@@ -927,17 +972,15 @@ static void adc_sch_reply(hub_t *hub, adc_cmd_t *cmd, hub_user_t *u, fl_list_t *
 
   int i;
   for(i=0; i<len; i++) {
-    GString *r = udp ? adc_generate('U', ADCC_RES, 0, 0) : adc_generate('D', ADCC_RES, hub->sid, cmd->source);
+    GString *r = udp ? adc_generate('U', ADCC_RES, 0, 0) : adc_generate('D', ADCC_RES, hub->sid, source);
     if(udp)
       g_string_append_printf(r, " %s", cid);
     if(to)
       adc_append(r, "TO", to);
-    g_string_append_printf(r, " SL%d SI%"G_GUINT64_FORMAT, slots_free, res[i]->size);
-    char *path = fl_list_path(res[i]);
-    adc_append(r, "FN", path);
-    g_free(path);
-    if(res[i]->isfile) {
-      base32_encode(res[i]->tth, tth);
+    g_string_append_printf(r, " SL%d SI%"G_GUINT64_FORMAT, slots_free, res[i].size);
+    adc_append(r, "FN", res[i].path);
+    if(res[i].isfile) {
+      base32_encode(res[i].tth, tth);
       g_string_append_printf(r, " TR%s", tth);
     } else
       g_string_append_c(r, '/'); // make sure a directory path ends with a slash
@@ -952,16 +995,27 @@ static void adc_sch_reply(hub_t *hub, adc_cmd_t *cmd, hub_user_t *u, fl_list_t *
 }
 
 
+// Called when a keyword search has been answered by the search thread.
+static void adc_sch_done(fl_search_res_t *res, int len, gpointer dat) {
+  hub_search_t *hs = dat;
+  hub_t *hub = hub_global_byid(hs->hubid);
+  hub_user_t *u = hub && net_is_connected(hub->net) ? g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(hs->source)) : NULL;
+  if(len && u && u->uid == hs->uid)
+    adc_sch_reply(hub, hs->source, hs->ky, hs->to, u, res, len);
+  hub_search_free(hs);
+}
+
+
 static void adc_sch(hub_t *hub, adc_cmd_t *cmd) {
-  char *an = adc_getparam(cmd->argv, "AN", NULL); // and
-  char *no = adc_getparam(cmd->argv, "NO", NULL); // not
-  char *ex = adc_getparam(cmd->argv, "EX", NULL); // ext
-  char *le = adc_getparam(cmd->argv, "LE", NULL); // less-than
-  char *ge = adc_getparam(cmd->argv, "GE", NULL); // greater-than
-  char *eq = adc_getparam(cmd->argv, "EQ", NULL); // equal
-  char *ty = adc_getparam(cmd->argv, "TY", NULL); // type (1=file, 2=dir)
-  char *tr = adc_getparam(cmd->argv, "TR", NULL); // TTH root
-  char *td = adc_getparam(cmd->argv, "TD", NULL); // tree depth
+  char *an = adc_cmd_param(cmd, 0, "AN"); // and
+  char *no = adc_cmd_param(cmd, 0, "NO"); // not
+  char *ex = adc_cmd_param(cmd, 0, "EX"); // ext
+  char *le = adc_cmd_param(cmd, 0, "LE"); // less-than
+  char *ge = adc_cmd_param(cmd, 0, "GE"); // greater-than
+  char *eq = adc_cmd_param(cmd, 0, "EQ"); // equal
+  char *ty = adc_cmd_param(cmd, 0, "TY"); // type (1=file, 2=dir)
+  char *tr = adc_cmd_param(cmd, 0, "TR"); // TTH root
+  char *td = adc_cmd_param(cmd, 0, "TD"); // tree depth
 
   // no strong enough filters specified? ignore
   if(!an && !no && !ex && !le && !ge && !eq && !tr)
@@ -991,37 +1045,48 @@ static void adc_sch(hub_t *hub, adc_cmd_t *cmd) {
   s.sizem = eq ? 0 : le ? -1 : ge ? 1 : -2;
   s.size = s.sizem == -2 ? 0 : g_ascii_strtoull(eq ? eq : le ? le : ge, NULL, 10);
   s.filedir = !ty ? 3 : ty[0] == '1' ? 1 : 2;
-  char **tmp = adc_getparams(cmd->argv, "AN");
-  s.and = fl_search_create_and(tmp);
-  g_free(tmp);
-  tmp = adc_getparams(cmd->argv, "NO");
+  char **and = adc_getparams(cmd->argv, "AN");
+  s.and = fl_search_create_and(and);
+  char **tmp = adc_getparams(cmd->argv, "NO");
   s.not = fl_search_create_not(tmp);
   g_free(tmp);
   s.ext = adc_getparams(cmd->argv, "EX");
 
   int i = 0;
   int max = (u->hasudp4 && u->udp4) || (u->hasudp6 && u->udp6) ? 10 : 5;
-  fl_list_t *res[max];
+  char *ky = adc_cmd_param(cmd, 0, "KY"); // SUDP key
+  char *to = adc_cmd_param(cmd, 0, "TO"); // token
 
   // TTH lookup
   if(tr) {
+    fl_search_res_t *res = g_new0(fl_search_res_t, max);
     char root[24];
     base32_decode(tr, root);
-    GSList *l = fl_local_from_tth(root);
+    int j, n;
+    fl_list_t **l = fl_local_from_tth(root, &n);
     // it still has to match the other requirements...
-    for(; i<max && l; l=l->next) {
-      fl_list_t *c = l->data;
+    for(j=0; i<max && j<n; j++) {
+      fl_list_t *c = l[j];
       if(fl_search_match_full(c, &s))
-        res[i++] = c;
+        fl_search_res_set(res+(i++), c);
     }
+    if(i)
+      adc_sch_reply(hub, cmd->source, ky, to, u, res, i);
+    fl_search_res_free(res, i);
 
-  // Advanced lookup (Noo! This is slooow!)
-  } else
-    i = fl_search_rec(fl_local_list, &s, res, max);
-
-  if(i)
-    adc_sch_reply(hub, cmd, u, res, i);
+  // Advanced lookup, answered by the search thread
+  } else {
+    hub_search_t *hs = g_slice_new0(hub_search_t);
+    hs->hubid = hub->id;
+    hs->source = cmd->source;
+    hs->uid = u->uid;
+    hs->ky = g_strdup(ky);
+    hs->to = g_strdup(to);
+    if(!fl_local_search_async(&s, and, max, adc_sch_done, hs))
+      hub_search_free(hs);
+  }
 
+  g_free(and);
   fl_search_free_and(s.and);
   if(s.not)
     g_regex_unref(s.not);
@@ -1048,7 +1113,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
   if(listen_hub_active(hub->id))
     feats[0] = ADC_DFCC("TCP4");
 
-  adc_parse(msg, &cmd, feats, &err);
+  adc_parse_arena(msg, &cmd, feats, &hub->adc_arena, &err);
   if(err) {
     g_message("ADC parse error from %s: %s. --> %s", net_remoteaddr(hub->net), err->message, msg);
     g_error_free(err);
@@ -1083,7 +1148,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       if(left)
         hname = adc_getparam(left, "NI", NULL);
       if(!hname)
-        hname = adc_getparam(cmd.argv, "DE", NULL);
+        hname = adc_cmd_param(&cmd, 0, "DE");
       if(hname) {
         g_free(hub->hubname);
         hub->hubname = g_strdup(hname);
@@ -1092,8 +1157,8 @@ static void adc_handle(net_t *net, char *msg, int _len) {
     } else if(cmd.type == 'B') {
       hub_user_t *u = g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(cmd.source));
       if(!u) {
-        char *nick = adc_getparam(cmd.argv, "NI", NULL);
-        char *cid = adc_getparam(cmd.argv, "ID", NULL);
+        char *nick = adc_cmd_param(&cmd, 0, "NI");
+        char *cid = adc_cmd_param(&cmd, 0, "ID");
         if(nick && cid && iscid(cid))
           u = user_add(hub, nick, cid);
       }
@@ -1129,9 +1194,9 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       int sid = ADC_DFCC(cmd.argv[0]);
       hub_user_t *u = g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(sid));
       if(sid == hub->sid) {
-        char *rd = adc_getparam(cmd.argv, "RD", NULL);
-        char *ms = adc_getparam(cmd.argv, "MS", NULL);
-        char *tl = adc_getparam(cmd.argv, "TL", NULL);
+        char *rd = adc_cmd_param(&cmd, 0, "RD");
+        char *ms = adc_cmd_param(&cmd, 0, "MS");
+        char *tl = adc_cmd_param(&cmd, 0, "TL");
         if(rd) {
           ui_mf(hub->tab, UIP_HIGH, "\nThe hub is requesting you to move to %s.\nType `/connect %s' to do so.\n", rd, rd);
           if(ms)
@@ -1170,7 +1235,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
   case ADCC_CTM:
     if(cmd.argc < 3 || cmd.type != 'D' || cmd.dest != hub->sid)
       g_message("Invalid message from %s: %s", net_remoteaddr(hub->net), msg);
-    else if(var_get_int(hub->id, VAR_tls_policy) == VAR_TLSP_DISABLE ? !is_adc_proto(cmd.argv[0]) : !is_valid_proto(cmd.argv[0])) {
+    else if(var_snap(hub->id)->tls_policy == VAR_TLSP_DISABLE ? !is_adc_proto(cmd.argv[0]) : !is_valid_proto(cmd.argv[0])) {
       GString *r = adc_generate('D', ADCC_STA, hub->sid, cmd.source);
       g_string_append(r, " 141 Unknown\\sprotocol");
       adc_append(r, "PR", cmd.argv[0]);
@@ -1199,7 +1264,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
   case ADCC_RCM:
     if(cmd.argc < 2 || cmd.type != 'D' || cmd.dest != hub->sid)
       g_message("Invalid message from %s: %s", net_remoteaddr(hub->net), msg);
-    else if(var_get_int(hub->id, VAR_tls_policy) == VAR_TLSP_DISABLE ? !is_adc_proto(cmd.argv[0]) : !is_valid_proto(cmd.argv[0])) {
+    else if(var_snap(hub->id)->tls_policy == VAR_TLSP_DISABLE ? !is_adc_proto(cmd.argv[0]) : !is_valid_proto(cmd.argv[0])) {
       GString *r = adc_generate('D', ADCC_STA, hub->sid, cmd.source);
       g_string_append(r, " 141 Unknown\\protocol");
       adc_append(r, "PR", cmd.argv[0]);
@@ -1237,8 +1302,8 @@ static void adc_handle(net_t *net, char *msg, int _len) {
     if(cmd.argc < 1 || (cmd.type != 'B' && cmd.type != 'E' && cmd.type != 'D' && cmd.type != 'I' && cmd.type != 'F'))
       g_message("Invalid message from %s: %s", net_remoteaddr(hub->net), msg);
     else {
-      char *pm = adc_getparam(cmd.argv+1, "PM", NULL);
-      gboolean me = adc_getparam(cmd.argv+1, "ME", NULL) != NULL;
+      char *pm = adc_cmd_param(&cmd, 1, "PM");
+      gboolean me = adc_cmd_param(&cmd, 1, "ME") != NULL;
       hub_user_t *u = cmd.type != 'I' ? g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(cmd.source)) : NULL;
       hub_user_t *d = (cmd.type == 'E' || cmd.type == 'D') && cmd.source == hub->sid
         ? g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(cmd.dest)) : NULL;
@@ -1290,8 +1355,8 @@ static void adc_handle(net_t *net, char *msg, int _len) {
     if(cmd.type != 'I' || cmd.argc < 4 || strcmp(cmd.argv[0], "blom") != 0 || strcmp(cmd.argv[1], "/") != 0 || strcmp(cmd.argv[2], "0") != 0)
       g_message("Invalid message from %s: %s", net_remoteaddr(hub->net), msg);
     else {
-      char *bk = adc_getparam(cmd.argv+4, "BK", NULL);
-      char *bh = adc_getparam(cmd.argv+4, "BH", NULL);
+      char *bk = adc_cmd_param(&cmd, 4, "BK");
+      char *bh = adc_cmd_param(&cmd, 4, "BH");
       long m = strtol(cmd.argv[3], NULL, 10);
       long k = bk ? strtol(bk, NULL, 10) : 0;
       long h = bh ? strtol(bh, NULL, 10) : 0;
@@ -1313,8 +1378,6 @@ static void adc_handle(net_t *net, char *msg, int _len) {
   default:
     g_message("Unknown command from %s: %s", net_remoteaddr(hub->net), msg);
   }
-
-  g_strfreev(cmd.argv);
 }
 
 #undef is_adcs_proto
@@ -1322,10 +1385,62 @@ static void adc_handle(net_t *net, char *msg, int _len) {
 #undef is_valid_proto
 
 
+static void nmdc_search_reply(hub_t *hub, const char *from, unsigned short port, fl_search_res_t *res, int i) {
+  const char *hubaddr = net_remoteaddr(hub->net);
+  int slots = var_snap(0)->slots;
+  int slots_free = slots - cc_slots_in_use(NULL);
+  if(slots_free < 0)
+    slots_free = 0;
+  char tth[44] = "TTH:";
+  tth[43] = 0;
+
+  net_udp_t udp;
+  if(port)
+    net_udp_init(&udp, from, port, var_get(hub->id, VAR_local_address));
+
+  while(--i>=0) {
+    char *fl = g_strdup(res[i].path);
+    // Windows style path delimiters... why!?
+    char *tmp = fl;
+    char *size = NULL;
+    for(; *tmp; tmp++)
+      if(*tmp == '/')
+        *tmp = '\\';
+    tmp = nmdc_encode_and_escape(hub, fl);
+    if(res[i].isfile) {
+      base32_encode(res[i].tth, tth+4);
+      size = g_strdup_printf("\05%"G_GUINT64_FORMAT, res[i].size);
+    }
+    char *msg = g_strdup_printf("$SR %s %s%s %d/%d\05%s (%s)",
+      hub->nick_hub, tmp, size ? size : "", slots_free, slots, res[i].isfile ? tth : hub->hubname_hub, hubaddr);
+    if(!port)
+      net_writef(hub->net, "%s\05%s|", msg, from);
+    else
+      net_udp_sendf(&udp, "%s|", msg);
+    g_free(fl);
+    g_free(msg);
+    g_free(size);
+    g_free(tmp);
+  }
+
+  if(port)
+    net_udp_destroy(&udp);
+}
+
+
+// Called when a keyword search has been answered by the search thread.
+static void nmdc_search_done(fl_search_res_t *res, int len, gpointer dat) {
+  hub_search_t *hs = dat;
+  hub_t *hub = hub_global_byid(hs->hubid);
+  if(len && hub && net_is_connected(hub->net) && hub->nick_valid)
+    nmdc_search_reply(hub, hs->from, hs->port, res, len);
+  hub_search_free(hs);
+}
+
+
 // If port = 0, 'from' is interpreted as a nick. Otherwise, from should be an IP address.
 static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m, guint64 size, int type, char *query) {
   int max = port ? 10 : 5;
-  fl_list_t *res[max];
   fl_search_t s = {};
   s.filedir = type == 1 ? 3 : type == 8 ? 2 : 1;
   s.ext = search_types[type].exts;
@@ -1339,17 +1454,22 @@ static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m,
       g_message("Invalid TTH $Search for %s", from);
       return;
     }
+    fl_search_res_t *res = g_new0(fl_search_res_t, max);
     char root[24];
     base32_decode(query+4, root);
-    GSList *l = fl_local_from_tth(root);
+    int j, n;
+    fl_list_t **l = fl_local_from_tth(root, &n);
     // it still has to match the other requirements...
-    for(; i<max && l; l=l->next) {
-      fl_list_t *c = l->data;
+    for(j=0; i<max && j<n; j++) {
+      fl_list_t *c = l[j];
       if(fl_search_match_full(c, &s))
-        res[i++] = c;
+        fl_search_res_set(res+(i++), c);
     }
+    if(i)
+      nmdc_search_reply(hub, from, port, res, i);
+    fl_search_res_free(res, i);
 
-  // Advanced lookup (Noo! This is slooow!)
+  // Advanced lookup, answered by the search thread
   } else {
     char *tmp = query;
     for(; *tmp; tmp++)
@@ -1359,54 +1479,15 @@ static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m,
     char **args = g_strsplit(tmp, " ", 0);
     g_free(tmp);
     s.and = fl_search_create_and(args);
+    hub_search_t *hs = g_slice_new0(hub_search_t);
+    hs->hubid = hub->id;
+    hs->from = g_strdup(from);
+    hs->port = port;
+    if(!fl_local_search_async(&s, args, max, nmdc_search_done, hs))
+      hub_search_free(hs);
     g_strfreev(args);
-    i = fl_search_rec(fl_local_list, &s, res, max);
     fl_search_free_and(s.and);
   }
-
-  // reply
-  if(!i)
-    return;
-
-  const char *hubaddr = net_remoteaddr(hub->net);
-  int slots = var_get_int(0, VAR_slots);
-  int slots_free = slots - cc_slots_in_use(NULL);
-  if(slots_free < 0)
-    slots_free = 0;
-  char tth[44] = "TTH:";
-  tth[43] = 0;
-
-  net_udp_t udp;
-  if(port)
-    net_udp_init(&udp, from, port, var_get(hub->id, VAR_local_address));
-
-  while(--i>=0) {
-    char *fl = fl_list_path(res[i]);
-    // Windows style path delimiters... why!?
-    char *tmp = fl;
-    char *size = NULL;
-    for(; *tmp; tmp++)
-      if(*tmp == '/')
-        *tmp = '\\';
-    tmp = nmdc_encode_and_escape(hub, fl);
-    if(res[i]->isfile) {
-      base32_encode(res[i]->tth, tth+4);
-      size = g_strdup_printf("\05%"G_GUINT64_FORMAT, res[i]->size);
-    }
-    char *msg = g_strdup_printf("$SR %s %s%s %d/%d\05%s (%s)",
-      hub->nick_hub, tmp, size ? size : "", slots_free, slots, res[i]->isfile ? tth : hub->hubname_hub, hubaddr);
-    if(!port)
-      net_writef(hub->net, "%s\05%s|", msg, from);
-    else
-      net_udp_sendf(&udp, "%s|", msg);
-    g_free(fl);
-    g_free(msg);
-    g_free(size);
-    g_free(tmp);
-  }
-
-  if(port)
-    net_udp_destroy(&udp);
 }
 
 
@@ -1416,34 +1497,15 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
   // called anyway.
   net_readmsg(net, '|', nmdc_handle);
 
-  if(!cmd[0])
+  // The arguments in c.argv point into cmd, see nmdc_parse().
+  nmdc_cmd_t c;
+  if(!cmd[0] || !nmdc_parse(cmd, &c))
     return;
 
-  GMatchInfo *nfo;
-
-  // create regexes (declared statically, allocated/compiled on first call)
-#define CMDREGEX(name, regex) \
-  static GRegex * name = NULL;\
-  if(!name) name = g_regex_new("\\$" regex, G_REGEX_OPTIMIZE|G_REGEX_ANCHORED|G_REGEX_DOTALL|G_REGEX_RAW, 0, NULL)
-
-  CMDREGEX(lock, "Lock ([^ $]+) Pk=[^ $]+");
-  CMDREGEX(supports, "Supports (.+)");
-  CMDREGEX(hello, "Hello ([^ $]+)");
-  CMDREGEX(quit, "Quit ([^ $]+)");
-  CMDREGEX(nicklist, "NickList (.+)");
-  CMDREGEX(oplist, "OpList (.+)");
-  CMDREGEX(userip, "UserIP (.+)");
-  CMDREGEX(myinfo, "MyINFO \\$ALL ([^ $]+) (.+)");
-  CMDREGEX(hubname, "HubName (.+)");
-  CMDREGEX(to, "To: ([^ $]+) From: ([^ $]+) \\$(.+)");
-  CMDREGEX(forcemove, "ForceMove (.+)");
-  CMDREGEX(connecttome, "ConnectToMe ([^ $]+) ([a-fA-F0-9:\\[\\]\\.]+)(S|)");
-  CMDREGEX(revconnecttome, "RevConnectToMe ([^ $]+) ([^ $]+)");
-  CMDREGEX(search, "Search (Hub:(?:[^ $]+)|(?:[a-fA-F0-9:\\[\\]\\.]+)) ([TF])\\?([TF])\\?([0-9]+)\\?([1-9])\\?(.+)");
-
-  // $Lock
-  if(g_regex_match(lock, cmd, 0, &nfo)) { // 1 = lock
-    char *lock = g_match_info_fetch(nfo, 1);
+  switch(c.cmd) {
+
+  case NMDCC_LOCK: { // 0 = lock
+    char *lock = c.argv[0];
     if(strncmp(lock, "EXTENDEDPROTOCOL", 16) == 0)
       net_writestr(hub->net, "$Supports NoGetINFO NoHello UserIP2|");
     char *key = nmdc_lock2key(lock);
@@ -1453,23 +1515,17 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
     uit_hub_setnick(hub->tab);
     net_writef(hub->net, "$ValidateNick %s|", hub->nick_hub);
     g_free(key);
-    g_free(lock);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $Supports
-  if(g_regex_match(supports, cmd, 0, &nfo)) { // 1 = list
-    char *list = g_match_info_fetch(nfo, 1);
-    if(strstr(list, "NoGetINFO"))
+  case NMDCC_SUPPORTS: // 0 = list
+    if(strstr(c.argv[0], "NoGetINFO"))
       hub->supports_nogetinfo = TRUE;
     // we also support NoHello, but no need to check for that
-    g_free(list);
-  }
-  g_match_info_free(nfo);
+    break;
 
-  // $Hello
-  if(g_regex_match(hello, cmd, 0, &nfo)) { // 1 = nick
-    char *nick = g_match_info_fetch(nfo, 1);
+  case NMDCC_HELLO: { // 0 = nick
+    char *nick = c.argv[0];
     if(strcmp(nick, hub->nick_hub) == 0) {
       // some hubs send our $Hello twice (like verlihub)
       // just ignore the second one
@@ -1489,13 +1545,11 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
       if(!u->hasinfo && !hub->supports_nogetinfo)
         net_writef(hub->net, "$GetINFO %s|", nick);
     }
-    g_free(nick);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $Quit
-  if(g_regex_match(quit, cmd, 0, &nfo)) { // 1 = nick
-    char *nick = g_match_info_fetch(nfo, 1);
+  case NMDCC_QUIT: { // 0 = nick
+    char *nick = c.argv[0];
     hub_user_t *u = g_hash_table_lookup(hub->users, nick);
     if(u) {
       uit_hub_userchange(hub->tab, UIHUB_UC_QUIT, u);
@@ -1505,16 +1559,12 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
       }
       g_hash_table_remove(hub->users, nick);
     }
-    g_free(nick);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $NickList
-  if(g_regex_match(nicklist, cmd, 0, &nfo)) { // 1 = list of users
+  case NMDCC_NICKLIST: { // 0 = list of users
     // not really efficient, but does the trick
-    char *str = g_match_info_fetch(nfo, 1);
-    char **list = g_strsplit(str, "$$", 0);
-    g_free(str);
+    char **list = g_strsplit(c.argv[0], "$$", 0);
     char **cur;
     for(cur=list; *cur&&**cur; cur++) {
       hub_user_t *u = user_add(hub, *cur, NULL);
@@ -1523,15 +1573,12 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
     }
     hub->received_first = TRUE;
     g_strfreev(list);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $OpList
-  if(g_regex_match(oplist, cmd, 0, &nfo)) { // 1 = list of ops
+  case NMDCC_OPLIST: { // 0 = list of ops
     // not really efficient, but does the trick
-    char *str = g_match_info_fetch(nfo, 1);
-    char **list = g_strsplit(str, "$$", 0);
-    g_free(str);
+    char **list = g_strsplit(c.argv[0], "$$", 0);
     char **cur;
     // Actually, we should be going through the entire user list and set
     // isop=FALSE when the user is not listed here. I consider this to be too
@@ -1549,14 +1596,11 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
     }
     hub->received_first = TRUE;
     g_strfreev(list);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $UserIP
-  if(g_regex_match(userip, cmd, 0, &nfo)) { // 1 = list of users/ips
-    char *str = g_match_info_fetch(nfo, 1);
-    char **list = g_strsplit(str, "$$", 0);
-    g_free(str);
+  case NMDCC_USERIP: { // 0 = list of users/ips
+    char **list = g_strsplit(c.argv[0], "$$", 0);
     char **cur;
     for(cur=list; *cur&&**cur; cur++) {
       char *sep = strchr(*cur, ' ');
@@ -1568,12 +1612,14 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
         struct in_addr new = ip4_pack(sep+1);
         if(ip4_cmp(new, u->ip4) != 0) {
           u->ip4 = new;
+          u->country_gen = 0;
           uit_hub_userchange(hub->tab, UIHUB_UC_NFO, u);
         }
       } else {
         struct in6_addr new = ip6_pack(sep+1);
         if(ip6_cmp(new, u->ip6) != 0) {
           u->ip6 = new;
+          u->country_gen = 0;
           uit_hub_userchange(hub->tab, UIHUB_UC_NFO, u);
         }
       }
@@ -1582,45 +1628,35 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
         setownip(hub, u);
     }
     g_strfreev(list);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $MyINFO
-  if(g_regex_match(myinfo, cmd, 0, &nfo)) { // 1 = nick, 2 = info string
-    char *nick = g_match_info_fetch(nfo, 1);
-    char *str = g_match_info_fetch(nfo, 2);
-    hub_user_t *u = user_add(hub, nick, NULL);
+  case NMDCC_MYINFO: { // 0 = nick, 1 = info string
+    hub_user_t *u = user_add(hub, c.argv[0], NULL);
     if(!u->hasinfo)
       hub->sharecount++;
     else
       hub->sharesize -= u->sharesize;
-    user_nmdc_nfo(hub, u, str);
+    user_nmdc_nfo(hub, u, c.argv[1]);
     if(!u->hasinfo)
       hub->sharecount--;
     else
       hub->sharesize += u->sharesize;
     if(hub->received_first && !hub->joincomplete && hub->sharecount == g_hash_table_size(hub->users))
       hub->joincomplete = TRUE;
-    g_free(str);
-    g_free(nick);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $HubName
-  if(g_regex_match(hubname, cmd, 0, &nfo)) { // 1 = name
+  case NMDCC_HUBNAME: // 0 = name
     g_free(hub->hubname_hub);
     g_free(hub->hubname);
-    hub->hubname_hub = g_match_info_fetch(nfo, 1);
+    hub->hubname_hub = g_strdup(c.argv[0]);
     hub->hubname = nmdc_unescape_and_decode(hub, hub->hubname_hub);
-  }
-  g_match_info_free(nfo);
-
-  // $To
-  if(g_regex_match(to, cmd, 0, &nfo)) { // 1 = to, 2 = from, 3 = msg
-    char *to = g_match_info_fetch(nfo, 1);
-    char *from = g_match_info_fetch(nfo, 2);
-    char *msg = g_match_info_fetch(nfo, 3);
-    char *msge = nmdc_unescape_and_decode(hub, msg);
+    break;
+
+  case NMDCC_TO: { // 0 = to, 1 = from, 2 = msg
+    char *from = c.argv[1];
+    char *msge = nmdc_unescape_and_decode(hub, c.argv[2]);
     hub_user_t *u = g_hash_table_lookup(hub->users, from);
     if(!u) {
       g_message("[hub: %s] Got a $To from `%s', who is not on this hub!", hub->tab->name, from);
@@ -1630,28 +1666,21 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
     } else
       uit_msg_msg(u, msge);
     g_free(msge);
-    g_free(from);
-    g_free(to);
-    g_free(msg);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $ForceMove
-  if(g_regex_match(forcemove, cmd, 0, &nfo)) { // 1 = addr
-    char *addr = g_match_info_fetch(nfo, 1);
-    char *eaddr = nmdc_unescape_and_decode(hub, addr);
+  case NMDCC_FORCEMOVE: { // 0 = addr
+    char *eaddr = nmdc_unescape_and_decode(hub, c.argv[0]);
     ui_mf(hub->tab, UIP_HIGH, "\nThe hub is requesting you to move to %s.\nType `/connect %s' to do so.\n", eaddr, eaddr);
     hub_disconnect(hub, FALSE);
     g_free(eaddr);
-    g_free(addr);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $ConnectToMe
-  if(g_regex_match(connecttome, cmd, 0, &nfo)) { // 1 = me, 2 = addr, 3 = TLS
-    char *me = g_match_info_fetch(nfo, 1);
-    char *addr = g_match_info_fetch(nfo, 2);
-    char *tls = g_match_info_fetch(nfo, 3);
+  case NMDCC_CONNECTTOME: { // 0 = me, 1 = addr, 2 = TLS
+    char *me = c.argv[0];
+    char *addr = c.argv[1];
+    char *tls = c.argv[2];
     if(strcmp(me, hub->nick_hub) != 0)
       g_message("Received a $ConnectToMe for someone else (to %s from %s)", me, addr);
     else {
@@ -1662,16 +1691,12 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
       else
         cc_nmdc_connect(cc_create(hub), uri.host, uri.port, var_get(hub->id, VAR_local_address), *tls ? TRUE : FALSE);
     }
-    g_free(me);
-    g_free(addr);
-    g_free(tls);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $RevConnectToMe
-  if(g_regex_match(revconnecttome, cmd, 0, &nfo)) { // 1 = other, 2 = me
-    char *other = g_match_info_fetch(nfo, 1);
-    char *me = g_match_info_fetch(nfo, 2);
+  case NMDCC_REVCONNECTTOME: { // 0 = other, 1 = me
+    char *other = c.argv[0];
+    char *me = c.argv[1];
     hub_user_t *u = g_hash_table_lookup(hub->users, other);
     if(strcmp(me, hub->nick_hub) != 0)
       g_message("Received a $RevConnectToMe for someone else (to %s from %s)", me, other);
@@ -1681,26 +1706,18 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
       // Unlike with ADC, the client sending the $RCTM can not indicate it
       // wants to use TLS or not, so the decision is with us. Let's require
       // tls_policy to be PREFER here.
-      int usetls = u->hastls && var_get_int(hub->id, VAR_tls_policy) == VAR_TLSP_PREFER;
+      int usetls = u->hastls && var_snap(hub->id)->tls_policy == VAR_TLSP_PREFER;
       int port = listen_hub_tcp(hub->id);
       net_writef(hub->net, net_is_ipv6(hub->net) ? "$ConnectToMe %s [%s]:%d%s|" : "$ConnectToMe %s %s:%d%s|",
           other, hub_ip(hub), port, usetls ? "S" : "");
       cc_expect_add(hub, u, port, NULL, FALSE);
     } else
       g_message("Received a $RevConnectToMe, but we're not active.");
-    g_free(me);
-    g_free(other);
+    break;
   }
-  g_match_info_free(nfo);
-
-  // $Search
-  if(g_regex_match(search, cmd, 0, &nfo)) { // 1=from, 2=sizerestrict, 3=ismax, 4=size, 5=type, 6=query
-    char *from = g_match_info_fetch(nfo, 1);
-    char *sizerestrict = g_match_info_fetch(nfo, 2);
-    char *ismax = g_match_info_fetch(nfo, 3);
-    char *size = g_match_info_fetch(nfo, 4);
-    char *type = g_match_info_fetch(nfo, 5);
-    char *query = g_match_info_fetch(nfo, 6);
+
+  case NMDCC_SEARCH: { // 0=from, 1=sizerestrict, 2=ismax, 3=size, 4=type, 5=query
+    char *from = c.argv[0];
     unsigned short port = 0;
     char *nfrom = NULL;
     if(strncmp(from, "Hub:", 4) == 0) {
@@ -1718,56 +1735,48 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
       }
     }
     if(nfrom)
-      nmdc_search(hub, nfrom, port, sizerestrict[0] == 'F' ? -2 : ismax[0] == 'T' ? -1 : 1, g_ascii_strtoull(size, NULL, 10), type[0]-'0', query);
-    g_free(from);
-    g_free(sizerestrict);
-    g_free(ismax);
-    g_free(size);
-    g_free(type);
-    g_free(query);
+      nmdc_search(hub, nfrom, port, c.argv[1][0] == 'F' ? -2 : c.argv[2][0] == 'T' ? -1 : 1,
+          g_ascii_strtoull(c.argv[3], NULL, 10), c.argv[4][0]-'0', c.argv[5]);
+    break;
   }
-  g_match_info_free(nfo);
 
-  // $GetPass
-  if(strncmp(cmd, "$GetPass", 8) == 0)
+  case NMDCC_GETPASS:
     hub_password(hub, NULL);
+    break;
 
-  // $BadPass
-  if(strncmp(cmd, "$BadPass", 8) == 0) {
+  case NMDCC_BADPASS:
     if(var_get(hub->id, VAR_password))
       ui_m(hub->tab, 0, "Wrong password. Use '/hset password <password>' to edit your password or '/hunset password' to reset it.");
     else
       ui_m(hub->tab, 0, "Wrong password. Type /reconnect to try again.");
     hub_disconnect(hub, FALSE);
-  }
+    break;
 
-  // $ValidateDenide
-  if(strncmp(cmd, "$ValidateDenide", 15) == 0) {
+  case NMDCC_VALIDATEDENIDE:
     ui_m(hub->tab, 0, "Username invalid or already taken.");
     hub_disconnect(hub, TRUE);
-  }
+    break;
 
-  // $HubIsFull
-  if(strncmp(cmd, "$HubIsFull", 10) == 0) {
+  case NMDCC_HUBISFULL:
     ui_m(hub->tab, 0, "Hub is full.");
     hub_disconnect(hub, TRUE);
-  }
+    break;
 
-  // $SR
-  if(strncmp(cmd, "$SR", 3) == 0) {
-    if(!search_handle_nmdc(hub, cmd))
+  case NMDCC_SR:
+    if(!search_handle_nmdc(hub, c.argv[0]))
       g_message("Received invalid $SR from %s", net_remoteaddr(hub->net));
-  }
+    break;
 
-  // global hub message
-  if(cmd[0] != '$') {
-    char *msg = nmdc_unescape_and_decode(hub, cmd);
+  case NMDCC_CHAT: { // global hub message
+    char *msg = nmdc_unescape_and_decode(hub, c.argv[0]);
     if(msg[0] == '<' || (msg[0] == '*' && msg[1] == '*'))
       ui_m(hub->tab, UIM_PASS|UIM_CHAT|UIP_MED, msg);
     else {
       ui_m(hub->tab, UIM_PASS|UIM_CHAT|UIP_MED, g_strconcat("<hub> ", msg, NULL));
       g_free(msg);
     }
+    break;
+  }
   }
 }
 
@@ -1822,11 +1831,27 @@ hub_t *hub_create(ui_tab_t *tab) {
   hub->sessions = g_hash_table_new(g_direct_hash, g_direct_equal);
   hub->nfo_timer = g_timeout_add_seconds(60, check_nfo, hub);
 
+  ratecalc_init(&hub->rate_in);
+  ratecalc_init(&hub->rate_out);
+  ratecalc_register_group(&hub->rate_in, RCC_DOWN);
+  ratecalc_register_group(&hub->rate_out, RCC_UP);
+  hub_setrate(hub);
+
   g_hash_table_insert(hubs, &hub->id, hub);
   return hub;
 }
 
 
+// Updates the limits of the hub ratecalc groups. Only the settings of the hub
+// itself are used here, the global settings apply to the classes as a whole.
+void hub_setrate(hub_t *hub) {
+  char *up = db_vars_get(hub->id, "upload_rate");
+  char *down = db_vars_get(hub->id, "download_rate");
+  ratecalc_setlimit(&hub->rate_out, up ? g_ascii_strtoll(up, NULL, 10) : 0);
+  ratecalc_setlimit(&hub->rate_in, down ? g_ascii_strtoll(down, NULL, 10) : 0);
+}
+
+
 static void handle_handshake(net_t *n, const char *kpr) {
   g_return_if_fail(kpr != NULL);
   hub_t *hub = net_handle(n);
@@ -1969,6 +1994,8 @@ void hub_free(hub_t *hub) {
   cc_remove_hub(hub);
   g_hash_table_remove(hubs, &hub->id);
   listen_refresh();
+  ratecalc_unregister(&hub->rate_in);
+  ratecalc_unregister(&hub->rate_out);
 
   net_unref(hub->net);
   g_free(hub->nfo_desc);
@@ -1976,6 +2003,7 @@ void hub_free(hub_t *hub) {
   g_free(hub->nfo_mail);
   g_free(hub->nfo_ip);
   g_free(hub->gpa_salt);
+  adc_arena_free(&hub->adc_arena);
   g_hash_table_unref(hub->users);
   g_hash_table_unref(hub->sessions);
   g_source_remove(hub->nfo_timer);
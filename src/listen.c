@@ -49,6 +49,7 @@ struct listen_bind_t {
   struct in6_addr ip6;
   int src; // glib event source
   int sock;
+  guint32 drops; // (UDP) last drop count reported by the kernel
   GSList *hubs; // hubs that use this bind
 };
 
@@ -167,26 +168,45 @@ static gboolean listen_tcp_handle(gpointer dat) {
 }
 
 
+// Reads a batch of datagrams (or a single one if recvmmsg() isn't available)
+// and passes them to search.c. All incoming messages must be search results.
 static gboolean listen_udp_handle(gpointer dat) {
-  static char buf[5000]; // can be static, this function is only called in the main thread.
+  // can be static, this function is only called in the main thread.
+  static char buf[NET_UDP_BATCH][5000];
+  static struct sockaddr_storage addr[NET_UDP_BATCH];
   listen_bind_t *b = dat;
 
-  int r;
-  char addr_str[100];
-  if(b->type & LBT_IP4) {
-    struct sockaddr_in a = {};
-    socklen_t len = sizeof(a);
-    r = recvfrom(b->sock, buf, sizeof(buf)-1, 0, (struct sockaddr *)&a, &len);
-    g_snprintf(addr_str, 100, "%s:%d", ip4_unpack(a.sin_addr), ntohs(a.sin_port));
-  } else {
-    struct sockaddr_in6 a = {};
-    socklen_t len = sizeof(a);
-    r = recvfrom(b->sock, buf, sizeof(buf)-1, 0, (struct sockaddr *)&a, &len);
-    g_snprintf(addr_str, 100, "[%s]:%d", ip6_unpack(a.sin6_addr), ntohs(a.sin6_port));
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr h[NET_UDP_BATCH];
+  struct iovec v[NET_UDP_BATCH];
+# ifdef SO_RXQ_OVFL
+  static char ctl[NET_UDP_BATCH][CMSG_SPACE(sizeof(guint32))];
+# endif
+  int i, n;
+  memset(h, 0, sizeof(h));
+  for(i=0; i<NET_UDP_BATCH; i++) {
+    v[i].iov_base = buf[i];
+    v[i].iov_len = sizeof(buf[i])-1;
+    h[i].msg_hdr.msg_name = addr+i;
+    h[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+    h[i].msg_hdr.msg_iov = v+i;
+    h[i].msg_hdr.msg_iovlen = 1;
+# ifdef SO_RXQ_OVFL
+    h[i].msg_hdr.msg_control = ctl[i];
+    h[i].msg_hdr.msg_controllen = sizeof(ctl[i]);
+# endif
   }
+  n = recvmmsg(b->sock, h, NET_UDP_BATCH, MSG_DONTWAIT, NULL);
+#else
+  int i, n = 1;
+  socklen_t len = sizeof(addr[0]);
+  int r = recvfrom(b->sock, buf[0], sizeof(buf[0])-1, 0, (struct sockaddr *)addr, &len);
+  if(r < 0)
+    n = -1;
+#endif
 
   // handle error
-  if(r < 0) {
+  if(n < 0) {
     if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
       return TRUE;
     ui_mf(uit_main_tab, 0, "UDP read error on %s: %s. Switching to passive mode.",
@@ -195,13 +215,38 @@ static gboolean listen_udp_handle(gpointer dat) {
     hub_global_nfochange();
     return FALSE;
   }
+  hist_add(&net_udp_stats_recv, n);
+
+  for(i=0; i<n; i++) {
+#ifdef HAVE_RECVMMSG
+    int r = h[i].msg_len;
+# ifdef SO_RXQ_OVFL
+    // The kernel includes the total drop count of the socket
+    struct cmsghdr *c;
+    for(c=CMSG_FIRSTHDR(&h[i].msg_hdr); c; c=CMSG_NXTHDR(&h[i].msg_hdr, c))
+      if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+        guint32 d;
+        memcpy(&d, CMSG_DATA(c), sizeof(d));
+        net_udp_drops_recv += d - b->drops;
+        b->drops = d;
+      }
+# endif
+#endif
+    char addr_str[100];
+    if(b->type & LBT_IP4) {
+      struct sockaddr_in *a = (struct sockaddr_in *)(addr+i);
+      g_snprintf(addr_str, 100, "%s:%d", ip4_unpack(a->sin_addr), ntohs(a->sin_port));
+    } else {
+      struct sockaddr_in6 *a = (struct sockaddr_in6 *)(addr+i);
+      g_snprintf(addr_str, 100, "[%s]:%d", ip6_unpack(a->sin6_addr), ntohs(a->sin6_port));
+    }
 
-  // Since all incoming messages must be search results, just pass the messages to search.c
-  buf[r] = 0;
-  if(!search_handle_udp(addr_str, buf, r)) {
-    // The message may habe been encrypted with SUDP, so this error reporting
-    // may not be too useful.
-    g_message("UDP:%s: Invalid message: %s", addr_str, buf);
+    buf[i][r] = 0;
+    if(!search_handle_udp(addr_str, buf[i], r)) {
+      // The message may habe been encrypted with SUDP, so this error reporting
+      // may not be too useful.
+      g_message("UDP:%s: Invalid message: %s", addr_str, buf[i]);
+    }
   }
   return TRUE;
 }
@@ -292,6 +337,11 @@ static void bind_create(listen_bind_t *b) {
 
   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
   fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0)|O_NONBLOCK);
+#if defined(HAVE_RECVMMSG) && defined(SO_RXQ_OVFL)
+  // Have the kernel report the number of dropped datagrams
+  if(b->type & LBT_UDP)
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, (void *)&one, sizeof(one));
+#endif
 
   // Bind
   int r = b->type & LBT_IP4
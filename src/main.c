@@ -155,9 +155,6 @@ static gboolean stdin_read(GIOChannel *src, GIOCondition cond, gpointer dat) {
 
 
 static gboolean one_second_timer(gpointer dat) {
-  // TODO: ratecalc_calc() requires fairly precise timing, perhaps do this in a separate thread?
-  ratecalc_calc();
-
   // Detect day change
   static char pday[11] = ""; // YYYY-MM-DD
   char *cday = localtime_fmt("%F");
@@ -241,9 +238,9 @@ static FILE *stderrlog;
 // redirect all non-fatal errors to the log
 static void log_redirect(const gchar *dom, GLogLevelFlags level, const gchar *msg, gpointer dat) {
   if(!(level & (G_LOG_LEVEL_INFO|G_LOG_LEVEL_DEBUG)) || (stderrlog != stderr && var_log_debug)) {
-    char *ts = localtime_fmt("[%F %H:%M:%S %Z]");
+    char ts[64];
+    logfile_timestamp(ts);
     fprintf(stderrlog, "%s *%s* %s\n", ts, loglevel_to_str(level), msg);
-    g_free(ts);
     fflush(stderrlog);
   }
 }
@@ -251,7 +248,8 @@ static void log_redirect(const gchar *dom, GLogLevelFlags level, const gchar *ms
 
 // clean-up our ncurses window before throwing a fatal error
 static void log_fatal(const gchar *dom, GLogLevelFlags level, const gchar *msg, gpointer dat) {
-  endwin();
+  if(!ui_headless)
+    endwin();
   // print to both log file and stdout
   if(stderrlog != stderr) {
     fprintf(stderrlog, "\n\n*%s* %s\n", loglevel_to_str(level), msg);
@@ -370,6 +368,8 @@ static GOptionEntry cli_options[] = {
       "Don't automatically connect to hubs with the `autoconnect' option set.", NULL },
   { "no-bracketed-paste", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &bracketed_paste,
       "Disable bracketed pasting.", NULL },
+  { "headless", 0, 0, G_OPTION_ARG_NONE, &ui_headless,
+      "Run without user interface, accepting commands on `$NCDC_DIR/ncdc.sock'.", NULL },
   { NULL }
 };
 
@@ -415,7 +415,7 @@ int main(int argc, char **argv) {
   g_option_context_free(optx);
 
   // check that the current locale is UTF-8. Things aren't going to work otherwise
-  if(!g_get_charset(NULL)) {
+  if(!g_get_charset(NULL) && !ui_headless) {
     puts("WARNING: Your current locale is not set to UTF-8.");
     puts("Non-ASCII characters may not display correctly.");
     puts("Hit Ctrl+c to abort ncdc, or the return key to continue anyway.");
@@ -436,6 +436,8 @@ int main(int argc, char **argv) {
   // Init database & variables
   db_init();
   vars_init();
+  db_init_readers();
+  ratecalc_init_global();
 
   // open log file
   char *errlog = g_build_filename(db_dir, "stderr.log", NULL);
@@ -451,6 +453,7 @@ int main(int argc, char **argv) {
   listen_global_init();
   cc_global_init();
   dl_init_global();
+  perf_init();
   ui_cmdhist_init("history");
   ui_init(bracketed_paste);
   geoip_reinit(4);
@@ -487,10 +490,14 @@ int main(int argc, char **argv) {
   fl_init();
   if(auto_open)
     open_autoconnect();
+  if(ui_headless)
+    ctl_init();
 
   // add some watches and start the main loop
-  GIOChannel *in = g_io_channel_unix_new(STDIN_FILENO);
-  g_io_add_watch(in, G_IO_IN, stdin_read, NULL);
+  if(!ui_headless) {
+    GIOChannel *in = g_io_channel_unix_new(STDIN_FILENO);
+    g_io_add_watch(in, G_IO_IN, stdin_read, NULL);
+  }
 
   GSource *sighandle = g_source_new(&sighandle_funcs, sizeof(GSource));
   g_source_set_priority(sighandle, G_PRIORITY_HIGH);
@@ -499,14 +506,17 @@ int main(int argc, char **argv) {
   g_source_unref(sighandle);
 
   g_timeout_add_seconds_full(G_PRIORITY_HIGH, 1, one_second_timer, NULL, NULL);
-  g_timeout_add(100, screen_update_check, NULL);
+  if(!ui_headless)
+    g_timeout_add(100, screen_update_check, NULL);
   int maxage = var_get_int(0, VAR_filelist_maxage);
   g_timeout_add_seconds_full(G_PRIORITY_LOW, CLAMP(maxage, 3600, 24*3600), dl_fl_clean, NULL, NULL);
 
   g_main_loop_run(main_loop);
 
   // cleanup
-  if(!main_noterm) {
+  if(ui_headless)
+    ctl_close();
+  else if(!main_noterm) {
     erase();
     refresh();
     endwin();
@@ -521,8 +531,9 @@ int main(int argc, char **argv) {
   fl_flush(NULL);
   dl_close_global();
   db_close();
+  logfile_global_close();
   gnutls_global_deinit();
-  if(!main_noterm)
+  if(!main_noterm && !ui_headless)
     printf(" Done!\n");
 
   g_debug("Clean shutdown.");
@@ -35,6 +35,21 @@ ratecalc_t net_in, net_out;
 #define NET_MAX_RBUF  (1024*1024)
 #define NET_TRANS_BUF (  32*1024)
 
+#define asy_rlen(n) ((n)->rbuf->len - (n)->roff)
+#define asy_wlen(n) ((n)->wbuf->len - (n)->woff)
+
+// Kernel TLS offloading for sending, see net_ktls_enable()
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_GNUTLS_RECORD_GET_STATE)
+# define USE_KTLS
+# include <linux/tls.h>
+# ifndef SOL_TLS
+#  define SOL_TLS 282
+# endif
+# ifndef TCP_ULP
+#  define TCP_ULP 31
+# endif
+#endif
+
 
 #if INTERFACE
 
@@ -81,10 +96,14 @@ struct net_t {
   gboolean shutdown_closed : 4; // state DIS, whether shutdown() has been called on the socket.
   gboolean writing : 4; // state ASY. Whether 'socksrc' is write poll event.
   gboolean wantwrite : 4; // state ASY. Whether we want a write on sock.
+  gboolean ktls : 4; // state ASY,SYN,DIS. Whether sending is done by the kernel, see net_ktls_enable().
 
   GString *tlsrbuf; // state ASY. Temporary buffer for data read before switching to TLS. (To be fed to GnuTLS)
   GString *rbuf; // state ASY. Read buffer.
   GString *wbuf; // state ASY. Write buffer.
+  // Number of bytes at the start of rbuf/wbuf that have already been
+  // consumed/sent. The buffers are only compacted when necessary.
+  gsize roff, woff;
 
   // Called when an error has occured. Second argument is NETERR_*, third a
   // string representing the error.
@@ -94,6 +113,7 @@ struct net_t {
   void (*rd_cb)(net_t *, char *, int len);
   gboolean rd_msg : 1; // TRUE: message, rd_dat=EOM; FALSE=bytes, rd_dat=count
   gboolean rd_consume : 1;
+  gboolean rd_loop : 1; // Whether asy_handlerbuf() is running its callback loop
   int rd_dat;
 
   // Synchronous file transfers (SYN state) When set in the ASY state, it means
@@ -188,6 +208,13 @@ static int low_recv(net_t *n, char *buf, int len, const char **err) {
 
 static ssize_t tls_push(gnutls_transport_ptr_t dat, const void *buf, size_t len) {
   net_t *n = dat;
+  // GnuTLS can't send anything anymore after the kernel has taken over, its
+  // sequence numbers are out of date. (This may happen if the peer requests a
+  // key update or renegotiation)
+  if(n->ktls) {
+    gnutls_transport_set_errno(n->tls, EIO);
+    return -1;
+  }
   int r = send(n->sock, buf, len, 0);
   if(r < 0)
     gnutls_transport_set_errno(n->tls, errno == EWOULDBLOCK ? EAGAIN : errno);
@@ -200,13 +227,15 @@ static ssize_t tls_push(gnutls_transport_ptr_t dat, const void *buf, size_t len)
 
 
 // Same as low_recv(), but for send().
+// With kernel TLS, a plain send() is used and the kernel handles encryption.
 static int low_send(net_t *n, const char *buf, int len, const char **err) {
-  int r = n->tls
+  gboolean tls = n->tls && !n->ktls;
+  int r = tls
     ? gnutls_record_send(n->tls, buf, len)
     : send(n->sock,              buf, len, 0);
 
   // Note: r == 0 is seen as a temporary error
-  if(!r || (r < 0 && (n->tls ? !gnutls_error_is_fatal(r) : errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN))) {
+  if(!r || (r < 0 && (tls ? !gnutls_error_is_fatal(r) : errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN))) {
     *err = NULL;
     return -1;
   }
@@ -214,11 +243,11 @@ static int low_send(net_t *n, const char *buf, int len, const char **err) {
   if(n->state != NETST_DIS)
     time(&n->timeout_last);
   if(r < 0) {
-    *err = n->tls ? gnutls_strerror(r) : g_strerror(errno);
+    *err = tls ? gnutls_strerror(r) : g_strerror(errno);
     return -1;
   }
 
-  if(!n->tls) {
+  if(!tls) {
     ratecalc_add(&net_out, r);
     ratecalc_add(&n->rate_out, r);
   }
@@ -226,6 +255,272 @@ static int low_send(net_t *n, const char *buf, int len, const char **err) {
 }
 
 
+// Hands the encryption of outgoing data over to the kernel (Linux kTLS), so
+// that sendfile() can be used on a TLS connection. Only the sending side is
+// offloaded; received data is still decrypted by GnuTLS. Must be called in
+// the main thread after a successful handshake, when GnuTLS has no buffered
+// outgoing data. Returns FALSE and leaves the connection untouched if the
+// kernel or the negotiated cipher is not supported.
+static gboolean net_ktls_enable(net_t *n) {
+#ifdef USE_KTLS
+  gnutls_protocol_t ver = gnutls_protocol_get_version(n->tls);
+  gnutls_cipher_algorithm_t cipher = gnutls_cipher_get(n->tls);
+  union {
+    struct tls12_crypto_info_aes_gcm_128 c128;
+#ifdef TLS_CIPHER_AES_GCM_256
+    struct tls12_crypto_info_aes_gcm_256 c256;
+#endif
+  } ci = {};
+  int cilen;
+
+  int version =
+#ifdef TLS_1_3_VERSION
+    ver == GNUTLS_TLS1_3 ? TLS_1_3_VERSION :
+#endif
+    ver == GNUTLS_TLS1_2 ? TLS_1_2_VERSION : 0;
+  if(!version)
+    return FALSE;
+
+  gnutls_datum_t mac, iv, key;
+  unsigned char seq[8];
+  if(gnutls_record_get_state(n->tls, 0, &mac, &iv, &key, seq) < 0)
+    return FALSE;
+
+  // TLS 1.2 has a 4-byte implicit IV (the salt) and uses the sequence number
+  // as explicit nonce, TLS 1.3 has a 12-byte IV (salt + iv).
+#define ktls_fill(c, bits) do {\
+    ci.c.info.version = version;\
+    ci.c.info.cipher_type = TLS_CIPHER_AES_GCM_##bits;\
+    if(key.size != sizeof(ci.c.key) || iv.size < sizeof(ci.c.salt)\
+        || (version != TLS_1_2_VERSION && iv.size != sizeof(ci.c.salt)+sizeof(ci.c.iv)))\
+      return FALSE;\
+    memcpy(ci.c.key, key.data, key.size);\
+    memcpy(ci.c.salt, iv.data, sizeof(ci.c.salt));\
+    memcpy(ci.c.iv, version == TLS_1_2_VERSION ? seq : iv.data+sizeof(ci.c.salt), sizeof(ci.c.iv));\
+    memcpy(ci.c.rec_seq, seq, sizeof(ci.c.rec_seq));\
+    cilen = sizeof(ci.c);\
+  } while(0)
+
+  if(cipher == GNUTLS_CIPHER_AES_128_GCM)
+    ktls_fill(c128, 128);
+#ifdef TLS_CIPHER_AES_GCM_256
+  else if(cipher == GNUTLS_CIPHER_AES_256_GCM)
+    ktls_fill(c256, 256);
+#endif
+  else
+    return FALSE;
+#undef ktls_fill
+
+  // Attaching the TLS ULP without configuring a key leaves the socket
+  // functioning as a normal TCP socket, so it's safe to fall back after the
+  // second setsockopt() fails.
+  if(setsockopt(n->sock, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0
+      || setsockopt(n->sock, SOL_TLS, TLS_TX, &ci, cilen) < 0) {
+    g_debug("%s: Kernel TLS not available: %s", net_remoteaddr(n), g_strerror(errno));
+    memset(&ci, 0, sizeof(ci));
+    return FALSE;
+  }
+  memset(&ci, 0, sizeof(ci));
+  g_debug("%s: Enabled kernel TLS for sending", net_remoteaddr(n));
+  n->ktls = TRUE;
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+
+
+
+
+
+// Shared upload block cache
+
+// When a popular file is being uploaded to several users at the same time,
+// and sendfile() can't be used (e.g. with TLS), every transfer would read the
+// same data from disk. The upload_cache setting enables a block cache shared
+// between uploads, indexed by TTH and block number. Blocks are evicted in LRU
+// order, but remain valid for transfers that still hold a reference. When the
+// next block will be needed by a transfer, the OS is asked to read it ahead.
+// If flush_file_cache includes uploads, data that has been read into this
+// cache is dropped from the OS cache immediately.
+// All functions are thread-safe.
+
+#define UPC_BLOCK (1024*1024)
+
+typedef struct upc_block_t {
+  char tth[24];
+  guint64 num;
+  int ref; // one for each transfer using it, plus one while in the cache
+  int len;
+  GList *lru; // NULL when not in the cache
+  char dat[];
+} upc_block_t;
+
+static GStaticMutex upc_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *upc_table = NULL; // upc_block_t -> upc_block_t
+static GQueue upc_lru = G_QUEUE_INIT; // most recently used first
+static guint64 upc_bytes = 0;
+static guint64 upc_max = 0;
+
+// Statistics
+static guint64 upc_hits, upc_misses, upc_hitbytes;
+
+
+static guint upc_hash(gconstpointer a) {
+  const upc_block_t *b = a;
+  return *((guint *)b->tth) ^ (guint)(b->num * 2654435761U);
+}
+
+static gboolean upc_equal(gconstpointer a, gconstpointer b) {
+  const upc_block_t *x = a;
+  const upc_block_t *y = b;
+  return x->num == y->num && memcmp(x->tth, y->tth, 24) == 0;
+}
+
+
+// Must be called with upc_lock held.
+static void upc_unref_locked(upc_block_t *b) {
+  if(--b->ref <= 0)
+    g_free(b);
+}
+
+
+static void upc_unref(upc_block_t *b) {
+  g_static_mutex_lock(&upc_lock);
+  upc_unref_locked(b);
+  g_static_mutex_unlock(&upc_lock);
+}
+
+
+// Must be called with upc_lock held.
+static void upc_evict(guint64 max) {
+  while(upc_bytes > max) {
+    upc_block_t *b = g_queue_pop_tail(&upc_lru);
+    g_hash_table_remove(upc_table, b);
+    b->lru = NULL;
+    upc_bytes -= b->len;
+    upc_unref_locked(b);
+  }
+}
+
+
+// Sets the maximum size of the cache, in bytes. 0 disables the cache.
+static void upc_setmax(guint64 max) {
+  g_static_mutex_lock(&upc_lock);
+  if(!upc_table)
+    upc_table = g_hash_table_new(upc_hash, upc_equal);
+  upc_max = max;
+  upc_evict(max);
+  g_static_mutex_unlock(&upc_lock);
+}
+
+
+static gboolean upc_has(const char *tth, guint64 num) {
+  upc_block_t k;
+  memcpy(k.tth, tth, 24);
+  k.num = num;
+  g_static_mutex_lock(&upc_lock);
+  gboolean r = g_hash_table_lookup(upc_table, &k) ? TRUE : FALSE;
+  g_static_mutex_unlock(&upc_lock);
+  return r;
+}
+
+
+// Returns a reference to the given block, reading it from fd if it isn't in
+// the cache. Returns NULL on error, with errno set.
+static upc_block_t *upc_get(const char *tth, guint64 num, int fd, gboolean flush) {
+  upc_block_t k, *b;
+  memcpy(k.tth, tth, 24);
+  k.num = num;
+
+  g_static_mutex_lock(&upc_lock);
+  if((b = g_hash_table_lookup(upc_table, &k))) {
+    g_queue_unlink(&upc_lru, b->lru);
+    g_queue_push_head_link(&upc_lru, b->lru);
+    b->ref++;
+    upc_hits++;
+    upc_hitbytes += b->len;
+    g_static_mutex_unlock(&upc_lock);
+    return b;
+  }
+  g_static_mutex_unlock(&upc_lock);
+
+  // Read without holding the lock, so other transfers don't have to wait for
+  // the disk.
+  b = g_malloc(offsetof(upc_block_t, dat) + UPC_BLOCK);
+  int len = 0;
+  while(len < UPC_BLOCK) {
+    ssize_t r = pread(fd, b->dat+len, UPC_BLOCK-len, num*UPC_BLOCK+len);
+    if(r < 0 && errno == EINTR)
+      continue;
+    if(r <= 0)
+      break;
+    len += r;
+  }
+  if(!len) {
+    int e = errno;
+    g_free(b);
+    errno = e ? e : EIO;
+    return NULL;
+  }
+  if(flush)
+    fadv_oneshot(fd, num*UPC_BLOCK, len, VAR_FFC_UPLOAD);
+  if(len < UPC_BLOCK)
+    b = g_realloc(b, offsetof(upc_block_t, dat) + len);
+  memcpy(b->tth, tth, 24);
+  b->num = num;
+  b->len = len;
+  b->ref = 1;
+  b->lru = NULL;
+
+  g_static_mutex_lock(&upc_lock);
+  upc_misses++;
+  upc_block_t *o = g_hash_table_lookup(upc_table, b);
+  // Another transfer has read the same block in the mean time
+  if(o) {
+    g_free(b);
+    b = o;
+    b->ref++;
+  } else if(upc_max >= (guint64)len) {
+    b->ref++;
+    g_queue_push_head(&upc_lru, b);
+    b->lru = upc_lru.head;
+    g_hash_table_insert(upc_table, b, b);
+    upc_bytes += len;
+    upc_evict(upc_max);
+  }
+  g_static_mutex_unlock(&upc_lock);
+  return b;
+}
+
+
+// Hints the OS to read the given block if it isn't in the cache yet.
+static void upc_readahead(const char *tth, guint64 num, int fd) {
+#ifdef HAVE_POSIX_FADVISE
+  if(!upc_has(tth, num))
+    posix_fadvise(fd, num*UPC_BLOCK, UPC_BLOCK, POSIX_FADV_WILLNEED);
+#endif
+}
+
+
+void net_upload_cache_stats(GString *out) {
+  g_static_mutex_lock(&upc_lock);
+  guint64 hits = upc_hits, misses = upc_misses, hitbytes = upc_hitbytes, bytes = upc_bytes, max = upc_max;
+  int num = upc_lru.length;
+  g_static_mutex_unlock(&upc_lock);
+
+  if(!max && !hits && !misses) {
+    g_string_append(out, "Disabled\n");
+    return;
+  }
+  g_string_append_printf(out, "Cached: %d blocks, %s", num, str_formatsize(bytes));
+  g_string_append_printf(out, " of %s\n", str_formatsize(max));
+  g_string_append_printf(out, "Lookups: %"G_GUINT64_FORMAT" hits, %"G_GUINT64_FORMAT" misses (%.1f%% hit rate), %s served from the cache\n",
+    hits, misses, hits+misses ? 100.0*hits/(hits+misses) : 0.0, str_formatsize(hitbytes));
+}
+
+
 
 
 
@@ -241,8 +536,18 @@ struct synfer_t {
   int fd;     // for uploads
   int cancel; // set to 1 to cancel transfer
   int can[2]; // close() this pipe (can[1]) to cancel the transfer
+  int sock;   // copy of net->sock, made when the transfer is started
   gboolean upl : 1; // whether this is an upload or download
   gboolean flush : 1; // for uploads
+  gboolean sendfile : 1; // for uploads, whether to use sendfile()
+  gboolean cache : 1; // for uploads, whether to use the upload cache
+  char tth[24];  // for uploads with cache set
+  upc_block_t *blk; // for uploads with cache set, the block at bufp
+  off_t off;     // for sendfile() and the upload cache, the current file offset
+  fadv_t adv;    // for uploads, if flush is set
+  char *buf;     // transfer buffer, NET_TRANS_BUF bytes
+  char *bufp;    // for uploads, start of the data in buf that hasn't been sent yet
+  int buflen;    // for uploads, length of the data at bufp
   char *err;
   void *ctx; // for downloads
   void (*cb_downdone)(net_t *, void *);
@@ -340,11 +645,9 @@ static int syn_wait(synfer_t *s, int sock, gboolean write) {
   int b = 0;
   int r = 0;
   while(r <= 0 && (b = ratecalc_burst(write ? &s->net->rate_out : &s->net->rate_in)) <= 0) {
-    // Wake up 4 times per second. If the resource is CPU or HDD I/O
-    // constrained, then this means that at most 1/4th of the possible usage
-    // time is "thrown away". I don't expect this to be much of an issue,
-    // however.
-    r = g_poll(fds, 1, 250); // only poll for the cancel fd here.
+    // Wake up every time the rate calculation thread hands out new
+    // bandwidth.
+    r = g_poll(fds, 1, RATECALC_TICK); // only poll for the cancel fd here.
     g_return_val_if_fail(r >= 0 || errno == EINTR, 0);
   }
   if(r)
@@ -361,183 +664,348 @@ static int syn_wait(synfer_t *s, int sock, gboolean write) {
 }
 
 
-#ifdef HAVE_SENDFILE
+// The functions below each perform a single send or receive operation of at
+// most `b' bytes, after syn_wait() or a syn_worker_thread() has determined
+// that the socket is ready. They return FALSE when the transfer can't continue
+// with this function, either because of an error (s->err is set), because the
+// transfer has been cancelled, or (for sendfile) when the fallback should be
+// used instead.
 
-static void syn_upload_sendfile(synfer_t *s, int sock, fadv_t *adv) {
-  off_t off = lseek(s->fd, 0, SEEK_CUR);
-  if(off == (off_t)-1) {
-    s->err = g_strdup(g_strerror(errno));
-    return;
-  }
+#ifdef HAVE_SENDFILE
 
-  while(s->left > 0 && !s->err && !s->cancel) {
-    off_t oldoff = off;
-    int b = syn_wait(s, sock, TRUE);
-    if(b <= 0)
-      return;
+static gboolean syn_upload_sendfile(synfer_t *s, int b) {
+  off_t oldoff = s->off;
 
-    // No need for a lock here, we're not using the TLS session and socket fd's
-    // are thread-safe. To some extent at least.
+  // Need to use s->sock here, since s->net->sock may be modified from the main
+  // thread. No need to lock the synfer struct here, since no low_* functions
+  // are used. It's important, however, that sendfile() and ratecalc_add()
+  // are thread-safe. To some extent at least.
 #ifdef HAVE_LINUX_SENDFILE
-    // XXX: On 32bit Linux with musl, sendfile() may fail with EOVERFLOW when
-    // an offset argument is given and is larger than UINT32_MAX, so we're
-    // passing NULL instead to use the fd's internal file offset.
-    ssize_t r = sendfile(sock, s->fd, NULL, MIN(b, s->left));
+  // XXX: On 32bit Linux with musl, sendfile() may fail with EOVERFLOW when
+  // an offset argument is given and is larger than UINT32_MAX, so we're
+  // passing NULL instead to use the fd's internal file offset.
+  ssize_t r = sendfile(s->sock, s->fd, NULL, MIN(b, s->left));
 #elif HAVE_BSD_SENDFILE
-    off_t len = 0;
-    gint64 r = sendfile(s->fd, sock, off, (size_t)MIN(b, s->left), NULL, &len, 0);
-    // a partial write results in an EAGAIN error on BSD, even though this isn't
-    // really an error condition at all.
-    if(r != -1 || (r == -1 && errno == EAGAIN))
-      r = len;
+  off_t len = 0;
+  gint64 r = sendfile(s->fd, s->sock, s->off, (size_t)MIN(b, s->left), NULL, &len, 0);
+  // a partial write results in an EAGAIN error on BSD, even though this isn't
+  // really an error condition at all.
+  if(r != -1 || (r == -1 && errno == EAGAIN))
+    r = len;
 #endif
 
-    if(r >= 0) {
-      if(s->flush)
-        fadv_purge(adv, r);
-      off = oldoff + r;
-      // This bypasses the low_send() function, so manually add it to the
-      // ratecalc thing and update timeout_last.
-      ratecalc_add(&net_out, r);
-      ratecalc_add(&s->net->rate_out, r);
-      g_static_mutex_lock(&s->lock);
-      time(&s->net->timeout_last);
-      s->left -= r;
-      g_static_mutex_unlock(&s->lock);
-      continue;
-    } else if(errno == EAGAIN || errno == EINTR) {
-      continue;
-    } else if(errno == ENOTSUP || errno == ENOSYS || errno == EINVAL || errno == EOVERFLOW) {
-      // Don't set s->err here, let the fallback handle the rest
-      g_message("sendfile() failed with `%s', using fallback.", g_strerror(errno));
-      // The fallback code continues from the fd position, so make sure to
-      // update it in case (FreeBSD's) sendfile() didn't do so.
-      if(lseek(s->fd, off, SEEK_SET) == (off_t)-1) {
-        g_message("Can't switch to fallback, seek failed: %d (%s)", errno, g_strerror(errno));
-        s->err = g_strdup(g_strerror(errno));
-      }
-      return;
-    } else {
-      if(errno != EPIPE && errno != ECONNRESET)
-        g_message("sendfile() returned an unknown error: %d (%s)", errno, g_strerror(errno));
+  if(r >= 0) {
+    if(s->flush)
+      fadv_purge(&s->adv, r);
+    s->off = oldoff + r;
+    // This bypasses the low_send() function, so manually add it to the
+    // ratecalc thing and update timeout_last.
+    ratecalc_add(&net_out, r);
+    ratecalc_add(&s->net->rate_out, r);
+    g_static_mutex_lock(&s->lock);
+    time(&s->net->timeout_last);
+    s->left -= r;
+    g_static_mutex_unlock(&s->lock);
+    return TRUE;
+  } else if(errno == EAGAIN || errno == EINTR) {
+    return TRUE;
+  } else if(errno == ENOTSUP || errno == ENOSYS || errno == EINVAL || errno == EOVERFLOW) {
+    // Don't set s->err here, let the fallback handle the rest
+    g_message("sendfile() failed with `%s', using fallback.", g_strerror(errno));
+    s->sendfile = FALSE;
+    // The fallback code continues from the fd position, so make sure to
+    // update it in case (FreeBSD's) sendfile() didn't do so.
+    if(lseek(s->fd, s->off, SEEK_SET) == (off_t)-1) {
+      g_message("Can't switch to fallback, seek failed: %d (%s)", errno, g_strerror(errno));
       s->err = g_strdup(g_strerror(errno));
-      return;
     }
+    return FALSE;
+  } else {
+    if(errno != EPIPE && errno != ECONNRESET)
+      g_message("sendfile() returned an unknown error: %d (%s)", errno, g_strerror(errno));
+    s->err = g_strdup(g_strerror(errno));
+    return FALSE;
   }
 }
 
 #endif
 
 
-static void syn_upload_buf(synfer_t *s, int sock, fadv_t *adv) {
-  char *buf = g_malloc(NET_TRANS_BUF);
-
-  while(s->left > 0 && !s->err && !s->cancel) {
-    int rd = read(s->fd, buf, MIN(NET_TRANS_BUF, s->left));
+static gboolean syn_upload_buf(synfer_t *s, int b) {
+  if(!s->buflen && s->cache) {
+    if(s->blk)
+      upc_unref(s->blk);
+    guint64 num = s->off / UPC_BLOCK;
+    int boff = s->off % UPC_BLOCK;
+    s->blk = upc_get(s->tth, num, s->fd, s->flush);
+    if(!s->blk || s->blk->len <= boff) {
+      s->err = g_strdup(!s->blk ? g_strerror(errno) : "Unexpected end of file");
+      return FALSE;
+    }
+    if(s->left > (guint64)(s->blk->len - boff))
+      upc_readahead(s->tth, num+1, s->fd);
+    s->bufp = s->blk->dat + boff;
+    s->buflen = MIN((guint64)(s->blk->len - boff), s->left);
+  } else if(!s->buflen) {
+    int rd = read(s->fd, s->buf, MIN(NET_TRANS_BUF, s->left));
     if(rd <= 0) {
       s->err = g_strdup(g_strerror(errno));
-      goto done;
+      return FALSE;
     }
     if(s->flush)
-      fadv_purge(adv, rd);
+      fadv_purge(&s->adv, rd);
+    s->bufp = s->buf;
+    s->buflen = rd;
+  }
 
-    char *p = buf;
-    while(rd > 0) {
-      int b = syn_wait(s, sock, TRUE);
-      if(b <= 0)
-        goto done;
-
-      g_static_mutex_lock(&s->lock);
-      const char *err = NULL;
-      int wr = s->cancel || !s->net->sock ? 0 : low_send(s->net, p, MIN(rd, b), &err);
-      // successful write
-      if(wr > 0) {
-        p += wr;
-        s->left -= wr;
-        rd -= wr;
-      }
-      g_static_mutex_unlock(&s->lock);
-
-      if(!wr) // cancelled
-        goto done;
-      if(wr < 0 && !err) // would block
-        continue;
-      if(wr < 0) { // actual error
-        s->err = g_strdup(err);
-        goto done;
-      }
-    }
+  g_static_mutex_lock(&s->lock);
+  const char *err = NULL;
+  int wr = s->cancel || !s->net->sock ? 0 : low_send(s->net, s->bufp, MIN(s->buflen, b), &err);
+  // successful write
+  if(wr > 0) {
+    s->bufp += wr;
+    s->left -= wr;
+    s->buflen -= wr;
+    s->off += wr;
   }
+  g_static_mutex_unlock(&s->lock);
 
-done:
-  g_free(buf);
+  if(!wr) // cancelled
+    return FALSE;
+  if(wr < 0 && !err) // would block
+    return TRUE;
+  if(wr < 0) { // actual error
+    s->err = g_strdup(err);
+    return FALSE;
+  }
+  return TRUE;
 }
 
 
-static void syn_download(synfer_t *s, int sock) {
-  char *buf = g_malloc(NET_TRANS_BUF);
+static gboolean syn_download(synfer_t *s) {
+  g_static_mutex_lock(&s->lock);
+  const char *err = NULL;
+  int r = s->cancel || !s->net->sock ? 0 : low_recv(s->net, s->buf, MIN(NET_TRANS_BUF, s->left), &err);
+  if(r > 0)
+    s->left -= r;
+  g_static_mutex_unlock(&s->lock);
 
-  while(s->left > 0 && !s->err && !s->cancel) {
-    int b = syn_wait(s, sock, FALSE);
-    if(b <= 0)
-      break;
+  if(!r)
+    return FALSE;
+  if(r < 0 && !err)
+    return TRUE;
+  if(r < 0) {
+    s->err = g_strdup(err);
+    return FALSE;
+  }
 
-    g_static_mutex_lock(&s->lock);
-    const char *err = NULL;
-    int r = s->cancel || !s->net->sock ? 0 : low_recv(s->net, buf, MIN(NET_TRANS_BUF, s->left), &err);
-    if(r > 0)
-      s->left -= r;
-    g_static_mutex_unlock(&s->lock);
+  if(!s->cb_downdata(s->ctx, s->buf, r)) {
+    s->err = g_strdup("Operation cancelled");
+    return FALSE;
+  }
+  return TRUE;
+}
 
-    if(!r)
-      break;
-    if(r < 0 && !err)
-      continue;
-    if(r < 0) {
-      s->err = g_strdup(err);
-      break;
-    }
 
-    if(!s->cb_downdata(s->ctx, buf, r)) {
-      s->err = g_strdup("Operation cancelled");
-      break;
-    }
+static gboolean syn_step(synfer_t *s, int b) {
+  if(!s->upl)
+    return syn_download(s);
+#ifdef HAVE_SENDFILE
+  // Continue with the fallback if sendfile() isn't supported
+  if(s->sendfile)
+    return syn_upload_sendfile(s, b) || (!s->sendfile && !s->err);
+#endif
+  return syn_upload_buf(s, b);
+}
+
+
+// Called from the transfer thread before the first syn_step().
+static void syn_begin(synfer_t *s) {
+  s->buf = g_malloc(NET_TRANS_BUF);
+  if(s->upl && s->flush && !s->cache)
+    fadv_init(&s->adv, s->fd, lseek(s->fd, 0, SEEK_CUR), VAR_FFC_UPLOAD);
+  if((s->sendfile || s->cache) && (s->off = lseek(s->fd, 0, SEEK_CUR)) == (off_t)-1)
+    s->err = g_strdup(g_strerror(errno));
+}
+
+
+// Called from the transfer thread when the transfer has stopped. Queues
+// syn_done() in the main thread.
+static void syn_end(synfer_t *s) {
+  if(s->upl && s->flush && !s->cache)
+    fadv_close(&s->adv);
+  if(s->blk) {
+    upc_unref(s->blk);
+    s->blk = NULL;
   }
 
-  g_free(buf);
+  // Signal the end of the data to the download callback, so that any buffered
+  // data can be flushed from this thread.
+  if(!s->upl && !s->cb_downdata(s->ctx, NULL, 0) && !s->err)
+    s->err = g_strdup("Operation cancelled");
+
+  g_free(s->buf);
+  s->buf = NULL;
+  g_idle_add(syn_done, s);
 }
 
 
+static gboolean syn_continue(synfer_t *s) {
+  return s->sock && s->left > 0 && !s->err && !s->cancel;
+}
+
+
+// Number of transfers currently handled by syn_thread(), and the highest
+// number seen so far. (atomic)
+static int syn_threads = 0;
+static int syn_threads_peak = 0;
+
+// The default engine: one thread (from syn_pool) for each transfer.
 static void syn_thread(gpointer dat, gpointer udat) {
   synfer_t *s = dat;
+  int n = g_atomic_int_exchange_and_add(&syn_threads, 1) + 1;
+  if(n > g_atomic_int_get(&syn_threads_peak))
+    g_atomic_int_set(&syn_threads_peak, n);
+  syn_begin(s);
+
+  while(syn_continue(s)) {
+    int b = syn_wait(s, s->sock, s->upl);
+    if(b <= 0 || !syn_step(s, b))
+      break;
+  }
 
-  // Make a copy of sock to make sure it doesn't disappear on us.
-  // (Still need to obtain the lock to make use of it).
-  g_static_mutex_lock(&s->lock);
-  int sock = s->net->sock;
-  gboolean tls = !!s->net->tls;
-  g_static_mutex_unlock(&s->lock);
+  syn_end(s);
+  g_atomic_int_add(&syn_threads, -1);
+}
 
-  if(sock && !s->cancel && s->upl) {
-    fadv_t adv;
-    if(s->flush)
-      fadv_init(&adv, s->fd, lseek(s->fd, 0, SEEK_CUR), VAR_FFC_UPLOAD);
 
-#ifdef HAVE_SENDFILE
-    if(!tls && var_get_bool(0, VAR_sendfile))
-      syn_upload_sendfile(s, sock, &adv);
-#endif
-    if(s->left > 0 && !s->err && !s->cancel)
-      syn_upload_buf(s, sock, &adv);
+// The alternative engine, used when transfer_threads is set: a fixed number
+// of worker threads, each handling any number of transfers in a single poll()
+// loop. A transfer is assigned to the worker with the least transfers when it
+// is started, and stays with that worker until it has finished.
 
-    if(s->flush)
-      fadv_close(&adv);
+#define SYN_MAXWORKERS 64
+
+typedef struct syn_worker_t {
+  GThread *thread;
+  GAsyncQueue *queue; // newly started transfers
+  int wake[2];        // written to after pushing to the queue
+  int num;            // number of transfers assigned to this worker (atomic)
+} syn_worker_t;
+
+static syn_worker_t syn_workers[SYN_MAXWORKERS];
+
+// Set in each worker thread, see net_syn_worker().
+static GStaticPrivate syn_worker_key = G_STATIC_PRIVATE_INIT;
+
+
+// Whether the current thread is a shared transfer worker. Transfer callbacks
+// can use this to avoid blocking operations that would also hold up the other
+// transfers of the same worker.
+gboolean net_syn_worker() {
+  return g_static_private_get(&syn_worker_key) != NULL;
+}
+
+
+static gpointer syn_worker_thread(gpointer dat) {
+  syn_worker_t *w = dat;
+  g_static_private_set(&syn_worker_key, w, NULL);
+  GPtrArray *list = g_ptr_array_new();
+  GArray *fds = g_array_new(FALSE, TRUE, sizeof(GPollFD));
+  GArray *bursts = g_array_new(FALSE, TRUE, sizeof(int));
+  synfer_t *s;
+  int i;
+
+  while(1) {
+    // Accept new transfers
+    while((s = g_async_queue_try_pop(w->queue))) {
+      syn_begin(s);
+      g_ptr_array_add(list, s);
+    }
+
+    // For each transfer, poll for the cancel fd and, if we are allowed to
+    // burst, for the socket. Transfers that may not burst are checked again
+    // after RATECALC_TICK, similar to syn_wait().
+    g_array_set_size(fds, 1+2*list->len);
+    g_array_set_size(bursts, list->len);
+    GPollFD *fd = (GPollFD *)fds->data;
+    fd[0].fd = w->wake[0];
+    fd[0].events = G_IO_IN;
+    fd[0].revents = 0;
+    int timeout = -1;
+    for(i=0; i<list->len; i++) {
+      s = g_ptr_array_index(list, i);
+      int b = syn_continue(s) ? ratecalc_burst(s->upl ? &s->net->rate_out : &s->net->rate_in) : 1;
+      g_array_index(bursts, int, i) = b;
+      if(b <= 0)
+        timeout = RATECALC_TICK;
+      fd[1+2*i].fd = s->can[0];
+      fd[1+2*i].events = G_IO_IN;
+      fd[1+2*i].revents = 0;
+      fd[2+2*i].fd = b > 0 && syn_continue(s) ? s->sock : -1;
+      fd[2+2*i].events = s->upl ? G_IO_OUT : G_IO_IN;
+      fd[2+2*i].revents = 0;
+    }
+    // There's no need to wait when a transfer has already finished
+    for(i=0; i<list->len; i++)
+      if(!syn_continue(g_ptr_array_index(list, i)))
+        timeout = 0;
+
+    if(g_poll(fd, fds->len, timeout) < 0 && errno != EINTR) {
+      g_critical("poll() failed in transfer thread: %s", g_strerror(errno));
+      g_usleep(100000);
+      continue;
+    }
+
+    if(fd[0].revents) {
+      char buf[64];
+      while(read(w->wake[0], buf, sizeof(buf)) > 0)
+        ;
+    }
+
+    // Walk backwards, so that removing an item doesn't affect the items that
+    // still have to be checked.
+    for(i=list->len-1; i>=0; i--) {
+      s = g_ptr_array_index(list, i);
+      int b = g_array_index(bursts, int, i);
+      gboolean stop = !syn_continue(s) || fd[1+2*i].revents;
+      if(!stop && b > 0 && fd[2+2*i].revents)
+        stop = !syn_step(s, b) || !syn_continue(s);
+      if(stop) {
+        g_ptr_array_remove_index_fast(list, i);
+        g_atomic_int_add(&w->num, -1);
+        syn_end(s);
+      }
+    }
   }
+  return NULL;
+}
 
-  if(sock && !s->cancel && !s->upl)
-    syn_download(s, sock);
 
-  g_idle_add(syn_done, s);
+// Hands the transfer to the least busy of the first `max' workers, starting a
+// new worker thread if necessary.
+static void syn_worker_push(synfer_t *s, int max) {
+  syn_worker_t *w = syn_workers;
+  int i;
+  for(i=1; i<max; i++)
+    if(g_atomic_int_get(&syn_workers[i].num) < g_atomic_int_get(&w->num))
+      w = syn_workers+i;
+
+  if(!w->thread) {
+    if(pipe(w->wake) < 0) {
+      g_critical("pipe() failed: %s", g_strerror(errno));
+      g_return_if_reached();
+    }
+    fcntl(w->wake[0], F_SETFL, fcntl(w->wake[0], F_GETFL)|O_NONBLOCK);
+    fcntl(w->wake[1], F_SETFL, fcntl(w->wake[1], F_GETFL)|O_NONBLOCK);
+    w->queue = g_async_queue_new();
+    w->thread = g_thread_create(syn_worker_thread, w, FALSE, NULL);
+  }
+
+  g_atomic_int_inc(&w->num);
+  g_async_queue_push(w->queue, s);
+  if(write(w->wake[1], "", 1) < 0 && errno != EAGAIN)
+    g_warning("Can't wake up transfer thread: %s", g_strerror(errno));
 }
 
 
@@ -548,7 +1016,26 @@ static void syn_start(net_t *n) {
     g_source_remove(n->socksrc);
     n->socksrc = 0;
   }
-  g_thread_pool_push(syn_pool, n->syn, NULL);
+
+  // Make a copy of sock to make sure it doesn't disappear on us.
+  // (Still need to obtain the lock to make use of it).
+  synfer_t *s = n->syn;
+  s->sock = n->sock;
+#ifdef HAVE_SENDFILE
+  if(s->upl && n->tls && !n->ktls && !n->tls_handshake && var_snap(0)->sendfile && var_snap(0)->tls_offload)
+    net_ktls_enable(n);
+  s->sendfile = s->upl && (!n->tls || n->ktls) && var_snap(0)->sendfile;
+#endif
+  if(s->cache) {
+    upc_setmax(var_snap(0)->upload_cache);
+    s->cache = !s->sendfile && upc_max > 0;
+  }
+
+  int max = MIN(var_snap(0)->transfer_threads, SYN_MAXWORKERS);
+  if(max > 0)
+    syn_worker_push(s, max);
+  else
+    g_thread_pool_push(syn_pool, s, NULL);
 }
 
 
@@ -576,45 +1063,55 @@ static gboolean handle_timer(gpointer dat);
 static gboolean asy_handlerbuf(gpointer dat) {
   net_t *n = dat;
   // The callbacks itself may in turn call other net_* functions, and thus
-  // immediately queue another read action. Hence the while loop. Note that no
+  // immediately queue another read action. Hence the while loop, which
+  // handles all complete messages in the buffer in a single run. Note that no
   // net_* function that remains in the ASY state is allowed to modify rbuf,
   // otherwise we need to make a copy of rbuf before passing it to the
   // callback.
   net_ref(n);
-  while(n->state == NETST_ASY && n->rbuf->len && n->rd_cb && !n->syn) {
+  n->rd_loop = TRUE;
+  while(n->state == NETST_ASY && asy_rlen(n) && n->rd_cb && !n->syn) {
     gboolean msg = n->rd_msg;
     gboolean consume = n->rd_consume;
     int dat = n->rd_dat;
     void(*cb)(net_t *, char *, int) = n->rd_cb;
+    GString *rbuf = n->rbuf;
+    char *buf = rbuf->str + n->roff;
 
     char *end = msg
-      ? memchr(n->rbuf->str, dat, n->rbuf->len)
-      : n->rbuf->len >= dat ? n->rbuf->str + dat : NULL;
+      ? memchr(buf, dat, asy_rlen(n))
+      : asy_rlen(n) >= dat ? buf + dat : NULL;
     if(!end)
       break;
     n->rd_cb = NULL;
     if(msg) {
       *end = 0;
       if(consume)
-        g_debug("%s< %s%c", net_remoteaddr(n), n->rbuf->str, dat != '\n' ? dat : ' ');
+        g_debug("%s< %s%c", net_remoteaddr(n), buf, dat != '\n' ? dat : ' ');
     }
-    cb(n, n->rbuf->str, end - n->rbuf->str);
-    if(n->state == NETST_ASY || n->state == NETST_SYN || n->state == NETST_DIS) {
+    perf_cmd_t pc;
+    if(msg)
+      perf_cmd_start(&pc, buf, dat);
+    cb(n, buf, end - buf);
+    if(msg)
+      perf_cmd_end(&pc);
+    if((n->state == NETST_ASY || n->state == NETST_SYN || n->state == NETST_DIS) && n->rbuf == rbuf) {
       if(consume)
-        g_string_erase(n->rbuf, 0, end - n->rbuf->str + (msg ? 1 : 0));
+        n->roff += end - buf + (msg ? 1 : 0);
       else if(msg)
         *end = dat;
     }
   }
+  n->rd_loop = FALSE;
 
   // Handle recvfile
   if(n->syn && n->state == NETST_ASY && !n->syn->upl) {
     synfer_t *s = n->syn;
-    if(n->rbuf->len) {
-      int w = MIN(n->rbuf->len, s->left);
+    if(asy_rlen(n)) {
+      int w = MIN(asy_rlen(n), s->left);
       s->left -= w;
-      s->cb_downdata(s->ctx, n->rbuf->str, w);
-      g_string_erase(n->rbuf, 0, w);
+      s->cb_downdata(s->ctx, n->rbuf->str + n->roff, w);
+      n->roff += w;
     }
     if(s->left)
       syn_start(n);
@@ -626,6 +1123,12 @@ static gboolean asy_handlerbuf(gpointer dat) {
     }
   }
 
+  // Everything has been consumed, reset the buffer without moving anything.
+  if(n->rbuf && n->roff && !asy_rlen(n)) {
+    g_string_truncate(n->rbuf, 0);
+    n->roff = 0;
+  }
+
   net_unref(n);
   return FALSE;
 }
@@ -634,7 +1137,12 @@ static gboolean asy_handlerbuf(gpointer dat) {
 // Tries a read. Returns FALSE if there was an error other than "please try
 // again later".
 static gboolean asy_read(net_t *n) {
-  // Make sure we have enough buffer space
+  // Make sure we have enough buffer space, moving any unconsumed data to the
+  // start of the buffer first if that is needed.
+  if(n->roff && n->rbuf->allocated_len - n->rbuf->len < NET_RECV_SIZE) {
+    g_string_erase(n->rbuf, 0, n->roff);
+    n->roff = 0;
+  }
   if(n->rbuf->allocated_len < NET_MAX_RBUF && n->rbuf->allocated_len - n->rbuf->len < NET_RECV_SIZE) {
     gsize oldlen = n->rbuf->len;
     g_string_set_size(n->rbuf, MIN(NET_MAX_RBUF, n->rbuf->len+NET_RECV_SIZE));
@@ -672,6 +1180,13 @@ static gboolean asy_read(net_t *n) {
 
 
 static gboolean dis_shutdown(net_t *n) {
+  // GnuTLS can't send the close_notify alert when the kernel has taken over,
+  // just close the TCP connection in that case.
+  if(n->tls && n->ktls) {
+    gnutls_deinit(n->tls);
+    n->tls = NULL;
+  }
+
   // Shutdown TLS
   if(n->tls) {
     int r = gnutls_bye(n->tls, GNUTLS_SHUT_RDWR);
@@ -719,11 +1234,11 @@ static gboolean dis_shutdown(net_t *n) {
 
 
 static gboolean asy_write(net_t *n) {
-  if(!n->wbuf->len)
+  if(!asy_wlen(n))
     return TRUE;
 
   const char *err = NULL;
-  int r = low_send(n, n->wbuf->str, n->wbuf->len, &err);
+  int r = low_send(n, n->wbuf->str + n->woff, asy_wlen(n), &err);
   if(r < 0 && !err) {
     n->wantwrite = TRUE;
     return TRUE;
@@ -738,9 +1253,19 @@ static gboolean asy_write(net_t *n) {
     return FALSE;
   }
 
-  g_string_erase(n->wbuf, 0, r);
+  // Only move the unsent data to the start of the buffer when it's smaller
+  // than what has already been sent, so that a large buffer that is written
+  // out in many small parts is not moved around each time.
+  n->woff += r;
+  if(!asy_wlen(n)) {
+    g_string_truncate(n->wbuf, 0);
+    n->woff = 0;
+  } else if(n->woff >= NET_RECV_SIZE && n->woff > asy_wlen(n)) {
+    g_string_erase(n->wbuf, 0, n->woff);
+    n->woff = 0;
+  }
 
-  if(!n->wbuf->len) {
+  if(!asy_wlen(n)) {
     if(n->syn && n->syn->upl) {
       syn_start(n);
       return FALSE;
@@ -749,7 +1274,7 @@ static gboolean asy_write(net_t *n) {
       return dis_shutdown(n);
   }
 
-  n->wantwrite = !!n->wbuf->len;
+  n->wantwrite = !!asy_wlen(n);
   return TRUE;
 }
 
@@ -851,7 +1376,10 @@ static void asy_setupread(net_t *n, gboolean msg, gboolean consume, int dat, voi
   n->rd_consume = consume;
   n->rd_dat = dat;
   n->rd_cb = cb;
-  g_idle_add(asy_handlerbuf, n);
+  // No need to schedule anything when called from a read callback, the loop
+  // in asy_handlerbuf() will pick this up.
+  if(!n->rd_loop)
+    g_idle_add(asy_handlerbuf, n);
 }
 
 
@@ -878,8 +1406,9 @@ void net_peekbytes(net_t *n, int bytes, void(*cb)(net_t *, char *, int)) {
 
 
 // Similar to net_readbytes(), but will call the data() callback for every read
-// from the network, this callback may be run from another thread. When done,
-// the done() callback will be run in the main thread.
+// from the network, this callback may be run from another thread. When the
+// transfer thread stops, data() is called from that thread with buf = NULL.
+// When done, the done() callback will be run in the main thread.
 void net_recvfile(net_t *n, guint64 len, gboolean(*data)(void *, const char *, int), void(*done)(net_t *, void *), void *ctx) {
   g_return_if_fail(n->state == NETST_ASY);
   syn_new(n, FALSE, len);
@@ -945,14 +1474,19 @@ void net_writef(net_t *n, const char *fmt, ...) {
 
 
 // Switches to the SYN state when the write buffer has been flushed. fd will be
-// close()'d when done. cb() will be called in the main thread.
-void net_sendfile(net_t *n, int fd, guint64 len, gboolean flush, void (*cb)(net_t *)) {
+// close()'d when done. cb() will be called in the main thread. tth may be set
+// to allow the transfer to use the upload cache.
+void net_sendfile(net_t *n, int fd, guint64 len, gboolean flush, const char *tth, void (*cb)(net_t *)) {
   g_return_if_fail(n->state == NETST_ASY && !n->syn);
   syn_new(n, TRUE, len);
   n->syn->flush = flush;
+  if(tth) {
+    n->syn->cache = TRUE;
+    memcpy(n->syn->tth, tth, 24);
+  }
   n->syn->cb_upldone = cb;
   n->syn->fd = fd;
-  if(!n->wbuf->len)
+  if(!asy_wlen(n))
     syn_start(n);
 }
 
@@ -965,7 +1499,7 @@ void net_shutdown(net_t *n, void(*cb)(net_t *)) {
   n->state = NETST_DIS;
   n->cb_shutdown = cb;
   time(&n->timeout_last);
-  if(!n->wbuf->len)
+  if(!asy_wlen(n))
     dis_shutdown(n);
 }
 
@@ -980,13 +1514,17 @@ void net_shutdown(net_t *n, void(*cb)(net_t *)) {
 // again.
 void net_settls(net_t *n, gboolean serv, void (*cb)(net_t *, const char *)) {
   g_return_if_fail(n->state == NETST_ASY);
-  g_return_if_fail(!n->wbuf->len);
+  g_return_if_fail(!asy_wlen(n));
   g_return_if_fail(!n->tls);
-  if(n->rbuf->len) {
+  if(asy_rlen(n)) {
+    g_string_erase(n->rbuf, 0, n->roff);
     n->tlsrbuf = n->rbuf;
     n->rbuf = g_string_sized_new(1024);
-  }
+  } else
+    g_string_truncate(n->rbuf, 0);
+  n->roff = 0;
   gnutls_init(&n->tls, serv ? GNUTLS_SERVER : GNUTLS_CLIENT);
+  n->ktls = FALSE;
   gnutls_credentials_set(n->tls, GNUTLS_CRD_CERTIFICATE, db_certificate);
   const char *pos;
   gnutls_priority_set_direct(n->tls, var_get(0, VAR_tls_priority), &pos);
@@ -1011,6 +1549,7 @@ void net_connected(net_t *n, int sock, const char *addr, gboolean v6) {
   n->v6 = v6;
   n->wbuf = g_string_sized_new(1024);
   n->rbuf = g_string_sized_new(1024);
+  n->roff = n->woff = 0;
 
   if(v6) {
     struct sockaddr_in6 a;
@@ -1042,27 +1581,73 @@ void net_connected(net_t *n, int sock, const char *addr, gboolean v6) {
 
 // DNS resolution and connecting
 
+// Resolved addresses are cached for a while, and concurrent requests for the
+// same host and port share a single lookup, so that reconnecting to a bunch of
+// hubs at the same time doesn't result in a storm of resolver requests.
+// getaddrinfo() doesn't tell us the TTL of the DNS records, so a fixed time is
+// used instead. An entry is also forgotten when connecting to all of its
+// addresses failed, so a host that has moved is looked up again on the next
+// attempt. Numeric addresses are never cached, these are handled directly.
+// The cache is only accessed from the main thread.
+
+#define DNS_CACHE_TTL    300 // seconds to remember a successful lookup
+#define DNS_CACHE_NEGTTL  30 // seconds to remember a failed lookup
+#define DNS_CACHE_MAX    256 // number of entries before expired ones are purged
+#define DNS_THREADS        4 // maximum number of concurrent lookups
+
+typedef struct dns_entry_t {
+  int ref;
+  char *key;  // "host:port", lowercase
+  char *host;
+  unsigned short port;
+  time_t expire; // 0 while resolving
+  struct addrinfo *nfo;
+  char *err;
+  GSList *waiting; // dnscon_t's to notify when resolving is done
+} dns_entry_t;
+
 struct dnscon_t {
   net_t *net;
-  char *addr;
   char *laddr;
-  unsigned short port;
-  struct addrinfo *nfo;
+  dns_entry_t *dns;
   struct addrinfo *next;
-  char *err;
   void(*cb)(net_t *, const char *);
 };
 
 
 static GThreadPool *dns_pool = NULL;
+static GHashTable *dns_cache = NULL; // key -> dns_entry_t
+
+
+static void dns_entry_unref(dns_entry_t *e) {
+  if(--e->ref > 0)
+    return;
+  g_free(e->key);
+  g_free(e->host);
+  g_free(e->err);
+  if(e->nfo)
+    freeaddrinfo(e->nfo);
+  g_slice_free(dns_entry_t, e);
+}
+
+
+// Removes the entry from the cache, if it is still in there.
+static void dns_entry_forget(dns_entry_t *e) {
+  if(e->key && g_hash_table_lookup(dns_cache, e->key) == e)
+    g_hash_table_remove(dns_cache, e->key);
+}
+
+
+static gboolean dns_cache_purge_one(gpointer key, gpointer val, gpointer dat) {
+  dns_entry_t *e = val;
+  return e->expire && e->expire < *((time_t *)dat);
+}
 
 
 static void dnscon_free(dnscon_t *r) {
-  g_free(r->err);
-  g_free(r->addr);
   g_free(r->laddr);
-  if(r->nfo)
-    freeaddrinfo(r->nfo);
+  if(r->dns)
+    dns_entry_unref(r->dns);
   g_slice_free(dnscon_t, r);
 }
 
@@ -1092,6 +1677,7 @@ static void dnsconn_handleconn(net_t *n, int err) {
   }
 
   // Error on the last try, time to give up.
+  dns_entry_forget(n->dnscon->dns);
   g_debug("%s: Connect error: %s", net_remoteaddr(n), g_strerror(err));
   n->cb_err(n, NETERR_CONN, g_strerror(err));
 }
@@ -1153,10 +1739,11 @@ static void dnscon_tryconn(net_t *n) {
 }
 
 
-// Called as an idle function from the dnscon_thread.
+// Called when the dns entry of a dnscon_t has been resolved.
 static gboolean dnscon_gotdns(gpointer dat) {
   dnscon_t *r = dat;
   net_t *n = r->net;
+  dns_entry_t *e = r->dns;
   // It's possible that a net_disconnect() has happened in the mean time. Free
   // and ignore the results in that case.
   if(!n) {
@@ -1164,38 +1751,116 @@ static gboolean dnscon_gotdns(gpointer dat) {
     return FALSE;
   }
 
-  // Handle error
-  if(r->err) {
-    g_debug("%s: DNS resolve: %s", net_remoteaddr(n), r->err);
-    n->cb_err(n, NETERR_CONN, r->err);
+  // Handle error. The callback is expected to call net_disconnect(), in which
+  // case r is no longer referenced.
+  if(e->err) {
+    g_debug("%s: DNS resolve: %s", net_remoteaddr(n), e->err);
+    n->cb_err(n, NETERR_CONN, e->err);
+    if(!r->net)
+      dnscon_free(r);
     return FALSE;
   }
 
   // Is it possible for getaddrinfo() to return an empty result set without an error?
-  g_return_val_if_fail(r->nfo, FALSE);
+  g_return_val_if_fail(e->nfo, FALSE);
 
   // Try connecting to each of the addresses.
   n->state = NETST_CON;
-  r->next = r->nfo;
+  r->next = e->nfo;
   dnscon_tryconn(n);
   return FALSE;
 }
 
 
-// Async DNS resolution in a background thread
-static void dnscon_thread(gpointer dat, gpointer udat) {
-  dnscon_t *r = dat;
+static int dns_getaddrinfo(const char *host, unsigned short port, int flags, struct addrinfo **nfo) {
   struct addrinfo hint = {};
   hint.ai_family = AF_UNSPEC;
   hint.ai_socktype = SOCK_STREAM;
   hint.ai_protocol = 0;
-  hint.ai_flags = 0;
-  char port[20];
-  g_snprintf(port, sizeof(port), "%d", (int)r->port);
-  int n = getaddrinfo(r->addr, port, &hint, &r->nfo);
+  hint.ai_flags = flags;
+  char sport[20];
+  g_snprintf(sport, sizeof(sport), "%d", (int)port);
+  return getaddrinfo(host, sport, &hint, nfo);
+}
+
+
+// Called as an idle function from the dns_thread.
+static gboolean dns_done(gpointer dat) {
+  dns_entry_t *e = dat;
+  time(&e->expire);
+  e->expire += e->err ? DNS_CACHE_NEGTTL : DNS_CACHE_TTL;
+
+  GSList *l = e->waiting;
+  e->waiting = NULL;
+  l = g_slist_reverse(l);
+  GSList *i;
+  for(i=l; i; i=i->next)
+    dnscon_gotdns(i->data);
+  g_slist_free(l);
+
+  dns_entry_unref(e);
+  return FALSE;
+}
+
+
+// Async DNS resolution in a background thread
+static void dns_thread(gpointer dat, gpointer udat) {
+  dns_entry_t *e = dat;
+  int n = dns_getaddrinfo(e->host, e->port, 0, &e->nfo);
   if(n)
-    r->err = g_strdup(n == EAI_SYSTEM ? g_strerror(errno) : gai_strerror(n));
-  g_idle_add(dnscon_gotdns, r);
+    e->err = g_strdup(n == EAI_SYSTEM ? g_strerror(errno) : gai_strerror(n));
+  g_idle_add(dns_done, e);
+}
+
+
+// Attaches r to a dns entry for the given host and port, and makes sure that
+// dnscon_gotdns() is called when it has been resolved.
+static void dns_resolve(dnscon_t *r, const char *host, unsigned short port) {
+  dns_entry_t *e;
+
+  // Numeric addresses don't need a lookup or a cache entry.
+  struct addrinfo *nfo = NULL;
+  if(dns_getaddrinfo(host, port, AI_NUMERICHOST, &nfo) == 0) {
+    e = g_slice_new0(dns_entry_t);
+    e->ref = 1;
+    e->nfo = nfo;
+    time(&e->expire);
+    r->dns = e;
+    g_idle_add(dnscon_gotdns, r);
+    return;
+  }
+
+  time_t now = time(NULL);
+  if(g_hash_table_size(dns_cache) >= DNS_CACHE_MAX)
+    g_hash_table_foreach_remove(dns_cache, dns_cache_purge_one, &now);
+
+  char *tmp = g_strdup_printf("%s:%d", host, (int)port);
+  char *key = g_ascii_strdown(tmp, -1);
+  g_free(tmp);
+
+  e = g_hash_table_lookup(dns_cache, key);
+  if(e && e->expire && e->expire < now) {
+    g_hash_table_remove(dns_cache, key);
+    e = NULL;
+  }
+
+  if(!e) {
+    e = g_slice_new0(dns_entry_t);
+    e->ref = 2; // one for the cache, one for the lookup
+    e->key = key;
+    e->host = g_strdup(host);
+    e->port = port;
+    g_hash_table_insert(dns_cache, e->key, e);
+    g_thread_pool_push(dns_pool, e, NULL);
+  } else
+    g_free(key);
+
+  e->ref++;
+  r->dns = e;
+  if(e->expire)
+    g_idle_add(dnscon_gotdns, r);
+  else
+    e->waiting = g_slist_prepend(e->waiting, r);
 }
 
 
@@ -1288,9 +1953,7 @@ void net_connect(net_t *n, const char *host, unsigned short port, const char *la
   g_return_if_fail(n->state == NETST_IDL);
 
   dnscon_t *r = g_slice_new0(dnscon_t);
-  r->addr = g_strdup(host);
   r->laddr = g_strdup(laddr);
-  r->port = port;
   r->net = n;
   r->cb = cb;
 
@@ -1299,7 +1962,7 @@ void net_connect(net_t *n, const char *host, unsigned short port, const char *la
   time(&n->timeout_last);
   n->dnscon = r;
   n->state = NETST_DNS;
-  g_thread_pool_push(dns_pool, r, NULL);
+  dns_resolve(r, host, port);
 }
 
 
@@ -1405,61 +2068,199 @@ void net_unref(net_t *n) {
 
 struct net_udp_t {
   char addr[62];
-  int sock;
+  int sock; // shared socket, see net_udp_socket(). -1 on error.
+  socklen_t salen;
+  struct sockaddr_storage sa;
 };
 
+#define NET_UDP_BATCH 64 // Max. number of messages per sendmmsg()/recvmmsg()
+
 #endif
 
 
-// Creates a new UDP socket for sending messages to the given destination.
-// host is assumed to be a valid IPv4 or IPv6 address.
-void net_udp_init(net_udp_t *udp, const char *host, unsigned short port, char *laddr) {
-  int af = ip4_isvalid(host) ? AF_INET : AF_INET6;
-  snprintf(udp->addr, sizeof(udp->addr), af == AF_INET ? "%s:%d" : "[%s]:%d", host, (int)port);
+// Messages are not sent immediately, but queued and flushed from an idle
+// function, so that all replies generated during a single main loop iteration
+// are sent with as few system calls as possible. Only used from the main
+// thread.
+#define NET_UDP_QUEUE 1024 // Max. number of queued messages
 
-  udp->sock = socket(af, SOCK_DGRAM, 0);
-  fcntl(udp->sock, F_SETFL, fcntl(udp->sock, F_GETFL, 0)|O_NONBLOCK);
+typedef struct net_udp_msg_t {
+  int sock;
+  socklen_t salen;
+  struct sockaddr_storage sa;
+  char *msg;
+  int len;
+} net_udp_msg_t;
+
+static net_udp_msg_t net_udp_queue[NET_UDP_QUEUE];
+static int net_udp_queued = 0;
+static guint net_udp_flush_src = 0;
+
+// Sockets used for sending, key = "af laddr", value = socket + 1.
+static GHashTable *net_udp_socks = NULL;
+
+// Statistics, displayed with /perf. The receive stats are updated from
+// listen.c.
+hist_t net_udp_stats_recv;     // Number of datagrams per receive call
+hist_t net_udp_stats_send;     // Number of datagrams per send call
+guint64 net_udp_drops_recv;    // Dropped by the kernel before we could read them
+guint64 net_udp_drops_send;    // Queue full or send error
+
+
+// Returns a non-blocking socket for the given address family and local
+// address. These are created on first use and never closed.
+static int net_udp_socket(int af, const char *laddr) {
+  if(!net_udp_socks)
+    net_udp_socks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  char *key = g_strdup_printf("%d %s", af, laddr ? laddr : "");
+  int sock = GPOINTER_TO_INT(g_hash_table_lookup(net_udp_socks, key)) - 1;
+  if(sock >= 0) {
+    g_free(key);
+    return sock;
+  }
 
-  if(net_sock_bind(af, udp->sock, laddr) < 0) {
-    g_message("Can't bind UDP socket for '%s' to local address '%s': %s", udp->addr, laddr, g_strerror(errno));
-    close(udp->sock);
-    return;
+  sock = socket(af, SOCK_DGRAM, 0);
+  if(sock < 0) {
+    g_message("Can't create UDP socket: %s", g_strerror(errno));
+    g_free(key);
+    return -1;
   }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0)|O_NONBLOCK);
+  if(net_sock_bind(af, sock, (char *)laddr) < 0) {
+    g_message("Can't bind UDP socket to local address '%s': %s", laddr, g_strerror(errno));
+    close(sock);
+    g_free(key);
+    return -1;
+  }
+  g_hash_table_insert(net_udp_socks, key, GINT_TO_POINTER(sock+1));
+  return sock;
+}
+
+
+// Prepares for sending messages to the given destination. host is assumed to
+// be a valid IPv4 or IPv6 address.
+void net_udp_init(net_udp_t *udp, const char *host, unsigned short port, char *laddr) {
+  int af = ip4_isvalid(host) ? AF_INET : AF_INET6;
+  snprintf(udp->addr, sizeof(udp->addr), af == AF_INET ? "%s:%d" : "[%s]:%d", host, (int)port);
 
-  int n;
   if(af == AF_INET) {
     struct in_addr a = ip4_pack(host);
-    n = connect(udp->sock, ip4_sockaddr(a, port), sizeof(struct sockaddr_in));
+    udp->salen = sizeof(struct sockaddr_in);
+    memcpy(&udp->sa, ip4_sockaddr(a, port), udp->salen);
   } else {
     struct in6_addr a = ip6_pack(host);
-    n = connect(udp->sock, ip6_sockaddr(a, port), sizeof(struct sockaddr_in6));
-  }
-  if(n < 0) {
-    g_message("Can't associate UDP socket with '%s': %s", udp->addr, g_strerror(errno));
-    close(udp->sock);
-    return;
+    udp->salen = sizeof(struct sockaddr_in6);
+    memcpy(&udp->sa, ip6_sockaddr(a, port), udp->salen);
   }
+  udp->sock = net_udp_socket(af, laddr);
 }
 
 
+// Doesn't do anything anymore, the socket is shared and queued messages are
+// still sent after this. Kept so that callers don't have to care.
 void net_udp_destroy(net_udp_t *udp) {
-  if(udp->sock >= 0)
-    close(udp->sock);
+  udp->sock = -1;
+}
+
+
+static void net_udp_senderr(net_udp_msg_t *m, int err) {
+  char addr[100];
+  if(m->sa.ss_family == AF_INET) {
+    struct sockaddr_in *a = (struct sockaddr_in *)&m->sa;
+    g_snprintf(addr, sizeof(addr), "%s:%d", ip4_unpack(a->sin_addr), ntohs(a->sin_port));
+  } else {
+    struct sockaddr_in6 *a = (struct sockaddr_in6 *)&m->sa;
+    g_snprintf(addr, sizeof(addr), "[%s]:%d", ip6_unpack(a->sin6_addr), ntohs(a->sin6_port));
+  }
+  g_message("Error sending UDP message to '%s': %s", addr, g_strerror(err));
+  net_udp_drops_send++;
 }
 
 
-// Send a message to a UDP socket, logs but otherwise ignores errors. Note that
-// the socket is created as non-blocking and this function does not attempt to
-// retry the send() on EWOULDBLOCK or EAGAIN. It is assumed that the kernel
-// buffers are large enough that we can burst-queue several messages, and that,
-// if the kernel buffers are full, we might be better off dropping some
-// messages than queueing them until infinity.
+// Sends n queued messages that share the same socket. Returns the number of
+// messages that have been processed, which includes failed messages.
+static int net_udp_sendbatch(net_udp_msg_t *m, int n) {
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr h[NET_UDP_BATCH];
+  struct iovec v[NET_UDP_BATCH];
+  int i;
+  n = MIN(n, NET_UDP_BATCH);
+  memset(h, 0, n*sizeof(*h));
+  for(i=0; i<n; i++) {
+    v[i].iov_base = m[i].msg;
+    v[i].iov_len = m[i].len;
+    h[i].msg_hdr.msg_name = &m[i].sa;
+    h[i].msg_hdr.msg_namelen = m[i].salen;
+    h[i].msg_hdr.msg_iov = v+i;
+    h[i].msg_hdr.msg_iovlen = 1;
+  }
+  int r;
+  do
+    r = sendmmsg(m->sock, h, n, 0);
+  while(r < 0 && errno == EINTR);
+  // The first message has failed, report and skip it.
+  if(r <= 0) {
+    net_udp_senderr(m, r < 0 ? errno : EAGAIN);
+    return 1;
+  }
+  hist_add(&net_udp_stats_send, r);
+  for(i=0; i<r; i++)
+    ratecalc_add(&net_out, m[i].len);
+  return r;
+#else
+  int r = sendto(m->sock, m->msg, m->len, 0, (struct sockaddr *)&m->sa, m->salen);
+  if(r != m->len)
+    net_udp_senderr(m, errno);
+  else {
+    hist_add(&net_udp_stats_send, 1);
+    ratecalc_add(&net_out, m->len);
+  }
+  return 1;
+#endif
+}
+
+
+static gboolean net_udp_flush(gpointer dat) {
+  int i = 0;
+  while(i < net_udp_queued) {
+    int n = 1;
+    while(i+n < net_udp_queued && net_udp_queue[i+n].sock == net_udp_queue[i].sock)
+      n++;
+    while(n > 0) {
+      int r = net_udp_sendbatch(net_udp_queue+i, n);
+      n -= r;
+      for(; r>0; r--)
+        g_free(net_udp_queue[i++].msg);
+    }
+  }
+  net_udp_queued = 0;
+  net_udp_flush_src = 0;
+  return FALSE;
+}
+
+
+// Queue a message for sending, logs but otherwise ignores errors. This
+// function does not attempt to retry the send on EWOULDBLOCK or EAGAIN, nor
+// does it queue more than NET_UDP_QUEUE messages. It is assumed that the
+// kernel buffers are large enough that we can burst-queue several messages,
+// and that, if the kernel buffers are full, we might be better off dropping
+// some messages than queueing them until infinity.
 void net_udp_send_raw(net_udp_t *udp, const char *msg, int len) {
-  int r = send(udp->sock, msg, len, 0);
-  if(r != len)
-    g_message("Error sending UDP message to '%s': %s", udp->addr, g_strerror(errno));
-  else
-    ratecalc_add(&net_out, len);
+  if(udp->sock < 0)
+    return;
+  if(net_udp_queued >= NET_UDP_QUEUE) {
+    net_udp_drops_send++;
+    return;
+  }
+  net_udp_msg_t *m = net_udp_queue + net_udp_queued++;
+  m->sock = udp->sock;
+  m->salen = udp->salen;
+  memcpy(&m->sa, &udp->sa, udp->salen);
+  m->msg = g_malloc(len);
+  memcpy(m->msg, msg, len);
+  m->len = len;
+  if(!net_udp_flush_src)
+    net_udp_flush_src = g_idle_add(net_udp_flush, NULL);
 }
 
 
@@ -1482,6 +2283,34 @@ void net_udp_sendf(net_udp_t *udp, const char *fmt, ...) {
 }
 
 
+// Writes the statistics of the transfer threads to *out, for display to the
+// user. syn_pool is not exclusive and doesn't keep idle threads of its own, so
+// the idle count is that of glib's shared pool, which is also used by the
+// other non-exclusive thread pools.
+void net_syn_stats(GString *out) {
+  g_string_append_printf(out, "Transfer threads: %d busy (peak %d)\n",
+    g_atomic_int_get(&syn_threads), g_atomic_int_get(&syn_threads_peak));
+  g_string_append_printf(out, "Idle shared pool threads: %d\n", g_thread_pool_get_num_unused_threads());
+  int i, workers = 0, num = 0;
+  for(i=0; i<SYN_MAXWORKERS; i++)
+    if(syn_workers[i].thread) {
+      workers++;
+      num += g_atomic_int_get(&syn_workers[i].num);
+    }
+  if(workers)
+    g_string_append_printf(out, "Transfer workers: %d, handling %d transfers\n", workers, num);
+}
+
+
+// Writes the UDP statistics to *out, for display to the user.
+void net_udp_stats(GString *out) {
+  hist_format(&net_udp_stats_recv, out, "Received per call", "");
+  hist_format(&net_udp_stats_send, out, "Sent per call", "");
+  g_string_append_printf(out, "Dropped: %"G_GUINT64_FORMAT" received, %"G_GUINT64_FORMAT" sent\n",
+    net_udp_drops_recv, net_udp_drops_send);
+}
+
+
 
 
 
@@ -1494,7 +2323,8 @@ void net_init_global() {
   ratecalc_register(&net_in, RCC_NONE);
   ratecalc_register(&net_out, RCC_NONE);
 
-  dns_pool = g_thread_pool_new(dnscon_thread, NULL, -1, FALSE, NULL);
+  dns_pool = g_thread_pool_new(dns_thread, NULL, DNS_THREADS, FALSE, NULL);
+  dns_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)dns_entry_unref);
   syn_pool = g_thread_pool_new(syn_thread, NULL, -1, FALSE, NULL);
 }
 
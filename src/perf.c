@@ -0,0 +1,253 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2014 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+#include "ncdc.h"
+#include "perf.h"
+
+
+// Main loop and protocol command statistics, and the collection of all other
+// statistics for /perf and the perf_log setting. Statistics that are updated
+// from other threads are kept by their own modules (see db_stats(),
+// ratecalc_stats(), etc). Everything in this file may only be used from the
+// main thread.
+
+
+#if INTERFACE
+
+struct perf_cmd_t {
+  hist_t *h;
+  guint64 start;
+};
+
+#endif
+
+
+// Current time in microseconds.
+guint64 perf_time() {
+  GTimeVal t;
+  g_get_current_time(&t);
+  return (guint64)t.tv_sec*G_USEC_PER_SEC + t.tv_usec;
+}
+
+
+// Microseconds since start, as returned by an earlier perf_time(). The
+// system clock is not monotonic, so this may return 0 if it went backwards.
+guint64 perf_elapsed(guint64 start) {
+  guint64 now = perf_time();
+  return now > start ? now - start : 0;
+}
+
+
+
+
+// Main loop. A source that never dispatches anything, but is checked right
+// after poll() returns and prepared again before the next poll(). The time in
+// between is the time spent handling events in that iteration.
+
+// Iterations that take longer than this (in microseconds) count as a stall.
+#define PERF_STALL 100000
+
+static guint64 perf_start;
+static guint64 perf_loop_iter;
+static guint64 perf_loop_stalls;
+static guint64 perf_loop_wake; // when poll() returned, 0 if not in an iteration
+static hist_t perf_loop_busy;  // time spent per iteration, in microseconds
+
+
+static gboolean perf_loop_prepare(GSource *src, gint *timeout) {
+  if(perf_loop_wake) {
+    guint64 t = perf_elapsed(perf_loop_wake);
+    hist_add(&perf_loop_busy, t);
+    if(t >= PERF_STALL)
+      perf_loop_stalls++;
+    perf_loop_wake = 0;
+  }
+  *timeout = -1;
+  return FALSE;
+}
+
+static gboolean perf_loop_check(GSource *src) {
+  perf_loop_iter++;
+  perf_loop_wake = perf_time();
+  return FALSE;
+}
+
+static gboolean perf_loop_dispatch(GSource *src, GSourceFunc cb, gpointer dat) {
+  return TRUE;
+}
+
+static GSourceFuncs perf_loop_funcs = {
+  perf_loop_prepare,
+  perf_loop_check,
+  perf_loop_dispatch,
+  NULL
+};
+
+
+
+
+// Hub and client protocol commands, from the time a message has been received
+// until its handler returns. Messages are grouped by their command name, to
+// prevent a misbehaving peer from filling up the table with garbage, any
+// names after the first PERF_CMD_MAX are grouped together.
+
+#define PERF_CMD_MAX 64
+
+static GHashTable *perf_cmds = NULL; // name -> hist_t
+
+
+// eom is the end-of-message character, which tells us whether this is an ADC
+// ('\n') or NMDC ('|') message.
+void perf_cmd_start(perf_cmd_t *p, const char *msg, char eom) {
+  char name[24];
+  if(eom == '\n')
+    g_snprintf(name, sizeof(name), "ADC %.4s", msg);
+  else if(*msg == '$')
+    g_snprintf(name, sizeof(name), "NMDC %.*s", (int)MIN(16, strcspn(msg, " ")), msg);
+  else
+    strcpy(name, "NMDC <chat>");
+
+  if(!perf_cmds)
+    perf_cmds = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  p->h = g_hash_table_lookup(perf_cmds, name);
+  if(!p->h) {
+    if(g_hash_table_size(perf_cmds) >= PERF_CMD_MAX)
+      strcpy(name, "(other)");
+    if(!(p->h = g_hash_table_lookup(perf_cmds, name))) {
+      p->h = g_new0(hist_t, 1);
+      g_hash_table_insert(perf_cmds, g_strdup(name), p->h);
+    }
+  }
+  p->start = perf_time();
+}
+
+
+void perf_cmd_end(perf_cmd_t *p) {
+  hist_add(p->h, perf_elapsed(p->start));
+}
+
+
+static gint perf_cmd_cmp(gconstpointer a, gconstpointer b) {
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+
+static void perf_cmd_stats(GString *out) {
+  if(!perf_cmds || !g_hash_table_size(perf_cmds)) {
+    g_string_append(out, "No messages received\n");
+    return;
+  }
+  GPtrArray *names = g_ptr_array_new();
+  GHashTableIter iter;
+  char *name;
+  g_hash_table_iter_init(&iter, perf_cmds);
+  while(g_hash_table_iter_next(&iter, (gpointer *)&name, NULL))
+    g_ptr_array_add(names, name);
+  g_ptr_array_sort(names, perf_cmd_cmp);
+  int i;
+  for(i=0; i<names->len; i++) {
+    name = g_ptr_array_index(names, i);
+    hist_format(g_hash_table_lookup(perf_cmds, name), out, name, "us");
+  }
+  g_ptr_array_free(names, TRUE);
+}
+
+
+
+
+// All statistics, as displayed by /perf.
+void perf_stats(GString *out) {
+  guint64 up = perf_elapsed(perf_start) / G_USEC_PER_SEC;
+  g_string_append(out, "Main loop:\n");
+  g_string_append_printf(out, "Iterations: %"G_GUINT64_FORMAT" (%.1f/s), %"G_GUINT64_FORMAT" stalls of %dms or longer\n",
+    perf_loop_iter, (double)perf_loop_iter/MAX(up, 1), perf_loop_stalls, PERF_STALL/1000);
+  hist_format(&perf_loop_busy, out, "Time per iteration", "us");
+  g_string_append(out, "\nProtocol messages:\n");
+  perf_cmd_stats(out);
+  g_string_append(out, "\nDatabase:\n");
+  db_stats(out);
+  g_string_append(out, "\nShare:\n");
+  fl_stats(out);
+  g_string_append(out, "\nTransfers:\n");
+  net_syn_stats(out);
+  ratecalc_stats(out);
+  g_string_append(out, "\nUDP:\n");
+  net_udp_stats(out);
+  g_string_append(out, "\nUpload cache:\n");
+  net_upload_cache_stats(out);
+}
+
+
+
+
+// Periodic dump to perf.log
+
+static logfile_t *perf_log = NULL;
+static guint perf_log_timer = 0;
+
+
+static gboolean perf_log_write(gpointer dat) {
+  GString *s = g_string_new("");
+  perf_stats(s);
+  char **lines = g_strsplit(s->str, "\n", 0);
+  char **l;
+  logfile_add(perf_log, "--");
+  for(l=lines; *l; l++)
+    if(**l)
+      logfile_add(perf_log, *l);
+  g_strfreev(lines);
+  g_string_free(s, TRUE);
+  return TRUE;
+}
+
+
+// (Re-)starts or stops the periodic dump after a change to perf_log.
+void perf_log_setup() {
+  int interval = var_get_int(0, VAR_perf_log);
+  if(perf_log_timer) {
+    g_source_remove(perf_log_timer);
+    perf_log_timer = 0;
+  }
+  if(interval > 0) {
+    if(!perf_log)
+      perf_log = logfile_create("perf");
+    perf_log_timer = g_timeout_add_seconds_full(G_PRIORITY_LOW, interval, perf_log_write, NULL, NULL);
+  }
+}
+
+
+void perf_init() {
+  perf_start = perf_time();
+
+  GSource *src = g_source_new(&perf_loop_funcs, sizeof(GSource));
+  // Must have a higher priority than anything else, glib doesn't check
+  // lower-priority sources when a higher priority one is ready.
+  g_source_set_priority(src, G_PRIORITY_HIGH-1);
+  g_source_attach(src, NULL);
+  g_source_unref(src);
+
+  perf_log_setup();
+}
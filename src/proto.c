@@ -106,6 +106,269 @@ char *nmdc_lock2key(char *lock) {
 }
 
 
+#if INTERFACE
+
+enum nmdc_cmd_type {
+  NMDCC_CHAT,         // 0 = message
+  NMDCC_LOCK,         // 0 = lock
+  NMDCC_SUPPORTS,     // 0 = list
+  NMDCC_HELLO,        // 0 = nick
+  NMDCC_QUIT,         // 0 = nick
+  NMDCC_NICKLIST,     // 0 = list of users
+  NMDCC_OPLIST,       // 0 = list of ops
+  NMDCC_USERIP,       // 0 = list of users/ips
+  NMDCC_MYINFO,       // 0 = nick, 1 = info string
+  NMDCC_HUBNAME,      // 0 = name
+  NMDCC_TO,           // 0 = to, 1 = from, 2 = msg
+  NMDCC_FORCEMOVE,    // 0 = addr
+  NMDCC_CONNECTTOME,  // 0 = me, 1 = addr, 2 = "S" for TLS or ""
+  NMDCC_REVCONNECTTOME, // 0 = other, 1 = me
+  NMDCC_SEARCH,       // 0 = from, 1 = sizerestrict, 2 = ismax, 3 = size, 4 = type, 5 = query
+  NMDCC_GETPASS,
+  NMDCC_BADPASS,
+  NMDCC_VALIDATEDENIDE,
+  NMDCC_HUBISFULL,
+  NMDCC_SR            // 0 = the full (unmodified) command
+};
+
+
+struct nmdc_cmd_t {
+  nmdc_cmd_type cmd;
+  char *argv[6];
+};
+
+#endif
+
+
+// Helpers for nmdc_parse(), these return a pointer to the first character
+// that does not match [^ $] or [a-fA-F0-9:\[\].], respectively.
+static char *nmdc_tok(char *s) {
+  while(*s && *s != ' ' && *s != '$')
+    s++;
+  return s;
+}
+
+static char *nmdc_addr(char *s) {
+  while(g_ascii_isxdigit(*s) || *s == ':' || *s == '[' || *s == ']' || *s == '.')
+    s++;
+  return s;
+}
+
+#define nmdc_prefix(s, lit) (strncmp(s, lit, sizeof(lit)-1) == 0 ? (s += sizeof(lit)-1, TRUE) : FALSE)
+
+
+// Parses a single hub message (without the terminating '|'), dispatching on
+// the first character of the command keyword. On success, c->argv points into
+// *str, which is modified in-place to zero-terminate the separate arguments.
+// No memory is allocated. Returns FALSE if the command is not recognized or
+// invalid, *str is left unmodified in that case.
+gboolean nmdc_parse(char *str, nmdc_cmd_t *c) {
+  char *s = str+1, *e, *f;
+
+  if(*str != '$') {
+    c->cmd = NMDCC_CHAT;
+    c->argv[0] = str;
+    return TRUE;
+  }
+
+  switch(*s) {
+  case 'B':
+    if(!nmdc_prefix(s, "BadPass"))
+      return FALSE;
+    c->cmd = NMDCC_BADPASS;
+    return TRUE;
+
+  case 'C': // $ConnectToMe ([^ $]+) ([a-fA-F0-9:\[\]\.]+)(S|)
+    if(!nmdc_prefix(s, "ConnectToMe "))
+      return FALSE;
+    e = nmdc_tok(s);
+    if(e == s || *e != ' ')
+      return FALSE;
+    f = nmdc_addr(e+1);
+    if(f == e+1)
+      return FALSE;
+    c->cmd = NMDCC_CONNECTTOME;
+    c->argv[0] = s;
+    c->argv[1] = e+1;
+    c->argv[2] = *f == 'S' ? "S" : "";
+    *e = *f = 0;
+    return TRUE;
+
+  case 'F': // $ForceMove (.+)
+    if(!nmdc_prefix(s, "ForceMove ") || !*s)
+      return FALSE;
+    c->cmd = NMDCC_FORCEMOVE;
+    c->argv[0] = s;
+    return TRUE;
+
+  case 'G':
+    if(!nmdc_prefix(s, "GetPass"))
+      return FALSE;
+    c->cmd = NMDCC_GETPASS;
+    return TRUE;
+
+  case 'H':
+    if(nmdc_prefix(s, "Hello ")) { // $Hello ([^ $]+)
+      e = nmdc_tok(s);
+      if(e == s)
+        return FALSE;
+      c->cmd = NMDCC_HELLO;
+      c->argv[0] = s;
+      *e = 0;
+      return TRUE;
+    }
+    if(nmdc_prefix(s, "HubName ")) { // $HubName (.+)
+      if(!*s)
+        return FALSE;
+      c->cmd = NMDCC_HUBNAME;
+      c->argv[0] = s;
+      return TRUE;
+    }
+    if(nmdc_prefix(s, "HubIsFull")) {
+      c->cmd = NMDCC_HUBISFULL;
+      return TRUE;
+    }
+    return FALSE;
+
+  case 'L': // $Lock ([^ $]+) Pk=[^ $]+
+    if(!nmdc_prefix(s, "Lock "))
+      return FALSE;
+    e = nmdc_tok(s);
+    if(e == s || strncmp(e, " Pk=", 4) != 0 || nmdc_tok(e+4) == e+4)
+      return FALSE;
+    c->cmd = NMDCC_LOCK;
+    c->argv[0] = s;
+    *e = 0;
+    return TRUE;
+
+  case 'M': // $MyINFO $ALL ([^ $]+) (.+)
+    if(!nmdc_prefix(s, "MyINFO $ALL "))
+      return FALSE;
+    e = nmdc_tok(s);
+    if(e == s || *e != ' ' || !e[1])
+      return FALSE;
+    c->cmd = NMDCC_MYINFO;
+    c->argv[0] = s;
+    c->argv[1] = e+1;
+    *e = 0;
+    return TRUE;
+
+  case 'N': // $NickList (.+)
+    if(!nmdc_prefix(s, "NickList ") || !*s)
+      return FALSE;
+    c->cmd = NMDCC_NICKLIST;
+    c->argv[0] = s;
+    return TRUE;
+
+  case 'O': // $OpList (.+)
+    if(!nmdc_prefix(s, "OpList ") || !*s)
+      return FALSE;
+    c->cmd = NMDCC_OPLIST;
+    c->argv[0] = s;
+    return TRUE;
+
+  case 'Q': // $Quit ([^ $]+)
+    if(!nmdc_prefix(s, "Quit "))
+      return FALSE;
+    e = nmdc_tok(s);
+    if(e == s)
+      return FALSE;
+    c->cmd = NMDCC_QUIT;
+    c->argv[0] = s;
+    *e = 0;
+    return TRUE;
+
+  case 'R': // $RevConnectToMe ([^ $]+) ([^ $]+)
+    if(!nmdc_prefix(s, "RevConnectToMe "))
+      return FALSE;
+    e = nmdc_tok(s);
+    if(e == s || *e != ' ')
+      return FALSE;
+    f = nmdc_tok(e+1);
+    if(f == e+1)
+      return FALSE;
+    c->cmd = NMDCC_REVCONNECTTOME;
+    c->argv[0] = s;
+    c->argv[1] = e+1;
+    *e = *f = 0;
+    return TRUE;
+
+  case 'S':
+    if(s[1] == 'R') {
+      c->cmd = NMDCC_SR;
+      c->argv[0] = str;
+      return TRUE;
+    }
+    if(nmdc_prefix(s, "Supports ")) { // $Supports (.+)
+      if(!*s)
+        return FALSE;
+      c->cmd = NMDCC_SUPPORTS;
+      c->argv[0] = s;
+      return TRUE;
+    }
+    // $Search (Hub:(?:[^ $]+)|(?:[a-fA-F0-9:\[\]\.]+)) ([TF])\?([TF])\?([0-9]+)\?([1-9])\?(.+)
+    if(!nmdc_prefix(s, "Search "))
+      return FALSE;
+    if(strncmp(s, "Hub:", 4) == 0) {
+      e = nmdc_tok(s+4);
+      if(e == s+4)
+        return FALSE;
+    } else {
+      e = nmdc_addr(s);
+      if(e == s)
+        return FALSE;
+    }
+    if(e[0] != ' ' || (e[1] != 'T' && e[1] != 'F') || e[2] != '?' || (e[3] != 'T' && e[3] != 'F') || e[4] != '?')
+      return FALSE;
+    for(f=e+5; g_ascii_isdigit(*f); f++)
+      ;
+    if(f == e+5 || f[0] != '?' || f[1] < '1' || f[1] > '9' || f[2] != '?' || !f[3])
+      return FALSE;
+    c->cmd = NMDCC_SEARCH;
+    c->argv[0] = s;
+    c->argv[1] = e+1;
+    c->argv[2] = e+3;
+    c->argv[3] = e+5;
+    c->argv[4] = f+1;
+    c->argv[5] = f+3;
+    e[0] = e[2] = e[4] = f[0] = f[2] = 0;
+    return TRUE;
+
+  case 'T': // $To: ([^ $]+) From: ([^ $]+) \$(.+)
+    if(!nmdc_prefix(s, "To: "))
+      return FALSE;
+    e = nmdc_tok(s);
+    if(e == s || strncmp(e, " From: ", 7) != 0)
+      return FALSE;
+    f = nmdc_tok(e+7);
+    if(f == e+7 || f[0] != ' ' || f[1] != '$' || !f[2])
+      return FALSE;
+    c->cmd = NMDCC_TO;
+    c->argv[0] = s;
+    c->argv[1] = e+7;
+    c->argv[2] = f+2;
+    *e = *f = 0;
+    return TRUE;
+
+  case 'U': // $UserIP (.+)
+    if(!nmdc_prefix(s, "UserIP ") || !*s)
+      return FALSE;
+    c->cmd = NMDCC_USERIP;
+    c->argv[0] = s;
+    return TRUE;
+
+  case 'V':
+    if(!nmdc_prefix(s, "ValidateDenide"))
+      return FALSE;
+    c->cmd = NMDCC_VALIDATEDENIDE;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+#undef nmdc_prefix
+
+
 
 
 
@@ -201,6 +464,24 @@ struct adc_cmd_t {
   int dest;         // Only when type = D|E
   char **argv;
   int argc;
+  adc_arena_t *arena; // Set if argv is owned by an arena, see adc_parse_arena()
+};
+
+
+// Number of possible two-letter parameter names ([A-Z][A-Z0-9])
+#define ADC_PIDX_SIZE (26*36)
+
+// Reusable buffers for adc_parse_arena(), one per connection. Must be
+// zero-initialized, adc_arena_free() releases the memory.
+struct adc_arena_t {
+  GString *buf;   // copy of the arguments, tokenized and unescaped in-place
+  char **argv;
+  int argvsize;
+  guint32 gen;    // incremented for each parsed command
+  struct {
+    guint32 gen;  // entry is only valid if this equals the gen above
+    guint32 arg;  // index of the first argument with this name
+  } *idx;
 };
 
 
@@ -222,20 +503,17 @@ static gboolean int_in_array(const int *arr, int needle) {
 }
 
 
-gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
-  if(!g_utf8_validate(str, -1, NULL)) {
-    g_set_error_literal(err, 1, 0, "Invalid encoding.");
-    return FALSE;
-  }
-
+// Parses the type, command, source, destination and features of a command.
+// Returns a pointer to the remaining arguments or NULL on error.
+static const char *adc_parse_head(const char *str, adc_cmd_t *c, int *feats, GError **err) {
   if(strlen(str) < 4) {
     g_set_error_literal(err, 1, 0, "Message too short.");
-    return FALSE;
+    return NULL;
   }
 
   if(*str != 'B' && *str != 'C' && *str != 'D' && *str != 'E' && *str != 'F' && *str != 'H' && *str != 'I' && *str != 'U') {
     g_set_error_literal(err, 1, 0, "Invalid ADC type");
-    return FALSE;
+    return NULL;
   }
   c->type = *str;
   c->cmd = ADC_TOCMD(str+1);
@@ -243,7 +521,7 @@ gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
   const char *off = str+4;
   if(off[0] && off[0] != ' ') {
     g_set_error_literal(err, 1, 0, "Invalid characters after command.");
-    return FALSE;
+    return NULL;
   }
   if(off[0])
     off++;
@@ -254,12 +532,12 @@ gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
   if(c->type == 'B' || c->type == 'D' || c->type == 'E' || c->type == 'F') {
     if(strlen(off) < 4) {
       g_set_error_literal(err, 1, 0, "Message too short");
-      return FALSE;
+      return NULL;
     }
     c->source = ADC_DFCC(off);
     if(off[4] && off[4] != ' ') {
       g_set_error_literal(err, 1, 0, "Invalid characters after argument.");
-      return FALSE;
+      return NULL;
     }
     off += off[4] ? 5 : 4;
   }
@@ -268,12 +546,12 @@ gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
   if(c->type == 'D' || c->type == 'E') {
     if(strlen(off) < 4) {
       g_set_error_literal(err, 1, 0, "Message too short");
-      return FALSE;
+      return NULL;
     }
     c->dest = ADC_DFCC(off);
     if(off[4] && off[4] != ' ') {
       g_set_error_literal(err, 1, 0, "Invalid characters after argument.");
-      return FALSE;
+      return NULL;
     }
     off += off[4] ? 5 : 4;
   }
@@ -286,23 +564,38 @@ gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
     int l = strchr(off, ' ') ? strchr(off, ' ')-off : strlen(off);
     if((l % 5) != 0) {
       g_set_error_literal(err, 1, 0, "Message too short");
-      return FALSE;
+      return NULL;
     }
     int i;
     for(i=0; i<l/5; i++) {
       int f = ADC_DFCC(off+i*5+1);
       if(off[i*5] == '+' && !int_in_array(feats, f)) {
         g_set_error_literal(err, 1, 0, "Feature broadcast for a feature we don't have.");
-        return FALSE;
+        return NULL;
       }
       if(off[i*5] == '-' && int_in_array(feats, f)) {
         g_set_error_literal(err, 1, 0, "Feature broadcast excluding a feature we have.");
-        return FALSE;
+        return NULL;
       }
     }
     off += off[l] ? l+1 : l;
   }
 
+  return off;
+}
+
+
+gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
+  if(!g_utf8_validate(str, -1, NULL)) {
+    g_set_error_literal(err, 1, 0, "Invalid encoding.");
+    return FALSE;
+  }
+
+  const char *off = adc_parse_head(str, c, feats, err);
+  if(!off)
+    return FALSE;
+  c->arena = NULL;
+
   // parse the rest of the arguments
   char **s = g_strsplit(off, " ", 0);
   c->argc = s ? g_strv_length(s) : 0;
@@ -329,6 +622,140 @@ gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
 }
 
 
+// Unescapes an ADC parameter in-place, returns FALSE on an invalid escape.
+static gboolean adc_unescape_inplace(char *str) {
+  char *dest = str;
+  while(*str) {
+    if(*str == '\\') {
+      str++;
+      if(*str == 's')
+        *dest = ' ';
+      else if(*str == 'n')
+        *dest = '\n';
+      else if(*str == '\\')
+        *dest = '\\';
+      else
+        return FALSE;
+    } else
+      *dest = *str;
+    dest++;
+    str++;
+  }
+  *dest = 0;
+  return TRUE;
+}
+
+
+// Index of a two-letter parameter name in adc_arena_t.idx, or -1 if the name
+// can't be indexed.
+static int adc_pidx(const char *name) {
+  int a = name[0], b = name[1];
+  if(a < 'A' || a > 'Z')
+    return -1;
+  if(b >= 'A' && b <= 'Z')
+    return (a-'A')*36 + b-'A';
+  if(b >= '0' && b <= '9')
+    return (a-'A')*36 + 26 + b-'0';
+  return -1;
+}
+
+
+// Same as adc_parse(), but without allocating memory for each command. The
+// arguments are tokenized and unescaped in-place in a copy of the message
+// held by the arena, and named parameters are indexed for adc_cmd_param().
+// The result must not be freed, it remains valid until the next call with
+// the same arena. str is only validated as UTF-8 when it is not pure ASCII.
+gboolean adc_parse_arena(const char *str, adc_cmd_t *c, int *feats, adc_arena_t *a, GError **err) {
+  const char *off = adc_parse_head(str, c, feats, err);
+  if(!off)
+    return FALSE;
+  c->arena = a;
+
+  int len = strlen(off);
+  if(!a->buf) {
+    a->buf = g_string_sized_new(MAX(len+1, 1024));
+    a->argvsize = 32;
+    a->argv = g_new(char *, a->argvsize);
+    a->idx = g_malloc0(ADC_PIDX_SIZE*sizeof(*a->idx));
+  }
+  g_string_truncate(a->buf, 0);
+  g_string_append_len(a->buf, off, len);
+  if(!++a->gen) {
+    memset(a->idx, 0, ADC_PIDX_SIZE*sizeof(*a->idx));
+    a->gen = 1;
+  }
+
+  // Check the command header for non-ASCII characters as well, the arguments
+  // are checked while tokenizing.
+  unsigned char hi = 0;
+  const char *h;
+  for(h=str; h<off; h++)
+    hi |= *h;
+
+  c->argc = 0;
+  char *p = a->buf->str, *tok = p;
+  gboolean esc = FALSE;
+  while(len) {
+    unsigned char ch = *p;
+    hi |= ch;
+    if(ch == '\\')
+      esc = TRUE;
+    else if(ch == ' ' || !ch) {
+      *p = 0;
+      if(esc && !adc_unescape_inplace(tok)) {
+        g_set_error_literal(err, 1, 0, "Invalid escape in argument.");
+        return FALSE;
+      }
+      if(c->argc+1 >= a->argvsize) {
+        a->argvsize *= 2;
+        a->argv = g_renew(char *, a->argv, a->argvsize);
+      }
+      int i = tok[0] ? adc_pidx(tok) : -1;
+      if(i >= 0 && a->idx[i].gen != a->gen) {
+        a->idx[i].gen = a->gen;
+        a->idx[i].arg = c->argc;
+      }
+      a->argv[c->argc++] = tok;
+      if(!ch)
+        break;
+      tok = p+1;
+      esc = FALSE;
+    }
+    p++;
+  }
+  a->argv[c->argc] = NULL;
+  c->argv = a->argv;
+
+  if((hi & 0x80) && !g_utf8_validate(str, -1, NULL)) {
+    g_set_error_literal(err, 1, 0, "Invalid encoding.");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+void adc_arena_free(adc_arena_t *a) {
+  if(a->buf)
+    g_string_free(a->buf, TRUE);
+  g_free(a->argv);
+  g_free(a->idx);
+}
+
+
+// Like adc_getparam(c->argv+start, name, NULL), but uses the parameter index
+// when the command has been parsed with adc_parse_arena().
+char *adc_cmd_param(adc_cmd_t *c, int start, char *name) {
+  int i = c->arena ? adc_pidx(name) : -1;
+  if(i >= 0) {
+    if(c->arena->idx[i].gen != c->arena->gen)
+      return NULL;
+    if(c->arena->idx[i].arg >= start)
+      return c->argv[c->arena->idx[i].arg]+2;
+  }
+  return adc_getparam(c->argv+start, name, NULL);
+}
+
+
 char *adc_getparam(char **a, char *name, char ***left) {
   while(a && *a) {
     if(**a && **a == name[0] && (*a)[1] == name[1]) {
@@ -39,6 +39,7 @@ struct search_q_t {
   gboolean ge;  // TRUE -> match >= size; FALSE -> match <= size
   guint64 size; // 0 = disabled.
   char **query; // list of patterns to include
+  char **lquery;// lowercased copy of query, set by search_add() for match()
   char tth[24]; // only used when type = 9
   char key[16]; // SUDP key that we sent along with the SCH
 
@@ -66,6 +67,12 @@ struct search_type_t {
 // A set of search_q pointers, listing the searches we're currently interested in.
 static GHashTable *search_list = NULL;
 
+// Index of the active searches, so that dispatch() doesn't have to match every
+// result against every query. TTH searches are grouped by their root (tth ->
+// GSList of search_q pointers), all other searches are in search_other.
+static GHashTable *search_tth = NULL;
+static GPtrArray *search_other = NULL;
+
 
 
 // NMDC search types and the relevant ADC SEGA extensions.
@@ -87,6 +94,8 @@ void search_q_free(search_q_t *q) {
     return;
   if(q->query)
     g_strfreev(q->query);
+  if(q->lquery)
+    g_strfreev(q->lquery);
   g_slice_free(search_q_t, q);
 }
 
@@ -117,6 +126,20 @@ search_r_t *search_r_copy(search_r_t *r) {
 }
 
 
+// Lowercases a string the same way str_casestr() compares characters, so that
+// a plain strstr() on lowercased strings gives the same results. Writes to
+// dest, or to a new GString if dest is NULL.
+static GString *lower(GString *dest, const char *str) {
+  if(dest)
+    g_string_truncate(dest, 0);
+  else
+    dest = g_string_sized_new(strlen(str));
+  for(; *str; str=g_utf8_next_char(str))
+    g_string_append_unichar(dest, g_unichar_tolower(g_utf8_get_char(str)));
+  return dest;
+}
+
+
 // Generate the required /search command for a query.
 char *search_command(search_q_t *q, gboolean onhub) {
   GString *str = g_string_new("/search");
@@ -168,7 +191,7 @@ gboolean search_add(hub_t *hub, search_q_t *q, GError **err) {
     return FALSE;
   }
 
-  if(var_get_int(0, VAR_sudp_policy) == VAR_SUDPP_PREFER)
+  if(var_snap(0)->sudp_policy == VAR_SUDPP_PREFER)
     crypt_nonce(q->key, 16);
 
   // Search a single hub
@@ -178,7 +201,7 @@ gboolean search_add(hub_t *hub, search_q_t *q, GError **err) {
       search_q_free(q);
       return FALSE;
     }
-    if(var_get_bool(hub->id, VAR_chat_only))
+    if(var_snap(hub->id)->chat_only)
       g_set_error(err, 1, 0, "Searching on a hub with the `chat_only' setting enabled.");
     hub_search(hub, q);
   }
@@ -190,7 +213,7 @@ gboolean search_add(hub_t *hub, search_q_t *q, GError **err) {
     hub_t *h = NULL;
     g_hash_table_iter_init(&i, hubs);
     while(g_hash_table_iter_next(&i, NULL, (gpointer *)&h)) {
-      if(h->nick_valid && !var_get_bool(h->id, VAR_chat_only)) {
+      if(h->nick_valid && !var_snap(h->id)->chat_only) {
         hub_search(h, q);
         one = TRUE;
       }
@@ -203,25 +226,49 @@ gboolean search_add(hub_t *hub, search_q_t *q, GError **err) {
   }
 
   // Add to the active searches list
-  if(!search_list)
+  if(!search_list) {
     search_list = g_hash_table_new(g_direct_hash, g_direct_equal);
+    search_tth = g_hash_table_new(g_int_hash, tiger_hash_equal);
+    search_other = g_ptr_array_new();
+  }
   g_hash_table_insert(search_list, q, q);
+
+  // And to the index
+  if(q->type == 9) {
+    GSList *l = g_hash_table_lookup(search_tth, q->tth);
+    g_hash_table_replace(search_tth, q->tth, g_slist_prepend(l, q));
+  } else {
+    int i, n = g_strv_length(q->query);
+    q->lquery = g_new0(char *, n+1);
+    for(i=0; i<n; i++)
+      q->lquery[i] = g_string_free(lower(NULL, q->query[i]), FALSE);
+    g_ptr_array_add(search_other, q);
+  }
   return TRUE;
 }
 
 
 // Remove a query from the active searches.
 void search_remove(search_q_t *q) {
-  if(search_list && g_hash_table_remove(search_list, q))
-    search_q_free(q);
+  if(!search_list || !g_hash_table_remove(search_list, q))
+    return;
+
+  if(q->type == 9) {
+    GSList *l = g_slist_remove(g_hash_table_lookup(search_tth, q->tth), q);
+    // The key points into a search_q, so make sure it refers to one that is
+    // still in the list.
+    g_hash_table_remove(search_tth, q->tth);
+    if(l)
+      g_hash_table_insert(search_tth, ((search_q_t *)l->data)->tth, l);
+  } else
+    g_ptr_array_remove_fast(search_other, q);
+  search_q_free(q);
 }
 
 
-// Match a search result with a query.
-static gboolean match(search_q_t *q, search_r_t *r) {
-  // TTH match is fast and easy
-  if(q->type == 9)
-    return r->size == G_MAXUINT64 ? FALSE : memcmp(q->tth, r->tth, 24) == 0 ? TRUE : FALSE;
+// Match a search result with a (non-TTH) query. lfile is the lowercased
+// r->file.
+static gboolean match(search_q_t *q, search_r_t *r, const char *lfile) {
   // Match file/dir type
   if(q->type == 8 && r->size != G_MAXUINT64)
     return FALSE;
@@ -231,9 +278,9 @@ static gboolean match(search_q_t *q, search_r_t *r) {
   if(q->size && !(q->ge ? r->size >= q->size : r->size <= q->size))
     return FALSE;
   // Match query
-  char **str = q->query;
+  char **str = q->lquery;
   for(; str&&*str; str++)
-    if(G_LIKELY(!str_casestr(r->file, *str)))
+    if(G_LIKELY(!strstr(lfile, *str)))
       return FALSE;
   // Match extension
   char **ext = search_types[(int)q->type].exts;
@@ -258,12 +305,27 @@ static gboolean match(search_q_t *q, search_r_t *r) {
 static void dispatch(search_r_t *r) {
   if(!search_list)
     return;
-  GHashTableIter i;
-  g_hash_table_iter_init(&i, search_list);
-  search_q_t *q;
-  while(g_hash_table_iter_next(&i, (gpointer *)&q, NULL))
-    if(q->cb && match(q, r))
+
+  // TTH searches only need a lookup
+  GSList *l = r->size == G_MAXUINT64 ? NULL : g_hash_table_lookup(search_tth, r->tth);
+  for(; l; l=l->next) {
+    search_q_t *q = l->data;
+    if(q->cb)
+      q->cb(r, q->cb_dat);
+  }
+
+  // Other searches match against the lowercased file name, which we only have
+  // to calculate once.
+  if(!search_other->len)
+    return;
+  static GString *lfile = NULL;
+  lfile = lower(lfile, r->file);
+  int i;
+  for(i=0; i<search_other->len; i++) {
+    search_q_t *q = g_ptr_array_index(search_other, i);
+    if(q->cb && match(q, r, lfile->str))
       q->cb(r, q->cb_dat);
+  }
 }
 
 
@@ -390,10 +452,10 @@ static search_r_t *parse_adc(hub_t *hub, adc_cmd_t *cmd) {
   if(!hub && (cmd->type != 'U' || cmd->argc < 1 || !iscid(cmd->argv[0])))
     return NULL;
   char *cid = hub ? NULL : cmd->argv[0];
-  char **argv = hub ? cmd->argv : cmd->argv+1;
+  int start = hub ? 0 : 1;
 
   // file
-  r.file = adc_getparam(argv, "FN", NULL);
+  r.file = adc_cmd_param(cmd, start, "FN");
   if(!r.file)
     return NULL;
   gboolean isfile = TRUE;
@@ -403,12 +465,12 @@ static search_r_t *parse_adc(hub_t *hub, adc_cmd_t *cmd) {
   }
 
   // tth & size
-  tmp = isfile ? adc_getparam(argv, "TR", NULL) : NULL;
+  tmp = isfile ? adc_cmd_param(cmd, start, "TR") : NULL;
   if(tmp) {
     if(!istth(tmp))
       return NULL;
     base32_decode(tmp, r.tth);
-    tmp = adc_getparam(argv, "SI", NULL);
+    tmp = adc_cmd_param(cmd, start, "SI");
     if(!tmp)
       return NULL;
     r.size = g_ascii_strtoull(tmp, &tmp2, 10);
@@ -418,7 +480,7 @@ static search_r_t *parse_adc(hub_t *hub, adc_cmd_t *cmd) {
     r.size = G_MAXUINT64;
 
   // slots
-  tmp = adc_getparam(argv, "SL", NULL);
+  tmp = adc_cmd_param(cmd, start, "SL");
   if(tmp) {
     r.slots = g_ascii_strtoull(tmp, &tmp2, 10);
     if(tmp == tmp2 || !tmp2 || *tmp2)
@@ -435,7 +497,7 @@ static search_r_t *parse_adc(hub_t *hub, adc_cmd_t *cmd) {
   // uid - active. Active responses must have the hubid in the token, from
   // which we can generate the uid.
   } else {
-    tmp = adc_getparam(argv, "TO", NULL);
+    tmp = adc_cmd_param(cmd, start, "TO");
     if(!tmp || strlen(tmp) != 13 || !isbase32(tmp))
       return NULL;
     guint64 hubid;
@@ -511,7 +573,7 @@ gboolean search_handle_udp(const char *addr, char *pack, int len) {
     adc = FALSE;
   else if(strncmp(msg, "URES ", 5) == 0)
     adc = TRUE;
-  else if(!(len & 15) && var_get_int(0, VAR_sudp_policy) != VAR_SUDPP_DISABLE) {
+  else if(!(len & 15) && var_snap(0)->sudp_policy != VAR_SUDPP_DISABLE) {
     char *buf = g_malloc(len);
     GHashTableIter i;
     g_hash_table_iter_init(&i, search_list);
@@ -257,6 +257,96 @@ void tiger_final(tiger_ctx_t *ctx, char result[24]) {
 }
 
 
+/* Multi-buffer tiger compression. Tiger is built around 8-bit table lookups,
+ * which do not map well onto SIMD instructions (the tables don't fit in
+ * registers and gathers are slow or unavailable). What does help is hashing
+ * several independent messages in lockstep: the rounds of one message are
+ * strictly serial, so interleaving the rounds of two or four messages lets the
+ * CPU overlap the S-box loads and multiplications of the different lanes.
+ * These macros expand the regular round/key schedule for each lane, the lane
+ * variables are suffixed with _0, _1, etc. */
+
+#define lane_load(L, s, blk) \
+  guint64 a##L = s[0], b##L = s[1], c##L = s[2];\
+  guint64 x0##L=GUINT64_FROM_LE(blk[0]), x1##L=GUINT64_FROM_LE(blk[1]),\
+          x2##L=GUINT64_FROM_LE(blk[2]), x3##L=GUINT64_FROM_LE(blk[3]),\
+          x4##L=GUINT64_FROM_LE(blk[4]), x5##L=GUINT64_FROM_LE(blk[5]),\
+          x6##L=GUINT64_FROM_LE(blk[6]), x7##L=GUINT64_FROM_LE(blk[7]);
+
+#define lane_store(L, s) \
+  s[0] = a##L ^ s[0];\
+  s[1] = b##L - s[1];\
+  s[2] = c##L + s[2];
+
+#define lane_key_schedule(L) { \
+  x0##L -= x7##L ^ G_GUINT64_CONSTANT(0xA5A5A5A5A5A5A5A5); \
+  x1##L ^= x0##L; \
+  x2##L += x1##L; \
+  x3##L -= x2##L ^ ((~x1##L)<<19); \
+  x4##L ^= x3##L; \
+  x5##L += x4##L; \
+  x6##L -= x5##L ^ ((~x4##L)>>23); \
+  x7##L ^= x6##L; \
+  x0##L += x7##L; \
+  x1##L -= x0##L ^ ((~x7##L)<<19); \
+  x2##L ^= x1##L; \
+  x3##L += x2##L; \
+  x4##L -= x3##L ^ ((~x2##L)>>23); \
+  x5##L ^= x4##L; \
+  x6##L += x5##L; \
+  x7##L -= x6##L ^ G_GUINT64_CONSTANT(0x0123456789ABCDEF); \
+}
+
+#define round2(a,b,c,x,mul) \
+  round(a##_0,b##_0,c##_0,x##_0,mul) \
+  round(a##_1,b##_1,c##_1,x##_1,mul)
+
+#define round4(a,b,c,x,mul) \
+  round2(a,b,c,x,mul) \
+  round(a##_2,b##_2,c##_2,x##_2,mul) \
+  round(a##_3,b##_3,c##_3,x##_3,mul)
+
+#define passn(r,a,b,c,mul) \
+  r(a,b,c,x0,mul) \
+  r(b,c,a,x1,mul) \
+  r(c,a,b,x2,mul) \
+  r(a,b,c,x3,mul) \
+  r(b,c,a,x4,mul) \
+  r(c,a,b,x5,mul) \
+  r(a,b,c,x6,mul) \
+  r(b,c,a,x7,mul)
+
+
+static void tiger_process_block2(guint64 state[2][3], guint64 block[2][8]) {
+  lane_load(_0, state[0], block[0])
+  lane_load(_1, state[1], block[1])
+  passn(round2, a, b, c, 5);
+  lane_key_schedule(_0) lane_key_schedule(_1)
+  passn(round2, c, a, b, 7);
+  lane_key_schedule(_0) lane_key_schedule(_1)
+  passn(round2, b, c, a, 9);
+  lane_store(_0, state[0])
+  lane_store(_1, state[1])
+}
+
+
+static void tiger_process_block4(guint64 state[4][3], guint64 block[4][8]) {
+  lane_load(_0, state[0], block[0])
+  lane_load(_1, state[1], block[1])
+  lane_load(_2, state[2], block[2])
+  lane_load(_3, state[3], block[3])
+  passn(round4, a, b, c, 5);
+  lane_key_schedule(_0) lane_key_schedule(_1) lane_key_schedule(_2) lane_key_schedule(_3)
+  passn(round4, c, a, b, 7);
+  lane_key_schedule(_0) lane_key_schedule(_1) lane_key_schedule(_2) lane_key_schedule(_3)
+  passn(round4, b, c, a, 9);
+  lane_store(_0, state[0])
+  lane_store(_1, state[1])
+  lane_store(_2, state[2])
+  lane_store(_3, state[3])
+}
+
+
 
 
 
@@ -293,6 +383,11 @@ struct tth_ctx_t {
 
 #define tth_base_block 1024
 
+// Maximum number of leaves to hash in one go from tth_update(), and the number
+// of leaves hashed in parallel.
+#define tth_leaf_batch 16
+#define tth_leaf_lanes 4
+
 
 #define tth_new_leaf(ctx) do {\
     tiger_init(&((ctx)->tiger));\
@@ -333,12 +428,108 @@ void tth_update_leaf(tth_ctx_t *ctx, const char *leaf) {
 }
 
 
+// Hashing of whole base leaves. A leaf hash is the tiger hash of a zero byte
+// followed by the 1024 bytes of the leaf, which makes for 16 full blocks and a
+// final block holding the last byte and the padding. Since all leaves have the
+// same length, the blocks can be constructed directly and several leaves can
+// be fed to the multi-buffer compression functions in lockstep.
+
+#define tth_leaf_blocks 17
+
+static void tth_leaf_block(guint64 *blk, const char *leaf, int n) {
+  char *b = (char *)blk;
+  if(n == 0) {
+    b[0] = 0;
+    memcpy(b+1, leaf, 63);
+  } else if(n < tth_leaf_blocks-1)
+    memcpy(b, leaf+(64*n)-1, 64);
+  else {
+    b[0] = leaf[tth_base_block-1];
+    b[1] = 0x01;
+    memset(b+2, 0, 54);
+    blk[7] = GUINT64_TO_LE((guint64)(tth_base_block+1) << 3);
+  }
+}
+
+
+#define tth_leaf_state_init(s) do {\
+    (s)[0] = G_GUINT64_CONSTANT(0x0123456789ABCDEF);\
+    (s)[1] = G_GUINT64_CONSTANT(0xFEDCBA9876543210);\
+    (s)[2] = G_GUINT64_CONSTANT(0xF096A5B4C3B2E187);\
+  } while(0)
+
+
+#define tth_leaf_state_save(s, res) do {\
+    guint64 *r = (guint64 *)(res);\
+    r[0] = GINT64_TO_LE((s)[0]);\
+    r[1] = GINT64_TO_LE((s)[1]);\
+    r[2] = GINT64_TO_LE((s)[2]);\
+  } while(0)
+
+
+#define tth_leaves_n(lanes, func, msg, res) do {\
+    guint64 state[lanes][3];\
+    guint64 block[lanes][8];\
+    int i, l;\
+    for(l=0; l<lanes; l++)\
+      tth_leaf_state_init(state[l]);\
+    for(i=0; i<tth_leaf_blocks; i++) {\
+      for(l=0; l<lanes; l++)\
+        tth_leaf_block(block[l], (msg)+(l*tth_base_block), i);\
+      func(state, block);\
+    }\
+    for(l=0; l<lanes; l++)\
+      tth_leaf_state_save(state[l], (res)+(l*24));\
+  } while(0)
+
+
+// Calculate the hashes of num consecutive base leaves in msg (which must be
+// num*1024 bytes long) and write them to res (num*24 bytes). lanes indicates
+// the maximum number of leaves to hash in parallel, 1, 2 or 4. 1 uses the
+// regular tiger_update() path.
+void tth_leaves(const char *msg, int num, char *res, int lanes) {
+  while(lanes >= 4 && num >= 4) {
+    tth_leaves_n(4, tiger_process_block4, msg, res);
+    msg += 4*tth_base_block;
+    res += 4*24;
+    num -= 4;
+  }
+  while(lanes >= 2 && num >= 2) {
+    tth_leaves_n(2, tiger_process_block2, msg, res);
+    msg += 2*tth_base_block;
+    res += 2*24;
+    num -= 2;
+  }
+  tiger_ctx_t t;
+  for(; num>0; num--) {
+    tiger_init(&t);
+    tiger_update(&t, "\0", 1);
+    tiger_update(&t, msg, tth_base_block);
+    tiger_final(&t, res);
+    msg += tth_base_block;
+    res += 24;
+  }
+}
+
+
 void tth_update(tth_ctx_t *ctx, const char *msg, size_t len) {
   char leaf[24];
   int left;
+  char leaves[tth_leaf_batch*24];
+  int i, n;
   if(len > 0)
     ctx->gotfirst = 1;
   while(len > 0) {
+    // Hash whole leaves in batches if we're at a leaf boundary
+    if(ctx->tiger.length == 1 && len >= 2*tth_base_block) {
+      n = MIN(len/tth_base_block, tth_leaf_batch);
+      tth_leaves(msg, n, leaves, tth_leaf_lanes);
+      for(i=0; i<n; i++)
+        tth_update_leaf(ctx, leaves+(i*24));
+      len -= n*tth_base_block;
+      msg += n*tth_base_block;
+      continue;
+    }
     left = MIN(tth_base_block - (ctx->tiger.length-1), len);
     tiger_update(&ctx->tiger, msg, left);
     len -= left;
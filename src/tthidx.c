@@ -0,0 +1,295 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2014 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// Index of items with a TTH (or any other tiger hash) as key. Implemented as
+// an open-addressing hash table with linear probing. Each slot holds the first
+// 8 bytes of the hash inline, so probing doesn't have to touch the items
+// themselves, and a pointer to either the item itself or, in the less common
+// case of multiple items with the same hash, a small vector of items. This
+// takes 16 bytes per slot and no further allocations for unique items,
+// compared to a GHashTable node plus a GSList node and its separate
+// allocation.
+//
+// The full hash is read from the item at the offset given to tthidx_init(),
+// items must not be modified while they are in the index.
+
+#include "ncdc.h"
+#include "tthidx.h"
+
+
+#if INTERFACE
+
+typedef struct {
+  guint64 prefix;
+  gpointer ptr; // item, or (tthidx_vec_t *)|1
+} tthidx_slot_t;
+
+typedef struct {
+  tthidx_slot_t *slots;
+  guint32 mask;   // number of slots - 1
+  guint32 keys;   // number of unique hashes in the index
+  guint32 items;  // total number of items in the index
+  int keyoff;     // offset of the hash within an item
+  gboolean vecs;  // whether any vectors have been allocated
+} tthidx_t;
+
+#define tthidx_size(i) ((i)->keys)
+
+#endif
+
+
+typedef struct {
+  guint32 n, size;
+  gpointer v[1];
+} tthidx_vec_t;
+
+#define TTHIDX_MINSIZE 64
+
+#define isvec(p) (GPOINTER_TO_SIZE(p) & 1)
+#define getvec(p) ((tthidx_vec_t *)(GPOINTER_TO_SIZE(p) & ~(gsize)1))
+#define mkvec(v) GSIZE_TO_POINTER(GPOINTER_TO_SIZE(v) | 1)
+#define keyof(i, p) ((const char *)(p) + (i)->keyoff)
+
+
+// Tiger hashes are uniformly distributed, so the first bytes can be used as
+// the hash value directly.
+static guint64 tthidx_prefix(const char *key) {
+  guint64 p;
+  memcpy(&p, key, 8);
+  return p;
+}
+
+static guint32 tthidx_slot(const tthidx_t *i, guint64 prefix) {
+  return (guint32)(prefix ^ (prefix >> 32)) & i->mask;
+}
+
+
+// First item of a slot, for comparing the full hash.
+static gpointer tthidx_first(gpointer p) {
+  return isvec(p) ? getvec(p)->v[0] : p;
+}
+
+
+void tthidx_init(tthidx_t *i, int keyoff) {
+  memset(i, 0, sizeof(tthidx_t));
+  i->keyoff = keyoff;
+  i->mask = TTHIDX_MINSIZE-1;
+  i->slots = g_new0(tthidx_slot_t, TTHIDX_MINSIZE);
+}
+
+
+// Returns the slot for the key, or the empty slot where it should be inserted.
+static tthidx_slot_t *tthidx_find(const tthidx_t *i, const char *key, guint64 prefix) {
+  guint32 n = tthidx_slot(i, prefix);
+  while(1) {
+    tthidx_slot_t *s = i->slots+n;
+    if(!s->ptr || (s->prefix == prefix && memcmp(keyof(i, tthidx_first(s->ptr))+8, key+8, 16) == 0))
+      return s;
+    n = (n+1) & i->mask;
+  }
+}
+
+
+static void tthidx_resize(tthidx_t *i, guint32 size) {
+  tthidx_slot_t *old = i->slots;
+  guint32 oldsize = i->mask+1;
+  i->slots = g_new0(tthidx_slot_t, size);
+  i->mask = size-1;
+  guint32 n;
+  for(n=0; n<oldsize; n++)
+    if(old[n].ptr) {
+      guint32 m = tthidx_slot(i, old[n].prefix);
+      while(i->slots[m].ptr)
+        m = (m+1) & i->mask;
+      i->slots[m] = old[n];
+    }
+  g_free(old);
+}
+
+
+// Returns the items with the given hash, the number of items is stored in *n.
+// The first item is always the one that has been added first. The returned
+// array is only valid until the next modification of the index.
+gpointer *tthidx_get(const tthidx_t *i, const char *key, int *n) {
+  tthidx_slot_t *s = tthidx_find(i, key, tthidx_prefix(key));
+  if(!s->ptr) {
+    *n = 0;
+    return NULL;
+  }
+  if(isvec(s->ptr)) {
+    *n = getvec(s->ptr)->n;
+    return getvec(s->ptr)->v;
+  }
+  *n = 1;
+  return &s->ptr;
+}
+
+
+// Adds an item to the index. Returns TRUE if this is the first item with that
+// hash.
+gboolean tthidx_add(tthidx_t *i, gpointer item) {
+  // Keep the load factor at or below 3/4
+  if((i->keys+1)*4 > (i->mask+1)*3)
+    tthidx_resize(i, (i->mask+1)*2);
+
+  const char *key = keyof(i, item);
+  guint64 prefix = tthidx_prefix(key);
+  tthidx_slot_t *s = tthidx_find(i, key, prefix);
+  i->items++;
+
+  if(!s->ptr) {
+    s->prefix = prefix;
+    s->ptr = item;
+    i->keys++;
+    return TRUE;
+  }
+
+  tthidx_vec_t *v;
+  if(!isvec(s->ptr)) {
+    v = g_malloc(sizeof(tthidx_vec_t) + 3*sizeof(gpointer));
+    v->size = 4;
+    v->n = 1;
+    v->v[0] = s->ptr;
+    i->vecs = TRUE;
+  } else {
+    v = getvec(s->ptr);
+    if(v->n == v->size) {
+      v->size *= 2;
+      v = g_realloc(v, sizeof(tthidx_vec_t) + (v->size-1)*sizeof(gpointer));
+    }
+  }
+  v->v[v->n++] = item;
+  s->ptr = mkvec(v);
+  return FALSE;
+}
+
+
+// Removes a slot, moving back any items in the probe sequence that follows it
+// so that no tombstones are necessary.
+static void tthidx_delslot(tthidx_t *i, tthidx_slot_t *s) {
+  guint32 hole = s - i->slots;
+  guint32 n = hole;
+  while(1) {
+    n = (n+1) & i->mask;
+    if(!i->slots[n].ptr)
+      break;
+    guint32 home = tthidx_slot(i, i->slots[n].prefix);
+    // Move the item if its home slot is not within (hole, n], cyclically.
+    if(hole <= n ? home <= hole || home > n : home <= hole && home > n) {
+      i->slots[hole] = i->slots[n];
+      hole = n;
+    }
+  }
+  i->slots[hole].ptr = NULL;
+  i->slots[hole].prefix = 0;
+  i->keys--;
+}
+
+
+// Removes an item from the index. Returns TRUE if this was the last item with
+// that hash, FALSE if there are other items left or if the item wasn't found
+// at all.
+gboolean tthidx_del(tthidx_t *i, gpointer item) {
+  const char *key = keyof(i, item);
+  tthidx_slot_t *s = tthidx_find(i, key, tthidx_prefix(key));
+  if(!s->ptr)
+    return FALSE;
+
+  if(!isvec(s->ptr)) {
+    if(s->ptr != item)
+      return FALSE;
+    i->items--;
+    tthidx_delslot(i, s);
+    if(i->mask+1 > TTHIDX_MINSIZE && i->keys*8 < i->mask+1)
+      tthidx_resize(i, (i->mask+1)/2);
+    return TRUE;
+  }
+
+  tthidx_vec_t *v = getvec(s->ptr);
+  guint32 n;
+  for(n=0; n<v->n; n++)
+    if(v->v[n] == item)
+      break;
+  if(n == v->n)
+    return FALSE;
+  i->items--;
+  // Keep the order, the first item is the one returned for single lookups.
+  memmove(v->v+n, v->v+n+1, (v->n-n-1)*sizeof(gpointer));
+  if(--v->n == 1) {
+    s->ptr = v->v[0];
+    g_free(v);
+  }
+  return FALSE;
+}
+
+
+// Calls the function for each unique hash in the index. The second argument
+// to the callback is the first item with that hash.
+void tthidx_foreach_key(const tthidx_t *i, void (*f)(const char *, gpointer, gpointer), gpointer dat) {
+  guint32 n;
+  for(n=0; n<=i->mask; n++)
+    if(i->slots[n].ptr) {
+      gpointer p = tthidx_first(i->slots[n].ptr);
+      f(keyof(i, p), p, dat);
+    }
+}
+
+
+// Calls the function for each item in the index.
+void tthidx_foreach(const tthidx_t *i, void (*f)(gpointer, gpointer), gpointer dat) {
+  guint32 n, m;
+  for(n=0; n<=i->mask; n++) {
+    gpointer p = i->slots[n].ptr;
+    if(!p)
+      continue;
+    if(!isvec(p))
+      f(p, dat);
+    else
+      for(m=0; m<getvec(p)->n; m++)
+        f(getvec(p)->v[m], dat);
+  }
+}
+
+
+// Memory used by the index, in bytes, excluding the items themselves.
+gsize tthidx_memsize(const tthidx_t *i) {
+  gsize r = (i->mask+1)*sizeof(tthidx_slot_t);
+  guint32 n;
+  if(i->vecs)
+    for(n=0; n<=i->mask; n++)
+      if(isvec(i->slots[n].ptr))
+        r += sizeof(tthidx_vec_t) + (getvec(i->slots[n].ptr)->size-1)*sizeof(gpointer);
+  return r;
+}
+
+
+void tthidx_free(tthidx_t *i) {
+  guint32 n;
+  if(i->vecs)
+    for(n=0; n<=i->mask; n++)
+      if(isvec(i->slots[n].ptr))
+        g_free(getvec(i->slots[n].ptr));
+  g_free(i->slots);
+}
@@ -79,6 +79,10 @@ int winrows;
 
 gboolean ui_beep = FALSE; // set to true anywhere to send a beep
 
+// Set when running without a terminal. Tabs still exist in this mode (hubs
+// are owned by them), but nothing is ever drawn.
+gboolean ui_headless = FALSE;
+
 
 
 // Generic message displaying thing.
@@ -141,6 +145,9 @@ static gboolean ui_m_mainthread(gpointer dat) {
   else if(!(msg->flags & UIM_DIRECT) && !g_list_find(ui_tabs, tab))
     goto ui_m_cleanup;
 
+  if(ui_headless && msg->msg)
+    ctl_message(tab, msg->msg);
+
   gboolean notify = (msg->flags & UIM_NOTIFY) || !tab->log;
 
   if(notify && ui_m_text) {
@@ -149,7 +156,7 @@ static gboolean ui_m_mainthread(gpointer dat) {
     g_source_remove(ui_m_timer);
     ui_m_updated = TRUE;
   }
-  if(notify && msg->msg) {
+  if(notify && msg->msg && !ui_headless) {
     ui_m_text = g_strdup(msg->msg);
     ui_m_timer = g_timeout_add(3000, ui_m_timeout, NULL);
     ui_m_updated = TRUE;
@@ -262,18 +269,20 @@ void ui_set_bracketed_paste(int enable) {
 
 void ui_init(gboolean bracketed_paste) {
   // init curses
-  initscr();
-  raw();
-  noecho();
-  curs_set(0);
-  keypad(stdscr, 1);
-  nodelay(stdscr, 1);
-
-  // ensure curses is init'd before event-keys defined before events happen
-  if(bracketed_paste) {
-    define_key("\x1b[200~", KEY_BRACKETED_PASTE_START);
-    define_key("\x1b[201~", KEY_BRACKETED_PASTE_END);
-    ui_set_bracketed_paste(1);
+  if(!ui_headless) {
+    initscr();
+    raw();
+    noecho();
+    curs_set(0);
+    keypad(stdscr, 1);
+    nodelay(stdscr, 1);
+
+    // ensure curses is init'd before event-keys defined before events happen
+    if(bracketed_paste) {
+      define_key("\x1b[200~", KEY_BRACKETED_PASTE_START);
+      define_key("\x1b[201~", KEY_BRACKETED_PASTE_END);
+      ui_set_bracketed_paste(1);
+    }
   }
 
   // global textinput field
@@ -282,8 +291,10 @@ void ui_init(gboolean bracketed_paste) {
   // first tab = main tab
   ui_tab_open(uit_main_create(), TRUE, NULL);
 
-  ui_colors_init();
-  ui_draw();
+  if(!ui_headless) {
+    ui_colors_init();
+    ui_draw();
+  }
 }
 
 
@@ -294,7 +305,7 @@ static void ui_draw_status() {
     mvprintw(winrows-1, 0, "[Hashing: %d / %s / %.2f MiB/s]",
       g_hash_table_size(fl_hash_queue), str_formatsize(fl_hash_queue_size), ((float)ratecalc_rate(&fl_hash_rate))/(1024.0f*1024.0f));
   mvprintw(winrows-1, wincols-37, "[U/D:%6d/%6d KiB/s]", ratecalc_rate(&net_out)/1024, ratecalc_rate(&net_in)/1024);
-  mvprintw(winrows-1, wincols-11, "[S:%3d/%3d]", cc_slots_in_use(NULL), var_get_int(0, VAR_slots));
+  mvprintw(winrows-1, wincols-11, "[S:%3d/%3d]", cc_slots_in_use(NULL), var_snap(0)->slots);
 
   ui_m_updated = FALSE;
   if(ui_m_text) {
@@ -420,6 +431,8 @@ static void ui_draw_tablist(int xoffset) {
 
 
 void ui_draw() {
+  if(ui_headless)
+    return;
   ui_tab_t *curtab = ui_tab_cur->data;
   curtab->prio = UIP_EMPTY;
 
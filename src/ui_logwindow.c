@@ -38,11 +38,26 @@
 
 #define LOGWIN_BUF 1023 // must be 2^x-1
 
+// Cached wrapping points and color masks of a log line, see
+// ui_logwindow_layout(). Only valid for the number of columns it was
+// calculated for.
+struct ui_logwindow_layout_t {
+  int cols;
+  int indent;
+  int ind_row;
+  int cmask;
+  int colors_sep[10];
+  ui_coltype colors[10]; // not the attributes, so that color changes apply immediately
+  int rmask;
+  int rows[];      // rmask+2 items
+};
+
 struct ui_logwindow_t {
   int lastlog;
   int lastvis;
   logfile_t *logfile;
   char *buf[LOGWIN_BUF+1];
+  ui_logwindow_layout_t *layout[LOGWIN_BUF+1];
   gboolean updated;
   int (*checkchat)(void *, char *, char *);
   void *handle;
@@ -52,6 +67,14 @@ struct ui_logwindow_t {
 
 
 void ui_logwindow_addline(ui_logwindow_t *lw, const char *msg, gboolean raw, gboolean nolog) {
+  // Nothing is ever displayed in headless mode, so only write to the log file
+  // rather than keeping a scrollback buffer for every tab.
+  if(ui_headless) {
+    if(!nolog && lw->logfile)
+      logfile_add(lw->logfile, msg);
+    return;
+  }
+
   if(lw->lastlog == lw->lastvis)
     lw->lastvis = lw->lastlog + 1;
   lw->lastlog++;
@@ -72,6 +95,8 @@ void ui_logwindow_addline(ui_logwindow_t *lw, const char *msg, gboolean raw, gbo
   }
 
   char *ts = localtime_fmt("%H:%M:%S ");
+  g_free(lw->layout[lw->lastlog & LOGWIN_BUF]);
+  lw->layout[lw->lastlog & LOGWIN_BUF] = NULL;
   lw->buf[lw->lastlog & LOGWIN_BUF] = raw ? g_strdup(msgl) : g_strconcat(ts, msgl, NULL);
   g_free(ts);
 
@@ -84,7 +109,9 @@ void ui_logwindow_addline(ui_logwindow_t *lw, const char *msg, gboolean raw, gbo
   int next = (lw->lastlog + 1) & LOGWIN_BUF;
   if(lw->buf[next]) {
     g_free(lw->buf[next]);
+    g_free(lw->layout[next]);
     lw->buf[next] = NULL;
+    lw->layout[next] = NULL;
   }
 }
 
@@ -138,7 +165,7 @@ ui_logwindow_t *ui_logwindow_create(const char *file, int load) {
   if(file) {
     lw->logfile = logfile_create(file);
 
-    if(load)
+    if(load && !ui_headless)
       ui_logwindow_load(lw, lw->logfile->path, load);
   }
   return lw;
@@ -189,7 +216,9 @@ void ui_logwindow_clear(ui_logwindow_t *lw) {
   int i;
   for(i=0; i<=LOGWIN_BUF; i++) {
     g_free(lw->buf[i]);
+    g_free(lw->layout[i]);
     lw->buf[i] = NULL;
+    lw->layout[i] = NULL;
   }
   lw->lastlog = lw->lastvis = 0;
 }
@@ -265,7 +294,7 @@ static int ui_logwindow_calc_wrap(char *str, int cols, int indent, int *rows, in
 
 // Determines the colors each part of a log line should have. Returns the
 // highest index to the attr array.
-static int ui_logwindow_calc_color(ui_logwindow_t *lw, char *str, int *sep, int *attr) {
+static int ui_logwindow_calc_color(ui_logwindow_t *lw, char *str, int *sep, ui_coltype *attr) {
   sep[0] = 0;
   int mask = 0;
 
@@ -274,7 +303,7 @@ static int ui_logwindow_calc_color(ui_logwindow_t *lw, char *str, int *sep, int
   int t_f = from;\
   if(sep[mask] != t_f) {\
     sep[mask+1] = t_f;\
-    attr[mask] = UIC(log_default);\
+    attr[mask] = UIC_log_default;\
     mask++;\
   }\
   sep[mask] = t_f;\
@@ -287,7 +316,7 @@ static int ui_logwindow_calc_color(ui_logwindow_t *lw, char *str, int *sep, int
   if(msg && msg-str != 8) // Make sure it's not "Day changed to ..", which doesn't have the time prefix
     msg = NULL;
   if(msg) {
-    addm(0, msg-str, UIC(log_time));
+    addm(0, msg-str, UIC_log_time);
     msg++;
   }
 
@@ -304,28 +333,32 @@ static int ui_logwindow_calc_color(ui_logwindow_t *lw, char *str, int *sep, int
     int r = lw->checkchat ? lw->checkchat(lw->handle, str+nickstart, str+nickend+1) : 0;
     tmp[0] = old;
     // and use the correct color
-    addm(nickstart, nickend, r == 2 ? UIC(log_ownnick) : r == 1 ? UIC(log_highlight) : UIC(log_nick));
+    addm(nickstart, nickend, r == 2 ? UIC_log_ownnick : r == 1 ? UIC_log_highlight : UIC_log_nick);
   }
 
   // join/quits (--> and --<)
   if(msg && msg[0] == '-' && msg[1] == '-' && (msg[2] == '>' || msg[2] == '<')) {
-    addm(msg-str, strlen(str), msg[2] == '>' ? UIC(log_join) : UIC(log_quit));
+    addm(msg-str, strlen(str), msg[2] == '>' ? UIC_log_join : UIC_log_quit);
   }
 
 #undef addm
   // make sure the last mask is correct and return
   if(sep[mask+1] != strlen(str)) {
     sep[mask+1] = strlen(str);
-    attr[mask] = UIC(log_default);
+    attr[mask] = UIC_log_default;
   }
   return mask;
 }
 
 
-// Draws a line between x and x+cols on row y (continuing on y-1 .. y-(rows+1) for
-// multiple rows). Returns the actual number of rows written to.
-static int ui_logwindow_drawline(ui_logwindow_t *lw, int y, int x, int nrows, int cols, char *str) {
-  g_return_val_if_fail(nrows > 0, 1);
+// Returns the (cached) layout of line i of the buffer for the given number of
+// columns. The layout is only recalculated when the line is new or when the
+// width has changed, so scrolling and redrawing don't have to.
+static ui_logwindow_layout_t *ui_logwindow_layout(ui_logwindow_t *lw, int i, int cols) {
+  ui_logwindow_layout_t *l = lw->layout[i];
+  if(l && l->cols == cols)
+    return l;
+  char *str = lw->buf[i];
 
   // Determine the indentation for multi-line rows. This is:
   // - Always after the time part (hh:mm:ss )
@@ -342,11 +375,11 @@ static int ui_logwindow_drawline(ui_logwindow_t *lw, int y, int x, int nrows, in
 
   // Convert indent from bytes to columns
   if(indent && indent <= strlen(str)) {
-    int i = indent;
-    char old = str[i];
-    str[i] = 0;
-    indent = str_columns(str);
-    str[i] = old;
+    char old = str[indent];
+    str[indent] = 0;
+    int n = str_columns(str);
+    str[indent] = old;
+    indent = n;
   }
 
   // Determine the wrapping boundaries.
@@ -355,10 +388,31 @@ static int ui_logwindow_drawline(ui_logwindow_t *lw, int y, int x, int nrows, in
   int ind_row;
   int rmask = ui_logwindow_calc_wrap(str, cols, indent, rows, &ind_row);
 
+  l = g_realloc(l, sizeof(ui_logwindow_layout_t) + (rmask+2)*sizeof(int));
+  lw->layout[i] = l;
+  l->cols = cols;
+  l->indent = indent;
+  l->ind_row = ind_row;
+  l->rmask = rmask;
+  memcpy(l->rows, rows, (rmask+2)*sizeof(int));
+
   // Determine the colors to give each part
-  static int colors_sep[10]; // Mask, similar to the rows array
-  static int colors[10];     // Color attribute for each mask
-  int cmask = ui_logwindow_calc_color(lw, str, colors_sep, colors);
+  l->cmask = ui_logwindow_calc_color(lw, str, l->colors_sep, l->colors);
+  return l;
+}
+
+
+// Draws line i of the buffer between x and x+cols on row y (continuing on y-1
+// .. y-(rows+1) for multiple rows). Returns the actual number of rows written
+// to.
+static int ui_logwindow_drawline(ui_logwindow_t *lw, int y, int x, int nrows, int cols, int i) {
+  g_return_val_if_fail(nrows > 0, 1);
+
+  char *str = lw->buf[i];
+  ui_logwindow_layout_t *l = ui_logwindow_layout(lw, i, cols);
+  int *rows = l->rows, *colors_sep = l->colors_sep;
+  ui_coltype *colors = l->colors;
+  int rmask = l->rmask, cmask = l->cmask, ind_row = l->ind_row, indent = l->indent;
 
   // print the rows
   int r = 0, c = 0, lr = 0;
@@ -379,9 +433,9 @@ static int ui_logwindow_drawline(ui_logwindow_t *lw, int y, int x, int nrows, in
       lr = r;
 
     if(start != end && rmask-r < nrows) {
-      attron(colors[c]);
+      attron(ui_colors[colors[c]].a);
       addnstr(str+start, end-start);
-      attroff(colors[c]);
+      attroff(ui_colors[colors[c]].a);
     }
 
     if(rend <= cend) {
@@ -403,10 +457,9 @@ void ui_logwindow_draw(ui_logwindow_t *lw, int y, int x, int rows, int cols) {
   lw->updated = FALSE;
 
   while(top >= y) {
-    char *str = lw->buf[cur & LOGWIN_BUF];
-    if(!str)
+    if(!lw->buf[cur & LOGWIN_BUF])
       break;
-    top -= ui_logwindow_drawline(lw, top, x, top-y+1, cols, str);
+    top -= ui_logwindow_drawline(lw, top, x, top-y+1, cols, cur & LOGWIN_BUF);
     cur = (cur-1) & LOGWIN_BUF;
   }
 }
@@ -150,16 +150,19 @@ static void draw_row(ui_listing_t *list, GSequenceIter *iter, int row, void *dat
   else
     mvaddstr(row, 20, " -");
 
-  if(dl->prio == DLP_ERR)
+  if(dl->moving)
+    mvaddstr(row, 26, " MOV");
+  else if(dl->prio == DLP_ERR)
     mvaddstr(row, 26, " ERR");
   else if(dl->prio == DLP_OFF)
     mvaddstr(row, 26, " OFF");
   else
     mvprintw(row, 26, "%3d", dl->prio);
 
-  if(dl->islist)
-    mvaddstr(row, 32, "files.xml.bz2");
-  else {
+  if(dl->islist) {
+    const char *fn = dl->flpath ? dl->flpath : "files.xml.bz2";
+    mvaddnstr(row, 32, fn, str_offset_from_columns(fn, wincols-32));
+  } else {
     char *def = var_get(0, VAR_download_dir);
     int len = strlen(def);
     char *dest = strncmp(def, dl->dest, len) == 0 ? dl->dest+len+(dl->dest[len-1] == '/' ? 0 : 1) : dl->dest;
@@ -231,7 +234,9 @@ static void t_draw(ui_tab_t *tab) {
   attroff(UIC(separator));
 
   // error info
-  if(sel && sel->prio == DLP_ERR)
+  if(sel && sel->moving)
+    mvprintw(++bottom, 0, "Moving to destination: %d%%", sel->size ? (int) MIN(100, ((guint64)g_atomic_int_get(&sel->moved)*100*1024*1024)/sel->size) : 0);
+  else if(sel && sel->prio == DLP_ERR)
     mvprintw(++bottom, 0, "Error: %s", dl_strerror(sel->error, sel->error_msg));
 
   // user list
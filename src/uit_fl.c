@@ -45,6 +45,8 @@ typedef struct tab_t {
   gboolean dirfirst : 1;
   gboolean loading : 1;
   gboolean needmatch : 1;
+  gboolean partial : 1;  // browsing a partial list, directories are fetched when opened
+  gboolean waitlist : 1; // waiting for the full list to be downloaded
 } tab_t;
 
 
@@ -127,6 +129,142 @@ static void dosel(tab_t *t, fl_list_t *fl, const char *sel) {
 }
 
 
+static void loaddone(fl_list_t *fl, GError *err, void *dat) {
+  // If the tab has been closed, then we can ignore the result
+  if(!g_list_find(ui_tabs, dat)) {
+    if(fl)
+      fl_list_free(fl);
+    if(err)
+      g_error_free(err);
+    return;
+  }
+
+  // Otherwise, update state
+  tab_t *t = dat;
+  t->err = err;
+  t->loading = FALSE;
+  ui_tab_incprio((ui_tab_t *)t, err ? UIP_HIGH : UIP_MED);
+  if(t->sel) {
+    if(fl)
+      dosel(t, fl, t->sel);
+    g_free(t->sel);
+    t->sel = NULL;
+  } else if(fl)
+    setdir(t, fl, NULL);
+  if(fl && t->needmatch)
+    matchqueue(t, NULL);
+}
+
+
+// Path of the cached full file list of a user.
+static char *listfile(guint64 uid) {
+  char *tmp = g_strdup_printf("%016"G_GINT64_MODIFIER"x.xml.bz2", uid);
+  char *fn = g_build_filename(db_dir, "fl", tmp, NULL);
+  g_free(tmp);
+  return fn;
+}
+
+
+// Whether the cache has a full file list of the user that is recent enough.
+static gboolean havelist(guint64 uid) {
+  char *fn = listfile(uid);
+  struct stat st;
+  int age = var_get_int(0, VAR_filelist_maxage);
+  gboolean e = stat(fn, &st) < 0 || st.st_mtime < time(NULL)-MAX(age, 30) ? FALSE : TRUE;
+  g_free(fn);
+  return e;
+}
+
+
+static void freelist(tab_t *t) {
+  if(t->list) {
+    g_sequence_free(t->list->list);
+    ui_listing_free(t->list);
+    t->list = NULL;
+  }
+
+  fl_list_t *p = t->fl;
+  while(p && p->parent)
+    p = p->parent;
+  if(p)
+    fl_list_free(p);
+  t->fl = NULL;
+}
+
+
+static void loadlist(tab_t *t) {
+  char *fn = listfile(t->uid);
+  struct stat st;
+  if(stat(fn, &st) >= 0)
+    t->age = st.st_mtime;
+  fl_load_async(fn, loaddone, t);
+  g_free(fn);
+  t->loading = TRUE;
+}
+
+
+// Drops the partial list and switches the tab to the full file list, which is
+// queued for download if there is no (recent) copy in the cache.
+static void getfull(tab_t *t, gboolean cached) {
+  freelist(t);
+  t->partial = t->waitlist = FALSE;
+  if(cached) {
+    loadlist(t);
+    return;
+  }
+  hub_user_t *u = g_hash_table_lookup(hub_uids, &t->uid);
+  if(!u || !u->hasinfo) {
+    if(t->err)
+      g_error_free(t->err);
+    t->err = g_error_new_literal(1, 0, "User offline.");
+    t->loading = FALSE;
+    return;
+  }
+  t->waitlist = t->loading = TRUE;
+  dl_queue_addlist(u, NULL, NULL, TRUE, FALSE);
+}
+
+
+// Requests the contents of an incomplete directory in a partial list.
+static void fetchdir(tab_t *t, fl_list_t *dir) {
+  hub_user_t *u = g_hash_table_lookup(hub_uids, &t->uid);
+  if(!u || !u->hasinfo) {
+    ui_m(NULL, 0, "User offline.");
+    return;
+  }
+  char *path = fl_list_path(dir);
+  char *req = g_strconcat(path, "/", NULL);
+  dl_queue_addpartial(u, req);
+  g_free(req);
+  g_free(path);
+}
+
+
+static gboolean hasincomplete(fl_list_t *fl) {
+  if(fl->incomplete)
+    return TRUE;
+  int i;
+  for(i=0; fl->sub && i<fl->sub->len; i++)
+    if(hasincomplete(g_ptr_array_index(fl->sub, i)))
+      return TRUE;
+  return FALSE;
+}
+
+
+static tab_t *newtab(guint64 uid) {
+  hub_user_t *u = uid ? g_hash_table_lookup(hub_uids, &uid) : NULL;
+  tab_t *t = g_new0(tab_t, 1);
+  t->tab.type = uit_fl;
+  t->tab.name = !uid ? g_strdup("/own") : u ? g_strdup_printf("/%s", u->name) : g_strdup_printf("/%016"G_GINT64_MODIFIER"x", uid);
+  t->uname = u ? g_strdup(u->name) : NULL;
+  t->uid = uid;
+  t->dirfirst = TRUE;
+  t->order = SORT_NAME;
+  time(&t->age);
+  return t;
+}
+
+
 // Callback function for use in uit_fl_queue() - not associated with any tab.
 // Will just match the list against the queue and free it.
 static void loadmatch(fl_list_t *fl, GError *err, void *dat) {
@@ -174,6 +312,11 @@ void uit_fl_queue(guint64 uid, gboolean force, const char *sel, ui_tab_t *parent
   if(n) {
     if(open)
       ui_tab_cur = n;
+    // Selecting items and matching the queue require the full list.
+    if(t->partial && (force || sel || match))
+      getfull(t, !force && havelist(uid));
+    else if(t->waitlist && havelist(uid))
+      getfull(t, TRUE);
     if(sel) {
       if(!t->loading && t->fl)
         dosel(n->data, t->fl, sel);
@@ -195,72 +338,93 @@ void uit_fl_queue(guint64 uid, gboolean force, const char *sel, ui_tab_t *parent
   }
 
   // check for cached file list, otherwise queue it
-  char *tmp = g_strdup_printf("%016"G_GINT64_MODIFIER"x.xml.bz2", uid);
-  char *fn = g_build_filename(db_dir, "fl", tmp, NULL);
-  g_free(tmp);
-
-  gboolean e = !force;
-  if(!force) {
-    struct stat st;
-    int age = var_get_int(0, VAR_filelist_maxage);
-    e = stat(fn, &st) < 0 || st.st_mtime < time(NULL)-MAX(age, 30) ? FALSE : TRUE;
-  }
-  if(e) {
+  if(!force && havelist(uid)) {
     if(open) {
       ui_tab_t *tab = uit_fl_create(uid, sel);
       ui_tab_open(tab, TRUE, parent);
       if(match)
         matchqueue((tab_t *)tab, NULL);
-    } else if(match)
+    } else if(match) {
+      char *fn = listfile(uid);
       fl_load_async(fn, loadmatch, g_memdup(&uid, 8));
+      g_free(fn);
+    }
   } else {
     g_return_if_fail(u); // the caller should have checked this
+    // Only browsing, fetch the directories as they are opened
+    if(open && !force && !sel && !match && var_get_bool(0, VAR_filelist_partial)) {
+      tab_t *t = newtab(uid);
+      t->partial = t->loading = TRUE;
+      ui_tab_incprio((ui_tab_t *)t, UIP_LOW);
+      ui_tab_open((ui_tab_t *)t, TRUE, parent);
+      dl_queue_addpartial(u, "/");
+      return;
+    }
     dl_queue_addlist(u, sel, parent, open, match);
     ui_mf(NULL, 0, "File list of %s added to the download queue.", u->name);
   }
-
-  g_free(fn);
 }
 
 
-static void loaddone(fl_list_t *fl, GError *err, void *dat) {
-  // If the tab has been closed, then we can ignore the result
-  if(!g_list_find(ui_tabs, dat)) {
-    if(fl)
-      fl_list_free(fl);
+// Called from dl.c when a partial list has been received, buf is NULL if the
+// request failed. The directory is merged into the list of the browse tab, if
+// it is still open.
+void uit_fl_partial(guint64 uid, const char *path, const char *buf, int len) {
+  GList *n;
+  tab_t *t = NULL;
+  for(n=ui_tabs; n; n=n->next) {
+    t = n->data;
+    if(t->tab.type == uit_fl && t->uid == uid)
+      break;
+  }
+  if(!n || !t->partial)
+    return;
+
+  GError *err = NULL;
+  fl_list_t *fl = buf ? fl_load_partial(buf, len, &err) : NULL;
+  if(!fl) {
+    ui_mf((ui_tab_t *)t, 0, "Can't fetch `%s'%s%s, downloading the full file list instead.", path, err ? ": " : "", err ? err->message : "");
     if(err)
       g_error_free(err);
+    getfull(t, havelist(uid));
     return;
   }
 
-  // Otherwise, update state
-  tab_t *t = dat;
-  t->err = err;
-  t->loading = FALSE;
-  ui_tab_incprio((ui_tab_t *)t, err ? UIP_HIGH : UIP_MED);
-  if(t->sel) {
-    if(fl)
-      dosel(t, fl, t->sel);
-    g_free(t->sel);
-    t->sel = NULL;
-  } else if(fl)
-    setdir(t, fl, NULL);
+  // The root directory
+  if(!t->fl) {
+    if(strcmp(path, "/") == 0) {
+      t->loading = FALSE;
+      ui_tab_incprio((ui_tab_t *)t, UIP_MED);
+      setdir(t, fl, NULL);
+    } else
+      fl_list_free(fl);
+    return;
+  }
+
+  fl_list_t *root = t->fl;
+  while(root->parent)
+    root = root->parent;
+  fl_list_t *dir = fl_list_from_path(root, path);
+  if(!dir || dir->isfile || !dir->incomplete) {
+    fl_list_free(fl);
+    return;
+  }
+
+  // Move the items over, fl_list_add() takes care of the directory sizes.
+  g_ptr_array_set_free_func(fl->sub, NULL);
+  int i;
+  for(i=0; i<fl->sub->len; i++)
+    fl_list_add(dir, g_ptr_array_index(fl->sub, i), -1);
+  fl_list_free(fl);
+  fl_list_sort(dir);
+  dir->incomplete = FALSE;
+  if(t->fl == dir)
+    setdir(t, dir, NULL);
 }
 
 
 ui_tab_t *uit_fl_create(guint64 uid, const char *sel) {
-  // get user
-  hub_user_t *u = uid ? g_hash_table_lookup(hub_uids, &uid) : NULL;
-
-  // create tab
-  tab_t *t = g_new0(tab_t, 1);
-  t->tab.type = uit_fl;
-  t->tab.name = !uid ? g_strdup("/own") : u ? g_strdup_printf("/%s", u->name) : g_strdup_printf("/%016"G_GINT64_MODIFIER"x", uid);
-  t->uname = u ? g_strdup(u->name) : NULL;
-  t->uid = uid;
-  t->dirfirst = TRUE;
-  t->order = SORT_NAME;
-  time(&t->age);
+  tab_t *t = newtab(uid);
 
   // get file list
   if(!uid) {
@@ -271,16 +435,8 @@ ui_tab_t *uit_fl_create(guint64 uid, const char *sel) {
     else if(fl && fl->sub)
       setdir(t, fl, NULL);
   } else {
-    char *tmp = g_strdup_printf("%016"G_GINT64_MODIFIER"x.xml.bz2", uid);
-    char *fn = g_build_filename(db_dir, "fl", tmp, NULL);
-    struct stat st;
-    if(stat(fn, &st) >= 0)
-      t->age = st.st_mtime;
-    fl_load_async(fn, loaddone, t);
-    g_free(tmp);
-    g_free(fn);
+    loadlist(t);
     ui_tab_incprio((ui_tab_t *)t, UIP_LOW);
-    t->loading = TRUE;
     if(sel)
       t->sel = g_strdup(sel);
   }
@@ -293,17 +449,7 @@ static void t_close(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
 
   ui_tab_remove(tab);
-
-  if(t->list) {
-    g_sequence_free(t->list->list);
-    ui_listing_free(t->list);
-  }
-
-  fl_list_t *p = t->fl;
-  while(p && p->parent)
-    p = p->parent;
-  if(p)
-    fl_list_free(p);
+  freelist(t);
 
   if(t->err)
     g_error_free(t->err);
@@ -363,6 +509,8 @@ static void t_draw(ui_tab_t *tab) {
   ui_cursor_t cursor = { 0, 2 };
   if(t->loading)
     mvaddstr(3, 2, "Loading filelist...");
+  else if(t->fl && t->fl->incomplete)
+    mvaddstr(3, 2, "Loading directory...");
   else if(t->err)
     mvprintw(3, 2, "Error loading filelist: %s", t->err->message);
   else if(t->fl && t->fl->sub && t->fl->sub->len)
@@ -414,8 +562,11 @@ static void t_key(ui_tab_t *tab, guint64 key) {
   case INPT_CTRL('j'):      // newline
   case INPT_KEY(KEY_RIGHT): // right
   case INPT_CHAR('l'):      // l          open selected directory
-    if(sel && !sel->isfile && sel->sub)
+    if(sel && !sel->isfile && sel->sub) {
       setdir(t, sel, NULL);
+      if(sel->incomplete)
+        fetchdir(t, sel);
+    }
     break;
 
   case INPT_CTRL('h'):     // backspace
@@ -448,6 +599,8 @@ static void t_key(ui_tab_t *tab, guint64 key) {
       ui_m(NULL, 0, "Nothing selected.");
     else if(!t->uid)
       ui_m(NULL, 0, "Can't download from yourself.");
+    else if(!sel->isfile && t->partial && hasincomplete(sel))
+      ui_m(NULL, 0, "Directory not completely loaded. Open its subdirectories first or use /browse -f to get the full list.");
     else if(!sel->isfile && fl_list_isempty(sel))
       ui_m(NULL, 0, "Directory empty.");
     else {
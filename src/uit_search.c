@@ -34,6 +34,7 @@ ui_tab_type_t uit_search[1];
 typedef struct tab_t {
   ui_tab_t tab;
   ui_listing_t *list;
+  GPtrArray *pending; // results not yet in the listing, see flush()
   search_q_t *q;
   char *hubname;
   time_t age;
@@ -113,15 +114,38 @@ static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
 }
 
 
-// Callback from search.c when we have a new result.
+// Callback from search.c when we have a new result. Results are buffered and
+// only added to the listing by flush(), which happens when the tab is drawn or
+// used. This avoids a sorted insert and listing update for every single result
+// of a popular query.
 static void result(search_r_t *r, void *dat) {
   tab_t *t = dat;
-  g_sequence_insert_sorted(t->list->list, search_r_copy(r), sort_func, t);
-  ui_listing_inserted(t->list);
+  g_ptr_array_add(t->pending, search_r_copy(r));
   ui_tab_incprio((ui_tab_t *)t, UIP_LOW);
 }
 
 
+// Move the buffered results into the listing. Small batches are inserted one
+// by one, large batches (compared to the existing list) are appended and the
+// list is re-sorted as a whole.
+static void flush(tab_t *t) {
+  if(!t->pending->len)
+    return;
+  GSequence *l = t->list->list;
+  int i;
+  if(t->pending->len*8 < g_sequence_get_length(l)) {
+    for(i=0; i<t->pending->len; i++)
+      g_sequence_insert_sorted(l, g_ptr_array_index(t->pending, i), sort_func, t);
+  } else {
+    for(i=0; i<t->pending->len; i++)
+      g_sequence_append(l, g_ptr_array_index(t->pending, i));
+    g_sequence_sort(l, sort_func, t);
+  }
+  g_ptr_array_set_size(t->pending, 0);
+  ui_listing_inserted(t->list);
+}
+
+
 static const char *search_r_get_file(GSequenceIter *iter) {
   search_r_t *r = g_sequence_get(iter);
   return r->file;
@@ -138,12 +162,14 @@ ui_tab_t *uit_search_create(hub_t *hub, search_q_t *q, GError **err) {
   t->hubname = hub ? g_strdup(hub->tab->name) : NULL;
   t->hide_hub = hub ? TRUE : FALSE;
   t->order = SORT_FILE;
+  t->pending = g_ptr_array_new();
   time(&t->age);
 
   // Do the search
   q->cb_dat = t;
   q->cb = result;
   if(!search_add(hub, q, err)) {
+    g_ptr_array_free(t->pending, TRUE);
     g_free(t);
     return NULL;
   }
@@ -171,6 +197,8 @@ ui_tab_t *uit_search_create(hub_t *hub, search_q_t *q, GError **err) {
 static void t_close(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
   search_remove(t->q);
+  g_ptr_array_foreach(t->pending, (GFunc)search_r_free, NULL);
+  g_ptr_array_free(t->pending, TRUE);
   g_sequence_free(t->list->list);
   ui_listing_free(t->list);
   ui_tab_remove(tab);
@@ -234,6 +262,7 @@ static void draw_row(ui_listing_t *list, GSequenceIter *iter, int row, void *dat
 
 static void t_draw(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
+  flush(t);
 
   attron(UIC(list_header));
   mvhline(1, 0, ' ', wincols);
@@ -276,6 +305,7 @@ static void t_draw(ui_tab_t *tab) {
 
 static void t_key(ui_tab_t *tab, guint64 key) {
   tab_t *t = (tab_t *)tab;
+  flush(t);
 
   if(ui_listing_key(t->list, key, (winrows-4)/2))
     return;
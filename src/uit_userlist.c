@@ -34,6 +34,7 @@ ui_tab_type_t uit_userlist[1];
 typedef struct tab_t {
   ui_tab_t tab;
   ui_listing_t *list;
+  GHashTable *pending; // hub_user_t -> PEND_*, changes not yet applied to the list
   int order;
   gboolean reverse : 1;
   gboolean details : 1;
@@ -57,6 +58,10 @@ typedef struct tab_t {
 #define SORT_CLIENT 5
 #define SORT_IP     6
 
+// Pending changes
+#define PEND_JOIN   1 // Not in the list yet, user->iter is invalid
+#define PEND_NFO    2 // In the list, but may have to be moved
+
 
 static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
   const hub_user_t *a = da;
@@ -87,6 +92,73 @@ static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
 }
 
 
+static gint sort_ptr_func(gconstpointer a, gconstpointer b, gpointer dat) {
+  return sort_func(*(hub_user_t **)a, *(hub_user_t **)b, dat);
+}
+
+
+// Applies the pending changes to the list. This is done at most once per
+// screen update, and not at all while the hub is still sending us its user
+// list, unless force is set. Small batches of changes are applied one by one,
+// larger ones are added in a single O(n log n) sort.
+//
+// In the small batch case, all changed users are first taken out of the list,
+// since a binary search over a list that still contains other changed users
+// may end up at the wrong position. The users are moved into a temporary
+// sequence rather than removed, so that their iters (and thus the selection)
+// remain valid.
+static void flush(tab_t *t, gboolean force) {
+  int n = g_hash_table_size(t->pending);
+  if(!n || (!force && !t->tab.hub->joincomplete))
+    return;
+
+  GSequence *l = t->list->list;
+  int len = g_sequence_get_length(l);
+  GHashTableIter iter;
+  hub_user_t *u;
+  gpointer v;
+  g_hash_table_iter_init(&iter, t->pending);
+
+  if(n*8 < len) {
+    GSequence *tmp = g_sequence_new(NULL);
+    while(g_hash_table_iter_next(&iter, (gpointer *)&u, &v))
+      if(GPOINTER_TO_INT(v) == PEND_NFO)
+        g_sequence_move_range(g_sequence_get_end_iter(tmp), u->iter, g_sequence_iter_next(u->iter));
+    g_hash_table_iter_init(&iter, t->pending);
+    while(g_hash_table_iter_next(&iter, (gpointer *)&u, &v)) {
+      if(GPOINTER_TO_INT(v) == PEND_JOIN)
+        u->iter = g_sequence_insert_sorted(l, u, sort_func, t);
+      else
+        g_sequence_move_range(g_sequence_search(l, u, sort_func, t), u->iter, g_sequence_iter_next(u->iter));
+    }
+    g_sequence_free(tmp);
+
+  // Empty list, sort the users first and append them in order
+  } else if(!len) {
+    GPtrArray *a = g_ptr_array_sized_new(n);
+    while(g_hash_table_iter_next(&iter, (gpointer *)&u, NULL))
+      g_ptr_array_add(a, u);
+    g_ptr_array_sort_with_data(a, sort_ptr_func, t);
+    int i;
+    for(i=0; i<a->len; i++) {
+      u = g_ptr_array_index(a, i);
+      u->iter = g_sequence_append(l, u);
+    }
+    g_ptr_array_free(a, TRUE);
+
+  } else {
+    while(g_hash_table_iter_next(&iter, (gpointer *)&u, &v))
+      if(GPOINTER_TO_INT(v) == PEND_JOIN)
+        u->iter = g_sequence_append(l, u);
+    g_sequence_sort(l, sort_func, t);
+  }
+
+  g_hash_table_remove_all(t->pending);
+  ui_listing_inserted(t->list);
+  ui_listing_sorted(t->list);
+}
+
+
 static const char *get_name(GSequenceIter *iter) {
   hub_user_t *u = g_sequence_get(iter);
   return u->name;
@@ -104,18 +176,16 @@ ui_tab_t *uit_userlist_create(hub_t *hub) {
   t->hide_mail = TRUE;
   t->hide_ip = TRUE;
 
-  GSequence *users = g_sequence_new(NULL);
+  t->list = ui_listing_create(g_sequence_new(NULL), NULL, t, get_name);
+  t->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+
   // populate the list
-  // g_sequence_sort() uses insertion sort? in that case it is faster to insert
-  // all items using g_sequence_insert_sorted() rather than inserting them in
-  // no particular order and then sorting them in one go. (which is faster for
-  // linked lists, since it uses a faster sorting algorithm)
   GHashTableIter iter;
   g_hash_table_iter_init(&iter, hub->users);
   hub_user_t *u;
   while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&u))
-    u->iter = g_sequence_insert_sorted(users, u, sort_func, t);
-  t->list = ui_listing_create(users, NULL, t, get_name);
+    g_hash_table_insert(t->pending, u, GINT_TO_POINTER(PEND_JOIN));
+  flush(t, TRUE);
 
   return (ui_tab_t *)t;
 }
@@ -130,6 +200,7 @@ static void t_close(ui_tab_t *tab) {
   // get reset in a subsequent ui_userlist_create().
   g_sequence_free(t->list->list);
   ui_listing_free(t->list);
+  g_hash_table_unref(t->pending);
   g_free(t->tab.name);
   g_free(t);
 }
@@ -167,9 +238,7 @@ static void draw_row(ui_listing_t *list, GSequenceIter *iter, int row, void *dat
     mvaddch(row, 4, 't');
 
   int j = 6;
-  const char *cc =
-    !ip4_isany(user->ip4) ? geoip_country4(ip4_unpack(user->ip4)) :
-    !ip6_isany(user->ip6) ? geoip_country6(ip6_unpack(user->ip6)) : NULL;
+  const char *cc = hub_user_country(user);
   DRAW_COL(row, j, t->cw_country, cc?cc:"");
   if(t->cw_user > 1)
     ui_listing_draw_match(list, iter, row, j, str_offset_from_columns(user->name, t->cw_user-1));
@@ -251,6 +320,7 @@ static void calc_widths(tab_t *t) {
 static void t_draw(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
 
+  flush(t, FALSE);
   calc_widths(t);
 
   // header
@@ -321,6 +391,7 @@ static void t_draw(ui_tab_t *tab) {
 
 static void t_key(ui_tab_t *tab, guint64 key) {
   tab_t *t = (tab_t *)tab;
+  flush(t, TRUE);
 
   if(ui_listing_key(t->list, key, winrows/2))
     return;
@@ -437,27 +508,31 @@ static void t_key(ui_tab_t *tab, guint64 key) {
 void uit_userlist_disconnect(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
 
+  g_hash_table_remove_all(t->pending);
   g_sequence_free(t->list->list);
   ui_listing_free(t->list);
   t->list = ui_listing_create(g_sequence_new(NULL), NULL, t, get_name);
 }
 
 
-// Called from the hub tab when something changes to the user list.
+// Called from the hub tab when something changes to the user list. Joins and
+// info changes are queued and applied in flush(), a quit has to be handled
+// immediately because the user struct is freed afterwards.
 void uit_userlist_userchange(ui_tab_t *tab, int change, hub_user_t *user) {
   tab_t *t = (tab_t *)tab;
-
-  if(change == UIHUB_UC_JOIN) {
-    user->iter = g_sequence_insert_sorted(t->list->list, user, sort_func, t);
-    ui_listing_inserted(t->list);
-  } else if(change == UIHUB_UC_QUIT) {
+  int p = GPOINTER_TO_INT(g_hash_table_lookup(t->pending, user));
+
+  if(change == UIHUB_UC_JOIN)
+    g_hash_table_insert(t->pending, user, GINT_TO_POINTER(PEND_JOIN));
+  else if(change == UIHUB_UC_QUIT) {
+    g_hash_table_remove(t->pending, user);
+    if(p == PEND_JOIN)
+      return;
     g_return_if_fail(g_sequence_get(user->iter) == (gpointer)user);
     ui_listing_remove(t->list, user->iter);
     g_sequence_remove(user->iter);
-  } else {
-    g_sequence_sort_changed(user->iter, sort_func, t);
-    ui_listing_sorted(t->list);
-  }
+  } else if(!p)
+    g_hash_table_insert(t->pending, user, GINT_TO_POINTER(PEND_NFO));
 }
 
 
@@ -482,6 +557,7 @@ gboolean uit_userlist_open(hub_t *hub, guint64 uid, const char *user, gboolean u
 
   if(u) {
     tab_t *t = (tab_t *)ut;
+    flush(t, TRUE);
     // u->iter should be valid at this point.
     t->list->sel = u->iter;
     t->details = TRUE;
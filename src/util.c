@@ -26,6 +26,10 @@
 
 #include "ncdc.h"
 #include "util.h"
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 #if INTERFACE
 
@@ -424,13 +428,19 @@ done:
 
 
 // Move a file from one place to another. Uses rename() when possible,
-// otherwise falls back to slow file copying. Does not copy over stat()
-// information such as modification times or chmod.
-// In the case of an error, the 'from' file will remain unmodified, but the
-// 'to' file may (or may not) have been deleted if 'overwrite' was true. In
-// some rare situations (if unlink fails), it may also remain on the disk but
-// with corrupted contents.
-gboolean file_move(const char *from, const char *to, gboolean overwrite, GError **err) {
+// otherwise tries a reflink, copy_file_range() or sendfile() before falling
+// back to slow file copying. Does not copy over stat() information such as
+// modification times or chmod.
+// A copy is written to a temporary file next to 'to', which is synced and
+// renamed to 'to' when complete, so 'to' never refers to a partial file.
+// The copy may take a while, so this function is usually called from a
+// separate thread. If done is non-NULL, it is atomically updated with the
+// number of MiB copied so far. The copy is aborted, with an EINTR error,
+// when *cancel (if non-NULL) becomes non-zero.
+// In the case of an error, the 'from' file will remain unmodified. The 'to'
+// file is only affected if the error occurred while removing 'from' after
+// the copy, in which case the copy is deleted again.
+gboolean file_move(const char *from, const char *to, gboolean overwrite, int *done, int *cancel, GError **err) {
   if(!overwrite && g_file_test(to, G_FILE_TEST_EXISTS)) {
     g_set_error_literal(err, 1, g_file_error_from_errno(EEXIST), g_strerror(EEXIST));
     return FALSE;
@@ -446,51 +456,145 @@ gboolean file_move(const char *from, const char *to, gboolean overwrite, GError
     return FALSE;
   }
 
-  // plain old copy fallback
   int fromfd = open(from, O_RDONLY);
   if(fromfd < 0) {
     g_set_error_literal(err, 1, g_file_error_from_errno(errno), g_strerror(errno));
     return FALSE;
   }
-  int tofd = open(to, O_WRONLY | O_CREAT | (overwrite ? 0 : O_EXCL), 0666);
+  // Any existing file with this name is a leftover from an earlier attempt.
+  char *tmp = g_strdup_printf("%s.ncdc-tmp", to);
+  int tofd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
   if(tofd < 0) {
     g_set_error_literal(err, 1, g_file_error_from_errno(errno), g_strerror(errno));
     close(fromfd);
+    g_free(tmp);
     return FALSE;
   }
 
-  char buf[8*1024];
+  // Each method below continues at the current file offsets, so if one is not
+  // supported by the kernel or filesystem, the next one is tried. Errors that
+  // indicate such a lack of support are only expected on the first call.
+#define unsupported(e) ((e) == ENOSYS || (e) == EXDEV || (e) == EINVAL || (e) == EOPNOTSUPP || (e) == ENOTTY)
+#define progress(n) do {\
+    copied += n;\
+    if(done)\
+      g_atomic_int_set(done, copied >> 20);\
+    if(cancel && g_atomic_int_get(cancel)) {\
+      errno = EINTR;\
+      goto err;\
+    }\
+  } while(0)
+  guint64 copied = 0;
+  ssize_t n = -1;
+  r = 0;
+
+#ifdef FICLONE
+  if(ioctl(tofd, FICLONE, fromfd) == 0)
+    goto finish;
+  if(!unsupported(errno))
+    goto err;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  do {
+    n = copy_file_range(fromfd, NULL, tofd, NULL, 8*1024*1024, 0);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n > 0)
+      progress(n);
+  } while(n != 0 && (n > 0 || errno == EINTR));
+  if(!n)
+    goto finish;
+  if(!(copied == 0 && unsupported(errno)))
+    goto err;
+#endif
+
+#ifdef HAVE_LINUX_SENDFILE
+  do {
+    n = sendfile(tofd, fromfd, NULL, 8*1024*1024);
+    if(n > 0)
+      progress(n);
+  } while(n != 0 && (n > 0 || errno == EINTR));
+  if(!n)
+    goto finish;
+  if(!(copied == 0 && unsupported(errno)))
+    goto err;
+#endif
+#undef unsupported
+
+  // plain old copy fallback
+  char *buf = g_malloc(128*1024);
   while(1) {
-    r = read(fromfd, buf, sizeof(buf));
+    r = read(fromfd, buf, 128*1024);
     if(r < 0 && errno == EINTR)
       continue;
     if(r <= 0)
       break;
 
+    int len = r;
     char *p = buf;
     while(r > 0) {
       int w = write(tofd, p, r);
       if(w < 0 && errno == EINTR)
         continue;
       if(w < 0)
-        goto err;
+        break;
       r -= w;
       p += w;
     }
+    if(r > 0)
+      break;
+    if(cancel && g_atomic_int_get(cancel)) {
+      errno = EINTR;
+      r = -1;
+      break;
+    }
+    copied += len;
+    if(done)
+      g_atomic_int_set(done, copied >> 20);
   }
-
-  if(r == 0) {
-    if(close(tofd) < 0 || unlink(from) < 0)
-      goto err;
+  g_free(buf);
+  if(r != 0)
+    goto err;
+#undef progress
+
+finish:
+  if(fsync(tofd) < 0)
+    goto err;
+  r = close(tofd);
+  tofd = -1;
+  if(r < 0)
+    goto err;
+  // link() fails if 'to' has been created in the mean time, rename() would
+  // overwrite it. Not all filesystems support hard links, though.
+  do
+    r = overwrite ? rename(tmp, to) : link(tmp, to);
+  while(r < 0 && errno == EINTR);
+  if(r < 0 && !overwrite && errno != EEXIST)
+    r = rename(tmp, to);
+  else if(!r && !overwrite)
+    unlink(tmp);
+  if(r < 0)
+    goto err;
+  g_free(tmp);
+  if(unlink(from) < 0) {
+    int e = errno;
+    unlink(to);
     close(fromfd);
-    return TRUE;
+    g_set_error_literal(err, 1, g_file_error_from_errno(e), g_strerror(e));
+    return FALSE;
   }
+  close(fromfd);
+  return TRUE;
 
 err:
-  g_set_error_literal(err, 1, g_file_error_from_errno(errno), g_strerror(errno));
+  r = errno;
+  g_set_error_literal(err, 1, g_file_error_from_errno(r), g_strerror(r));
   close(fromfd);
-  close(tofd);
-  unlink(to);
+  if(tofd >= 0)
+    close(tofd);
+  unlink(tmp);
+  g_free(tmp);
   return FALSE;
 }
 
@@ -715,6 +819,124 @@ char *darray_get_dat(char *v, int *l) {
 
 
 
+// Simple log2-bucketed histograms, for keeping statistics on queue lengths,
+// latencies and such without having to store every sample. Bucket 0 counts
+// the zero values, bucket i (i > 0) counts the values in [2^(i-1), 2^i).
+// These functions do not perform any locking.
+
+#if INTERFACE
+
+#define HIST_BUCKETS 64
+
+struct hist_t {
+  guint64 num;
+  guint64 sum;
+  guint64 max;
+  guint64 bucket[HIST_BUCKETS];
+};
+
+#endif
+
+
+void hist_add(hist_t *h, guint64 v) {
+  int i = 0;
+  guint64 n = v;
+  while(n) {
+    i++;
+    n >>= 1;
+  }
+  h->bucket[MIN(i, HIST_BUCKETS-1)]++;
+  h->num++;
+  h->sum += v;
+  if(v > h->max)
+    h->max = v;
+}
+
+
+// Returns an upper bound for the value below which the given fraction of the
+// samples lie.
+guint64 hist_percentile(const hist_t *h, double p) {
+  guint64 want = ceil(p * h->num);
+  guint64 cnt = 0;
+  int i;
+  for(i=0; i<HIST_BUCKETS; i++) {
+    cnt += h->bucket[i];
+    if(cnt >= want && cnt)
+      return MIN(h->max, i ? (G_GUINT64_CONSTANT(1)<<i)-1 : 0);
+  }
+  return h->max;
+}
+
+
+// Appends a single-line summary of the histogram to *out.
+void hist_format(const hist_t *h, GString *out, const char *name, const char *unit) {
+  if(!h->num) {
+    g_string_append_printf(out, "%s: no samples\n", name);
+    return;
+  }
+  g_string_append_printf(out,
+    "%s: %"G_GUINT64_FORMAT" samples, avg %.1f%s, p50 <= %"G_GUINT64_FORMAT"%s,"
+    " p90 <= %"G_GUINT64_FORMAT"%s, p99 <= %"G_GUINT64_FORMAT"%s, max %"G_GUINT64_FORMAT"%s\n",
+    name, h->num, (double)h->sum/h->num, unit,
+    hist_percentile(h, 0.5), unit, hist_percentile(h, 0.9), unit,
+    hist_percentile(h, 0.99), unit, h->max, unit);
+}
+
+
+
+
+// Reference-counted pool of immutable strings, for data that is repeated a
+// lot, such as the client and description of hub users. Equal strings share a
+// single copy. The pool may only be used from the main thread.
+
+typedef struct strpool_t {
+  int ref;
+  char str[];
+} strpool_t;
+
+static GHashTable *strpool = NULL;
+
+
+// Returns the pooled copy of str, or NULL if str is NULL. The returned string
+// must not be modified, and must be released with strpool_unref().
+char *strpool_ref(const char *str) {
+  if(!str)
+    return NULL;
+  if(!strpool)
+    strpool = g_hash_table_new(g_str_hash, g_str_equal);
+  strpool_t *s = g_hash_table_lookup(strpool, str);
+  if(!s) {
+    size_t len = strlen(str);
+    s = g_malloc(offsetof(strpool_t, str) + len + 1);
+    s->ref = 0;
+    memcpy(s->str, str, len+1);
+    g_hash_table_insert(strpool, s->str, s);
+  }
+  s->ref++;
+  return s->str;
+}
+
+
+// Same as strpool_ref(), but takes ownership of a g_malloc()'ed string.
+char *strpool_take(char *str) {
+  char *r = strpool_ref(str);
+  g_free(str);
+  return r;
+}
+
+
+void strpool_unref(char *str) {
+  if(!str)
+    return;
+  strpool_t *s = (strpool_t *)(str - offsetof(strpool_t, str));
+  if(--s->ref > 0)
+    return;
+  g_hash_table_remove(strpool, s->str);
+  g_free(s);
+}
+
+
+
 // Transfer / hashing rate calculation and limiting
 
 /* How to use this:
@@ -730,7 +952,16 @@ char *darray_get_dat(char *v, int *l) {
  *   ratecalc_reset(&thing);
  *   ratecalc_unregister(&thing);
  *
- * ratecalc_calc() should be called with a one-second interval
+ * Bandwidth is handed out by a separate scheduler thread (started with
+ * ratecalc_init_global()) every RATECALC_TICK milliseconds. ratecalc_add()
+ * and ratecalc_burst() only use atomic operations and never block.
+ *
+ * Limits are hierarchical: each class (RCC_*) has a global limit, and a
+ * registered ratecalc object may be placed in a group with
+ * ratecalc_setparent(). A group is itself a ratecalc object, registered with
+ * ratecalc_register_group(), which has its own limit. Groups are used for
+ * per-hub limits, the individual objects are per connection and thus per
+ * user.
  */
 
 #if INTERFACE
@@ -742,125 +973,257 @@ char *darray_get_dat(char *v, int *l) {
 #define RCC_DOWN 4
 #define RCC_MAX  RCC_DOWN
 
+// Interval between two bandwidth allocations, in milliseconds.
+#define RATECALC_TICK 20
+
 struct ratecalc_t {
-  GStaticMutex lock; // protects total, last, rate and burst
+  int burst;   // (atomic) number of bytes that may be transferred
+  int pending; // (atomic) bytes added since the last tick
+  int limit;   // (atomic) limit for groups, in bytes/s. 0 = unlimited
+  // The following fields are protected by ratecalc_lock
   gint64 total;
   gint64 last;
-  int burst;
   int rate;
   int reg; // 0 = not registered, >1 = registered with class #n
+  int advance; // bytes charged to ratecalc_debt[reg] by ratecalc_register()
+  gboolean group;
+  ratecalc_t *parent;
+  int room; // used within the scheduler
 };
 
-#define ratecalc_reset(rc) do {\
-    g_static_mutex_lock(&((rc)->lock));\
-    (rc)->total = (rc)->last = (rc)->rate = (rc)->burst = 0;\
-    g_static_mutex_unlock(&((rc)->lock));\
-  } while(0)
+#endif
 
-#define ratecalc_init(rc) do {\
-    g_static_mutex_init(&((rc)->lock));\
-    ratecalc_unregister(rc);\
-    ratecalc_reset(rc);\
-  } while(0)
+// Bucket size, as a fraction of the limit. A connection can burst at most a
+// quarter second worth of data.
+#define RATECALC_DEPTH 4
+// Minimum bucket size for limited objects.
+#define RATECALC_MINBURST (8*1024)
+// Burst for unlimited objects.
+#define RATECALC_UNLIMITED (INT_MAX/2)
+
+static GStaticMutex ratecalc_lock = G_STATIC_MUTEX_INIT;
+static GSList *ratecalc_list = NULL;
+
+// Per-class limits (atomic, set from the main thread) and the bytes that have
+// been handed out in advance to newly registered objects.
+static int ratecalc_limits[RCC_MAX+1];
+static gint64 ratecalc_debt[RCC_MAX+1];
+
+// Statistics, protected by ratecalc_lock. The jitter is the difference
+// between the actual and the intended interval between two ticks.
+static hist_t ratecalc_stats_jitter; // in microseconds
+static hist_t ratecalc_stats_tick;   // time taken by ratecalc_tick(), in microseconds
+
+
+// Bucket size of a ratecalc object. Must be called with ratecalc_lock held.
+static int ratecalc_cap(ratecalc_t *rc) {
+  int l = g_atomic_int_get(&ratecalc_limits[rc->reg]);
+  if(rc->group)
+    l = g_atomic_int_get(&rc->limit);
+  else if(rc->parent && g_atomic_int_get(&rc->parent->limit))
+    l = l ? MIN(l, g_atomic_int_get(&rc->parent->limit)) : g_atomic_int_get(&rc->parent->limit);
+  return l ? MAX(l/RATECALC_DEPTH, RATECALC_MINBURST) : RATECALC_UNLIMITED;
+}
 
-// TODO: get some burst allocated upon registering? Otherwise a transfer will
-// block until _calc() has assigned some bandwidth to it...
-#define ratecalc_register(rc, n) do { if(!(rc)->reg) {\
-    ratecalc_list = g_slist_prepend(ratecalc_list, rc);\
-    (rc)->reg = n;\
-  } } while(0)
-
-// TODO: give rc->burst back to the class? (in particular the negative ones)
-#define ratecalc_unregister(rc) do {\
-    ratecalc_list = g_slist_remove(ratecalc_list, rc);\
-    (rc)->reg = (rc)->rate = (rc)->burst = 0;\
-  } while(0)
 
-#endif
+void ratecalc_reset(ratecalc_t *rc) {
+  g_static_mutex_lock(&ratecalc_lock);
+  g_atomic_int_set(&rc->burst, 0);
+  g_atomic_int_set(&rc->pending, 0);
+  rc->total = rc->last = rc->rate = 0;
+  g_static_mutex_unlock(&ratecalc_lock);
+}
+
+
+void ratecalc_init(ratecalc_t *rc) {
+  memset(rc, 0, sizeof(ratecalc_t));
+}
+
+
+// A newly registered object gets a full bucket, so that a transfer can start
+// immediately rather than wait for the next tick. For limited classes, this
+// is paid back from the next allocations. Groups only limit their members and
+// don't take bandwidth from the class, so they aren't charged.
+void ratecalc_register(ratecalc_t *rc, int class) {
+  g_static_mutex_lock(&ratecalc_lock);
+  if(!rc->reg) {
+    ratecalc_list = g_slist_prepend(ratecalc_list, rc);
+    rc->reg = class;
+    int cap = ratecalc_cap(rc);
+    g_atomic_int_set(&rc->burst, cap);
+    rc->advance = !rc->group && g_atomic_int_get(&ratecalc_limits[class]) ? cap : 0;
+    ratecalc_debt[class] += rc->advance;
+  }
+  g_static_mutex_unlock(&ratecalc_lock);
+}
+
+
+void ratecalc_register_group(ratecalc_t *rc, int class) {
+  rc->group = TRUE;
+  ratecalc_register(rc, class);
+}
+
+
+// Any negative burst (i.e. data that has been transferred but not yet paid
+// for) is given back to the class, and any unused part of the bucket handed
+// out by ratecalc_register() is refunded.
+void ratecalc_unregister(ratecalc_t *rc) {
+  g_static_mutex_lock(&ratecalc_lock);
+  if(rc->reg) {
+    ratecalc_list = g_slist_remove(ratecalc_list, rc);
+    int b = g_atomic_int_get(&rc->burst);
+    if(!rc->group && b < 0 && g_atomic_int_get(&ratecalc_limits[rc->reg]))
+      ratecalc_debt[rc->reg] -= b;
+    else if(b > 0 && rc->advance)
+      ratecalc_debt[rc->reg] = MAX(0, ratecalc_debt[rc->reg] - MIN(b, rc->advance));
+    if(rc->group) {
+      GSList *n;
+      for(n=ratecalc_list; n; n=n->next)
+        if(((ratecalc_t *)n->data)->parent == rc)
+          ((ratecalc_t *)n->data)->parent = NULL;
+    }
+  }
+  rc->reg = rc->rate = rc->advance = 0;
+  rc->parent = NULL;
+  g_atomic_int_set(&rc->burst, 0);
+  g_static_mutex_unlock(&ratecalc_lock);
+}
+
+
+// Places rc in a group, or removes it from its group if parent is NULL.
+void ratecalc_setparent(ratecalc_t *rc, ratecalc_t *parent) {
+  g_static_mutex_lock(&ratecalc_lock);
+  rc->parent = parent;
+  g_static_mutex_unlock(&ratecalc_lock);
+}
+
 
-GSList *ratecalc_list = NULL;
+void ratecalc_setlimit(ratecalc_t *rc, int limit) {
+  g_atomic_int_set(&rc->limit, limit);
+}
+
+
+// Reads the class limits from the global settings. Must be called from the
+// main thread whenever one of the settings changes.
+void ratecalc_setlimits() {
+  g_atomic_int_set(&ratecalc_limits[RCC_HASH], var_get_int(0, VAR_hash_rate));
+  g_atomic_int_set(&ratecalc_limits[RCC_UP],   var_get_int(0, VAR_upload_rate));
+  g_atomic_int_set(&ratecalc_limits[RCC_DOWN], var_get_int(0, VAR_download_rate));
+}
 
 
 void ratecalc_add(ratecalc_t *rc, int b) {
-  g_static_mutex_lock(&rc->lock);
-  rc->total += b;
-  rc->burst -= b;
-  g_static_mutex_unlock(&rc->lock);
+  g_atomic_int_add(&rc->pending, b);
+  g_atomic_int_add(&rc->burst, -b);
 }
 
 
 int ratecalc_rate(ratecalc_t *rc) {
-  g_static_mutex_lock(&rc->lock);
+  g_static_mutex_lock(&ratecalc_lock);
   int r = rc->rate;
-  g_static_mutex_unlock(&rc->lock);
+  g_static_mutex_unlock(&ratecalc_lock);
   return r;
 }
 
 
 int ratecalc_burst(ratecalc_t *rc) {
-  g_static_mutex_lock(&rc->lock);
-  int r = rc->burst;
-  g_static_mutex_unlock(&rc->lock);
-  return r;
+  return g_atomic_int_get(&rc->burst);
 }
 
 
 gint64 ratecalc_total(ratecalc_t *rc) {
-  g_static_mutex_lock(&rc->lock);
-  gint64 r = rc->total;
-  g_static_mutex_unlock(&rc->lock);
+  g_static_mutex_lock(&ratecalc_lock);
+  gint64 r = rc->total + g_atomic_int_get(&rc->pending);
+  g_static_mutex_unlock(&ratecalc_lock);
   return r;
 }
 
 
-// Calculates rc->rate and rc->burst.
-void ratecalc_calc() {
+// Distributes the bandwidth that has become available in the last 'us'
+// microseconds, and updates the rates every second. Only called from
+// ratecalc_thread(), and directly by bench/corebench.c.
+void ratecalc_tick(gint64 us) {
+  static gint64 rateus = 0;
+  static gint64 frac[RCC_MAX+1];
   GSList *n;
-  // Bytes allocated to each class
-  int maxburst[RCC_MAX+1] = {};
-  maxburst[RCC_HASH] = var_get_int(0, VAR_hash_rate);
-  maxburst[RCC_UP]   = var_get_int(0, VAR_upload_rate);
-  maxburst[RCC_DOWN] = var_get_int(0, VAR_download_rate);
   int i;
-  for(i=0; i<=RCC_MAX; i++)
-    if(!maxburst[i])
-      maxburst[i] = INT_MAX;
 
-  int left[RCC_MAX+1]; // Number of bytes left to distribute
+  gboolean calcrate = (rateus += us) >= 1000000;
+  g_static_mutex_lock(&ratecalc_lock);
+
+  // Bytes to distribute to each class. -1 = unlimited.
+  gint64 left[RCC_MAX+1];
   int nums[RCC_MAX+1] = {}; // Number of rc structs with burst < max
-  memcpy(left, maxburst, (RCC_MAX+1)*sizeof(int));
+  for(i=0; i<=RCC_MAX; i++) {
+    gint64 l = g_atomic_int_get(&ratecalc_limits[i]);
+    if(!l) {
+      left[i] = -1;
+      ratecalc_debt[i] = frac[i] = 0;
+      continue;
+    }
+    frac[i] += l*us;
+    left[i] = frac[i] / 1000000;
+    frac[i] %= 1000000;
+    gint64 sub = MIN(left[i], ratecalc_debt[i]);
+    left[i] -= sub;
+    ratecalc_debt[i] -= sub;
+  }
 
-  // Pass one: calculate rc->rate, substract negative burst values from left[] and calculate nums[].
+  // Pass one: move pending bytes to the totals and refill the group buckets.
   for(n=ratecalc_list; n; n=n->next) {
     ratecalc_t *rc = n->data;
-    g_static_mutex_lock(&rc->lock);
-    gint64 diff = rc->total - rc->last;
-    rc->rate = diff + ((rc->rate - diff) / 2);
-    rc->last = rc->total;
-    if(rc->burst < 0) {
-      int sub = MIN(left[rc->reg], -rc->burst);
-      left[rc->reg] -= sub;
-      rc->burst += sub;
+    int p = g_atomic_int_get(&rc->pending);
+    g_atomic_int_add(&rc->pending, -p);
+    rc->total += p;
+    if(rc->parent)
+      rc->parent->total += p;
+    if(rc->group) {
+      gint64 l = g_atomic_int_get(&rc->limit);
+      int cap = ratecalc_cap(rc);
+      int b = g_atomic_int_get(&rc->burst);
+      g_atomic_int_set(&rc->burst, l ? MIN(cap, b + l*us/1000000) : RATECALC_UNLIMITED);
     }
-    if(rc->burst < maxburst[rc->reg])
-      nums[rc->reg]++;
-    else
-      rc->burst = maxburst[rc->reg];
-    g_static_mutex_unlock(&rc->lock);
   }
 
-  //g_debug("Num: %d - %d - %d", nums[2], nums[3], nums[4]);
+  // Pass two: calculate rc->rate and rc->room, and calculate nums[].
+  for(n=ratecalc_list; n; n=n->next) {
+    ratecalc_t *rc = n->data;
+    if(calcrate) {
+      gint64 diff = (rc->total - rc->last) * 1000000 / rateus;
+      rc->rate = diff + ((rc->rate - diff) / 2);
+      rc->last = rc->total;
+    }
+    rc->room = 0;
+    if(rc->group)
+      continue;
+    if(left[rc->reg] < 0 && !(rc->parent && g_atomic_int_get(&rc->parent->limit))) {
+      g_atomic_int_set(&rc->burst, RATECALC_UNLIMITED);
+      continue;
+    }
+    int b = g_atomic_int_get(&rc->burst);
+    int cap = ratecalc_cap(rc);
+    // Limit may have been lowered, or the class was unlimited before.
+    if(b > cap)
+      g_atomic_int_add(&rc->burst, cap-b);
+    rc->room = cap - b;
+    if(rc->parent)
+      rc->room = MIN(rc->room, g_atomic_int_get(&rc->parent->burst));
+    if(rc->room > 0)
+      nums[rc->reg]++;
+  }
+  if(calcrate)
+    rateus = 0;
 
-  // Pass 2..i+1: distribute bandwidth from left[] among the ratecalc structures.
+  // Pass 3..i+3: distribute bandwidth from left[] among the ratecalc structures.
   // (The i variable is to limit the number of passes, otherwise it easily gets into an infinite loop)
   i = 3;
   while(i--) {
-    int bwp[RCC_MAX+1] = {}; // average bandwidth-per-item
+    gint64 bwp[RCC_MAX+1] = {}; // average bandwidth-per-item
     gboolean c = FALSE;
     int j;
     for(j=2; j<=RCC_MAX; j++) {
-      bwp[j] = nums[j] ? left[j]/nums[j] : 0;
-      if(bwp[j] > 0)
+      bwp[j] = !nums[j] ? 0 : left[j] < 0 ? RATECALC_UNLIMITED : MAX(1, left[j]/nums[j]);
+      if(bwp[j] > 0 && left[j])
         c = TRUE;
     }
     // If there's nothing to distribute, stop.
@@ -869,22 +1232,67 @@ void ratecalc_calc() {
     // Loop through the ratecalc structs and assign it some BW
     for(n=ratecalc_list; n; n=n->next) {
       ratecalc_t *rc = n->data;
-      if(bwp[rc->reg] > 0) {
-        g_static_mutex_lock(&rc->lock);
-        int alloc = MIN(maxburst[rc->reg]-rc->burst, bwp[rc->reg]);
-        //g_debug("Allocing class %d(num=%d), %d new bytes to %d", rc->reg, nums[rc->reg], alloc, rc->burst);
-        rc->burst += alloc;
-        left[rc->reg] -= alloc;
-        g_static_mutex_unlock(&rc->lock);
-        if(alloc > 0 && alloc < bwp[rc->reg])
-          nums[rc->reg]--;
+      if(rc->room <= 0 || bwp[rc->reg] <= 0 || !left[rc->reg])
+        continue;
+      int alloc = MIN(rc->room, bwp[rc->reg]);
+      if(left[rc->reg] > 0)
+        alloc = MIN(alloc, left[rc->reg]);
+      if(rc->parent)
+        alloc = MIN(alloc, g_atomic_int_get(&rc->parent->burst));
+      if(alloc > 0) {
+        g_atomic_int_add(&rc->burst, alloc);
+        if(rc->parent)
+          g_atomic_int_add(&rc->parent->burst, -alloc);
+        if(left[rc->reg] > 0)
+          left[rc->reg] -= alloc;
       }
+      // Objects that got less than the average are done.
+      rc->room = alloc < bwp[rc->reg] ? 0 : rc->room - alloc;
+      if(rc->room <= 0)
+        nums[rc->reg]--;
     }
-    //g_debug("Left after #%d: %d - %d - %d", 3-i, left[2], left[3], left[4]);
   }
 
-  //g_debug("Left after distribution: %d - %d - %d", left[2], left[3], left[4]);
-  // TODO: distribute the last remaining BW on a first-find basis?
+  g_static_mutex_unlock(&ratecalc_lock);
+}
+
+
+static gpointer ratecalc_thread(gpointer dat) {
+  GTimer *tm = g_timer_new();
+  while(1) {
+    g_usleep(RATECALC_TICK*1000);
+    gint64 us = g_timer_elapsed(tm, NULL) * 1000000.0;
+    g_timer_start(tm);
+    // Don't hand out more than a second worth of bandwidth when the thread
+    // has been suspended for a while.
+    ratecalc_tick(MIN(us, 1000000));
+    gint64 took = g_timer_elapsed(tm, NULL) * 1000000.0;
+    g_static_mutex_lock(&ratecalc_lock);
+    hist_add(&ratecalc_stats_jitter, ABS(us - RATECALC_TICK*1000));
+    hist_add(&ratecalc_stats_tick, took);
+    g_static_mutex_unlock(&ratecalc_lock);
+  }
+  return NULL;
+}
+
+
+// Writes the scheduler statistics to *out, for display to the user.
+void ratecalc_stats(GString *out) {
+  g_static_mutex_lock(&ratecalc_lock);
+  hist_t jitter = ratecalc_stats_jitter;
+  hist_t tick = ratecalc_stats_tick;
+  int num = g_slist_length(ratecalc_list);
+  g_static_mutex_unlock(&ratecalc_lock);
+
+  g_string_append_printf(out, "Rate limiter: %d registered objects\n", num);
+  hist_format(&jitter, out, "Tick jitter", "us");
+  hist_format(&tick, out, "Tick duration", "us");
+}
+
+
+void ratecalc_init_global() {
+  ratecalc_setlimits();
+  g_thread_create(ratecalc_thread, NULL, FALSE, NULL);
 }
 
 
@@ -900,19 +1308,58 @@ char *ratecalc_eta(ratecalc_t *rc, guint64 left) {
 
 // Log file writer. Prefixes all messages with a timestamp and allows the logs
 // to be rotated.
+// Messages are appended to a per-file buffer, the actual writing is done by a
+// separate thread. The buffers are written out every LOGFILE_FLUSH seconds,
+// or earlier when one grows larger than LOGFILE_BUFSIZE. Log rotation is
+// checked for every LOGFILE_CHECK seconds and on logfile_global_reopen().
 
 #if INTERFACE
 
 struct logfile_t {
-  int file;
   char *path;
+  GString *buf;         // pending messages, protected by logfile_lock
+  gboolean reopen : 1;  // protected by logfile_lock
+  gboolean freed : 1;   // protected by logfile_lock
+  // Only accessed by the writer thread
+  gboolean doreopen : 1;
+  int file;
   struct stat st;
+  time_t checked;
+  GString *wbuf;
 };
 
 #endif
 
 
+#define LOGFILE_FLUSH   1
+#define LOGFILE_BUFSIZE (64*1024)
+#define LOGFILE_CHECK   10
+
+static GStaticMutex logfile_lock = G_STATIC_MUTEX_INIT;
 static GSList *logfile_instances = NULL;
+static GAsyncQueue *logfile_queue = NULL; // wakeups for the writer thread
+static GThread *logfile_thread = NULL;
+static int logfile_wake, logfile_quit;    // queue items, only the address is used
+
+
+// Writes the current time as "[yyyy-mm-dd hh:mm:ss TZ]" into buf, which
+// should be at least 64 bytes. The formatted string is cached for the current
+// second. This function is thread-safe.
+void logfile_timestamp(char *buf) {
+  static GStaticMutex lock = G_STATIC_MUTEX_INIT;
+  static time_t last = 0;
+  static char ts[64];
+  time_t now = time(NULL);
+  g_static_mutex_lock(&lock);
+  if(now != last) {
+    char *t = localtime_fmt("[%F %H:%M:%S %Z]");
+    g_strlcpy(ts, t, sizeof(ts));
+    g_free(t);
+    last = now;
+  }
+  strcpy(buf, ts);
+  g_static_mutex_unlock(&lock);
+}
 
 
 // (Re-)opens the log file and checks for inode and file size changes.
@@ -950,6 +1397,91 @@ static void logfile_checkfile(logfile_t *l) {
 }
 
 
+// Writes out the buffer of a single log file, from the writer thread.
+static void logfile_write(logfile_t *l, time_t now) {
+  if(l->doreopen && l->file >= 0) {
+    close(l->file);
+    l->file = -1;
+  }
+  if(l->doreopen || (l->wbuf->len && now-l->checked >= LOGFILE_CHECK)) {
+    logfile_checkfile(l);
+    l->checked = now;
+    l->doreopen = FALSE;
+  }
+
+  if(l->wbuf->len && l->file >= 0) {
+    int wr = 0;
+    int r = 1;
+    while(wr < l->wbuf->len && (r = write(l->file, l->wbuf->str+wr, l->wbuf->len-wr)) > 0)
+      wr += r;
+    if(r <= 0)
+      g_warning("Error writing to log file '%s': %s", l->path, g_strerror(errno));
+    l->st.st_size += wr;
+  }
+  g_string_truncate(l->wbuf, 0);
+}
+
+
+static void logfile_flush() {
+  time_t now = time(NULL);
+
+  // Grab the pending data of each file, so that the main thread is not
+  // blocked while we're writing.
+  g_static_mutex_lock(&logfile_lock);
+  GSList *todo = g_slist_copy(logfile_instances);
+  GSList *dead = NULL;
+  GSList *n;
+  for(n=todo; n; n=n->next) {
+    logfile_t *l = n->data;
+    GString *tmp = l->buf;
+    l->buf = l->wbuf;
+    l->wbuf = tmp;
+    if(l->reopen)
+      l->doreopen = TRUE;
+    l->reopen = FALSE;
+    if(l->freed) {
+      logfile_instances = g_slist_remove(logfile_instances, l);
+      dead = g_slist_prepend(dead, l);
+    }
+  }
+  g_static_mutex_unlock(&logfile_lock);
+
+  for(n=todo; n; n=n->next)
+    logfile_write(n->data, now);
+  g_slist_free(todo);
+
+  for(n=dead; n; n=n->next) {
+    logfile_t *l = n->data;
+    if(l->file >= 0)
+      close(l->file);
+    g_string_free(l->buf, TRUE);
+    g_string_free(l->wbuf, TRUE);
+    g_free(l->path);
+    g_slice_free(logfile_t, l);
+  }
+  g_slist_free(dead);
+}
+
+
+static gpointer logfile_thread_func(gpointer dat) {
+  gboolean quit = FALSE;
+  while(!quit) {
+    GTimeVal end;
+    g_get_current_time(&end);
+    g_time_val_add(&end, LOGFILE_FLUSH*G_USEC_PER_SEC);
+    gpointer m = g_async_queue_timed_pop(logfile_queue, &end);
+    // Coalesce wakeups
+    while(m) {
+      if(m == &logfile_quit)
+        quit = TRUE;
+      m = g_async_queue_try_pop(logfile_queue);
+    }
+    logfile_flush();
+  }
+  return NULL;
+}
+
+
 logfile_t *logfile_create(const char *name) {
   logfile_t *l = g_slice_new0(logfile_t);
 
@@ -957,56 +1489,72 @@ logfile_t *logfile_create(const char *name) {
   char *n = g_strconcat(name, ".log", NULL);
   l->path = g_build_filename(db_dir, "logs", n, NULL);
   g_free(n);
+  l->buf = g_string_new("");
+  l->wbuf = g_string_new("");
+  l->doreopen = TRUE;
+
+  if(!logfile_thread) {
+    logfile_queue = g_async_queue_new();
+    logfile_thread = g_thread_create(logfile_thread_func, NULL, TRUE, NULL);
+  }
 
-  logfile_checkfile(l);
+  g_static_mutex_lock(&logfile_lock);
   logfile_instances = g_slist_prepend(logfile_instances, l);
+  g_static_mutex_unlock(&logfile_lock);
   return l;
 }
 
 
+// The log file is closed and freed by the writer thread, after any remaining
+// messages have been written.
 void logfile_free(logfile_t *l) {
   if(!l)
     return;
-  logfile_instances = g_slist_remove(logfile_instances, l);
-  if(l->file >= 0)
-    close(l->file);
-  g_free(l->path);
-  g_slice_free(logfile_t, l);
+  g_static_mutex_lock(&logfile_lock);
+  l->freed = TRUE;
+  g_static_mutex_unlock(&logfile_lock);
+  g_async_queue_push(logfile_queue, &logfile_wake);
 }
 
 
 void logfile_add(logfile_t *l, const char *msg) {
-  logfile_checkfile(l);
-  if(l->file < 0)
-    return;
-
-  char *ts = localtime_fmt("[%F %H:%M:%S %Z]");
-  char *line = g_strdup_printf("%s %s\n", ts, msg);
-  g_free(ts);
-
-  int len = strlen(line);
-  int wr = 0;
-  int r = 1;
-  while(wr < len && (r = write(l->file, line+wr, len-wr)) > 0)
-    wr += r;
-
-  g_free(line);
-  if(r <= 0 && !strstr(msg, " (LOGERR)"))
-    g_warning("Error writing to log file: %s (LOGERR)", g_strerror(errno));
+  char ts[64];
+  logfile_timestamp(ts);
+
+  g_static_mutex_lock(&logfile_lock);
+  g_string_append(l->buf, ts);
+  g_string_append_c(l->buf, ' ');
+  g_string_append(l->buf, msg);
+  g_string_append_c(l->buf, '\n');
+  gboolean wake = l->buf->len >= LOGFILE_BUFSIZE;
+  g_static_mutex_unlock(&logfile_lock);
+
+  if(wake)
+    g_async_queue_push(logfile_queue, &logfile_wake);
 }
 
 
 // Flush and re-open all opened log files.
 void logfile_global_reopen() {
+  if(!logfile_thread)
+    return;
+  g_static_mutex_lock(&logfile_lock);
   GSList *n = logfile_instances;
-  for(; n; n=n->next) {
-    logfile_t *l = n->data;
-    if(l->file >= 0) {
-      close(l->file);
-      l->file = -1;
-    }
-    logfile_checkfile(l);
-  }
+  for(; n; n=n->next)
+    ((logfile_t *)n->data)->reopen = TRUE;
+  g_static_mutex_unlock(&logfile_lock);
+  g_async_queue_push(logfile_queue, &logfile_wake);
+}
+
+
+// Writes out all pending messages and stops the writer thread. Called on
+// shutdown.
+void logfile_global_close() {
+  if(!logfile_thread)
+    return;
+  g_async_queue_push(logfile_queue, &logfile_quit);
+  g_thread_join(logfile_thread);
+  logfile_thread = NULL;
 }
 
 
@@ -170,6 +170,18 @@ static char *p_speed(const char *val, GError **err) {
   return g_strdup_printf("%"G_GUINT64_FORMAT, size);
 }
 
+static gboolean s_speed(guint64 hub, const char *key, const char *val, GError **err) {
+  db_vars_set(hub, key, val);
+  hub_t *h = hub ? g_hash_table_lookup(hubs, &hub) : NULL;
+  if(h)
+    hub_setrate(h);
+  else if(!hub)
+    ratecalc_setlimits();
+  if(strcmp(key, "upload_rate") == 0)
+    hub_global_nfochange();
+  return TRUE;
+}
+
 // Only suggests "true" or "false" regardless of the input. There are only two
 // states anyway, and one would want to switch between those two without any
 // hassle.
@@ -624,6 +636,101 @@ static gboolean s_geoip_cc(guint64 hub, const char *key, const char *val, GError
 }
 
 
+// hash_threads
+
+static char *p_hash_threads(const char *val, GError **err) {
+  return p_int_range(val, 1, 64, "Number of hash threads must be between 1 and 64.", err);
+}
+
+static gboolean s_hash_threads(guint64 hub, const char *key, const char *val, GError **err) {
+  db_vars_set(hub, key, val);
+  fl_hash_setthreads();
+  return TRUE;
+}
+
+
+// share_watch
+
+static char *f_share_watch(const char *val) {
+#ifdef HAVE_SYS_INOTIFY_H
+  return f_id(val);
+#else
+  return g_strdup("false (not supported)");
+#endif
+}
+
+static char *p_share_watch(const char *val, GError **err) {
+  char *r = p_bool(val, err);
+#ifndef HAVE_SYS_INOTIFY_H
+  if(r && bool_raw(val)) {
+    g_set_error(err, 1, 0, "This option can't be modified: %s.", "Ncdc has not been compiled with inotify support");
+    g_free(r);
+    r = NULL;
+  }
+#endif
+  return r;
+}
+
+static gboolean s_share_watch(guint64 hub, const char *key, const char *val, GError **err) {
+  db_vars_set(hub, key, val);
+  fl_watch_setup();
+  return TRUE;
+}
+
+
+// tls_offload
+
+static char *f_tls_offload(const char *val) {
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_GNUTLS_RECORD_GET_STATE) && defined(HAVE_SENDFILE)
+  return f_id(val);
+#else
+  return g_strdup("false (not supported)");
+#endif
+}
+
+static char *p_tls_offload(const char *val, GError **err) {
+  char *r = p_bool(val, err);
+#if !(defined(HAVE_LINUX_TLS_H) && defined(HAVE_GNUTLS_RECORD_GET_STATE) && defined(HAVE_SENDFILE))
+  if(r && bool_raw(val)) {
+    g_set_error(err, 1, 0, "This option can't be modified: %s.", "Ncdc has not been compiled with kernel TLS support");
+    g_free(r);
+    return NULL;
+  }
+#endif
+  return r;
+}
+
+
+// transfer_threads
+
+static char *p_transfer_threads(const char *val, GError **err) {
+  return p_int_range(val, 0, 64, "Number of transfer threads must be between 0 and 64.", err);
+}
+
+
+// db_readers
+
+static char *p_db_readers(const char *val, GError **err) {
+  return p_int_range(val, 0, DB_READERS_MAX, "Number of read connections must be between 0 and "G_STRINGIFY(DB_READERS_MAX)".", err);
+}
+
+
+// upload_cache
+
+static char *f_upload_cache(const char *var) {
+  return g_strdup(strcmp(var, "0") == 0 ? "0 (disabled)" : str_formatsize(int_raw(var)));
+}
+
+static char *p_upload_cache(const char *val, GError **err) {
+  guint64 size = str_parsesize(val);
+  if(size == G_MAXUINT64) {
+    g_set_error_literal(err, 1, 0, "Invalid size.");
+    return NULL;
+  }
+  return g_strdup_printf("%"G_GUINT64_FORMAT, size);
+}
+
+
 // hubname
 
 static char *p_hubname(const char *val, GError **err) {
@@ -714,6 +821,15 @@ static gboolean s_password(guint64 hub, const char *key, const char *val, GError
 }
 
 
+// perf_log
+
+static gboolean s_perf_log(guint64 hub, const char *key, const char *val, GError **err) {
+  db_vars_set(hub, key, val);
+  perf_log_setup();
+  return TRUE;
+}
+
+
 // sendfile
 
 static char *f_sendfile(const char *val) {
@@ -956,21 +1072,25 @@ struct var_t {
   V(cid,              0,0, NULL,           NULL,            NULL,          NULL,         NULL,            i_cid_pid())\
   UI_COLORS \
   V(connection,       1,1, f_id,           p_connection,    su_old,        NULL,         s_hubinfo,       NULL)\
+  V(db_readers,       1,0, f_int,          p_db_readers,    NULL,          NULL,         NULL,            "0")\
   V(description,      1,1, f_id,           p_id,            su_old,        NULL,         s_hubinfo,       NULL)\
   V(disconnect_offline,1,1,f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
   V(download_dir,     1,0, f_id,           p_id,            su_path,       NULL,         s_dl_inc_dir,    i_dl_inc_dir(TRUE))\
   V(download_exclude, 1,0, f_id,           p_regex,         su_old,        NULL,         NULL,            NULL)\
-  V(download_rate,    1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)\
+  V(download_rate,    1,1, f_speed,        p_speed,         NULL,          NULL,         s_speed,         NULL)\
   V(download_segment, 1,0, f_download_segment,p_download_segment,NULL,     NULL,         NULL,            g_strdup_printf("%"G_GUINT64_FORMAT, (guint64)DLFILE_CHUNKSIZE))\
   V(download_slots,   1,0, f_int,          p_int,           NULL,          NULL,         s_download_slots,"3")\
   V(email,            1,1, f_id,           p_id,            su_old,        NULL,         s_hubinfo,       NULL)\
   V(encoding,         1,1, f_id,           p_encoding,      su_encoding,   NULL,         NULL,            "UTF-8")\
   V(filelist_maxage,  1,0, f_interval,     p_interval,      su_old,        NULL,         NULL,            "604800")\
+  V(filelist_partial, 1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
   V(fl_done,          0,0, NULL,           NULL,            NULL,          NULL,         NULL,            "false")\
   V(flush_file_cache, 1,0, f_ffc,          p_ffc,           su_ffc,        g_ffc,        s_ffc,           i_ffc())\
   V(geoip_cc4,        1,0, f_id,           p_id,            su_path,       NULL,         s_geoip_cc,      NULL)\
   V(geoip_cc6,        1,0, f_id,           p_id,            su_path,       NULL,         s_geoip_cc,      NULL)\
-  V(hash_rate,        1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)\
+  V(hash_mmap,        1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
+  V(hash_rate,        1,0, f_speed,        p_speed,         NULL,          NULL,         s_speed,         NULL)\
+  V(hash_threads,     1,0, f_int,          p_hash_threads,  NULL,          NULL,         s_hash_threads,  "1")\
   V(hubaddr,          0,0, NULL,           NULL,            NULL,          NULL,         NULL,            NULL)\
   V(hubkp,            0,0, NULL,           NULL,            NULL,          NULL,         NULL,            NULL)\
   V(hubname,          0,1, f_id,           p_hubname,       su_old,        NULL,         s_hubname,       NULL)\
@@ -985,6 +1105,7 @@ struct var_t {
   V(nick,             1,1, f_id,           p_nick,          su_old,        NULL,         s_nick,          i_nick())\
   V(notify_bell,      1,0, f_notify_bell,  p_notify_bell,   su_notify_bell,g_notify_bell,s_notify_bell,   G_STRINGIFY(VAR_NOTB_DISABLE))\
   V(password,         0,1, f_password,     p_id,            NULL,          NULL,         s_password,      NULL)\
+  V(perf_log,         1,0, f_autorefresh,  p_interval,      su_old,        NULL,         s_perf_log,      "0")\
   V(pid,              0,0, NULL,           NULL,            NULL,          NULL,         NULL,            i_cid_pid())\
   V(reconnect_timeout,1,1, f_interval,     p_interval,      su_old,        NULL,         NULL,            "30")\
   V(sendfile,         1,0, f_sendfile,     p_sendfile,      su_bool,       NULL,         NULL,            "true")\
@@ -992,13 +1113,41 @@ struct var_t {
   V(share_exclude,    1,0, f_id,           p_regex,         su_old,        NULL,         NULL,            NULL)\
   V(share_hidden,     1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
   V(share_symlinks,   1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
+  V(share_watch,      1,0, f_share_watch,  p_share_watch,   su_bool,       NULL,         s_share_watch,   "false")\
   V(show_joinquit,    1,1, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
   V(slots,            1,0, f_int,          p_int_ge1,       NULL,          NULL,         s_hubinfo,       "10")\
   V(sudp_policy,      1,0, f_sudp_policy,  p_sudp_policy,   su_sudp_policy,g_sudp_policy,s_sudp_policy,   G_STRINGIFY(VAR_SUDPP_PREFER))\
   V(tls_policy,       1,1, f_tls_policy,   p_tls_policy,    su_tls_policy, g_tls_policy, s_tls_policy,    G_STRINGIFY(VAR_TLSP_PREFER))\
+  V(tls_offload,      1,0, f_tls_offload,  p_tls_offload,   su_bool,       NULL,         NULL,            "false")\
   V(tls_priority,     1,0, f_id,           p_tls_priority,  su_old,        NULL,         NULL,            "NORMAL:-ARCFOUR-128")\
+  V(transfer_threads, 1,0, f_int,          p_transfer_threads,NULL,        NULL,         NULL,            "0")\
   V(ui_time_format,   1,0, f_id,           p_id,            su_old,        NULL,         NULL,            "[%H:%M:%S]")\
-  V(upload_rate,      1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)
+  V(upload_cache,     1,0, f_upload_cache, p_upload_cache,  NULL,          NULL,         NULL,            "0")\
+  V(upload_rate,      1,1, f_speed,        p_speed,         NULL,          NULL,         s_speed,         NULL)
+
+// Settings that are read often enough to be kept in a typed snapshot, see
+// var_snap().
+// name               type      getter
+#define VAR_SNAP\
+  S(chat_only,        gboolean, var_get_bool)\
+  S(download_segment, gint64,   var_get_int64)\
+  S(minislot_size,    int,      var_get_int)\
+  S(minislots,        int,      var_get_int)\
+  S(sendfile,         gboolean, var_get_bool)\
+  S(slots,            int,      var_get_int)\
+  S(sudp_policy,      int,      var_get_int)\
+  S(tls_offload,      gboolean, var_get_bool)\
+  S(tls_policy,       int,      var_get_int)\
+  S(transfer_threads, int,      var_get_int)\
+  S(upload_cache,     gint64,   var_get_int64)
+
+struct var_snap_t {
+#define S(n, t, f) t n;
+  VAR_SNAP
+#undef S
+  guint64 hub;
+  int gen;
+};
 
 enum var_type {
 #define V(n, gl, h, f, p, su, g, s, d) VAR_##n,
@@ -1120,6 +1269,64 @@ struct in6_addr var_parse_ip6(char *r) {
 
 
 
+// Typed snapshot of the settings listed in VAR_SNAP, so that hot paths don't
+// have to go through db_vars_get() and parse the string each time. Snapshots
+// are invalidated by db_vars_set() and db_vars_rm(), which all setters go
+// through. The global snapshot is updated in place right away and may be read
+// from other threads without locking. Each field holds either the old or the
+// new value, but gint64 fields may be torn on 32-bit systems, so only read
+// those from the main thread. Hub snapshots are refreshed on their next use
+// and are for the main thread only.
+
+static var_snap_t var_snap_global;
+static GHashTable *var_snaps = NULL;
+static int var_snap_gen = 0; // 0 until vars_init() has been called
+
+
+static void var_snap_fill(guint64 h, var_snap_t *s) {
+#define S(n, t, f) s->n = f(h, VAR_##n);
+  VAR_SNAP
+#undef S
+  s->gen = var_snap_gen;
+}
+
+
+// Called from db.c whenever a var has been changed. rmhub is set when all
+// vars of the hub have been removed, its snapshot is then dropped as well.
+void var_snap_invalidate(guint64 h, gboolean rmhub) {
+  if(!var_snap_gen)
+    return;
+  // A change to a global var may be inherited by any hub
+  var_snap_gen++;
+  if(!h)
+    var_snap_fill(0, &var_snap_global);
+  var_snap_t *s;
+  if(rmhub && var_snaps && (s = g_hash_table_lookup(var_snaps, &h))) {
+    g_hash_table_remove(var_snaps, &h);
+    g_slice_free(var_snap_t, s);
+  }
+}
+
+
+var_snap_t *var_snap(guint64 h) {
+  if(!h)
+    return &var_snap_global;
+  if(!var_snaps)
+    var_snaps = g_hash_table_new(g_int64_hash, g_int64_equal);
+  var_snap_t *s = g_hash_table_lookup(var_snaps, &h);
+  if(!s) {
+    s = g_slice_new0(var_snap_t);
+    s->hub = h;
+    g_hash_table_insert(var_snaps, &s->hub, s);
+  }
+  if(s->gen != var_snap_gen)
+    var_snap_fill(h, s);
+  return s;
+}
+
+
+
+
 // Initialization
 
 void vars_init() {
@@ -1133,5 +1340,8 @@ void vars_init() {
   VARS
 #undef C
 #undef V
+
+  var_snap_gen = 1;
+  var_snap_fill(0, &var_snap_global);
 }
 